@@ -0,0 +1,290 @@
+/* This file is part of wslman.
+ *
+ * wslman is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * wslman is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with wslman.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "wslbulkedit.h"
+
+#include "wsldistcache.h"
+#include "wslui.h"
+#include "wslutils.h"
+#include <QLabel>
+#include <QListWidget>
+#include <QCheckBox>
+#include <QSpinBox>
+#include <QLineEdit>
+#include <QPlainTextEdit>
+#include <QPushButton>
+#include <QDialogButtonBox>
+#include <QGridLayout>
+#include <QHBoxLayout>
+#include <QProgressDialog>
+#include <QMessageBox>
+#include <QRegularExpression>
+
+#if QT_VERSION >= QT_VERSION_CHECK(5, 14, 0)
+#   define QT_SKIP_EMPTY_PARTS Qt::SkipEmptyParts
+#else
+#   define QT_SKIP_EMPTY_PARTS QString::SkipEmptyParts
+#endif
+
+enum {
+    DistUuidRole = Qt::UserRole,
+};
+
+static std::vector<std::wstring> parseKeys(const QString &text)
+{
+    std::vector<std::wstring> result;
+    for (const QString &key : text.split(QRegularExpression(QStringLiteral("\\s+")),
+                                         QT_SKIP_EMPTY_PARTS)) {
+        result.emplace_back(key.toStdWString());
+    }
+    return result;
+}
+
+// Partially checked boxes leave the flag as it is
+static int applyFlag(int flags, Qt::CheckState state, int flag)
+{
+    switch (state) {
+    case Qt::Checked:
+        return flags | flag;
+    case Qt::Unchecked:
+        return flags & ~flag;
+    default:
+        return flags;
+    }
+}
+
+WslBulkEditDialog::WslBulkEditDialog(const QString &selectedUuid, QWidget *parent)
+    : QDialog(parent)
+{
+    setWindowTitle(tr("Edit Multiple Distributions"));
+
+    auto lblDists = new QLabel(tr("&Distributions to change:"), this);
+    m_distList = new QListWidget(this);
+    lblDists->setBuddy(m_distList);
+
+    try {
+        auto snapshot = WslDistributionCache::instance().snapshot();
+        for (const auto &[uuid, dist] : snapshot->distributions) {
+            auto distName = QString::fromStdWString(dist->name());
+            auto item = new QListWidgetItem(WslUi::pickDistIcon(distName), distName, m_distList);
+            item->setData(DistUuidRole, QString::fromStdWString(uuid));
+            item->setFlags(item->flags() | Qt::ItemIsUserCheckable);
+            item->setCheckState(QString::fromStdWString(uuid) == selectedUuid
+                                ? Qt::Checked : Qt::Unchecked);
+        }
+    } catch (const std::runtime_error &err) {
+        QMessageBox::critical(this, QString(),
+                tr("Failed to get distribution list: %1").arg(err.what()));
+    }
+    m_distList->sortItems();
+
+    auto selectAll = new QPushButton(tr("Select &All"), this);
+    auto selectNone = new QPushButton(tr("Select &None"), this);
+    auto setAllChecked = [this](Qt::CheckState state) {
+        for (int i = 0; i < m_distList->count(); ++i)
+            m_distList->item(i)->setCheckState(state);
+    };
+    connect(selectAll, &QPushButton::clicked, this, [setAllChecked](bool) {
+        setAllChecked(Qt::Checked);
+    });
+    connect(selectNone, &QPushButton::clicked, this, [setAllChecked](bool) {
+        setAllChecked(Qt::Unchecked);
+    });
+    auto selectLayout = new QHBoxLayout;
+    selectLayout->addWidget(selectAll);
+    selectLayout->addWidget(selectNone);
+    selectLayout->addStretch(1);
+
+    // Flags start out partially checked, which leaves them unchanged
+    auto lblFlags = new QLabel(tr("Flags (partially checked flags are not changed):"), this);
+    m_enableInterop = new QCheckBox(tr("Enable &Interop"), this);
+    m_appendNTPath = new QCheckBox(tr("Append NT &Path"), this);
+    m_enableDriveMounting = new QCheckBox(tr("Enable Drive &Mounting"), this);
+    for (QCheckBox *flag : {m_enableInterop, m_appendNTPath, m_enableDriveMounting}) {
+        flag->setTristate(true);
+        flag->setCheckState(Qt::PartiallyChecked);
+    }
+
+    m_setDefaultUID = new QCheckBox(tr("Set default &user ID:"), this);
+    m_defaultUID = new QSpinBox(this);
+    m_defaultUID->setRange(0, 0x7fffffff);
+    m_defaultUID->setValue(1000);
+    m_defaultUID->setEnabled(false);
+    connect(m_setDefaultUID, &QCheckBox::toggled, m_defaultUID, &QWidget::setEnabled);
+
+    m_setKernelCmdLine = new QCheckBox(tr("Set &kernel command line:"), this);
+    m_kernelCmdLine = new QLineEdit(this);
+    m_kernelCmdLine->setEnabled(false);
+    connect(m_setKernelCmdLine, &QCheckBox::toggled, m_kernelCmdLine, &QWidget::setEnabled);
+
+    auto lblSetEnv = new QLabel(tr("&Set environment variables (KEY=VALUE, one per line):"), this);
+    m_setEnvironment = new QPlainTextEdit(this);
+    m_setEnvironment->setTabChangesFocus(true);
+    lblSetEnv->setBuddy(m_setEnvironment);
+
+    auto lblRemoveEnv = new QLabel(tr("&Remove environment variables:"), this);
+    m_removeEnvironment = new QLineEdit(this);
+    m_removeEnvironment->setPlaceholderText(tr("Names separated by spaces"));
+    lblRemoveEnv->setBuddy(m_removeEnvironment);
+
+    auto buttons = new QDialogButtonBox(QDialogButtonBox::Ok | QDialogButtonBox::Cancel, this);
+    connect(buttons, &QDialogButtonBox::accepted, this, &QDialog::accept);
+    connect(buttons, &QDialogButtonBox::rejected, this, &QDialog::reject);
+
+    auto layout = new QGridLayout(this);
+    int layoutRow = 0;
+    layout->addWidget(lblDists, layoutRow, 0, 1, 2);
+    layout->addWidget(m_distList, ++layoutRow, 0, 1, 2);
+    layout->addLayout(selectLayout, ++layoutRow, 0, 1, 2);
+    layout->addItem(new QSpacerItem(0, 10), ++layoutRow, 0, 1, 2);
+    layout->addWidget(lblFlags, ++layoutRow, 0, 1, 2);
+    layout->addWidget(m_enableInterop, ++layoutRow, 0, 1, 2);
+    layout->addWidget(m_appendNTPath, ++layoutRow, 0, 1, 2);
+    layout->addWidget(m_enableDriveMounting, ++layoutRow, 0, 1, 2);
+    layout->addWidget(m_setDefaultUID, ++layoutRow, 0);
+    layout->addWidget(m_defaultUID, layoutRow, 1);
+    layout->addWidget(m_setKernelCmdLine, ++layoutRow, 0);
+    layout->addWidget(m_kernelCmdLine, layoutRow, 1);
+    layout->addWidget(lblSetEnv, ++layoutRow, 0, 1, 2);
+    layout->addWidget(m_setEnvironment, ++layoutRow, 0, 1, 2);
+    layout->addWidget(lblRemoveEnv, ++layoutRow, 0, 1, 2);
+    layout->addWidget(m_removeEnvironment, ++layoutRow, 0, 1, 2);
+    layout->addItem(new QSpacerItem(0, 10), ++layoutRow, 0, 1, 2);
+    layout->addWidget(buttons, ++layoutRow, 0, 1, 2);
+}
+
+bool WslBulkEditDialog::hasChanges() const
+{
+    for (QCheckBox *flag : {m_enableInterop, m_appendNTPath, m_enableDriveMounting}) {
+        if (flag->checkState() != Qt::PartiallyChecked)
+            return true;
+    }
+    return m_setDefaultUID->isChecked() || m_setKernelCmdLine->isChecked()
+        || !m_setEnvironment->toPlainText().trimmed().isEmpty()
+        || !m_removeEnvironment->text().trimmed().isEmpty();
+}
+
+bool WslBulkEditDialog::validate()
+{
+    bool anyChecked = false;
+    for (int i = 0; i < m_distList->count(); ++i) {
+        if (m_distList->item(i)->checkState() == Qt::Checked) {
+            anyChecked = true;
+            break;
+        }
+    }
+    if (!anyChecked) {
+        QMessageBox::critical(this, QString(), tr("No distributions selected"));
+        return false;
+    }
+
+    if (!hasChanges()) {
+        QMessageBox::critical(this, QString(), tr("No changes selected"));
+        return false;
+    }
+
+    // The variables use the same syntax as .env files
+    try {
+        WslEnvironment::fromEnvFile(m_setEnvironment->toPlainText().toStdString());
+    } catch (const std::runtime_error &err) {
+        QMessageBox::critical(this, QString(), err.what());
+        return false;
+    }
+
+    return true;
+}
+
+void WslBulkEditDialog::performBulkEdit()
+{
+    std::vector<std::wstring> uuids;
+    QStringList names;
+    for (int i = 0; i < m_distList->count(); ++i) {
+        QListWidgetItem *item = m_distList->item(i);
+        if (item->checkState() != Qt::Checked)
+            continue;
+        uuids.push_back(item->data(DistUuidRole).toString().toStdWString());
+        names << item->text();
+    }
+
+    const Qt::CheckState enableInterop = m_enableInterop->checkState();
+    const Qt::CheckState appendNTPath = m_appendNTPath->checkState();
+    const Qt::CheckState enableDriveMounting = m_enableDriveMounting->checkState();
+    const bool setDefaultUID = m_setDefaultUID->isChecked();
+    const auto defaultUID = static_cast<uint32_t>(m_defaultUID->value());
+    const bool setKernelCmdLine = m_setKernelCmdLine->isChecked();
+    const std::wstring kernelCmdLine = m_kernelCmdLine->text().toStdWString();
+    const std::vector<std::wstring> removeEnvironment = parseKeys(m_removeEnvironment->text());
+    const auto setEnvironment =
+            WslEnvironment::fromEnvFile(m_setEnvironment->toPlainText().toStdString()).entries();
+
+    auto stage = [&](WslDistributionUpdate &update) {
+        int flags = update.staged().flags();
+        flags = applyFlag(flags, enableInterop, WslApi::DistributionFlags_EnableInterop);
+        flags = applyFlag(flags, appendNTPath, WslApi::DistributionFlags_AppendNTPath);
+        flags = applyFlag(flags, enableDriveMounting,
+                          WslApi::DistributionFlags_EnableDriveMounting);
+        update.setFlags(static_cast<WslApi::DistributionFlags>(flags));
+
+        if (setDefaultUID)
+            update.setDefaultUID(defaultUID);
+        if (setKernelCmdLine)
+            update.setKernelCmdLine(kernelCmdLine);
+        for (const std::wstring &key : removeEnvironment)
+            update.delEnvironment(key);
+        for (const auto &[key, value] : setEnvironment)
+            update.addEnvironment(key, value);
+    };
+
+    QProgressDialog progressDialog(parentWidget());
+    progressDialog.setWindowModality(Qt::WindowModal);
+    progressDialog.setMinimumDuration(0);
+    progressDialog.setCancelButton(nullptr);
+    progressDialog.setLabelText(tr("Updating %1 distributions...").arg(uuids.size()));
+    progressDialog.setMaximum(0);
+
+    std::vector<WslBulkUpdateResult> results;
+    try {
+        WslUtil::runInBackground([&]() {
+            results = WslDistributionCache::instance().updateMany(uuids, stage);
+        }, []() { });
+    } catch (const std::runtime_error &err) {
+        QMessageBox::critical(parentWidget(), QString(),
+                tr("Failed to update distributions: %1").arg(err.what()));
+        return;
+    }
+    progressDialog.reset();
+
+    // Report each distribution separately, so the failures can be retried
+    size_t failed = 0;
+    QString details;
+    for (size_t i = 0; i < results.size(); ++i) {
+        if (results[i].succeeded()) {
+            details += tr("%1: Updated\n").arg(names[static_cast<int>(i)]);
+        } else {
+            ++failed;
+            details += tr("%1: %2\n").arg(names[static_cast<int>(i)])
+                                     .arg(QString::fromStdString(results[i].error));
+        }
+    }
+
+    QMessageBox result(failed ? QMessageBox::Warning : QMessageBox::Information, windowTitle(),
+                       tr("Updated %1 of %2 distributions.")
+                            .arg(results.size() - failed).arg(results.size()),
+                       QMessageBox::Ok, parentWidget());
+    result.setDetailedText(details);
+    result.exec();
+}
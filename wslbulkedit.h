@@ -0,0 +1,51 @@
+/* This file is part of wslman.
+ *
+ * wslman is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * wslman is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with wslman.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <QDialog>
+
+class QListWidget;
+class QCheckBox;
+class QSpinBox;
+class QLineEdit;
+class QPlainTextEdit;
+
+// Applies the same flags, default user and environment changes to several
+// distributions at once
+class WslBulkEditDialog : public QDialog
+{
+public:
+    WslBulkEditDialog(const QString &selectedUuid, QWidget *parent = nullptr);
+
+    bool validate();
+    void performBulkEdit();
+
+private:
+    QListWidget *m_distList;
+    QCheckBox *m_enableInterop;
+    QCheckBox *m_appendNTPath;
+    QCheckBox *m_enableDriveMounting;
+    QCheckBox *m_setDefaultUID;
+    QSpinBox *m_defaultUID;
+    QCheckBox *m_setKernelCmdLine;
+    QLineEdit *m_kernelCmdLine;
+    QPlainTextEdit *m_setEnvironment;
+    QLineEdit *m_removeEnvironment;
+
+    bool hasChanges() const;
+};
@@ -0,0 +1,192 @@
+/* This file is part of wslman.
+ *
+ * wslman is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * wslman is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with wslman.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "wslclone.h"
+
+#include "wslregistry.h"
+#include "wsltreecopy.h"
+#include "wslui.h"
+#include "wslutils.h"
+#include <QLabel>
+#include <QLineEdit>
+#include <QCheckBox>
+#include <QDialogButtonBox>
+#include <QPushButton>
+#include <QToolButton>
+#include <QGridLayout>
+#include <QCompleter>
+#include <QFileSystemModel>
+#include <QFileInfo>
+#include <QFileDialog>
+#include <QProgressDialog>
+#include <QMessageBox>
+
+WslCloneDialog::WslCloneDialog(const QString &sourceUuid, QWidget *parent)
+    : QDialog(parent), m_sourceUuid(sourceUuid.toStdWString())
+{
+    setWindowTitle(tr("Clone WSL Distribution"));
+
+    auto lblName = new QLabel(tr("&Name:"), this);
+    m_distName = new QLineEdit(this);
+    lblName->setBuddy(m_distName);
+
+    auto lblPath = new QLabel(tr("Install &Path:"), this);
+    m_installPath = new QLineEdit(this);
+    auto dirModel = new QFileSystemModel(m_installPath);
+    dirModel->setFilter(QDir::AllDirs | QDir::NoDotAndDotDot);
+    dirModel->setRootPath(QDir::rootPath());
+    auto installPathCompleter = new QCompleter(dirModel, m_installPath);
+    m_installPath->setCompleter(installPathCompleter);
+    lblPath->setBuddy(m_installPath);
+    auto selectInstallPath = new QToolButton(this);
+    selectInstallPath->setIconSize(QSize(16, 16));
+    selectInstallPath->setIcon(QIcon(":/icons/document-open.ico"));
+
+    m_linkUsr = new QCheckBox(tr("&Share /usr with the source distribution (hard links)"), this);
+
+    try {
+        WslDistribution source = WslRegistry::findDistByUuid(m_sourceUuid);
+        m_distName->setText(tr("%1 (Copy)").arg(QString::fromStdWString(source.name())));
+    } catch (const std::runtime_error &) {
+        // The name will be validated later
+    }
+
+    auto buttons = new QDialogButtonBox(QDialogButtonBox::Ok | QDialogButtonBox::Cancel, this);
+    connect(buttons, &QDialogButtonBox::accepted, this, &QDialog::accept);
+    connect(buttons, &QDialogButtonBox::rejected, this, &QDialog::reject);
+    buttons->button(QDialogButtonBox::Ok)->setText(tr("&Clone"));
+
+    connect(selectInstallPath, &QAbstractButton::clicked, this, [this](bool) {
+        QString path = QFileDialog::getExistingDirectory(this,
+                            tr("Select Install Path..."), m_installPath->text());
+        if (!path.isEmpty())
+            m_installPath->setText(path);
+    });
+
+    auto layout = new QGridLayout(this);
+    int layoutRow = 0;
+    layout->addWidget(lblName, layoutRow, 0);
+    layout->addWidget(m_distName, layoutRow, 1, 1, 2);
+    layout->addWidget(lblPath, ++layoutRow, 0);
+    layout->addWidget(m_installPath, layoutRow, 1);
+    layout->addWidget(selectInstallPath, layoutRow, 2);
+    layout->addWidget(m_linkUsr, ++layoutRow, 1, 1, 2);
+    layout->addItem(new QSpacerItem(0, 10), ++layoutRow, 0, 1, 3);
+    layout->addWidget(buttons, ++layoutRow, 0, 1, 3);
+}
+
+bool WslCloneDialog::validate()
+{
+    if (m_distName->text().isEmpty() || m_installPath->text().isEmpty()) {
+        QMessageBox::critical(this, QString(), tr("Missing required fields"));
+        return false;
+    }
+
+    std::wstring distName = m_distName->text().toStdWString();
+    WslDistribution dist;
+    try {
+        WslRegistry registry;
+        dist = registry.findDistByName(distName);
+    } catch (const std::runtime_error &err) {
+        QMessageBox::critical(this, QString(),
+                tr("Failed to query WSL distributions: %1").arg(err.what()));
+        return false;
+    }
+    if (dist.isValid()) {
+        QMessageBox::critical(this, QString(),
+                tr("A distribution named \"%1\" already exists").arg(m_distName->text()));
+        return false;
+    }
+
+    QString installPath = m_installPath->text();
+    if (QFileInfo(installPath).exists() && !WslUtil::isDirectoryEmpty(installPath)) {
+        QMessageBox::critical(this, QString(),
+                tr("The install path \"%1\" already exists and is not empty").arg(installPath));
+        return false;
+    }
+
+    return true;
+}
+
+void WslCloneDialog::performClone()
+{
+    const bool createdDir = !QFileInfo::exists(m_installPath->text());
+    if (!QDir::current().mkpath(m_installPath->text())) {
+        QMessageBox::critical(parentWidget(), QString(),
+                tr("Failed to create distribution directory"));
+        return;
+    }
+
+    const std::wstring distName = m_distName->text().toStdWString();
+    const std::wstring distDir = QDir::toNativeSeparators(
+                    QFileInfo(m_installPath->text()).absoluteFilePath()).toStdWString();
+
+    QProgressDialog progressDialog(parentWidget());
+    progressDialog.setLabelText(tr("Copying distribution rootfs..."));
+    progressDialog.setWindowModality(Qt::WindowModal);
+    progressDialog.setMinimumDuration(0);
+
+    const std::wstring rootfsDir = distDir + L"\\rootfs";
+    std::atomic<bool> cancel = false;
+    bool copyStarted = false;
+
+    // Don't leave a partial or unregistered copy behind
+    auto cleanUp = [&]() {
+        if (copyStarted)
+            WslUi::deleteTree(parentWidget(), rootfsDir);
+        if (createdDir)
+            RemoveDirectoryW(distDir.c_str());
+    };
+
+    try {
+        WslDistribution source = WslRegistry::findDistByUuid(m_sourceUuid);
+        if (!source.isValid())
+            throw std::runtime_error("Source distribution no longer exists");
+
+        WslTreeCopy copy(WslFs(source.rootfsPath()), rootfsDir);
+        if (m_linkUsr->isChecked())
+            copy.setLinkedPaths({"/usr"});
+
+        copyStarted = true;
+        WslUtil::runInBackground([&]() { copy.run(&cancel); }, [&]() {
+            if (progressDialog.wasCanceled())
+                cancel = true;
+
+            // QProgressDialog only supports int progress
+            progressDialog.setMaximum(static_cast<int>(copy.entriesFound()));
+            progressDialog.setValue(static_cast<int>(copy.entriesCopied()));
+        });
+        if (cancel) {
+            cleanUp();
+            return;
+        }
+
+        WslRegistry registry;
+        WslDistribution dist = registry.cloneDistribution(source, distName, distDir);
+        if (!dist.isValid()) {
+            cleanUp();
+            QMessageBox::critical(parentWidget(), QString(), tr("Failed to register distribution"));
+        }
+    } catch (const std::runtime_error &err) {
+        try {
+            cleanUp();
+        } catch (const std::runtime_error &) {
+            // The clone failure below is what matters
+        }
+        QMessageBox::critical(parentWidget(), QString(),
+                tr("Failed to clone distribution: %1").arg(err.what()));
+    }
+}
@@ -0,0 +1,259 @@
+/* This file is part of wslman.
+ *
+ * wslman is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * wslman is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with wslman.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "wslconvert.h"
+
+#include <QStandardPaths>
+#include <QFileInfo>
+#include <QDir>
+#include <optional>
+
+static std::wstring childPath(const std::wstring &ntPath, const std::wstring &name)
+{
+    if (!ntPath.empty() && ntPath.back() == L'\\')
+        return ntPath + name;
+    return ntPath + L'\\' + name;
+}
+
+WslConvert::WslConvert(const std::wstring &rootfsPath, const QString &journalPath)
+    : m_source(WslFs::open(rootfsPath, WslApi::v1)),
+      m_target(WslFs::open(rootfsPath, WslApi::v2)),
+      m_journal(journalPath), m_directoriesDone(), m_entriesConverted(),
+      m_entriesRenamed()
+{
+    // The journal holds the NUL-terminated paths of the directories whose
+    // entries have all been converted, and of the entries which have been
+    // given their WslFs name (prefixed with '>')
+    if (m_journal.open(QIODevice::ReadOnly)) {
+        const QByteArray journal = m_journal.readAll();
+        for (const QByteArray &path : journal.split('\0')) {
+            if (path.startsWith('>'))
+                m_renamed.insert(path.mid(1).toStdString());
+            else if (!path.isEmpty())
+                m_completed.insert(path.toStdString());
+        }
+        m_journal.close();
+    }
+
+    QDir().mkpath(QFileInfo(journalPath).absolutePath());
+    if (!m_journal.open(QIODevice::WriteOnly | QIODevice::Append))
+        throw std::runtime_error("Could not open conversion journal");
+}
+
+QString WslConvert::journalPath(const std::wstring &uuid)
+{
+    return QStandardPaths::writableLocation(QStandardPaths::AppLocalDataLocation)
+            + QStringLiteral("/convert/") + QString::fromStdWString(uuid)
+            + QStringLiteral(".journal");
+}
+
+void WslConvert::run(const std::atomic<bool> *cancel)
+{
+    m_directoriesDone = 0;
+    m_entriesConverted = 0;
+    m_entriesRenamed = 0;
+
+    // Directories are processed one level at a time, so every directory is
+    // renamed by its parent before its own entries are converted.
+    std::vector<PendingDirectory> level{{m_source.rootPath(), std::string()}};
+    std::vector<PendingDirectory> nextLevel;
+    std::mutex levelMutex;
+    while (!level.empty()) {
+        WslUtil::parallelFor(level.size(), [&](size_t index) {
+            std::vector<PendingDirectory> subdirs;
+            convertDirectory(level[index], subdirs);
+
+            std::lock_guard<std::mutex> lock(levelMutex);
+            nextLevel.insert(nextLevel.end(), std::make_move_iterator(subdirs.begin()),
+                             std::make_move_iterator(subdirs.end()));
+        }, cancel);
+        if (cancel && *cancel)
+            return;
+
+        level.swap(nextLevel);
+        nextLevel.clear();
+    }
+
+    convertRoot();
+
+    m_journal.close();
+    m_journal.remove();
+}
+
+void WslConvert::convertDirectory(const PendingDirectory &dir,
+                                  std::vector<PendingDirectory> &subdirs)
+{
+    const std::string displayPath = dir.unixPath.empty() ? "/" : dir.unixPath;
+    UniqueHandle hDir = CreateFileW(dir.ntPath.c_str(),
+                                    FILE_LIST_DIRECTORY | FILE_READ_ATTRIBUTES
+                                        | FILE_WRITE_ATTRIBUTES | SYNCHRONIZE,
+                                    FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                    nullptr, OPEN_EXISTING,
+                                    FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OPEN_REPARSE_POINT,
+                                    nullptr);
+    if (hDir == INVALID_HANDLE_VALUE)
+        throw std::runtime_error("Could not open directory " + displayPath);
+
+    struct Child
+    {
+        std::wstring ntName;
+        bool isDirectory;
+        bool isReparsePoint;
+    };
+    std::vector<Child> children;
+    WslFs::listDirectory(hDir.get(), [&](const FILE_ID_BOTH_DIR_INFO &info) {
+        Child child;
+        child.ntName.assign(info.FileName, info.FileNameLength / sizeof(wchar_t));
+        child.isDirectory = (info.FileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+        child.isReparsePoint = (info.FileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0;
+        children.push_back(std::move(child));
+    });
+
+    // Renaming entries updates the directory's modification time, which
+    // has already been converted along with the directory itself
+    FILE_BASIC_INFO times;
+    if (!GetFileInformationByHandleEx(hDir.get(), FileBasicInfo, &times, sizeof(times)))
+        throw std::runtime_error("Failed to query file extended info");
+
+    // LxFs doesn't use the per-directory flag, but WslFs relies on it.  It
+    // is set before the entries are renamed, since names which only differ
+    // in case can't be told apart without it.
+    const bool completed = m_completed.count(displayPath) != 0;
+    if (!completed && !m_target.setCaseSensitive(hDir.get()))
+        throw std::runtime_error("Could not set case sensitivity of " + displayPath);
+
+    bool renamed = false;
+    for (const Child &child : children) {
+        // Entries converted by an interrupted run already have their WslFs
+        // name, which must not be decoded as an LxFs name again
+        std::string name = m_target.unixName(child.ntName);
+        std::wstring ntName = child.ntName;
+
+        if (!completed) {
+            UniqueHandle hFile = WslFs::openRelative(hDir.get(), child.ntName,
+                                                     GENERIC_READ | GENERIC_WRITE,
+                                                     child.isDirectory);
+            if (hFile == INVALID_HANDLE_VALUE)
+                throw std::runtime_error("Could not open " + dir.unixPath + "/" + name);
+
+            std::optional<WslAttr> attr;
+            try {
+                attr = m_source.getAttr(hFile.get());
+            } catch (const std::runtime_error &) {
+                // Already converted, or created from Windows without LX metadata
+            }
+
+            if (attr && m_renamed.count(dir.unixPath + "/" + name) == 0) {
+                name = m_source.unixName(child.ntName);
+                ntName = m_target.ntName(name);
+            }
+            const std::string unixPath = dir.unixPath + "/" + name;
+
+            // The entry is renamed before its LXATTRB attribute is removed,
+            // and the new name is recorded first, so the two states can be
+            // told apart after an interruption
+            if (attr && ntName != child.ntName) {
+                hFile = nullptr;
+                markRenamed(unixPath);
+                if (!MoveFileExW(childPath(dir.ntPath, child.ntName).c_str(),
+                                 childPath(dir.ntPath, ntName).c_str(), 0)) {
+                    throw std::runtime_error("Could not rename " + unixPath);
+                }
+                renamed = true;
+                ++m_entriesRenamed;
+
+                hFile = WslFs::openRelative(hDir.get(), ntName, GENERIC_READ | GENERIC_WRITE,
+                                            child.isDirectory);
+                if (hFile == INVALID_HANDLE_VALUE)
+                    throw std::runtime_error("Could not open " + unixPath);
+            }
+            if (attr)
+                convertEntry(hFile.get(), *attr, child.isReparsePoint, unixPath);
+        }
+
+        if (child.isDirectory && !child.isReparsePoint)
+            subdirs.push_back({childPath(dir.ntPath, ntName), dir.unixPath + "/" + name});
+    }
+
+    if (renamed) {
+        times.FileAttributes = 0;
+        if (!SetFileInformationByHandle(hDir.get(), FileBasicInfo, &times, sizeof(times)))
+            throw std::runtime_error("Failed to set file extended info");
+    }
+
+    markCompleted(displayPath);
+    ++m_directoriesDone;
+}
+
+void WslConvert::convertEntry(HANDLE hFile, const WslAttr &attr, bool isReparsePoint,
+                              const std::string &unixPath)
+{
+    if ((attr.mode & LX_IFMT) == LX_IFLNK) {
+        if (!isReparsePoint) {
+            const std::string target = m_source.readSymlink(hFile);
+            if (!m_target.writeSymlink(hFile, target))
+                throw std::runtime_error("Could not convert symlink " + unixPath);
+        }
+
+        FILE_END_OF_FILE_INFO eof;
+        eof.EndOfFile.QuadPart = 0;
+        if (!SetFileInformationByHandle(hFile, FileEndOfFileInfo, &eof, sizeof(eof)))
+            throw std::runtime_error("Could not truncate symlink " + unixPath);
+    }
+
+    // The LXATTRB attribute is removed last, since it marks the entry as
+    // still needing conversion
+    m_target.setAttr(hFile, attr);
+    if (!WslFs::removeExtendedAttribute(hFile, "LXATTRB"))
+        throw std::runtime_error("Could not remove LxFs attributes from " + unixPath);
+    ++m_entriesConverted;
+}
+
+void WslConvert::convertRoot()
+{
+    UniqueHandle hRoot = CreateFileW(m_source.rootPath().c_str(), GENERIC_READ | GENERIC_WRITE,
+                                     FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                     nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS,
+                                     nullptr);
+    if (hRoot == INVALID_HANDLE_VALUE)
+        throw std::runtime_error("Could not open root directory");
+
+    WslAttr attr;
+    try {
+        attr = m_source.getAttr(hRoot.get());
+    } catch (const std::runtime_error &) {
+        // Already converted
+        return;
+    }
+    convertEntry(hRoot.get(), attr, false, "/");
+}
+
+void WslConvert::markCompleted(const std::string &unixPath)
+{
+    std::lock_guard<std::mutex> lock(m_journalMutex);
+    m_journal.write(unixPath.c_str(), static_cast<qint64>(unixPath.size() + 1));
+    m_journal.flush();
+}
+
+void WslConvert::markRenamed(const std::string &unixPath)
+{
+    const std::string record = ">" + unixPath;
+    std::lock_guard<std::mutex> lock(m_journalMutex);
+    m_journal.write(record.c_str(), static_cast<qint64>(record.size() + 1));
+    if (!m_journal.flush())
+        throw std::runtime_error("Could not write conversion journal");
+}
@@ -0,0 +1,79 @@
+/* This file is part of wslman.
+ *
+ * wslman is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * wslman is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with wslman.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "wslfs.h"
+
+#include <QFile>
+#include <mutex>
+#include <unordered_set>
+#include <vector>
+
+// Converts a legacy LxFs (v1) rootfs to the WslFs (v2) format in place:
+// the LXATTRB attribute of every entry is replaced by the $LX* attributes
+// and NTFS timestamps, #XXXX escaped names are renamed to the WslFs escape
+// characters, and symlink targets are moved from the file data into
+// IO_REPARSE_TAG_LX_SYMLINK reparse points.
+//
+// Every step is safe to repeat, and completed directories and renamed
+// entries are recorded in a journal, so an interrupted conversion can simply
+// be run again.  The root directory is converted last, so the rootfs is
+// still detected as v1 until everything else is done.
+class WslConvert
+{
+public:
+    WslConvert(const std::wstring &rootfsPath, const QString &journalPath);
+
+    static QString journalPath(const std::wstring &uuid);
+
+    // True if a previous conversion was interrupted
+    bool isResuming() const { return !m_completed.empty(); }
+
+    void run(const std::atomic<bool> *cancel = nullptr);
+
+    // These may be queried from another thread while run() is active
+    uint64_t directoriesDone() const { return m_directoriesDone; }
+    uint64_t entriesConverted() const { return m_entriesConverted; }
+    uint64_t entriesRenamed() const { return m_entriesRenamed; }
+
+private:
+    struct PendingDirectory
+    {
+        std::wstring ntPath;
+        std::string unixPath;
+    };
+
+    WslFs m_source;
+    WslFs m_target;
+
+    QFile m_journal;
+    std::mutex m_journalMutex;
+    std::unordered_set<std::string> m_completed;
+    std::unordered_set<std::string> m_renamed;
+
+    std::atomic<uint64_t> m_directoriesDone;
+    std::atomic<uint64_t> m_entriesConverted;
+    std::atomic<uint64_t> m_entriesRenamed;
+
+    void convertDirectory(const PendingDirectory &dir, std::vector<PendingDirectory> &subdirs);
+    void convertEntry(HANDLE hFile, const WslAttr &attr, bool isReparsePoint,
+                      const std::string &unixPath);
+    void convertRoot();
+    void markCompleted(const std::string &unixPath);
+    void markRenamed(const std::string &unixPath);
+};
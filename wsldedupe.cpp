@@ -0,0 +1,493 @@
+/* This file is part of wslman.
+ *
+ * wslman is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * wslman is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with wslman.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "wsldedupe.h"
+
+#include "wslregistry.h"
+#include "wslui.h"
+#include <QLabel>
+#include <QListWidget>
+#include <QCheckBox>
+#include <QSpinBox>
+#include <QDialogButtonBox>
+#include <QGridLayout>
+#include <QProgressDialog>
+#include <QMessageBox>
+#include <QLocale>
+
+#include <algorithm>
+#include <tuple>
+
+#define HASH_BLOCK_SIZE     (1024 * 1024)
+
+struct WslDedupe::Candidate
+{
+    size_t root;
+    std::wstring ntPath;
+    std::string unixPath;
+    uint64_t fileId;
+    uint64_t size;
+
+    // Filled in during the hashing phase
+    bool valid;
+    WslAttr attr;
+    WslHash::Digest digest;
+    uint32_t linkCount;
+
+    // The other names of the same file, which have to be relinked along
+    // with it before its space is freed
+    std::vector<const Candidate *> otherNames;
+
+    // The file this one was (or would be) replaced with a link to
+    const Candidate *linkedTo;
+
+    uint32_t volumeSerial(const std::vector<Root> &roots) const
+    {
+        return roots[root].volumeSerial;
+    }
+};
+
+WslDedupe::WslDedupe()
+    : m_dryRun(true), m_phase(Finished), m_filesScanned(), m_bytesToHash(),
+      m_bytesHashed(), m_bytesReclaimed()
+{
+}
+
+void WslDedupe::addRootfs(const std::wstring &distName, const std::wstring &rootfsPath)
+{
+    WslFs rootfs(rootfsPath);
+    if (rootfs.version() == WslApi::InvalidVersion)
+        throw std::runtime_error("Unsupported rootfs format for " + WslUtil::toUtf8(distName));
+
+    // Hard links can only be created between files on the same volume
+    UniqueHandle hRoot = CreateFileW(rootfs.rootPath().c_str(), FILE_READ_ATTRIBUTES,
+                                     FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                                     OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr);
+    BY_HANDLE_FILE_INFORMATION info;
+    if (hRoot == INVALID_HANDLE_VALUE || !GetFileInformationByHandle(hRoot.get(), &info))
+        throw std::runtime_error("Could not open rootfs for " + WslUtil::toUtf8(distName));
+
+    m_roots.push_back(Root{distName, rootfs, info.dwVolumeSerialNumber});
+}
+
+void WslDedupe::run(const std::atomic<bool> *cancel)
+{
+    m_groups.clear();
+    m_filesScanned = 0;
+    m_bytesToHash = 0;
+    m_bytesHashed = 0;
+    m_bytesReclaimed = 0;
+
+    // Phase 1: Collect all regular files.  Empty files and special files
+    // (which are reparse points on WslFs) are never worth linking.
+    m_phase = Scanning;
+    std::vector<Candidate> files;
+    std::mutex filesMutex;
+    for (size_t root = 0; root < m_roots.size(); ++root) {
+        m_roots[root].rootfs.walk("", [&](const WslDirEntry &entry) {
+            ++m_filesScanned;
+            if (entry.isDirectory() || entry.isReparsePoint() || entry.size == 0)
+                return;
+
+            std::lock_guard<std::mutex> lock(filesMutex);
+            files.push_back(Candidate{root, entry.ntPath, entry.unixPath,
+                                      entry.fileId, entry.size, false});
+        }, cancel);
+    }
+    if (cancel && *cancel)
+        return;
+
+    // Phase 2: Group by size, and drop any size that only occurs once.
+    // Multiple links to the same file are only hashed once.
+    std::sort(files.begin(), files.end(), [this](const Candidate &a, const Candidate &b) {
+        return std::make_tuple(a.volumeSerial(m_roots), a.size, a.fileId)
+                < std::make_tuple(b.volumeSerial(m_roots), b.size, b.fileId);
+    });
+    std::vector<Candidate *> candidates;
+    for (size_t first = 0; first < files.size(); ) {
+        size_t last = first + 1;
+        while (last < files.size()
+                && files[last].volumeSerial(m_roots) == files[first].volumeSerial(m_roots)
+                && files[last].size == files[first].size)
+            ++last;
+
+        size_t uniqueFiles = 1;
+        for (size_t i = first + 1; i < last; ++i) {
+            if (files[i].fileId != files[i - 1].fileId)
+                ++uniqueFiles;
+        }
+        if (uniqueFiles > 1) {
+            for (size_t i = first; i < last; ++i) {
+                if (i == first || files[i].fileId != files[i - 1].fileId) {
+                    candidates.push_back(&files[i]);
+                    m_bytesToHash += files[i].size;
+                } else {
+                    candidates.back()->otherNames.push_back(&files[i]);
+                }
+            }
+        }
+        first = last;
+    }
+
+    // Phase 3: Hash only the files whose size collides with another file
+    m_phase = Hashing;
+    WslUtil::parallelFor(candidates.size(), [&](size_t index) {
+        hashCandidate(*candidates[index]);
+    }, cancel);
+    if (cancel && *cancel)
+        return;
+
+    // Phase 4: Group identical contents with identical LX metadata
+    candidates.erase(std::remove_if(candidates.begin(), candidates.end(),
+                                    [](const Candidate *c) { return !c->valid; }),
+                     candidates.end());
+    auto identityKey = [this](const Candidate *c) {
+        return std::make_tuple(c->volumeSerial(m_roots), c->size, c->digest,
+                               c->attr.mode, c->attr.uid, c->attr.gid,
+                               c->attr.mtime, c->attr.mtime_nsec);
+    };
+    std::stable_sort(candidates.begin(), candidates.end(),
+                     [&](const Candidate *a, const Candidate *b) {
+        return identityKey(a) < identityKey(b);
+    });
+
+    std::vector<std::vector<Candidate *>> duplicates;
+    for (size_t first = 0; first < candidates.size(); ) {
+        size_t last = first + 1;
+        while (last < candidates.size()
+                && identityKey(candidates[last]) == identityKey(candidates[first]))
+            ++last;
+        if (last - first > 1)
+            duplicates.emplace_back(candidates.begin() + first, candidates.begin() + last);
+        first = last;
+    }
+
+    // Phase 5: Replace the duplicates with hard links
+    m_phase = Linking;
+    auto displayPath = [this](const Candidate *file) {
+        return QStringLiteral("%1:%2")
+                .arg(QString::fromStdWString(m_roots[file->root].distName))
+                .arg(QString::fromStdString(file->unixPath));
+    };
+    std::vector<std::vector<WslDedupeGroup>> results(duplicates.size());
+    WslUtil::parallelFor(duplicates.size(), [&](size_t index) {
+        std::vector<Candidate *> &group = duplicates[index];
+        size_t freed = 0;
+        if (m_dryRun) {
+            for (auto iter = group.begin() + 1; iter != group.end(); ++iter) {
+                Candidate *file = *iter;
+                file->linkedTo = group.front();
+                if (file->linkCount == file->otherNames.size() + 1)
+                    ++freed;
+            }
+        } else {
+            freed = linkGroup(group);
+        }
+        m_bytesReclaimed += group.front()->size * freed;
+
+        // One result for each file that was kept, which is only more than
+        // one if NTFS's link limit was reached
+        for (const Candidate *keep : group) {
+            if (!keep->valid || keep->linkedTo)
+                continue;
+
+            WslDedupeGroup result;
+            result.size = keep->size;
+            result.paths.push_back(displayPath(keep));
+            for (const Candidate *file : group) {
+                if (file->linkedTo != keep)
+                    continue;
+                result.paths.push_back(displayPath(file));
+                for (const Candidate *name : file->otherNames)
+                    result.paths.push_back(displayPath(name));
+            }
+            if (result.paths.size() > 1)
+                results[index].push_back(std::move(result));
+        }
+    }, cancel);
+
+    for (std::vector<WslDedupeGroup> &groups : results) {
+        for (WslDedupeGroup &group : groups)
+            m_groups.push_back(std::move(group));
+    }
+    m_phase = Finished;
+}
+
+void WslDedupe::hashCandidate(Candidate &candidate)
+{
+    const WslFs &rootfs = m_roots[candidate.root].rootfs;
+    UniqueHandle hFile = CreateFileW(candidate.ntPath.c_str(), GENERIC_READ | FILE_READ_EA,
+                                     FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                                     FILE_FLAG_OPEN_REPARSE_POINT | FILE_FLAG_SEQUENTIAL_SCAN,
+                                     nullptr);
+    if (hFile == INVALID_HANDLE_VALUE) {
+        m_bytesHashed += candidate.size;
+        return;
+    }
+
+    // Relinking a file only frees its space if none of its names are left
+    BY_HANDLE_FILE_INFORMATION info;
+    candidate.linkCount = GetFileInformationByHandle(hFile.get(), &info)
+                        ? info.nNumberOfLinks : 0;
+
+    try {
+        // On LxFs, special files are not reparse points, so we can only
+        // tell them apart by their mode.
+        candidate.attr = rootfs.getAttr(hFile.get());
+        if ((candidate.attr.mode & LX_IFMT) != LX_IFREG) {
+            m_bytesHashed += candidate.size;
+            return;
+        }
+
+        WslHash hash;
+        auto buffer = std::make_unique<std::byte[]>(HASH_BLOCK_SIZE);
+        uint64_t remaining = candidate.size;
+        for ( ;; ) {
+            m_budget.consume(std::min<uint64_t>(remaining, HASH_BLOCK_SIZE));
+            DWORD nRead = 0;
+            if (!ReadFile(hFile.get(), buffer.get(), HASH_BLOCK_SIZE, &nRead, nullptr))
+                throw std::runtime_error("Could not read file data");
+            if (nRead == 0)
+                break;
+            hash.update(buffer.get(), nRead);
+            m_bytesHashed += nRead;
+            remaining -= std::min<uint64_t>(remaining, nRead);
+        }
+        m_bytesHashed += remaining;
+
+        // The file changed size while we were looking at it
+        if (remaining != 0)
+            return;
+
+        candidate.digest = hash.finish();
+        candidate.valid = true;
+    } catch (const std::runtime_error &) {
+        // Unreadable files are simply left alone
+        candidate.valid = false;
+    }
+}
+
+static bool replaceWithHardLink(const std::wstring &target, const std::wstring &path)
+{
+    // Link to a temporary name first, so the original file is only replaced
+    // once the link exists.
+    const std::wstring tempPath = path + L".wslman-dedupe";
+    if (!CreateHardLinkW(tempPath.c_str(), target.c_str(), nullptr))
+        return false;
+    if (!MoveFileExW(tempPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+        const DWORD error = GetLastError();
+        DeleteFileW(tempPath.c_str());
+        SetLastError(error);
+        return false;
+    }
+    return true;
+}
+
+size_t WslDedupe::linkGroup(std::vector<Candidate *> &group)
+{
+    size_t freed = 0;
+    Candidate *keep = group.front();
+    for (auto iter = group.begin() + 1; iter != group.end(); ++iter) {
+        Candidate *file = *iter;
+        std::vector<const Candidate *> names{file};
+        names.insert(names.end(), file->otherNames.begin(), file->otherNames.end());
+
+        size_t relinked = 0;
+        DWORD error = ERROR_SUCCESS;
+        for (const Candidate *name : names) {
+            if (!replaceWithHardLink(keep->ntPath, name->ntPath)) {
+                error = GetLastError();
+                break;
+            }
+            ++relinked;
+        }
+        if (relinked == names.size()) {
+            // Names outside of the scanned distributions still keep the
+            // old file around
+            file->linkedTo = keep;
+            if (file->linkCount == names.size())
+                ++freed;
+            continue;
+        }
+
+        // NTFS limits the number of links per file.  If we hit that limit,
+        // start linking to the current file instead.
+        if (error == ERROR_TOO_MANY_LINKS)
+            keep = file;
+        else
+            file->valid = false;
+    }
+    return freed;
+}
+
+QString WslDedupe::report() const
+{
+    const QLocale locale;
+    size_t duplicateFiles = 0;
+    for (const WslDedupeGroup &group : m_groups)
+        duplicateFiles += group.paths.size() - 1;
+
+    QString text = QObject::tr("Scanned %1 files, found %2 duplicates in %3 groups.\n")
+                        .arg(m_filesScanned.load()).arg(duplicateFiles).arg(m_groups.size());
+    if (m_dryRun) {
+        text += QObject::tr("%1 can be reclaimed.\n")
+                        .arg(locale.formattedDataSize(m_bytesReclaimed.load()));
+    } else {
+        text += QObject::tr("%1 reclaimed.\n")
+                        .arg(locale.formattedDataSize(m_bytesReclaimed.load()));
+    }
+
+    for (const WslDedupeGroup &group : m_groups) {
+        text += QStringLiteral("\n%1 (%2)\n").arg(group.paths.front())
+                        .arg(locale.formattedDataSize(group.size));
+        for (size_t i = 1; i < group.paths.size(); ++i)
+            text += QStringLiteral("    %1\n").arg(group.paths[i]);
+    }
+    return text;
+}
+
+
+enum {
+    DistRootfsRole = Qt::UserRole,
+};
+
+WslDedupeDialog::WslDedupeDialog(const QString &selectedUuid, QWidget *parent)
+    : QDialog(parent)
+{
+    setWindowTitle(tr("Deduplicate Distributions"));
+
+    auto lblDists = new QLabel(tr("&Distributions to scan:"), this);
+    m_distList = new QListWidget(this);
+    lblDists->setBuddy(m_distList);
+
+    try {
+        WslRegistry registry;
+        for (const WslDistribution &dist : registry.getDistributions()) {
+            auto distName = QString::fromStdWString(dist.name());
+            auto item = new QListWidgetItem(WslUi::pickDistIcon(distName), distName, m_distList);
+            item->setData(DistRootfsRole, QString::fromStdWString(dist.rootfsPath()));
+            item->setFlags(item->flags() | Qt::ItemIsUserCheckable);
+            item->setCheckState(QString::fromStdWString(dist.uuid()) == selectedUuid
+                                ? Qt::Checked : Qt::Unchecked);
+        }
+    } catch (const std::runtime_error &err) {
+        QMessageBox::critical(this, QString(),
+                tr("Failed to get distribution list: %1").arg(err.what()));
+    }
+    m_distList->sortItems();
+
+    m_dryRun = new QCheckBox(tr("Only &report duplicates (dry run)"), this);
+    m_dryRun->setChecked(true);
+
+    auto lblIoBudget = new QLabel(tr("&I/O Limit:"), this);
+    m_ioBudget = new QSpinBox(this);
+    m_ioBudget->setRange(0, 10000);
+    m_ioBudget->setSuffix(tr(" MiB/s"));
+    m_ioBudget->setSpecialValueText(tr("Unlimited"));
+    lblIoBudget->setBuddy(m_ioBudget);
+
+    auto buttons = new QDialogButtonBox(QDialogButtonBox::Ok | QDialogButtonBox::Cancel, this);
+    connect(buttons, &QDialogButtonBox::accepted, this, &QDialog::accept);
+    connect(buttons, &QDialogButtonBox::rejected, this, &QDialog::reject);
+
+    auto layout = new QGridLayout(this);
+    int layoutRow = 0;
+    layout->addWidget(lblDists, layoutRow, 0, 1, 2);
+    layout->addWidget(m_distList, ++layoutRow, 0, 1, 2);
+    layout->addWidget(m_dryRun, ++layoutRow, 0, 1, 2);
+    layout->addWidget(lblIoBudget, ++layoutRow, 0);
+    layout->addWidget(m_ioBudget, layoutRow, 1);
+    layout->addItem(new QSpacerItem(0, 10), ++layoutRow, 0, 1, 2);
+    layout->addWidget(buttons, ++layoutRow, 0, 1, 2);
+}
+
+bool WslDedupeDialog::validate()
+{
+    for (int i = 0; i < m_distList->count(); ++i) {
+        if (m_distList->item(i)->checkState() == Qt::Checked)
+            return true;
+    }
+
+    QMessageBox::critical(this, QString(), tr("No distributions selected"));
+    return false;
+}
+
+void WslDedupeDialog::performDedupe()
+{
+    WslDedupe dedupe;
+    dedupe.setDryRun(m_dryRun->isChecked());
+    dedupe.setIoBudget(static_cast<uint64_t>(m_ioBudget->value()) * 1024 * 1024);
+
+    try {
+        for (int i = 0; i < m_distList->count(); ++i) {
+            QListWidgetItem *item = m_distList->item(i);
+            if (item->checkState() != Qt::Checked)
+                continue;
+            dedupe.addRootfs(item->text().toStdWString(),
+                             item->data(DistRootfsRole).toString().toStdWString());
+        }
+    } catch (const std::runtime_error &err) {
+        QMessageBox::critical(parentWidget(), QString(), err.what());
+        return;
+    }
+
+    QProgressDialog progressDialog(parentWidget());
+    progressDialog.setWindowModality(Qt::WindowModal);
+    progressDialog.setMinimumDuration(0);
+
+    std::atomic<bool> cancel = false;
+    try {
+        WslUtil::runInBackground([&]() { dedupe.run(&cancel); }, [&]() {
+            if (progressDialog.wasCanceled())
+                cancel = true;
+
+            // QProgressDialog only supports int progress, so adjust to KiB
+            switch (dedupe.phase()) {
+            case WslDedupe::Scanning:
+                progressDialog.setLabelText(tr("Scanning files... (%1 found)")
+                                            .arg(dedupe.filesScanned()));
+                progressDialog.setMaximum(0);
+                break;
+            case WslDedupe::Hashing:
+                progressDialog.setLabelText(tr("Comparing file contents..."));
+                progressDialog.setMaximum(static_cast<int>(dedupe.bytesToHash() / 1024));
+                progressDialog.setValue(static_cast<int>(dedupe.bytesHashed() / 1024));
+                break;
+            case WslDedupe::Linking:
+                progressDialog.setLabelText(tr("Linking duplicate files... (%1 reclaimed)")
+                        .arg(QLocale().formattedDataSize(dedupe.bytesReclaimed())));
+                progressDialog.setMaximum(0);
+                break;
+            case WslDedupe::Finished:
+                break;
+            }
+        });
+    } catch (const std::runtime_error &err) {
+        QMessageBox::critical(parentWidget(), QString(),
+                tr("Failed to deduplicate files: %1").arg(err.what()));
+        return;
+    }
+    progressDialog.reset();
+
+    if (cancel)
+        return;
+
+    QMessageBox result(QMessageBox::Information, windowTitle(),
+                       dedupe.report().section(QLatin1Char('\n'), 0, 1),
+                       QMessageBox::Ok, parentWidget());
+    result.setDetailedText(dedupe.report());
+    result.exec();
+}
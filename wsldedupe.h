@@ -0,0 +1,106 @@
+/* This file is part of wslman.
+ *
+ * wslman is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * wslman is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with wslman.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "wslfs.h"
+
+#include <QDialog>
+#include <vector>
+
+class QListWidget;
+class QCheckBox;
+class QSpinBox;
+
+struct WslDedupeGroup
+{
+    uint64_t size;
+
+    // The first path is the file that is kept; the rest are (or would be)
+    // replaced by hard links to it.  A file with several names is listed
+    // once for each of them.
+    std::vector<QString> paths;
+};
+
+class WslDedupe
+{
+public:
+    enum Phase
+    {
+        Scanning,
+        Hashing,
+        Linking,
+        Finished,
+    };
+
+    WslDedupe();
+
+    void addRootfs(const std::wstring &distName, const std::wstring &rootfsPath);
+    void setDryRun(bool dryRun) { m_dryRun = dryRun; }
+    void setIoBudget(uint64_t bytesPerSecond) { m_budget.setLimit(bytesPerSecond); }
+
+    void run(const std::atomic<bool> *cancel = nullptr);
+
+    // These may be queried from another thread while run() is active
+    Phase phase() const { return m_phase; }
+    uint64_t filesScanned() const { return m_filesScanned; }
+    uint64_t bytesToHash() const { return m_bytesToHash; }
+    uint64_t bytesHashed() const { return m_bytesHashed; }
+    uint64_t bytesReclaimed() const { return m_bytesReclaimed; }
+
+    bool isDryRun() const { return m_dryRun; }
+    const std::vector<WslDedupeGroup> &groups() const { return m_groups; }
+    QString report() const;
+
+private:
+    struct Root
+    {
+        std::wstring distName;
+        WslFs rootfs;
+        uint32_t volumeSerial;
+    };
+    struct Candidate;
+
+    std::vector<Root> m_roots;
+    std::vector<WslDedupeGroup> m_groups;
+    WslIoBudget m_budget;
+    bool m_dryRun;
+
+    std::atomic<Phase> m_phase;
+    std::atomic<uint64_t> m_filesScanned;
+    std::atomic<uint64_t> m_bytesToHash;
+    std::atomic<uint64_t> m_bytesHashed;
+    std::atomic<uint64_t> m_bytesReclaimed;
+
+    void hashCandidate(Candidate &candidate);
+    // Returns the number of files whose space was freed, which only
+    // happens once every one of their names was replaced by a link
+    size_t linkGroup(std::vector<Candidate *> &group);
+};
+
+class WslDedupeDialog : public QDialog
+{
+public:
+    WslDedupeDialog(const QString &selectedUuid, QWidget *parent = nullptr);
+
+    bool validate();
+    void performDedupe();
+
+private:
+    QListWidget *m_distList;
+    QCheckBox *m_dryRun;
+    QSpinBox *m_ioBudget;
+};
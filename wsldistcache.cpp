@@ -0,0 +1,178 @@
+/* This file is part of wslman.
+ *
+ * wslman is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * wslman is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with wslman.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "wsldistcache.h"
+
+WslDistributionCache::DistPtr WslDistributionCache::Snapshot::find(const std::wstring &uuid) const
+{
+    auto iter = distributions.find(uuid);
+    return (iter != distributions.end()) ? iter->second : nullptr;
+}
+
+WslDistributionCache &WslDistributionCache::instance()
+{
+    static WslDistributionCache s_instance;
+    return s_instance;
+}
+
+WslDistributionCache::SnapshotPtr WslDistributionCache::snapshot()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_snapshot)
+        return loadAll();
+    return m_snapshot;
+}
+
+WslDistributionCache::DistPtr
+WslDistributionCache::update(const std::wstring &uuid,
+                             const std::function<void (WslDistribution &)> &change)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_snapshot)
+        loadAll();
+
+    DistPtr current = m_snapshot->find(uuid);
+    if (!current)
+        return nullptr;
+
+    auto snapshot = std::make_shared<Snapshot>(*m_snapshot);
+    auto updated = std::make_shared<WslDistribution>(*current);
+    try {
+        change(*updated);
+    } catch (...) {
+        // Some of the values may have been written before the failure
+        reloadDistribution(*snapshot, uuid);
+        publish(snapshot);
+        throw;
+    }
+
+    snapshot->distributions[uuid] = updated;
+    publish(snapshot);
+    return updated;
+}
+
+std::vector<WslBulkUpdateResult>
+WslDistributionCache::updateMany(const std::vector<std::wstring> &uuids,
+                                 const WslRegistry::StageChanges &stage)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_snapshot)
+        loadAll();
+
+    // Unknown distributions are left invalid, which fails their commit
+    std::vector<WslDistribution> dists;
+    dists.reserve(uuids.size());
+    for (const std::wstring &uuid : uuids) {
+        DistPtr current = m_snapshot->find(uuid);
+        dists.push_back(current ? *current : WslDistribution());
+    }
+
+    auto results = WslRegistry::updateDistributions(dists, stage);
+
+    auto snapshot = std::make_shared<Snapshot>(*m_snapshot);
+    for (size_t i = 0; i < results.size(); ++i) {
+        if (!dists[i].isValid())
+            continue;
+
+        // Some of the values may have been written before a failure
+        if (results[i].succeeded())
+            snapshot->distributions[uuids[i]] = std::make_shared<WslDistribution>(results[i].dist);
+        else
+            reloadDistribution(*snapshot, uuids[i]);
+    }
+    publish(snapshot);
+    return results;
+}
+
+void WslDistributionCache::setDefaultDistribution(const std::wstring &uuid)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_snapshot)
+        loadAll();
+
+    WslRegistry registry;
+    registry.setDefaultDistribution(uuid);
+
+    auto snapshot = std::make_shared<Snapshot>(*m_snapshot);
+    snapshot->defaultUuid = uuid;
+    publish(snapshot);
+}
+
+WslDistributionCache::SnapshotPtr
+WslDistributionCache::reload(const WslRegistryChanges &changes)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_snapshot)
+        return loadAll();
+
+    auto snapshot = std::make_shared<Snapshot>(*m_snapshot);
+    for (const std::wstring &uuid : changes.removed)
+        snapshot->distributions.erase(uuid);
+    for (const std::wstring &uuid : changes.changed)
+        reloadDistribution(*snapshot, uuid);
+    if (changes.defaultChanged) {
+        WslRegistry registry;
+        snapshot->defaultUuid = registry.defaultDistribution().uuid();
+    }
+    return publish(snapshot);
+}
+
+WslDistributionCache::SnapshotPtr WslDistributionCache::reloadAll()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return loadAll();
+}
+
+WslDistributionCache::SnapshotPtr WslDistributionCache::loadAll()
+{
+    WslRegistry registry;
+    auto snapshot = std::make_shared<Snapshot>();
+    for (WslDistribution &dist : registry.getDistributions()) {
+        // Keep the objects that didn't change, so readers can tell
+        const std::wstring uuid = dist.uuid();
+        DistPtr cached = m_snapshot ? m_snapshot->find(uuid) : nullptr;
+        if (cached && *cached == dist)
+            snapshot->distributions.emplace(uuid, cached);
+        else
+            snapshot->distributions.emplace(uuid, std::make_shared<WslDistribution>(std::move(dist)));
+    }
+    snapshot->defaultUuid = registry.defaultDistribution().uuid();
+    return publish(snapshot);
+}
+
+void WslDistributionCache::reloadDistribution(Snapshot &snapshot, const std::wstring &uuid)
+{
+    WslDistribution dist = WslRegistry::findDistByUuid(uuid);
+    if (!dist.isValid()) {
+        // Removed again since the change was seen
+        snapshot.distributions.erase(uuid);
+        return;
+    }
+    DistPtr cached = snapshot.find(uuid);
+
+    // Our own changes come back as notifications too, and are already known
+    if (cached && *cached == dist)
+        return;
+    snapshot.distributions[uuid] = std::make_shared<WslDistribution>(std::move(dist));
+}
+
+WslDistributionCache::SnapshotPtr
+WslDistributionCache::publish(std::shared_ptr<Snapshot> snapshot)
+{
+    snapshot->generation = m_snapshot ? m_snapshot->generation + 1 : 1;
+    m_snapshot = std::move(snapshot);
+    return m_snapshot;
+}
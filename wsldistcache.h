@@ -0,0 +1,80 @@
+/* This file is part of wslman.
+ *
+ * wslman is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * wslman is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with wslman.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "wslregistry.h"
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+
+// An in-memory model of all registered distributions, which the UI reads
+// instead of going back to the registry for every action.
+//
+// The model is published as immutable snapshots.  A snapshot can be used
+// for as long as needed without locking, and a distribution which hasn't
+// changed keeps the same shared object across snapshots.  Changes made
+// through update() are written through to the registry and published as a
+// new snapshot with the next generation number.  Changes made elsewhere
+// are picked up by reload().
+class WslDistributionCache
+{
+public:
+    typedef std::shared_ptr<const WslDistribution> DistPtr;
+
+    struct Snapshot
+    {
+        uint64_t generation = 0;
+        std::wstring defaultUuid;
+        std::map<std::wstring, DistPtr> distributions;
+
+        DistPtr find(const std::wstring &uuid) const;
+    };
+    typedef std::shared_ptr<const Snapshot> SnapshotPtr;
+
+    static WslDistributionCache &instance();
+
+    // Loads all distributions on first use
+    SnapshotPtr snapshot();
+    DistPtr find(const std::wstring &uuid) { return snapshot()->find(uuid); }
+
+    // Applies the change to a copy of the distribution with its setters,
+    // which write to the registry, and publishes the result.  Returns the
+    // updated distribution, or null if it isn't known.
+    DistPtr update(const std::wstring &uuid,
+                   const std::function<void (WslDistribution &)> &change);
+    void setDefaultDistribution(const std::wstring &uuid);
+
+    // Like update(), but for several distributions at once, which are
+    // published together in one snapshot
+    std::vector<WslBulkUpdateResult>
+    updateMany(const std::vector<std::wstring> &uuids,
+               const WslRegistry::StageChanges &stage);
+
+    SnapshotPtr reload(const WslRegistryChanges &changes);
+    SnapshotPtr reloadAll();
+
+private:
+    std::mutex m_mutex;
+    SnapshotPtr m_snapshot;
+
+    // These must be called with m_mutex held
+    SnapshotPtr loadAll();
+    void reloadDistribution(Snapshot &snapshot, const std::wstring &uuid);
+    SnapshotPtr publish(std::shared_ptr<Snapshot> snapshot);
+};
@@ -0,0 +1,507 @@
+/* This file is part of wslman.
+ *
+ * wslman is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * wslman is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with wslman.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "wsldistmodel.h"
+
+#include "wslenviron.h"
+#include "wslusage.h"
+#include "wslusers.h"
+#include "wslui.h"
+#include <QDataStream>
+#include <QDir>
+#include <QFileInfo>
+#include <QLocale>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <tuple>
+
+#define STATE_MAGIC         0x57534c44  // "WSLD"
+#define STATE_VERSION       1
+
+WslDistributionModel::WslDistributionModel(QObject *parent)
+    : QAbstractListModel(parent), m_stopping()
+{
+    m_detailsThread = std::thread(&WslDistributionModel::lookupDetails, this);
+}
+
+WslDistributionModel::~WslDistributionModel()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_detailsMutex);
+        m_stopping = true;
+    }
+    m_detailsWake.notify_one();
+    m_detailsThread.join();
+}
+
+int WslDistributionModel::rowCount(const QModelIndex &parent) const
+{
+    return parent.isValid() ? 0 : static_cast<int>(m_rows.size());
+}
+
+static QString lookupDefaultUser(const std::wstring &rootfsPath, uint32_t uid)
+{
+    try {
+        auto userDb = WslUserDb::forRootfs(rootfsPath);
+        const WslUser *user = userDb ? userDb->findUser(uid) : nullptr;
+        if (user)
+            return QString::fromUtf8(user->name.data(), static_cast<int>(user->name.size()));
+    } catch (const std::runtime_error &) {
+        // Shown as unknown
+    }
+    return QString();
+}
+
+static bool isSymlink(const WslFs &rootfs, HANDLE hFile)
+{
+    try {
+        return (rootfs.getOwnership(hFile).mode & LX_IFMT) == LX_IFLNK;
+    } catch (const std::runtime_error &) {
+        // No LX metadata, e.g. a file copied in from Windows
+        return false;
+    }
+}
+
+// The target of a symlink as an absolute path.  Relative targets are
+// resolved against the directory which contains the link.
+static std::string resolveLink(const std::string &linkPath, const std::string &target)
+{
+    std::string joined = target;
+    if (target.empty() || target.front() != '/')
+        joined = linkPath.substr(0, linkPath.rfind('/') + 1) + target;
+
+    std::vector<std::string_view> parts;
+    std::string_view rest(joined);
+    while (!rest.empty()) {
+        const size_t end = rest.find('/');
+        const std::string_view part = rest.substr(0, end);
+        rest = (end == std::string_view::npos) ? std::string_view() : rest.substr(end + 1);
+        if (part.empty() || part == ".")
+            continue;
+        if (part == "..") {
+            if (!parts.empty())
+                parts.pop_back();
+        } else {
+            parts.push_back(part);
+        }
+    }
+
+    std::string resolved;
+    for (const std::string_view &part : parts) {
+        resolved += '/';
+        resolved += part;
+    }
+    return resolved.empty() ? std::string("/") : resolved;
+}
+
+// PRETTY_NAME from os-release, which uses the same syntax as .env files
+static QString readOsName(const std::wstring &rootfsPath, WslApi::Version version)
+{
+    for (const char *releasePath : {"/etc/os-release", "/usr/lib/os-release"}) {
+        try {
+            const WslFs rootfs = WslFs::open(rootfsPath, version);
+
+            // On Debian and Ubuntu, /etc/os-release is a symlink to
+            // ../usr/lib/os-release.  openFile() doesn't follow links.
+            std::string unixPath = releasePath;
+            UniqueHandle hFile = rootfs.openFile(unixPath);
+            for (int links = 0; hFile.isValid() && isSymlink(rootfs, hFile.get()); ++links) {
+                if (links == 8) {
+                    hFile = nullptr;
+                    break;
+                }
+                unixPath = resolveLink(unixPath, rootfs.readSymlink(hFile.get()));
+                hFile = rootfs.openFile(unixPath);
+            }
+            if (!hFile.isValid())
+                continue;
+
+            // The file is small, so a single read is enough
+            std::string content(16 * 1024, '\0');
+            DWORD nRead = 0;
+            if (!ReadFile(hFile.get(), content.data(), static_cast<DWORD>(content.size()),
+                          &nRead, nullptr)) {
+                continue;
+            }
+            content.resize(nRead);
+
+            const WslEnvironment release = WslEnvironment::fromEnvFile(content);
+            std::wstring name = release.value(L"PRETTY_NAME");
+            if (name.empty())
+                name = release.value(L"NAME");
+            if (!name.empty())
+                return QString::fromStdWString(name);
+        } catch (const std::runtime_error &) {
+            // Try the next location
+            continue;
+        }
+    }
+    return QString();
+}
+
+QVariant WslDistributionModel::data(const QModelIndex &index, int role) const
+{
+    if (!index.isValid() || index.row() >= static_cast<int>(m_rows.size()))
+        return QVariant();
+
+    const Row &row = m_rows[static_cast<size_t>(index.row())];
+    switch (role) {
+    case Qt::DisplayRole:
+        loadUsage(row);
+        if (row.allocated >= 0) {
+            return QStringLiteral("%1\n%2").arg(label(row))
+                        .arg(QLocale().formattedDataSize(row.allocated));
+        }
+        return label(row);
+    case Qt::DecorationRole:
+        return row.icon;
+    case Qt::ToolTipRole:
+        {
+            const QString osName = data(index, OsNameRole).toString();
+            const QString userName = data(index, DefaultUserRole).toString();
+            return tr("OS: %1\nDefault user: %2 (%3)\nLocation: %4")
+                    .arg(osName.isEmpty() ? tr("Unknown") : osName)
+                    .arg(userName.isEmpty() ? tr("Unknown") : userName)
+                    .arg(row.dist->defaultUID())
+                    .arg(QString::fromStdWString(row.dist->path()));
+        }
+    case UuidRole:
+        return row.uuid;
+    case NameRole:
+        return row.name;
+    case UsageRole:
+        loadUsage(row);
+        return (row.allocated >= 0) ? QVariant(row.allocated) : QVariant();
+    case DefaultUserRole:
+        requestDetails(row);
+        return row.defaultUser ? QVariant(*row.defaultUser) : QVariant();
+    case OsNameRole:
+        requestDetails(row);
+        return row.osName ? QVariant(*row.osName) : QVariant();
+    default:
+        return QVariant();
+    }
+}
+
+void WslDistributionModel::setSnapshot(const WslDistributionCache::SnapshotPtr &snapshot)
+{
+    // Distributions which are being removed, or which another tool hasn't
+    // finished registering, aren't listed
+    auto isListed = [](const WslDistributionCache::DistPtr &dist) {
+        return dist && dist->state() != WslDistribution::StateUninstalling
+            && !dist->name().empty();
+    };
+
+    bool removed = false;
+    for (int rowNum = static_cast<int>(m_rows.size()); rowNum-- > 0; ) {
+        auto dist = snapshot->find(m_rows[static_cast<size_t>(rowNum)].dist->uuid());
+        if (isListed(dist))
+            continue;
+
+        beginRemoveRows(QModelIndex(), rowNum, rowNum);
+        m_rows.erase(m_rows.begin() + rowNum);
+        endRemoveRows();
+        removed = true;
+    }
+    if (removed) {
+        m_rowIndex.clear();
+        for (size_t i = 0; i < m_rows.size(); ++i)
+            m_rowIndex.insert(m_rows[i].uuid, static_cast<int>(i));
+    }
+
+    // Unchanged distributions keep the same object across snapshots, so
+    // only the pointers need to be compared
+    for (size_t i = 0; i < m_rows.size(); ++i) {
+        Row &row = m_rows[i];
+        auto dist = snapshot->find(row.dist->uuid());
+        if (dist == row.dist)
+            continue;
+
+        setRowDistribution(row, dist);
+        const QModelIndex changed = index(static_cast<int>(i));
+        emit dataChanged(changed, changed);
+    }
+
+    const QString defaultUuid = QString::fromStdWString(snapshot->defaultUuid);
+    if (defaultUuid != m_defaultUuid) {
+        const QString oldDefault = m_defaultUuid;
+        m_defaultUuid = defaultUuid;
+        rowChanged(oldDefault);
+        rowChanged(m_defaultUuid);
+    }
+
+    std::vector<Row> added;
+    for (const auto &[uuid, dist] : snapshot->distributions) {
+        const QString rowUuid = QString::fromStdWString(uuid);
+        if (!isListed(dist) || m_rowIndex.contains(rowUuid))
+            continue;
+
+        Row row;
+        row.uuid = rowUuid;
+        setRowDistribution(row, dist);
+        added.push_back(std::move(row));
+    }
+    if (!added.empty()) {
+        const int first = static_cast<int>(m_rows.size());
+        beginInsertRows(QModelIndex(), first, first + static_cast<int>(added.size()) - 1);
+        for (Row &row : added) {
+            m_rowIndex.insert(row.uuid, static_cast<int>(m_rows.size()));
+            m_rows.push_back(std::move(row));
+        }
+        endInsertRows();
+    }
+}
+
+void WslDistributionModel::setUsage(const QString &uuid, const WslUsageTotals &totals)
+{
+    auto iter = m_rowIndex.constFind(uuid);
+    if (iter == m_rowIndex.constEnd())
+        return;
+
+    Row &row = m_rows[static_cast<size_t>(iter.value())];
+    row.usageLoaded = true;
+    row.allocated = static_cast<qint64>(totals.allocated);
+    rowChanged(uuid);
+}
+
+QModelIndex WslDistributionModel::indexOf(const QString &uuid) const
+{
+    auto iter = m_rowIndex.constFind(uuid);
+    return (iter != m_rowIndex.constEnd()) ? index(iter.value()) : QModelIndex();
+}
+
+WslDistributionCache::DistPtr WslDistributionModel::distribution(const QModelIndex &index) const
+{
+    if (!index.isValid() || index.row() >= static_cast<int>(m_rows.size()))
+        return nullptr;
+    return m_rows[static_cast<size_t>(index.row())].dist;
+}
+
+void WslDistributionModel::setRowDistribution(Row &row, const WslDistributionCache::DistPtr &dist)
+{
+    const QString name = QString::fromStdWString(dist->name());
+    if (name != row.name) {
+        row.name = name;
+        row.icon = WslUi::pickDistIcon(name);
+    }
+    // The details are looked up again, but the last known values are shown
+    // until then if they still apply.  The disk usage is cached per uuid,
+    // so it survives a move.
+    if (row.dist && (row.dist->path() != dist->path()
+                     || row.dist->version() != dist->version())) {
+        row.defaultUser.reset();
+        row.osName.reset();
+    } else if (row.dist && row.dist->defaultUID() != dist->defaultUID()) {
+        row.defaultUser.reset();
+    }
+    row.detailsRequested = false;
+    row.dist = dist;
+}
+
+void WslDistributionModel::rowChanged(const QString &uuid)
+{
+    const QModelIndex changed = indexOf(uuid);
+    if (changed.isValid())
+        emit dataChanged(changed, changed);
+}
+
+QString WslDistributionModel::label(const Row &row) const
+{
+    if (row.uuid == m_defaultUuid)
+        return tr("%1 (Default)").arg(row.name);
+    return row.name;
+}
+
+void WslDistributionModel::requestDetails(const Row &row) const
+{
+    if (row.detailsRequested)
+        return;
+
+    row.detailsRequested = true;
+    {
+        std::lock_guard<std::mutex> lock(m_detailsMutex);
+        m_detailsQueue.push_back({row.uuid, row.dist->rootfsPath(), row.dist->version(),
+                                  row.dist->defaultUID()});
+    }
+    m_detailsWake.notify_one();
+}
+
+void WslDistributionModel::lookupDetails()
+{
+    for ( ;; ) {
+        DetailsRequest request;
+        {
+            std::unique_lock<std::mutex> lock(m_detailsMutex);
+            m_detailsWake.wait(lock, [this]() {
+                return m_stopping || !m_detailsQueue.empty();
+            });
+            if (m_stopping)
+                return;
+            request = std::move(m_detailsQueue.front());
+            m_detailsQueue.pop_front();
+        }
+
+        const QString defaultUser = lookupDefaultUser(request.rootfsPath, request.uid);
+        const QString osName = readOsName(request.rootfsPath, request.version);
+        QMetaObject::invokeMethod(this, [this, request, defaultUser, osName]() {
+            setDetails(request, defaultUser, osName);
+        }, Qt::QueuedConnection);
+    }
+}
+
+void WslDistributionModel::setDetails(const DetailsRequest &request,
+                                      const QString &defaultUser, const QString &osName)
+{
+    auto iter = m_rowIndex.constFind(request.uuid);
+    if (iter == m_rowIndex.constEnd())
+        return;
+
+    // A newer request has been queued if the distribution changed since
+    Row &row = m_rows[static_cast<size_t>(iter.value())];
+    if (row.dist->rootfsPath() != request.rootfsPath || row.dist->version() != request.version
+            || row.dist->defaultUID() != request.uid) {
+        return;
+    }
+
+    row.defaultUser = defaultUser;
+    row.osName = osName;
+    rowChanged(request.uuid);
+}
+
+QString WslDistributionModel::statePath()
+{
+    return QStandardPaths::writableLocation(QStandardPaths::AppLocalDataLocation)
+            + QStringLiteral("/distributions.dat");
+}
+
+static QDataStream &operator<<(QDataStream &stream, const std::wstring &str)
+{
+    return stream << QString::fromStdWString(str);
+}
+
+static QDataStream &operator>>(QDataStream &stream, std::wstring &str)
+{
+    QString value;
+    stream >> value;
+    str = value.toStdWString();
+    return stream;
+}
+
+static QDataStream &operator<<(QDataStream &stream, const std::optional<QString> &value)
+{
+    return stream << bool(value) << value.value_or(QString());
+}
+
+static QDataStream &operator>>(QDataStream &stream, std::optional<QString> &value)
+{
+    bool hasValue;
+    QString str;
+    stream >> hasValue >> str;
+    value = hasValue ? std::optional<QString>(str) : std::nullopt;
+    return stream;
+}
+
+bool WslDistributionModel::loadState(const QString &path)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+
+    QDataStream stream(&file);
+    quint32 magic, version, rowCount;
+    stream >> magic >> version;
+    if (magic != STATE_MAGIC || version != STATE_VERSION)
+        return false;
+
+    auto snapshot = std::make_shared<WslDistributionCache::Snapshot>();
+    std::map<std::wstring, std::pair<std::optional<QString>, std::optional<QString>>> details;
+    stream >> snapshot->defaultUuid >> rowCount;
+    for (quint32 i = 0; i < rowCount && stream.status() == QDataStream::Ok; ++i) {
+        std::wstring uuid, name, path, kernelCmdLine, packageFamilyName;
+        quint32 distVersion, defaultUID, flags, state;
+        QStringList environment;
+        std::optional<QString> defaultUser, osName;
+        stream >> uuid >> name >> distVersion >> defaultUID >> flags >> environment
+               >> state >> path >> kernelCmdLine >> packageFamilyName
+               >> defaultUser >> osName;
+
+        WslDistribution dist = WslDistribution::detached(uuid);
+        WslDistributionUpdate update(dist);
+        update.setName(name);
+        update.setVersion(static_cast<WslApi::Version>(distVersion));
+        update.setDefaultUID(defaultUID);
+        update.setFlags(static_cast<WslApi::DistributionFlags>(flags));
+        update.setState(state);
+        update.setPath(path);
+        update.setKernelCmdLine(kernelCmdLine);
+        update.setPackageFamilyName(packageFamilyName);
+        std::vector<std::wstring> envList;
+        for (const QString &entry : environment)
+            envList.push_back(entry.toStdWString());
+        update.setEnvironment(envList);
+
+        snapshot->distributions.emplace(uuid, std::make_shared<WslDistribution>(update.staged()));
+        details.emplace(uuid, std::make_pair(defaultUser, osName));
+    }
+    if (stream.status() != QDataStream::Ok)
+        return false;
+
+    setSnapshot(snapshot);
+    for (Row &row : m_rows) {
+        auto iter = details.find(row.dist->uuid());
+        if (iter != details.end())
+            std::tie(row.defaultUser, row.osName) = iter->second;
+    }
+    return true;
+}
+
+void WslDistributionModel::saveState(const QString &path) const
+{
+    QDir().mkpath(QFileInfo(path).absolutePath());
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly))
+        throw std::runtime_error("Could not save the distribution list");
+
+    QDataStream stream(&file);
+    stream << quint32(STATE_MAGIC) << quint32(STATE_VERSION);
+    stream << m_defaultUuid.toStdWString() << quint32(m_rows.size());
+    for (const Row &row : m_rows) {
+        const WslDistribution &dist = *row.dist;
+        QStringList environment;
+        for (const std::wstring &entry : dist.defaultEnvironment())
+            environment << QString::fromStdWString(entry);
+
+        stream << dist.uuid() << dist.name() << quint32(dist.version())
+               << quint32(dist.defaultUID()) << quint32(dist.flags()) << environment
+               << quint32(dist.state()) << dist.path() << dist.kernelCmdLine()
+               << dist.packageFamilyName() << row.defaultUser << row.osName;
+    }
+
+    if (stream.status() != QDataStream::Ok || !file.commit())
+        throw std::runtime_error("Could not save the distribution list");
+}
+
+void WslDistributionModel::loadUsage(const Row &row) const
+{
+    if (row.usageLoaded)
+        return;
+
+    row.usageLoaded = true;
+    WslUsageTotals totals;
+    if (WslDiskUsage::loadTotals(WslDiskUsage::cachePath(row.dist->uuid()), totals))
+        row.allocated = static_cast<qint64>(totals.allocated);
+}
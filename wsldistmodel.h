@@ -0,0 +1,117 @@
+/* This file is part of wslman.
+ *
+ * wslman is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * wslman is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with wslman.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "wsldistcache.h"
+
+#include <QAbstractListModel>
+#include <QHash>
+#include <QIcon>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+struct WslUsageTotals;
+
+// The distribution list of the main window, backed by the snapshots of
+// WslDistributionCache.  Rows can be looked up by uuid in constant time,
+// and applying a new snapshot only emits the rows which were inserted,
+// removed or changed, so views keep their selection and scroll position.
+//
+// The default user and OS name are only read from the rootfs when they
+// are first requested, on a background thread, and the disk usage when the
+// row is first shown.  Until a lookup finishes, the roles return the last
+// known value, or an invalid QVariant if there is none.
+class WslDistributionModel : public QAbstractListModel
+{
+public:
+    enum Roles
+    {
+        UuidRole = Qt::UserRole,
+        NameRole,
+        UsageRole,
+        DefaultUserRole,
+        OsNameRole,
+    };
+
+    explicit WslDistributionModel(QObject *parent = nullptr);
+    ~WslDistributionModel();
+
+    int rowCount(const QModelIndex &parent = QModelIndex()) const override;
+    QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const override;
+
+    void setSnapshot(const WslDistributionCache::SnapshotPtr &snapshot);
+    void setUsage(const QString &uuid, const WslUsageTotals &totals);
+
+    QModelIndex indexOf(const QString &uuid) const;
+    WslDistributionCache::DistPtr distribution(const QModelIndex &index) const;
+    const QString &defaultUuid() const { return m_defaultUuid; }
+
+    // The rows of the last session, so the list can be shown before the
+    // registry has been read.  Loading replaces the current snapshot.
+    static QString statePath();
+    bool loadState(const QString &path);
+    void saveState(const QString &path) const;
+
+private:
+    struct Row
+    {
+        QString uuid;
+        QString name;
+        QIcon icon;
+        WslDistributionCache::DistPtr dist;
+
+        // Loaded on first use
+        mutable bool usageLoaded = false;
+        mutable qint64 allocated = -1;
+        mutable bool detailsRequested = false;
+        std::optional<QString> defaultUser;
+        std::optional<QString> osName;
+    };
+
+    struct DetailsRequest
+    {
+        QString uuid;
+        std::wstring rootfsPath;
+        WslApi::Version version;
+        uint32_t uid;
+    };
+
+    std::vector<Row> m_rows;
+    QHash<QString, int> m_rowIndex;
+    QString m_defaultUuid;
+
+    // Rootfs lookups, which are done one at a time by m_detailsThread
+    mutable std::mutex m_detailsMutex;
+    mutable std::condition_variable m_detailsWake;
+    mutable std::deque<DetailsRequest> m_detailsQueue;
+    bool m_stopping;
+    std::thread m_detailsThread;
+
+    void setRowDistribution(Row &row, const WslDistributionCache::DistPtr &dist);
+    void rowChanged(const QString &uuid);
+    QString label(const Row &row) const;
+    void loadUsage(const Row &row) const;
+    void requestDetails(const Row &row) const;
+    void lookupDetails();
+    void setDetails(const DetailsRequest &request, const QString &defaultUser,
+                    const QString &osName);
+};
@@ -0,0 +1,228 @@
+/* This file is part of wslman.
+ *
+ * wslman is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * wslman is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with wslman.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "wslenviron.h"
+
+#include "wslutils.h"
+
+#include <stdexcept>
+
+WslEnvironment::WslEnvironment(const std::vector<std::wstring> &lines)
+    : m_nextOrder()
+{
+    for (const std::wstring &line : lines) {
+        const auto sep = line.find(L'=');
+        if (sep == std::wstring::npos)
+            set(line, std::wstring());
+        else
+            set(line.substr(0, sep), line.substr(sep + 1));
+    }
+}
+
+bool WslEnvironment::operator==(const WslEnvironment &other) const
+{
+    if (m_values.size() != other.m_values.size())
+        return false;
+
+    auto lhs = m_order.begin();
+    auto rhs = other.m_order.begin();
+    for ( ; lhs != m_order.end(); ++lhs, ++rhs) {
+        if (lhs->second != rhs->second)
+            return false;
+        if (m_values.at(lhs->second).value != other.m_values.at(rhs->second).value)
+            return false;
+    }
+    return true;
+}
+
+std::wstring WslEnvironment::value(const std::wstring &key) const
+{
+    auto iter = m_values.find(key);
+    return (iter != m_values.end()) ? iter->second.value : std::wstring();
+}
+
+void WslEnvironment::set(const std::wstring &key, const std::wstring &value)
+{
+    auto iter = m_values.find(key);
+    if (iter != m_values.end()) {
+        iter->second.value = value;
+    } else {
+        const uint64_t order = m_nextOrder++;
+        m_values.emplace(key, Entry{value, order});
+        m_order.emplace(order, key);
+    }
+}
+
+bool WslEnvironment::remove(const std::wstring &key)
+{
+    auto iter = m_values.find(key);
+    if (iter == m_values.end())
+        return false;
+
+    m_order.erase(iter->second.order);
+    m_values.erase(iter);
+    return true;
+}
+
+bool WslEnvironment::rename(const std::wstring &oldKey, const std::wstring &newKey)
+{
+    auto iter = m_values.find(oldKey);
+    if (iter == m_values.end())
+        return false;
+    if (oldKey == newKey)
+        return true;
+
+    Entry entry = std::move(iter->second);
+    m_values.erase(iter);
+    remove(newKey);
+
+    m_order[entry.order] = newKey;
+    m_values.emplace(newKey, std::move(entry));
+    return true;
+}
+
+void WslEnvironment::merge(const WslEnvironment &other)
+{
+    for (const auto &[order, key] : other.m_order)
+        set(key, other.m_values.at(key).value);
+}
+
+std::vector<std::pair<std::wstring, std::wstring>> WslEnvironment::entries() const
+{
+    std::vector<std::pair<std::wstring, std::wstring>> result;
+    result.reserve(m_order.size());
+    for (const auto &[order, key] : m_order)
+        result.emplace_back(key, m_values.at(key).value);
+    return result;
+}
+
+std::vector<std::wstring> WslEnvironment::toList() const
+{
+    std::vector<std::wstring> result;
+    result.reserve(m_order.size());
+    for (const auto &[order, key] : m_order)
+        result.emplace_back(key + L"=" + m_values.at(key).value);
+    return result;
+}
+
+static std::string_view trimmed(std::string_view text)
+{
+    const auto start = text.find_first_not_of(" \t");
+    if (start == std::string_view::npos)
+        return std::string_view();
+    const auto end = text.find_last_not_of(" \t");
+    return text.substr(start, end - start + 1);
+}
+
+// Supports the usual subset of the format: comments, an optional "export"
+// prefix, and single or double quoted values.  Quoted values may not span
+// several lines, but double quoted values can use \n for a line break.
+WslEnvironment WslEnvironment::fromEnvFile(const std::string &text)
+{
+    WslEnvironment result;
+    size_t lineNumber = 0;
+    size_t start = 0;
+    while (start < text.size()) {
+        size_t end = text.find('\n', start);
+        if (end == std::string::npos)
+            end = text.size();
+        std::string_view line(text.data() + start, end - start);
+        start = end + 1;
+        ++lineNumber;
+
+        if (!line.empty() && line.back() == '\r')
+            line.remove_suffix(1);
+        line = trimmed(line);
+        if (line.empty() || line.front() == '#')
+            continue;
+        if (line.compare(0, 7, "export ") == 0)
+            line = trimmed(line.substr(7));
+
+        const auto invalidLine = [lineNumber]() {
+            return std::runtime_error("Invalid environment variable on line "
+                                      + std::to_string(lineNumber));
+        };
+
+        const auto sep = line.find('=');
+        if (sep == std::string_view::npos)
+            throw invalidLine();
+        const std::string_view key = trimmed(line.substr(0, sep));
+        if (key.empty() || key.find_first_of(" \t") != std::string_view::npos)
+            throw invalidLine();
+
+        std::string_view rawValue = trimmed(line.substr(sep + 1));
+        std::string value;
+        if (!rawValue.empty() && rawValue.front() == '\'') {
+            const auto close = rawValue.find('\'', 1);
+            if (close == std::string_view::npos)
+                throw invalidLine();
+            value = rawValue.substr(1, close - 1);
+        } else if (!rawValue.empty() && rawValue.front() == '"') {
+            size_t pos = 1;
+            for ( ;; ) {
+                if (pos >= rawValue.size())
+                    throw invalidLine();
+                const char ch = rawValue[pos++];
+                if (ch == '"')
+                    break;
+                if (ch == '\\' && pos < rawValue.size()) {
+                    const char escaped = rawValue[pos++];
+                    value += (escaped == 'n') ? '\n' : escaped;
+                } else {
+                    value += ch;
+                }
+            }
+        } else {
+            // Unquoted values end at a comment
+            const auto comment = rawValue.find(" #");
+            value = trimmed(rawValue.substr(0, comment));
+        }
+
+        result.set(WslUtil::fromUtf8(key), WslUtil::fromUtf8(value));
+    }
+
+    return result;
+}
+
+std::string WslEnvironment::toEnvFile() const
+{
+    std::string result;
+    for (const auto &[order, key] : m_order) {
+        const std::string value = WslUtil::toUtf8(m_values.at(key).value);
+        result += WslUtil::toUtf8(key);
+        result += '=';
+
+        // Only quote the values which wouldn't be read back unchanged
+        if (value.find_first_of(" \t\n#'\"\\") == std::string::npos) {
+            result += value;
+        } else {
+            result += '"';
+            for (char ch : value) {
+                if (ch == '\n') {
+                    result += "\\n";
+                } else {
+                    if (ch == '"' || ch == '\\')
+                        result += '\\';
+                    result += ch;
+                }
+            }
+            result += '"';
+        }
+        result += '\n';
+    }
+    return result;
+}
@@ -0,0 +1,77 @@
+/* This file is part of wslman.
+ *
+ * wslman is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * wslman is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with wslman.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+// The default environment of a distribution, as a map from the variable
+// names to their values.  The variables keep the order they were added in,
+// which is also the order they are stored in the registry.  Lookups and
+// edits of single variables take O(log n).
+class WslEnvironment
+{
+public:
+    WslEnvironment() : m_nextOrder() { }
+
+    // From the KEY=VALUE lines of the registry.  A line without '=' is kept
+    // as a variable with an empty value.
+    explicit WslEnvironment(const std::vector<std::wstring> &lines);
+
+    // Equal if both have the same variables in the same order
+    bool operator==(const WslEnvironment &other) const;
+    bool operator!=(const WslEnvironment &other) const { return !(*this == other); }
+
+    bool isEmpty() const { return m_values.empty(); }
+    size_t size() const { return m_values.size(); }
+    bool contains(const std::wstring &key) const { return m_values.count(key) != 0; }
+    std::wstring value(const std::wstring &key) const;
+
+    // Replaces the value in place, or adds the variable at the end
+    void set(const std::wstring &key, const std::wstring &value);
+    bool remove(const std::wstring &key);
+
+    // Keeps the position of the variable.  A different variable which
+    // already has the new name is replaced.
+    bool rename(const std::wstring &oldKey, const std::wstring &newKey);
+
+    // Sets all variables of the other environment
+    void merge(const WslEnvironment &other);
+
+    // The variables in order, as (key, value) pairs or KEY=VALUE lines
+    std::vector<std::pair<std::wstring, std::wstring>> entries() const;
+    std::vector<std::wstring> toList() const;
+
+    // Reads and writes the UTF-8 text of a .env file.  Parsing throws
+    // std::runtime_error for lines which aren't variable assignments.
+    static WslEnvironment fromEnvFile(const std::string &text);
+    std::string toEnvFile() const;
+
+private:
+    struct Entry
+    {
+        std::wstring value;
+        uint64_t order;
+    };
+
+    std::map<std::wstring, Entry> m_values;
+    std::map<uint64_t, std::wstring> m_order;
+    uint64_t m_nextOrder;
+};
@@ -25,6 +25,11 @@
 #include <ntstatus.h>
 
 #include <memory>
+#include <algorithm>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 // NOTE: This is based on the work of LxRunOffline's WSL filesystem support
 
@@ -111,6 +116,16 @@ struct FILE_FULL_EA_INFORMATION
     }
 };
 
+// Header of one entry in a variable length EA list
+struct FILE_FULL_EA_ENTRY
+{
+    ULONG   NextEntryOffset;
+    UCHAR   Flags;
+    UCHAR   EaNameLength;
+    USHORT  EaValueLength;
+    CHAR    EaName[1];
+};
+
 struct REPARSE_DATA_BUFFER
 {
     ULONG   ReparseTag;
@@ -239,10 +254,20 @@ WslFs::WslFs(WslApi::Version version, const std::wstring &path)
         m_rootPath = LR"(\\?\)" + path;
 }
 
+WslFs WslFs::open(const std::wstring &path, WslApi::Version version)
+{
+    return WslFs(version, path);
+}
+
 WslFs WslFs::create(const std::wstring &path)
 {
     WslApi::Version version = WslUtil::checkWindowsVersion(WslUtil::Windows1809)
                             ? WslApi::v2 : WslApi::v1;
+    return create(path, version);
+}
+
+WslFs WslFs::create(const std::wstring &path, WslApi::Version version)
+{
     WslFs rootfs(version, path);
 
     LARGE_INTEGER sysTime;
@@ -274,20 +299,50 @@ static std::wstring encodeChar(WslApi::Version version, wchar_t ch)
     }
 }
 
+static bool isEscapedChar(wchar_t ch)
+{
+    return (ch >= L'\x01' && ch <= L'\x1f') || ch == L'<' || ch == L'>'
+            || ch == L':' || ch == L'"' || ch == L'\\' || ch == L'|'
+            || ch == L'*' || ch == L'#';
+}
+
 static std::wstring encodePath(WslApi::Version version, const std::wstring_view &path)
 {
     std::wstring result;
     result.reserve(path.size());
     for (wchar_t ch : path) {
-        if (ch == L'/') {
+        if (ch == L'/')
             result.push_back(L'\\');
-        } else if ((ch >= L'\x01' && ch <= L'\x1f') || ch == L'<' || ch == L'>'
-                    || ch == L':' || ch == L'"' || ch == L'\\' || ch == L'|'
-                    || ch == L'*' || ch == L'#') {
+        else if (isEscapedChar(ch))
             result.append(encodeChar(version, ch));
-        } else {
+        else
             result.push_back(ch);
+    }
+
+    return result;
+}
+
+static std::wstring decodeName(WslApi::Version version, const std::wstring_view &name)
+{
+    std::wstring result;
+    result.reserve(name.size());
+    for (size_t i = 0; i < name.size(); ++i) {
+        const wchar_t ch = name[i];
+        if (version == WslApi::v1 && ch == L'#' && i + 4 < name.size()) {
+            const wchar_t hex[5] = {name[i + 1], name[i + 2], name[i + 3], name[i + 4], 0};
+            wchar_t *end;
+            auto value = static_cast<wchar_t>(wcstoul(hex, &end, 16));
+            if (end == hex + 4 && isEscapedChar(value)) {
+                result.push_back(value);
+                i += 4;
+                continue;
+            }
+        } else if (version == WslApi::v2 && (ch & 0xff00) == 0xf000
+                    && isEscapedChar(ch & 0x00ff)) {
+            result.push_back(ch & 0x00ff);
+            continue;
         }
+        result.push_back(ch);
     }
 
     return result;
@@ -312,6 +367,42 @@ std::wstring WslFs::path(const std::string_view &unixPath) const
     return result;
 }
 
+std::string WslFs::unixPath(const std::wstring_view &ntPath) const
+{
+    std::wstring_view relPath = ntPath;
+    if (starts_with(relPath, std::wstring_view(m_rootPath)))
+        relPath = relPath.substr(m_rootPath.size());
+
+    std::string result;
+    for ( ;; ) {
+        while (!relPath.empty() && relPath.front() == L'\\')
+            relPath = relPath.substr(1);
+        if (relPath.empty())
+            break;
+
+        const size_t end = relPath.find(L'\\');
+        result.push_back('/');
+        result.append(WslUtil::toUtf8(decodeName(m_version, relPath.substr(0, end))));
+        if (end == relPath.npos)
+            break;
+        relPath = relPath.substr(end);
+    }
+
+    if (result.empty())
+        result.push_back('/');
+    return result;
+}
+
+std::wstring WslFs::ntName(const std::string_view &unixName) const
+{
+    return encodePath(m_version, WslUtil::fromUtf8(unixName));
+}
+
+std::string WslFs::unixName(const std::wstring_view &ntName) const
+{
+    return WslUtil::toUtf8(decodeName(m_version, ntName));
+}
+
 WslAttr WslFs::getAttr(HANDLE hFile) const
 {
     switch (m_version) {
@@ -361,6 +452,106 @@ void WslFs::setAttr(HANDLE hFile, const WslAttr &attr) const
         throw std::runtime_error("Failed to set file extended info");
 }
 
+// The WslFs ownership EA names all have the same length, so they can be
+// batched as arrays of the fixed size EA structures.
+#define LX_OWNER_EA_SIZE    sizeof("$LXUID")
+
+WslOwnership WslFs::getOwnership(HANDLE hFile) const
+{
+    switch (m_version) {
+    case WslApi::v1:
+        {
+            const auto attr = getNtExAttr<WslAttr>(hFile, "LXATTRB");
+            return WslOwnership{attr.mode, attr.uid, attr.gid};
+        }
+    case WslApi::v2:
+        {
+            FILE_GET_EA_INFORMATION<LX_OWNER_EA_SIZE> eaList[] = {
+                {"$LXUID"}, {"$LXGID"}, {"$LXMOD"}
+            };
+            eaList[0].NextEntryOffset = sizeof(eaList[0]);
+            eaList[1].NextEntryOffset = sizeof(eaList[1]);
+
+            IO_STATUS_BLOCK iosb;
+            memset(&iosb, 0, sizeof(iosb));
+            alignas(ULONG) std::byte buffer[256];
+            auto rc = NtQueryEaFile(hFile, &iosb, buffer, sizeof(buffer), FALSE,
+                                    eaList, sizeof(eaList), nullptr, TRUE);
+            if (rc != 0) {
+                QString error = ntdllError("Failed to query NT Extended Attribute", rc);
+                throw std::runtime_error(error.toStdString());
+            }
+
+            // Missing EAs are returned with an empty value
+            WslOwnership ownership;
+            int found = 0;
+            auto entry = reinterpret_cast<const FILE_FULL_EA_ENTRY *>(buffer);
+            for ( ;; ) {
+                const std::string_view name(entry->EaName, entry->EaNameLength);
+                uint32_t *value = nullptr;
+                if (name == "$LXUID")
+                    value = &ownership.uid;
+                else if (name == "$LXGID")
+                    value = &ownership.gid;
+                else if (name == "$LXMOD")
+                    value = &ownership.mode;
+                if (value && entry->EaValueLength == sizeof(uint32_t)) {
+                    memcpy(value, entry->EaName + entry->EaNameLength + 1, sizeof(uint32_t));
+                    ++found;
+                }
+
+                if (entry->NextEntryOffset == 0)
+                    break;
+                entry = reinterpret_cast<const FILE_FULL_EA_ENTRY *>(
+                            reinterpret_cast<const std::byte *>(entry) + entry->NextEntryOffset);
+            }
+            if (found != 3)
+                throw InvalidAttribute();
+            return ownership;
+        }
+    default:
+        throw std::runtime_error("Invalid file format");
+    }
+}
+
+void WslFs::setOwnership(HANDLE hFile, const WslOwnership &ownership) const
+{
+    switch (m_version) {
+    case WslApi::v1:
+        {
+            // The timestamps are part of the same attribute, so keep them
+            auto attr = getNtExAttr<WslAttr>(hFile, "LXATTRB");
+            attr.mode = ownership.mode;
+            attr.uid = ownership.uid;
+            attr.gid = ownership.gid;
+            setNtExAttr(hFile, "LXATTRB", attr);
+        }
+        break;
+    case WslApi::v2:
+        {
+            FILE_FULL_EA_INFORMATION<LX_OWNER_EA_SIZE, uint32_t> eaInfo[] = {
+                {"$LXUID"}, {"$LXGID"}, {"$LXMOD"}
+            };
+            eaInfo[0].NextEntryOffset = sizeof(eaInfo[0]);
+            eaInfo[1].NextEntryOffset = sizeof(eaInfo[1]);
+            eaInfo[0].setAttr(ownership.uid);
+            eaInfo[1].setAttr(ownership.gid);
+            eaInfo[2].setAttr(ownership.mode);
+
+            IO_STATUS_BLOCK iosb;
+            memset(&iosb, 0, sizeof(iosb));
+            auto rc = NtSetEaFile(hFile, &iosb, eaInfo, sizeof(eaInfo));
+            if (rc != 0) {
+                QString error = ntdllError("Failed to set NT Extended Attribute", rc);
+                throw std::runtime_error(error.toStdString());
+            }
+        }
+        break;
+    default:
+        throw std::runtime_error("Invalid file format");
+    }
+}
+
 UniqueHandle WslFs::createFile(const std::string_view &unixPath, const WslAttr &attr) const
 {
     const uint32_t ftype = attr.mode & LX_IFMT;
@@ -404,17 +595,22 @@ bool WslFs::createDirectory(const std::string_view &unixPath, const WslAttr &att
     setAttr(hDir.get(), attr);
 
     // Case sensitivity is set on a per-directory basis
+    return setCaseSensitive(hDir.get());
+}
+
+bool WslFs::setCaseSensitive(HANDLE hDir) const
+{
     FILE_CASE_SENSITIVE_INFORMATION info = {FILE_CS_FLAG_CASE_SENSITIVE_DIR};
     IO_STATUS_BLOCK iosb;
     memset(&iosb, 0, sizeof(iosb));
-    auto rc = NtSetInformationFile(hDir.get(), &iosb, &info, sizeof(info),
+    auto rc = NtSetInformationFile(hDir, &iosb, &info, sizeof(info),
                                    FileCaseSensitiveInformation);
     if (rc == STATUS_ACCESS_DENIED) {
         // Directories which already exist might require FILE_DELETE_CHILD
         // permission in order to modify existing files already in the directory
         ACL *acl;
         PSECURITY_DESCRIPTOR security;
-        if (GetSecurityInfo(hDir.get(), SE_FILE_OBJECT, DACL_SECURITY_INFORMATION,
+        if (GetSecurityInfo(hDir, SE_FILE_OBJECT, DACL_SECURITY_INFORMATION,
                             nullptr, nullptr, &acl, nullptr, &security) != ERROR_SUCCESS)
             return false;
 
@@ -427,18 +623,104 @@ bool WslFs::createDirectory(const std::string_view &unixPath, const WslAttr &att
             return false;
         }
 
-        SetSecurityInfo(hDir.get(), SE_FILE_OBJECT, DACL_SECURITY_INFORMATION,
+        SetSecurityInfo(hDir, SE_FILE_OBJECT, DACL_SECURITY_INFORMATION,
                         nullptr, nullptr, newAcl, nullptr);
         LocalFree(newAcl);
         LocalFree(security);
 
         // Try again
-        rc = NtSetInformationFile(hDir.get(), &iosb, &info, sizeof(info),
+        rc = NtSetInformationFile(hDir, &iosb, &info, sizeof(info),
                                   FileCaseSensitiveInformation);
     }
     return rc == 0;
 }
 
+bool WslFs::isCaseSensitive(HANDLE hDir)
+{
+    FILE_CASE_SENSITIVE_INFORMATION info = {0};
+    IO_STATUS_BLOCK iosb;
+    memset(&iosb, 0, sizeof(iosb));
+    auto rc = NtQueryInformationFile(hDir, &iosb, &info, sizeof(info),
+                                     FileCaseSensitiveInformation);
+    return rc == 0 && (info.Flags & FILE_CS_FLAG_CASE_SENSITIVE_DIR) != 0;
+}
+
+#define EA_BUFFER_SIZE      65536
+
+bool WslFs::copyExtendedAttributes(HANDLE hSource, HANDLE hTarget)
+{
+    // The EAs of a single file are limited to 64 KiB, so they can always be
+    // read and written in one call each.
+    auto buffer = std::make_unique<std::byte[]>(EA_BUFFER_SIZE);
+    IO_STATUS_BLOCK iosb;
+    memset(&iosb, 0, sizeof(iosb));
+    auto rc = NtQueryEaFile(hSource, &iosb, buffer.get(), EA_BUFFER_SIZE, FALSE,
+                            nullptr, 0, nullptr, TRUE);
+    if (rc == STATUS_NO_EAS_ON_FILE)
+        return true;
+    else if (rc != 0)
+        return false;
+
+    const auto eaLength = static_cast<ULONG>(iosb.Information);
+    memset(&iosb, 0, sizeof(iosb));
+    return NtSetEaFile(hTarget, &iosb, buffer.get(), eaLength) == 0;
+}
+
+bool WslFs::removeExtendedAttribute(HANDLE hFile, const std::string_view &name)
+{
+    // An EA is deleted by setting it with an empty value
+    const ULONG eaLength = static_cast<ULONG>(offsetof(FILE_FULL_EA_ENTRY, EaName)
+                                              + name.size() + 1);
+    auto buffer = std::make_unique<std::byte[]>(eaLength);
+    memset(buffer.get(), 0, eaLength);
+    auto eaInfo = reinterpret_cast<FILE_FULL_EA_ENTRY *>(buffer.get());
+    eaInfo->EaNameLength = static_cast<UCHAR>(name.size());
+    memcpy(eaInfo->EaName, name.data(), name.size());
+
+    IO_STATUS_BLOCK iosb;
+    memset(&iosb, 0, sizeof(iosb));
+    return NtSetEaFile(hFile, &iosb, eaInfo, eaLength) == 0;
+}
+
+bool WslFs::copyReparsePoint(HANDLE hSource, HANDLE hTarget)
+{
+    auto buffer = std::make_unique<std::byte[]>(MAXIMUM_REPARSE_DATA_BUFFER_SIZE);
+    DWORD nReturned;
+    if (!DeviceIoControl(hSource, FSCTL_GET_REPARSE_POINT, nullptr, 0, buffer.get(),
+                         MAXIMUM_REPARSE_DATA_BUFFER_SIZE, &nReturned, nullptr))
+        return false;
+
+    return DeviceIoControl(hTarget, FSCTL_SET_REPARSE_POINT, buffer.get(), nReturned,
+                           nullptr, 0, &nReturned, nullptr);
+}
+
+UniqueHandle WslFs::openRelative(HANDLE hParent, const std::wstring_view &name,
+                                 DWORD access, bool directory)
+{
+    UNICODE_STRING ntName;
+    ntName.Buffer = const_cast<PWSTR>(name.data());
+    ntName.Length = static_cast<USHORT>(name.size() * sizeof(wchar_t));
+    ntName.MaximumLength = ntName.Length;
+
+    // No OBJ_CASE_INSENSITIVE, since names may only differ by case in
+    // case sensitive directories
+    OBJECT_ATTRIBUTES attributes;
+    InitializeObjectAttributes(&attributes, &ntName, 0, hParent, nullptr);
+
+    IO_STATUS_BLOCK iosb;
+    memset(&iosb, 0, sizeof(iosb));
+    HANDLE hFile;
+    const ULONG options = FILE_OPEN_REPARSE_POINT | FILE_OPEN_FOR_BACKUP_INTENT
+                        | FILE_SYNCHRONOUS_IO_NONALERT
+                        | (directory ? FILE_DIRECTORY_FILE : FILE_NON_DIRECTORY_FILE);
+    auto rc = NtCreateFile(&hFile, access | SYNCHRONIZE, &attributes, &iosb, nullptr, 0,
+                           FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                           FILE_OPEN, options, nullptr, 0);
+    if (rc != 0)
+        return INVALID_HANDLE_VALUE;
+    return hFile;
+}
+
 bool WslFs::createSymlink(const std::string_view &unixPath,
                           const std::string_view &target, const WslAttr &attr) const
 {
@@ -449,11 +731,16 @@ bool WslFs::createSymlink(const std::string_view &unixPath,
     if (hFile == INVALID_HANDLE_VALUE)
         return false;
 
+    return writeSymlink(hFile.get(), target);
+}
+
+bool WslFs::writeSymlink(HANDLE hFile, const std::string_view &target) const
+{
     switch (m_version) {
     case WslApi::v1:
         {
             DWORD nWritten;
-            return WriteFile(hFile.get(), target.data(), static_cast<DWORD>(target.size()),
+            return WriteFile(hFile, target.data(), static_cast<DWORD>(target.size()),
                              &nWritten, nullptr);
         }
     case WslApi::v2:
@@ -470,7 +757,7 @@ bool WslFs::createSymlink(const std::string_view &unixPath,
             memcpy(reparse->DataBuffer + sizeof(data), target.data(), target.size());
 
             DWORD nReturned;
-            return DeviceIoControl(hFile.get(), FSCTL_SET_REPARSE_POINT, reparse,
+            return DeviceIoControl(hFile, FSCTL_SET_REPARSE_POINT, reparse,
                                    bufLen, nullptr, 0, &nReturned, nullptr);
         }
     default:
@@ -478,6 +765,46 @@ bool WslFs::createSymlink(const std::string_view &unixPath,
     }
 }
 
+std::string WslFs::readSymlink(HANDLE hFile) const
+{
+    switch (m_version) {
+    case WslApi::v1:
+        {
+            // LxFs stores the target as the file's data
+            std::string target;
+            char buffer[4096];
+            for ( ;; ) {
+                DWORD nRead = 0;
+                if (!ReadFile(hFile, buffer, sizeof(buffer), &nRead, nullptr))
+                    throw std::runtime_error("Could not read symlink");
+                if (nRead == 0)
+                    break;
+                target.append(buffer, nRead);
+            }
+            return target;
+        }
+    case WslApi::v2:
+        {
+            auto buffer = std::make_unique<std::byte[]>(MAXIMUM_REPARSE_DATA_BUFFER_SIZE);
+            DWORD nReturned;
+            if (!DeviceIoControl(hFile, FSCTL_GET_REPARSE_POINT, nullptr, 0, buffer.get(),
+                                 MAXIMUM_REPARSE_DATA_BUFFER_SIZE, &nReturned, nullptr))
+                throw std::runtime_error("Could not read symlink");
+
+            auto reparse = reinterpret_cast<const REPARSE_DATA_BUFFER *>(buffer.get());
+            if (reparse->ReparseTag != IO_REPARSE_TAG_LX_SYMLINK
+                    || reparse->ReparseDataLength < sizeof(uint32_t))
+                throw std::runtime_error("Not a symlink");
+
+            // The target follows the same 32-bit value written by createSymlink
+            auto target = reinterpret_cast<const char *>(reparse->DataBuffer) + sizeof(uint32_t);
+            return std::string(target, reparse->ReparseDataLength - sizeof(uint32_t));
+        }
+    default:
+        throw std::runtime_error("Cannot read a symlink in an invalid WSL Root");
+    }
+}
+
 bool WslFs::createHardLink(const std::string_view &unixPath,
                            const std::string_view &unixTarget) const
 {
@@ -485,3 +812,184 @@ bool WslFs::createHardLink(const std::string_view &unixPath,
     std::wstring winTarget = path(unixTarget);
     return CreateHardLinkW(winPath.c_str(), winTarget.c_str(), nullptr);
 }
+
+#define WALK_BUFFER_SIZE    65536
+
+struct WalkDirectory
+{
+    std::wstring ntPath;
+    std::string unixPath;
+};
+
+void WslFs::listDirectory(HANDLE hDir, const ListVisitor &visitor)
+{
+    // A single query returns as many entries (names, sizes and file IDs) as
+    // will fit in the buffer
+    auto buffer = std::make_unique<std::byte[]>(WALK_BUFFER_SIZE);
+    FILE_INFO_BY_HANDLE_CLASS infoClass = FileIdBothDirectoryRestartInfo;
+    for ( ;; ) {
+        if (!GetFileInformationByHandleEx(hDir, infoClass, buffer.get(), WALK_BUFFER_SIZE)) {
+            if (GetLastError() == ERROR_NO_MORE_FILES)
+                break;
+            throw std::runtime_error("Could not list directory");
+        }
+        infoClass = FileIdBothDirectoryInfo;
+
+        auto info = reinterpret_cast<const FILE_ID_BOTH_DIR_INFO *>(buffer.get());
+        for ( ;; ) {
+            std::wstring_view name(info->FileName, info->FileNameLength / sizeof(wchar_t));
+            if (name != L"." && name != L"..")
+                visitor(*info);
+
+            if (info->NextEntryOffset == 0)
+                break;
+            info = reinterpret_cast<const FILE_ID_BOTH_DIR_INFO *>(
+                        reinterpret_cast<const std::byte *>(info) + info->NextEntryOffset);
+        }
+    }
+}
+
+static void walkDirectory(WslApi::Version version, const WalkDirectory &dir,
+                          const WslFs::WalkVisitor &visitor,
+                          std::vector<WalkDirectory> &subdirs)
+{
+    UniqueHandle hDir = CreateFileW(dir.ntPath.c_str(), FILE_LIST_DIRECTORY | SYNCHRONIZE,
+                                    FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                    nullptr, OPEN_EXISTING,
+                                    FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OPEN_REPARSE_POINT,
+                                    nullptr);
+    if (hDir == INVALID_HANDLE_VALUE)
+        throw std::runtime_error("Could not open directory " + dir.unixPath);
+
+    WslFs::listDirectory(hDir.get(), [&](const FILE_ID_BOTH_DIR_INFO &info) {
+        std::wstring_view name(info.FileName, info.FileNameLength / sizeof(wchar_t));
+        WslDirEntry entry;
+        entry.ntPath.reserve(dir.ntPath.size() + name.size() + 1);
+        entry.ntPath.append(dir.ntPath);
+        entry.ntPath.push_back(L'\\');
+        entry.ntPath.append(name);
+        entry.unixPath = dir.unixPath + "/" + WslUtil::toUtf8(decodeName(version, name));
+        entry.attributes = info.FileAttributes;
+        // For reparse points, the EA size field holds the reparse tag
+        entry.reparseTag = entry.isReparsePoint() ? info.EaSize : 0;
+        entry.fileId = static_cast<uint64_t>(info.FileId.QuadPart);
+        entry.size = static_cast<uint64_t>(info.EndOfFile.QuadPart);
+        entry.allocationSize = static_cast<uint64_t>(info.AllocationSize.QuadPart);
+        entry.lastWriteTime = info.LastWriteTime.QuadPart;
+        entry.changeTime = info.ChangeTime.QuadPart;
+        visitor(entry);
+
+        if (entry.isDirectory() && !entry.isReparsePoint())
+            subdirs.push_back({std::move(entry.ntPath), std::move(entry.unixPath)});
+    });
+}
+
+// Each walker thread owns a queue of directories.  A thread takes work from
+// the back of its own queue (so it tends to descend depth-first into the
+// directories it just listed), and only when that is empty does it steal from
+// the front of another thread's queue, which holds the oldest and usually
+// largest subtrees.
+struct WalkQueue
+{
+    std::mutex mutex;
+    std::deque<WalkDirectory> directories;
+};
+
+void WslFs::walk(const std::string_view &unixPath, const WalkVisitor &visitor,
+                 const std::atomic<bool> *cancel) const
+{
+    std::string startPath(unixPath);
+    while (!startPath.empty() && startPath.back() == '/')
+        startPath.pop_back();
+
+    const unsigned threadCount = std::max(2u, std::thread::hardware_concurrency());
+    std::vector<WalkQueue> queues(threadCount);
+
+    // Directories which are queued or still being listed.  The walk is
+    // finished once this drops to zero.
+    std::atomic<size_t> pending = 1;
+    std::atomic<size_t> queued = 1;
+    std::mutex idleMutex;
+    std::condition_variable idleCond;
+    std::atomic<bool> failed = false;
+    std::exception_ptr error;
+
+    std::wstring startNtPath = path(startPath);
+    if (startNtPath.back() == L'\\')
+        startNtPath.pop_back();
+    queues[0].directories.push_back({std::move(startNtPath), startPath});
+
+    auto takeWork = [&](unsigned self, WalkDirectory &dir) {
+        for (unsigned i = 0; i < threadCount; ++i) {
+            WalkQueue &queue = queues[(self + i) % threadCount];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.directories.empty())
+                continue;
+            if (i == 0) {
+                dir = std::move(queue.directories.back());
+                queue.directories.pop_back();
+            } else {
+                dir = std::move(queue.directories.front());
+                queue.directories.pop_front();
+            }
+            --queued;
+            return true;
+        }
+        return false;
+    };
+
+    auto wakeIdle = [&]() {
+        // Taking the lock ensures an idle thread can't miss the wakeup
+        // between checking its condition and starting to wait.
+        { std::lock_guard<std::mutex> lock(idleMutex); }
+        idleCond.notify_all();
+    };
+
+    auto worker = [&](unsigned self) {
+        std::vector<WalkDirectory> subdirs;
+        for ( ;; ) {
+            WalkDirectory dir;
+            if (!takeWork(self, dir)) {
+                std::unique_lock<std::mutex> lock(idleMutex);
+                idleCond.wait(lock, [&]() {
+                    return queued != 0 || pending == 0 || failed;
+                });
+                if (pending == 0 || failed)
+                    return;
+                continue;
+            }
+
+            subdirs.clear();
+            try {
+                if (!failed && (!cancel || !*cancel))
+                    walkDirectory(m_version, dir, visitor, subdirs);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(idleMutex);
+                if (!error)
+                    error = std::current_exception();
+                failed = true;
+            }
+
+            if (!subdirs.empty()) {
+                pending += subdirs.size();
+                {
+                    std::lock_guard<std::mutex> lock(queues[self].mutex);
+                    for (auto &subdir : subdirs)
+                        queues[self].directories.push_back(std::move(subdir));
+                }
+                queued += subdirs.size();
+            }
+            if (--pending == 0 || !subdirs.empty() || failed)
+                wakeIdle();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < threadCount; ++i)
+        threads.emplace_back(worker, i);
+    for (auto &thread : threads)
+        thread.join();
+
+    if (error)
+        std::rethrow_exception(error);
+}
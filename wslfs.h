@@ -19,6 +19,8 @@
 #include "wslwrap.h"
 #include "wslutils.h"
 
+#include <functional>
+
 // NOTE: This is based on the work of LxRunOffline's WSL filesystem support
 
 /* File type modes compatible with Linux */
@@ -63,21 +65,63 @@ struct WslAttr
           ctime(ctime_) { }
 };
 
+struct WslOwnership
+{
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+
+    bool operator==(const WslOwnership &other) const
+    {
+        return mode == other.mode && uid == other.uid && gid == other.gid;
+    }
+    bool operator!=(const WslOwnership &other) const { return !operator==(other); }
+};
+
+struct WslDirEntry
+{
+    std::string unixPath;
+    std::wstring ntPath;
+    uint32_t attributes;
+    uint32_t reparseTag;
+    uint64_t fileId;
+    uint64_t size;
+    uint64_t allocationSize;
+    int64_t lastWriteTime;      // FILETIME
+    int64_t changeTime;         // FILETIME
+
+    bool isDirectory() const { return attributes & FILE_ATTRIBUTE_DIRECTORY; }
+    bool isReparsePoint() const { return attributes & FILE_ATTRIBUTE_REPARSE_POINT; }
+};
+
 class WslFs
 {
 public:
     WslFs(const std::wstring &path);
 
     static WslFs create(const std::wstring &path);
+    static WslFs create(const std::wstring &path, WslApi::Version version);
+
+    // Open an existing rootfs as the given format, rather than detecting it
+    // from the root directory.
+    static WslFs open(const std::wstring &path, WslApi::Version version);
 
     std::wstring rootPath() const { return m_rootPath; }
     WslApi::Version version() const { return m_version; }
 
     std::wstring path(const std::string_view &unixPath) const;
+    std::string unixPath(const std::wstring_view &ntPath) const;
+    std::string unixName(const std::wstring_view &ntName) const;
+    std::wstring ntName(const std::string_view &unixName) const;
 
     WslAttr getAttr(HANDLE hFile) const;
     void setAttr(HANDLE hFile, const WslAttr &attr) const;
 
+    // Read or update only the mode and ownership, with a single batched EA
+    // query or update.  Unlike setAttr(), this leaves the timestamps alone.
+    WslOwnership getOwnership(HANDLE hFile) const;
+    void setOwnership(HANDLE hFile, const WslOwnership &ownership) const;
+
     UniqueHandle createFile(const std::string_view &unixPath, const WslAttr &attr) const;
     UniqueHandle openFile(const std::string_view &unixPath) const;
 
@@ -87,6 +131,36 @@ public:
     bool createHardLink(const std::string_view &unixPath,
                         const std::string_view &unixTarget) const;
 
+    // Read or write the target of an open symlink, in either rootfs format
+    std::string readSymlink(HANDLE hFile) const;
+    bool writeSymlink(HANDLE hFile, const std::string_view &target) const;
+
+    bool setCaseSensitive(HANDLE hDir) const;
+    static bool isCaseSensitive(HANDLE hDir);
+
+    // Copy all of the NT Extended Attributes (which hold the LX metadata for
+    // both formats) from one open file to another in a single batch.
+    static bool copyExtendedAttributes(HANDLE hSource, HANDLE hTarget);
+    static bool copyReparsePoint(HANDLE hSource, HANDLE hTarget);
+    static bool removeExtendedAttribute(HANDLE hFile, const std::string_view &name);
+
+    // Open an entry by name relative to an already open directory, which
+    // avoids resolving the full path again for every entry.
+    static UniqueHandle openRelative(HANDLE hParent, const std::wstring_view &name,
+                                     DWORD access, bool directory);
+
+    // List the entries of an open directory handle (excluding . and ..),
+    // fetching as many entries per query as will fit in a large buffer.
+    typedef std::function<void (const FILE_ID_BOTH_DIR_INFO &)> ListVisitor;
+    static void listDirectory(HANDLE hDir, const ListVisitor &visitor);
+
+    // Enumerate everything below unixPath (not including unixPath itself).
+    // The visitor is called concurrently from several worker threads, and
+    // subdirectories are visited before their contents.
+    typedef std::function<void (const WslDirEntry &)> WalkVisitor;
+    void walk(const std::string_view &unixPath, const WalkVisitor &visitor,
+              const std::atomic<bool> *cancel = nullptr) const;
+
 private:
     WslApi::Version m_version;
     std::wstring m_rootPath;
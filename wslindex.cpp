@@ -0,0 +1,621 @@
+/* This file is part of wslman.
+ *
+ * wslman is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * wslman is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with wslman.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "wslindex.h"
+
+#include "wslregistry.h"
+#include "wslutils.h"
+#include <QLabel>
+#include <QLineEdit>
+#include <QComboBox>
+#include <QPushButton>
+#include <QDialogButtonBox>
+#include <QTreeWidget>
+#include <QHeaderView>
+#include <QGridLayout>
+#include <QProgressDialog>
+#include <QMessageBox>
+#include <QStandardPaths>
+#include <QSaveFile>
+#include <QDateTime>
+#include <QLocale>
+#include <QFileInfo>
+#include <QElapsedTimer>
+#include <QDir>
+
+#include <algorithm>
+#include <mutex>
+#include <unordered_map>
+
+// Bump the version whenever the layout below changes; old index files are
+// then simply rebuilt.
+#define INDEX_MAGIC         "WSLIDX01"
+
+// Maximum number of query results shown in the dialog
+#define MAX_SHOWN_RESULTS   10000
+
+struct WslIndexHeader
+{
+    char magic[8];
+    uint32_t rootfsVersion;
+    uint32_t count;
+    uint64_t namesSize;
+    int64_t buildTime;
+};
+
+// The columns follow the header in this order, with the 32-bit columns
+// first so that every column stays naturally aligned:
+//   parent, firstChild, childCount, nameOffset, nameLength, mode, uid, gid
+//   size, fileId, mtime, changeTime
+//   names
+static constexpr size_t Columns32 = 8;
+static constexpr size_t Columns64 = 4;
+
+static size_t align8(size_t offset)
+{
+    return (offset + 7) & ~size_t(7);
+}
+
+static size_t columns64Offset(uint32_t count)
+{
+    return align8(sizeof(WslIndexHeader) + Columns32 * count * sizeof(uint32_t));
+}
+
+static size_t namesOffset(uint32_t count)
+{
+    return columns64Offset(count) + Columns64 * count * sizeof(uint64_t);
+}
+
+WslIndex::WslIndex()
+    : m_header(), m_parent(), m_firstChild(), m_childCount(), m_nameOffset(),
+      m_nameLength(), m_mode(), m_uid(), m_gid(), m_size(), m_fileId(),
+      m_mtime(), m_changeTime(), m_names()
+{
+}
+
+QString WslIndex::indexPath(const std::wstring &uuid)
+{
+    return QStandardPaths::writableLocation(QStandardPaths::AppLocalDataLocation)
+            + QStringLiteral("/index/") + QString::fromStdWString(uuid)
+            + QStringLiteral(".idx");
+}
+
+bool WslIndex::open(const QString &path)
+{
+    close();
+
+    m_file.setFileName(path);
+    if (!m_file.open(QIODevice::ReadOnly))
+        return false;
+
+    const qint64 fileSize = m_file.size();
+    if (fileSize < static_cast<qint64>(sizeof(WslIndexHeader))) {
+        m_file.close();
+        return false;
+    }
+
+    const uchar *data = m_file.map(0, fileSize);
+    if (!data) {
+        m_file.close();
+        return false;
+    }
+
+    auto header = reinterpret_cast<const WslIndexHeader *>(data);
+    if (memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0
+            || header->count == 0
+            || header->namesSize > static_cast<uint64_t>(fileSize)
+            || static_cast<uint64_t>(fileSize) != namesOffset(header->count) + header->namesSize) {
+        m_file.unmap(const_cast<uchar *>(data));
+        m_file.close();
+        return false;
+    }
+
+    const uint32_t count = header->count;
+    auto columns32 = reinterpret_cast<const uint32_t *>(data + sizeof(WslIndexHeader));
+    m_parent = columns32;
+    m_firstChild = columns32 + count;
+    m_childCount = columns32 + 2 * count;
+    m_nameOffset = columns32 + 3 * count;
+    m_nameLength = columns32 + 4 * count;
+    m_mode = columns32 + 5 * count;
+    m_uid = columns32 + 6 * count;
+    m_gid = columns32 + 7 * count;
+
+    auto columns64 = data + columns64Offset(count);
+    m_size = reinterpret_cast<const uint64_t *>(columns64);
+    m_fileId = m_size + count;
+    m_mtime = reinterpret_cast<const int64_t *>(m_fileId + count);
+    m_changeTime = m_mtime + count;
+
+    m_names = reinterpret_cast<const char *>(data + namesOffset(count));
+
+    // The columns are used as indexes without further checks, so a damaged
+    // index is rejected here, and then simply rebuilt.  Every node must come
+    // after its parent, which also keeps path() from looping.
+    for (uint32_t node = 0; node < count; ++node) {
+        if ((node != RootNode && m_parent[node] >= node)
+                || m_firstChild[node] > count
+                || m_childCount[node] > count - m_firstChild[node]
+                || uint64_t(m_nameOffset[node]) + m_nameLength[node] > header->namesSize) {
+            m_file.unmap(const_cast<uchar *>(data));
+            m_file.close();
+            return false;
+        }
+    }
+
+    m_header = header;
+    return true;
+}
+
+void WslIndex::close()
+{
+    if (m_header) {
+        m_file.unmap(reinterpret_cast<uchar *>(const_cast<WslIndexHeader *>(m_header)));
+        m_header = nullptr;
+    }
+    m_file.close();
+}
+
+uint32_t WslIndex::count() const
+{
+    return m_header ? m_header->count : 0;
+}
+
+int64_t WslIndex::buildTime() const
+{
+    return m_header ? m_header->buildTime : 0;
+}
+
+std::string_view WslIndex::name(uint32_t node) const
+{
+    return std::string_view(m_names + m_nameOffset[node], m_nameLength[node]);
+}
+
+std::string WslIndex::path(uint32_t node) const
+{
+    if (node == RootNode)
+        return "/";
+
+    std::vector<uint32_t> components;
+    for (uint32_t n = node; n != RootNode; n = m_parent[n])
+        components.push_back(n);
+
+    std::string result;
+    for (auto iter = components.rbegin(); iter != components.rend(); ++iter) {
+        result.push_back('/');
+        result.append(name(*iter));
+    }
+    return result;
+}
+
+uint32_t WslIndex::find(const std::string_view &unixPath) const
+{
+    if (!isOpen())
+        return InvalidNode;
+
+    uint32_t node = RootNode;
+    size_t start = 0;
+    while (start < unixPath.size()) {
+        size_t end = unixPath.find('/', start);
+        if (end == std::string_view::npos)
+            end = unixPath.size();
+        const std::string_view component = unixPath.substr(start, end - start);
+        start = end + 1;
+        if (component.empty())
+            continue;
+
+        const uint32_t first = m_firstChild[node];
+        const uint32_t last = first + m_childCount[node];
+        uint32_t lo = first, hi = last;
+        while (lo < hi) {
+            const uint32_t mid = lo + (hi - lo) / 2;
+            if (name(mid) < component)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (lo == last || name(lo) != component)
+            return InvalidNode;
+        node = lo;
+    }
+    return node;
+}
+
+std::vector<uint32_t> WslIndex::ownedBy(uint32_t uid) const
+{
+    std::vector<uint32_t> result;
+    for (uint32_t node = 0; node < count(); ++node) {
+        if (m_uid[node] == uid)
+            result.push_back(node);
+    }
+    return result;
+}
+
+std::vector<uint32_t> WslIndex::changedSince(int64_t mtime) const
+{
+    std::vector<uint32_t> result;
+    for (uint32_t node = 0; node < count(); ++node) {
+        if (m_mtime[node] >= mtime)
+            result.push_back(node);
+    }
+    return result;
+}
+
+std::vector<std::pair<uint32_t, uint64_t>> WslIndex::largestDirectories(size_t count) const
+{
+    // Children always come after their parent, so a single reverse pass
+    // accumulates the totals bottom-up.
+    const uint32_t nodeCount = this->count();
+    if (nodeCount == 0)
+        return {};
+    std::vector<uint64_t> totals(m_size, m_size + nodeCount);
+    for (uint32_t node = nodeCount - 1; node != RootNode; --node)
+        totals[m_parent[node]] += totals[node];
+
+    std::vector<std::pair<uint32_t, uint64_t>> result;
+    for (uint32_t node = 0; node < nodeCount; ++node) {
+        if ((m_mode[node] & LX_IFMT) == LX_IFDIR)
+            result.emplace_back(node, totals[node]);
+    }
+
+    count = std::min(count, result.size());
+    std::partial_sort(result.begin(), result.begin() + count, result.end(),
+                      [](const auto &a, const auto &b) { return a.second > b.second; });
+    result.resize(count);
+    return result;
+}
+
+WslIndexBuilder::WslIndexBuilder(const WslFs &rootfs)
+    : m_rootfs(rootfs), m_previous(), m_entriesFound(), m_entriesReused()
+{
+    if (m_rootfs.version() == WslApi::InvalidVersion)
+        throw std::runtime_error("Unsupported rootfs format");
+}
+
+WslIndexBuilder::Record WslIndexBuilder::makeRecord(const WslDirEntry &entry)
+{
+    Record record;
+    record.unixPath = entry.unixPath;
+    record.isDirectory = entry.isDirectory() && !entry.isReparsePoint();
+    record.size = record.isDirectory ? 0 : entry.size;
+    record.fileId = entry.fileId;
+    record.changeTime = entry.changeTime;
+
+    // The root has no listing entry to compare, so it is always re-read
+    if (m_previous && !entry.unixPath.empty()) {
+        const uint32_t node = m_previous->find(entry.unixPath);
+        if (node != WslIndex::InvalidNode && m_previous->fileId(node) == entry.fileId
+                && m_previous->changeTime(node) == entry.changeTime) {
+            record.mode = m_previous->mode(node);
+            record.uid = m_previous->uid(node);
+            record.gid = m_previous->gid(node);
+            record.mtime = m_previous->mtime(node);
+            ++m_entriesReused;
+            return record;
+        }
+    }
+
+    UniqueHandle hFile = CreateFileW(entry.ntPath.c_str(), FILE_READ_EA | FILE_READ_ATTRIBUTES,
+                                     FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                     nullptr, OPEN_EXISTING,
+                                     FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OPEN_REPARSE_POINT,
+                                     nullptr);
+    if (hFile == INVALID_HANDLE_VALUE)
+        throw std::runtime_error("Could not open " + entry.unixPath);
+
+    try {
+        const WslAttr attr = m_rootfs.getAttr(hFile.get());
+        record.mode = attr.mode;
+        record.uid = attr.uid;
+        record.gid = attr.gid;
+        record.mtime = static_cast<int64_t>(attr.mtime);
+    } catch (const std::runtime_error &) {
+        // Files created from Windows have no LX metadata at all
+        record.mode = record.isDirectory ? LX_IFDIR : LX_IFREG;
+        record.uid = 0;
+        record.gid = 0;
+        record.mtime = 0;
+    }
+    return record;
+}
+
+void WslIndexBuilder::run(const std::atomic<bool> *cancel)
+{
+    m_records.clear();
+    m_entriesFound = 0;
+    m_entriesReused = 0;
+
+    WslDirEntry rootEntry;
+    rootEntry.ntPath = m_rootfs.rootPath();
+    rootEntry.attributes = FILE_ATTRIBUTE_DIRECTORY;
+    rootEntry.fileId = 0;
+    rootEntry.size = 0;
+    rootEntry.changeTime = 0;
+    m_records.push_back(makeRecord(rootEntry));
+
+    std::mutex recordsMutex;
+    m_rootfs.walk("", [&](const WslDirEntry &entry) {
+        Record record = makeRecord(entry);
+        ++m_entriesFound;
+
+        std::lock_guard<std::mutex> lock(recordsMutex);
+        m_records.push_back(std::move(record));
+    }, cancel);
+    // A parent path always sorts before everything below it, and siblings
+    // sort by name since they share the same prefix.
+    std::sort(m_records.begin(), m_records.end(), [](const Record &a, const Record &b) {
+        return a.unixPath < b.unixPath;
+    });
+}
+
+void WslIndexBuilder::save(const QString &path) const
+{
+    if (m_records.empty() || m_records.size() >= WslIndex::InvalidNode)
+        throw std::runtime_error("Invalid index contents");
+
+    // Link every record to its parent directory, keeping the sorted order
+    // for the children of each directory.
+    std::unordered_map<std::string_view, uint32_t> directories;
+    std::vector<std::vector<uint32_t>> children(m_records.size());
+    directories.emplace(std::string_view(), 0);
+    for (uint32_t i = 1; i < m_records.size(); ++i) {
+        const std::string_view unixPath = m_records[i].unixPath;
+        const std::string_view parentPath = unixPath.substr(0, unixPath.rfind('/'));
+        auto parent = directories.find(parentPath);
+        if (parent == directories.end())
+            throw std::runtime_error("Missing parent directory for " + m_records[i].unixPath);
+        children[parent->second].push_back(i);
+        if (m_records[i].isDirectory)
+            directories.emplace(unixPath, i);
+    }
+
+    // Lay the nodes out breadth-first, so each node's children are
+    // contiguous and always come after it.
+    const uint32_t count = static_cast<uint32_t>(m_records.size());
+    std::vector<uint32_t> order;
+    order.reserve(count);
+    order.push_back(0);
+    std::vector<uint32_t> parent(count), firstChild(count), childCount(count);
+    std::vector<uint32_t> nameOffset(count), nameLength(count);
+    std::vector<uint32_t> mode(count), uid(count), gid(count);
+    std::vector<uint64_t> size(count), fileId(count);
+    std::vector<int64_t> mtime(count), changeTime(count);
+    std::string names;
+    std::unordered_map<std::string, uint32_t> nameIndex;
+    parent[0] = 0;
+    for (uint32_t node = 0; node < order.size(); ++node) {
+        const uint32_t recordIndex = order[node];
+        const Record &record = m_records[recordIndex];
+
+        firstChild[node] = static_cast<uint32_t>(order.size());
+        childCount[node] = static_cast<uint32_t>(children[recordIndex].size());
+        for (uint32_t child : children[recordIndex]) {
+            parent[order.size()] = node;
+            order.push_back(child);
+        }
+
+        const std::string name = record.unixPath.substr(record.unixPath.rfind('/') + 1);
+        auto interned = nameIndex.find(name);
+        if (interned == nameIndex.end()) {
+            interned = nameIndex.emplace(name, static_cast<uint32_t>(names.size())).first;
+            names.append(name);
+        }
+        nameOffset[node] = interned->second;
+        nameLength[node] = static_cast<uint32_t>(name.size());
+
+        mode[node] = record.mode;
+        uid[node] = record.uid;
+        gid[node] = record.gid;
+        size[node] = record.size;
+        fileId[node] = record.fileId;
+        mtime[node] = record.mtime;
+        changeTime[node] = record.changeTime;
+    }
+
+    WslIndexHeader header;
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.rootfsVersion = static_cast<uint32_t>(m_rootfs.version());
+    header.count = count;
+    header.namesSize = names.size();
+    header.buildTime = QDateTime::currentSecsSinceEpoch();
+
+    QDir().mkpath(QFileInfo(path).absolutePath());
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly))
+        throw std::runtime_error("Could not create index file");
+
+    auto writeColumn = [&file](const auto &column) {
+        const qint64 bytes = column.size() * sizeof(column[0]);
+        if (file.write(reinterpret_cast<const char *>(column.data()), bytes) != bytes)
+            throw std::runtime_error("Could not write index file");
+    };
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    for (const auto *column : {&parent, &firstChild, &childCount, &nameOffset,
+                               &nameLength, &mode, &uid, &gid})
+        writeColumn(*column);
+    const size_t padding = columns64Offset(count) - (sizeof(header) + Columns32 * count * sizeof(uint32_t));
+    file.write(QByteArray(static_cast<int>(padding), '\0'));
+    writeColumn(size);
+    writeColumn(fileId);
+    writeColumn(mtime);
+    writeColumn(changeTime);
+    writeColumn(names);
+
+    if (!file.commit())
+        throw std::runtime_error("Could not write index file");
+}
+
+WslIndexDialog::WslIndexDialog(const QString &uuid, QWidget *parent)
+    : QDialog(parent), m_uuid(uuid.toStdWString())
+{
+    setWindowTitle(tr("Search Files"));
+
+    m_status = new QLabel(this);
+    auto updateButton = new QPushButton(tr("&Update Index"), this);
+
+    m_queryType = new QComboBox(this);
+    m_queryType->addItem(tr("Files owned by UID"));
+    m_queryType->addItem(tr("Files changed since (yyyy-MM-dd)"));
+    m_queryType->addItem(tr("Largest directories (count)"));
+    m_queryValue = new QLineEdit(this);
+    auto searchButton = new QPushButton(tr("&Search"), this);
+    searchButton->setDefault(true);
+
+    m_results = new QTreeWidget(this);
+    m_results->setHeaderLabels(QStringList{tr("Path"), tr("Size"), tr("Mode"),
+                                           tr("UID"), tr("GID"), tr("Modified")});
+    m_results->setRootIsDecorated(false);
+    m_results->setUniformRowHeights(true);
+    m_results->header()->setSectionResizeMode(0, QHeaderView::Stretch);
+
+    auto buttons = new QDialogButtonBox(QDialogButtonBox::Close, this);
+    connect(buttons, &QDialogButtonBox::rejected, this, &QDialog::reject);
+    connect(updateButton, &QPushButton::clicked, this, [this](bool) { updateIndex(); });
+    connect(searchButton, &QPushButton::clicked, this, [this](bool) { runQuery(); });
+
+    auto layout = new QGridLayout(this);
+    int layoutRow = 0;
+    layout->addWidget(m_status, layoutRow, 0, 1, 2);
+    layout->addWidget(updateButton, layoutRow, 2);
+    layout->addWidget(m_queryType, ++layoutRow, 0);
+    layout->addWidget(m_queryValue, layoutRow, 1);
+    layout->addWidget(searchButton, layoutRow, 2);
+    layout->addWidget(m_results, ++layoutRow, 0, 1, 3);
+    layout->addWidget(buttons, ++layoutRow, 0, 1, 3);
+    resize(800, 500);
+
+    m_index.open(WslIndex::indexPath(m_uuid));
+    updateStatus();
+}
+
+void WslIndexDialog::updateIndex()
+{
+    QProgressDialog progressDialog(this);
+    progressDialog.setLabelText(tr("Indexing files..."));
+    progressDialog.setWindowModality(Qt::WindowModal);
+    progressDialog.setMinimumDuration(0);
+    progressDialog.setMaximum(0);
+
+    std::atomic<bool> cancel = false;
+    try {
+        WslDistribution dist = WslRegistry::findDistByUuid(m_uuid);
+        if (!dist.isValid())
+            throw std::runtime_error("Distribution no longer exists");
+
+        WslIndexBuilder builder{WslFs(dist.rootfsPath())};
+        if (m_index.isOpen())
+            builder.setPrevious(&m_index);
+        WslUtil::runInBackground([&]() { builder.run(&cancel); }, [&]() {
+            if (progressDialog.wasCanceled())
+                cancel = true;
+            progressDialog.setLabelText(tr("Indexing files... (%1 found)")
+                                        .arg(builder.entriesFound()));
+        });
+        if (cancel)
+            return;
+
+        // The mapped file can't be replaced while it's still open
+        m_index.close();
+        builder.save(WslIndex::indexPath(m_uuid));
+    } catch (const std::runtime_error &err) {
+        QMessageBox::critical(this, QString(),
+                tr("Failed to update file index: %1").arg(err.what()));
+    }
+
+    m_index.open(WslIndex::indexPath(m_uuid));
+    updateStatus();
+}
+
+void WslIndexDialog::updateStatus()
+{
+    if (!m_index.isOpen()) {
+        m_status->setText(tr("No file index has been built for this distribution yet."));
+        return;
+    }
+
+    const QDateTime buildTime = QDateTime::fromSecsSinceEpoch(m_index.buildTime());
+    m_status->setText(tr("%1 entries, indexed %2").arg(m_index.count())
+                      .arg(QLocale().toString(buildTime, QLocale::ShortFormat)));
+}
+
+void WslIndexDialog::runQuery()
+{
+    if (!m_index.isOpen())
+        updateIndex();
+    if (!m_index.isOpen())
+        return;
+
+    QElapsedTimer timer;
+    timer.start();
+
+    std::vector<uint32_t> nodes;
+    std::vector<uint64_t> totals;
+    bool ok = false;
+    switch (m_queryType->currentIndex()) {
+    case 0:
+        {
+            const uint32_t uid = m_queryValue->text().toUInt(&ok);
+            if (ok)
+                nodes = m_index.ownedBy(uid);
+        }
+        break;
+    case 1:
+        {
+            const QDate date = QDate::fromString(m_queryValue->text(), Qt::ISODate);
+            ok = date.isValid();
+            if (ok)
+                nodes = m_index.changedSince(date.startOfDay().toSecsSinceEpoch());
+        }
+        break;
+    case 2:
+        {
+            const uint32_t count = m_queryValue->text().toUInt(&ok);
+            if (ok) {
+                for (const auto &dir : m_index.largestDirectories(count)) {
+                    nodes.push_back(dir.first);
+                    totals.push_back(dir.second);
+                }
+            }
+        }
+        break;
+    }
+    if (!ok) {
+        QMessageBox::critical(this, QString(), tr("Invalid search value"));
+        return;
+    }
+    const qint64 queryTime = timer.elapsed();
+
+    m_results->clear();
+    QList<QTreeWidgetItem *> items;
+    for (size_t i = 0; i < nodes.size() && i < MAX_SHOWN_RESULTS; ++i) {
+        const uint32_t node = nodes[i];
+        const uint64_t size = totals.empty() ? m_index.size(node) : totals[i];
+        items << new QTreeWidgetItem(QStringList{
+            QString::fromStdString(m_index.path(node)),
+            QLocale().formattedDataSize(static_cast<qint64>(size)),
+            QString::number(m_index.mode(node), 8),
+            QString::number(m_index.uid(node)),
+            QString::number(m_index.gid(node)),
+            QLocale().toString(QDateTime::fromSecsSinceEpoch(m_index.mtime(node)),
+                               QLocale::ShortFormat),
+        });
+    }
+    m_results->addTopLevelItems(items);
+
+    updateStatus();
+    m_status->setText(tr("%1 -- %2 results in %3 ms").arg(m_status->text())
+                      .arg(nodes.size()).arg(queryTime));
+}
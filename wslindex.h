@@ -0,0 +1,155 @@
+/* This file is part of wslman.
+ *
+ * wslman is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * wslman is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with wslman.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "wslfs.h"
+
+#include <QDialog>
+#include <QFile>
+#include <vector>
+
+class QComboBox;
+class QLineEdit;
+class QLabel;
+class QTreeWidget;
+
+struct WslIndexHeader;
+
+// A persistent index of the metadata of every entry in a rootfs, so queries
+// don't need to walk the tree and read the LX attributes of each file.
+//
+// The index file is memory mapped and used in place.  Path components form
+// a tree where each directory is stored once, with the children of a node
+// stored contiguously and sorted by name, so a path can be resolved with one
+// binary search per component.  Names are interned in a shared pool, and the
+// metadata is stored as one array per field.
+class WslIndex
+{
+public:
+    static constexpr uint32_t InvalidNode = 0xFFFFFFFFu;
+    static constexpr uint32_t RootNode = 0;
+
+    WslIndex();
+    ~WslIndex() { close(); }
+
+    WslIndex(const WslIndex &) = delete;
+    WslIndex &operator=(const WslIndex &) = delete;
+
+    // The index location for the distribution with the given UUID
+    static QString indexPath(const std::wstring &uuid);
+
+    bool open(const QString &path);
+    void close();
+    bool isOpen() const { return m_header != nullptr; }
+
+    uint32_t count() const;
+    int64_t buildTime() const;      // Unix time
+
+    uint32_t parent(uint32_t node) const { return m_parent[node]; }
+    std::string_view name(uint32_t node) const;
+    std::string path(uint32_t node) const;
+    uint32_t find(const std::string_view &unixPath) const;
+
+    uint32_t mode(uint32_t node) const { return m_mode[node]; }
+    uint32_t uid(uint32_t node) const { return m_uid[node]; }
+    uint32_t gid(uint32_t node) const { return m_gid[node]; }
+    uint64_t size(uint32_t node) const { return m_size[node]; }
+    int64_t mtime(uint32_t node) const { return m_mtime[node]; }
+    uint64_t fileId(uint32_t node) const { return m_fileId[node]; }
+    int64_t changeTime(uint32_t node) const { return m_changeTime[node]; }
+
+    std::vector<uint32_t> ownedBy(uint32_t uid) const;
+    std::vector<uint32_t> changedSince(int64_t mtime) const;
+
+    // The directories with the largest total (apparent) size of everything
+    // below them, paired with that size.
+    std::vector<std::pair<uint32_t, uint64_t>> largestDirectories(size_t count) const;
+
+private:
+    QFile m_file;
+    const WslIndexHeader *m_header;
+    const uint32_t *m_parent;
+    const uint32_t *m_firstChild;
+    const uint32_t *m_childCount;
+    const uint32_t *m_nameOffset;
+    const uint32_t *m_nameLength;
+    const uint32_t *m_mode;
+    const uint32_t *m_uid;
+    const uint32_t *m_gid;
+    const uint64_t *m_size;
+    const uint64_t *m_fileId;
+    const int64_t *m_mtime;
+    const int64_t *m_changeTime;
+    const char *m_names;
+};
+
+class WslIndexBuilder
+{
+public:
+    WslIndexBuilder(const WslFs &rootfs);
+
+    // Entries whose file ID and change time match the previous index reuse
+    // its metadata instead of reading the extended attributes again.
+    void setPrevious(const WslIndex *previous) { m_previous = previous; }
+
+    void run(const std::atomic<bool> *cancel = nullptr);
+    void save(const QString &path) const;
+
+    // These may be queried from another thread while run() is active
+    uint64_t entriesFound() const { return m_entriesFound; }
+    uint64_t entriesReused() const { return m_entriesReused; }
+
+private:
+    struct Record
+    {
+        std::string unixPath;
+        bool isDirectory;
+        uint32_t mode;
+        uint32_t uid;
+        uint32_t gid;
+        uint64_t size;
+        uint64_t fileId;
+        int64_t mtime;
+        int64_t changeTime;
+    };
+
+    WslFs m_rootfs;
+    const WslIndex *m_previous;
+    std::vector<Record> m_records;
+    std::atomic<uint64_t> m_entriesFound;
+    std::atomic<uint64_t> m_entriesReused;
+
+    Record makeRecord(const WslDirEntry &entry);
+};
+
+class WslIndexDialog : public QDialog
+{
+public:
+    WslIndexDialog(const QString &uuid, QWidget *parent = nullptr);
+
+private:
+    std::wstring m_uuid;
+    WslIndex m_index;
+    QLabel *m_status;
+    QComboBox *m_queryType;
+    QLineEdit *m_queryValue;
+    QTreeWidget *m_results;
+
+    void updateIndex();
+    void updateStatus();
+    void runQuery();
+};
@@ -19,6 +19,8 @@
 #include "wslregistry.h"
 #include "wslui.h"
 #include "wslfs.h"
+#include "wslprovision.h"
+#include "wslsetupscript.h"
 #include <QLabel>
 #include <QLineEdit>
 #include <QPlainTextEdit>
@@ -35,6 +37,8 @@
 #include <QProgressDialog>
 #include <QMessageBox>
 #include <QRegularExpression>
+#include <QFontDatabase>
+#include <QVBoxLayout>
 #include <archive.h>
 #include <archive_entry.h>
 
@@ -178,14 +182,6 @@ WslInstallDialog::WslInstallDialog(QWidget *parent)
     layout->addWidget(buttons, ++layoutRow, 0, 1, 3);
 }
 
-static bool isDirectoryEmpty(const QString &path)
-{
-    const QFileInfoList entries = QDir(path).entryInfoList(
-            QDir::NoDotAndDotDot | QDir::AllEntries | QDir::AllDirs
-            | QDir::Hidden | QDir::System);
-    return entries.count() == 0;
-}
-
 bool WslInstallDialog::validate()
 {
     if (m_distName->text().isEmpty() || m_installPath->text().isEmpty()
@@ -212,7 +208,7 @@ bool WslInstallDialog::validate()
     }
 
     QString installPath = m_installPath->text();
-    if (QFileInfo(installPath).exists() && !isDirectoryEmpty(installPath)) {
+    if (QFileInfo(installPath).exists() && !WslUtil::isDirectoryEmpty(installPath)) {
         QMessageBox::critical(this, QString(),
                 tr("The install path \"%1\" already exists and is not empty").arg(installPath));
         return false;
@@ -229,27 +225,26 @@ bool WslInstallDialog::validate()
     return true;
 }
 
-static std::wstring wslError(HRESULT rc)
-{
-    wchar_t buffer[512];
-    swprintf(buffer, std::size(buffer), L"0x%08x", rc);
-    FormatMessageW(FORMAT_MESSAGE_FROM_SYSTEM, nullptr, rc,
-                   MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
-                   buffer, static_cast<DWORD>(std::size(buffer)), nullptr);
-    return buffer;
-}
-
 void WslInstallDialog::performInstall()
 {
     std::wstring distName = m_distName->text().toStdWString();
-    AllocConsole();
-    auto context = WslConsoleContext::createConsole(distName, m_distIcon);
-
-    setupDistribution();
+    WslConsoleContext *context;
+    try {
+        context = WslConsoleContext::createConsole(distName, m_distIcon);
+    } catch (const std::runtime_error &err) {
+        QMessageBox::critical(this, QString(),
+                tr("Failed to open a console for %1: %2")
+                .arg(m_distName->text()).arg(err.what()));
+        return;
+    }
 
-    // Attempt to run the newly installed distribution
-    context->startConsoleThread(this);
-    FreeConsole();
+    // Attempt to run the newly installed distribution.  This dialog is gone
+    // by the time the shell has started, so report errors to the main window.
+    if (setupDistribution()) {
+        context->startConsoleThread(parentWidget());
+    } else {
+        context->cancelConsole();
+    }
 }
 
 #define BLOCK_SIZE 16384
@@ -259,7 +254,7 @@ static std::string archiveError(archive *arc)
     return std::string("Failed to extract archive: ") + archive_error_string(arc);
 }
 
-static void extractTarball(WslFs &rootfs, const std::wstring &tarball)
+static bool extractTarball(WslFs &rootfs, const std::wstring &tarball)
 {
     std::unique_ptr<archive, decltype(&archive_read_free)> rootfsArchive(
         archive_read_new(), &archive_read_free
@@ -289,7 +284,7 @@ static void extractTarball(WslFs &rootfs, const std::wstring &tarball)
 
     for ( ;; ) {
         if (progressDialog.wasCanceled())
-            break;
+            return false;
 
         archive_entry *ent;
         int rc = archive_read_next_header(rootfsArchive.get(), &ent);
@@ -390,9 +385,11 @@ static void extractTarball(WslFs &rootfs, const std::wstring &tarball)
             }
         }
     }
+
+    return true;
 }
 
-void WslInstallDialog::setupDistribution()
+bool WslInstallDialog::setupDistribution()
 {
     std::wstring distName = m_distName->text().toStdWString();
     wprintf(L"Installing %s...\n", distName.c_str());
@@ -400,7 +397,7 @@ void WslInstallDialog::setupDistribution()
         if (!QDir::current().mkpath(m_installPath->text())) {
             QMessageBox::critical(this, QString(),
                     tr("Failed to create distribution directory"));
-            return;
+            return false;
         }
 
         WslRegistry registry;
@@ -408,66 +405,89 @@ void WslInstallDialog::setupDistribution()
         WslDistribution dist = registry.registerDistribution(distName.c_str(), distDir.c_str());
         if (!dist.isValid()) {
             QMessageBox::critical(this, QString(), tr("Failed to register distribution"));
-            return;
+            return false;
         }
 
         std::wstring tarball = m_tarball->text().toStdWString();
         auto rootfs = WslFs::create(dist.rootfsPath());
         dist.setVersion(rootfs.version());
-        extractTarball(rootfs, tarball);
+        if (!extractTarball(rootfs, tarball)) {
+            wprintf(L"Installation cancelled, removing %s...\n", distName.c_str());
+            WslUi::removeDistribution(this, dist);
+            return false;
+        }
 
-        DWORD exitCode;
-        std::wstring commandLine;
+        // Everything that has to run inside the distribution is collected
+        // into one script, so the distribution is only launched once
+        WslSetupScript setupScript;
         if (m_runCmdGroupBox->isChecked()) {
             QStringList runCommands = m_runCommands->toPlainText()
                             .split(QRegularExpression("[\\r\\n]"), QT_SKIP_EMPTY_PARTS);
-            for (QString cmd : runCommands) {
-                commandLine = cmd.toStdWString();
-                wprintf(L"Running %s\n", commandLine.c_str());
-                auto rc = WslApi::LaunchInteractive(distName.c_str(), commandLine.c_str(),
-                                                    TRUE, &exitCode);
-                if (FAILED(rc)) {
-                    std::wstring errMessage = wslError(rc);
-                    wprintf(L"Running custom command failed: %s\n", errMessage.c_str());
-                } else if (exitCode != 0) {
-                    wprintf(L"Command returned exit status %u\n", exitCode);
-                }
-            }
+            for (const QString &cmd : runCommands)
+                setupScript.addStep(cmd, tr("Command"));
         }
 
-        // Create a default user
-        if (m_userGroupBox->isChecked()) {
-            QString username = m_defaultUsername->text();
-            wprintf(L"Creating user %s with adduser\n", username.toStdWString().c_str());
-            username.replace(QLatin1Char('\''), QLatin1String("'\\''"));
-            commandLine = QStringLiteral("/usr/sbin/adduser -g '' '%1'")
-                                .arg(username).toStdWString();
-            auto rc = WslApi::LaunchInteractive(distName.c_str(), commandLine.c_str(),
-                                                TRUE, &exitCode);
-            if (FAILED(rc)) {
-                std::wstring errMessage = wslError(rc);
-                wprintf(L"Failed to create default user: %s\n", errMessage.c_str());
-            } else if (exitCode != 0) {
-                wprintf(L"adduser returned exit status %u\n", exitCode);
+        // Create a default user.  The offline rootfs is only edited before
+        // the distribution is launched for the first time.
+        const QString username = m_defaultUsername->text();
+        QString quotedName = username;
+        quotedName.replace(QLatin1Char('\''), QLatin1String("'\\''"));
+        bool userCreated = false;
+        std::vector<std::string> missingGroups;
+        if (m_userGroupBox->isChecked() && WslProvision(rootfs).isSupported())
+            userCreated = provisionUser(rootfs, dist, missingGroups);
+
+        if (userCreated) {
+            // The custom commands may create groups the user should join
+            // (e.g. groupadd docker), so those are joined after them, in
+            // the same phase
+            if (!setupScript.isEmpty()) {
+                for (const std::string &group : missingGroups) {
+                    QString quotedGroup = QString::fromStdString(group);
+                    quotedGroup.replace(QLatin1Char('\''), QLatin1String("'\\''"));
+                    setupScript.addStep(QStringLiteral("/usr/sbin/usermod -aG '%1' '%2'")
+                                        .arg(quotedGroup).arg(quotedName),
+                                        QStringLiteral("usermod"));
+                }
+            } else {
+                for (const std::string &group : missingGroups)
+                    wprintf(L"Group %S does not exist, skipping\n", group.c_str());
             }
 
+            // Password hashes can't be generated here, so the account is
+            // created locked and the password is set from inside the
+            // distribution.
+            setupScript.addStep(QStringLiteral("/usr/bin/passwd '%1'")
+                                .arg(quotedName), QStringLiteral("passwd"), true);
+        } else if (m_userGroupBox->isChecked()) {
+            setupScript.addStep(QStringLiteral("/usr/sbin/adduser -g '' '%1'").arg(quotedName),
+                                QStringLiteral("adduser"), true);
+
+            // These have to follow adduser, so they run in the same phase
+
             const QStringList tryGroups = m_userGroups->text().split(QLatin1Char(','));
             for (QString group : tryGroups) {
                 group.replace(QLatin1Char('\''), QLatin1String("'\\''"))
                      .replace(QLatin1Char(' '), QString());
-                commandLine = QStringLiteral("/usr/sbin/usermod -aG '%1' '%2'")
-                                    .arg(group).arg(username).toStdWString();
-                auto rc = WslApi::LaunchInteractive(distName.c_str(), commandLine.c_str(),
-                                                    TRUE, &exitCode);
-                if (FAILED(rc)) {
-                    std::wstring errMessage = wslError(rc);
-                    wprintf(L"Failed to add user to group %s: %s\n",
-                            group.toStdWString().c_str(), errMessage.c_str());
-                } else if (exitCode != 0) {
-                    wprintf(L"usermod returned exit status %u\n", exitCode);
-                }
+                setupScript.addStep(QStringLiteral("/usr/sbin/usermod -aG '%1' '%2'")
+                                    .arg(group).arg(quotedName), QStringLiteral("usermod"),
+                                    true);
             }
+        }
 
+        if (!setupScript.isEmpty()) {
+            wprintf(L"Running setup commands...\n");
+            QPlainTextEdit *logPane = nullptr;
+            if (setupScript.hasCapturedSteps())
+                logPane = createSetupLog(QString::fromStdWString(distName));
+            setupScript.run(distName, rootfs, [logPane](const QString &text) {
+                logPane->moveCursor(QTextCursor::End);
+                logPane->insertPlainText(text);
+                logPane->ensureCursorVisible();
+            });
+        }
+
+        if (m_userGroupBox->isChecked() && !userCreated) {
             uint32_t uid = WslUtil::getUid(distName, username);
             if (uid != INVALID_UID)
                 dist.setDefaultUID(uid);
@@ -475,6 +495,58 @@ void WslInstallDialog::setupDistribution()
     } catch (const std::runtime_error &err) {
         QMessageBox::critical(this, QString(),
                 tr("Failed to register distribution: %1").arg(err.what()));
-        return;
+        return false;
+    }
+
+    return true;
+}
+
+QPlainTextEdit *WslInstallDialog::createSetupLog(const QString &distName)
+{
+    // The install dialog is already hidden by the time the setup runs, so
+    // the output goes to its own window, which stays open for review
+    auto logDialog = new QDialog(parentWidget());
+    logDialog->setAttribute(Qt::WA_DeleteOnClose);
+    logDialog->setWindowTitle(tr("Setup Log - %1").arg(distName));
+
+    auto logPane = new QPlainTextEdit(logDialog);
+    logPane->setReadOnly(true);
+    logPane->setLineWrapMode(QPlainTextEdit::NoWrap);
+    logPane->setFont(QFontDatabase::systemFont(QFontDatabase::FixedFont));
+
+    auto buttons = new QDialogButtonBox(QDialogButtonBox::Close, logDialog);
+    connect(buttons, &QDialogButtonBox::rejected, logDialog, &QDialog::close);
+
+    auto layout = new QVBoxLayout(logDialog);
+    layout->addWidget(logPane);
+    layout->addWidget(buttons);
+
+    logDialog->resize(640, 400);
+    logDialog->show();
+    return logPane;
+}
+
+bool WslInstallDialog::provisionUser(const WslFs &rootfs, WslDistribution &dist,
+                                     std::vector<std::string> &missingGroups)
+{
+    const QString username = m_defaultUsername->text();
+    wprintf(L"Creating user %s\n", username.toStdWString().c_str());
+
+    std::vector<std::string> groups;
+    for (const QString &group : m_userGroups->text().split(QLatin1Char(','))) {
+        const QString trimmed = group.trimmed();
+        if (!trimmed.isEmpty())
+            groups.push_back(trimmed.toStdString());
     }
+
+    try {
+        WslProvision provision(rootfs);
+        const uint32_t uid = provision.addUser(username.toStdString(), std::string(),
+                                               groups, missingGroups);
+        dist.setDefaultUID(uid);
+    } catch (const std::runtime_error &err) {
+        wprintf(L"Failed to create default user: %S\n", err.what());
+        return false;
+    }
+    return true;
 }
@@ -18,11 +18,15 @@
 
 #include <QDialog>
 #include <QIcon>
+#include <string>
+#include <vector>
 
 class QLineEdit;
 class QPlainTextEdit;
 class QLabel;
 class QGroupBox;
+class WslFs;
+class WslDistribution;
 
 class WslInstallDialog : public QDialog
 {
@@ -47,5 +51,10 @@ private:
     QLineEdit *m_userGecos;
     QLineEdit *m_userGroups;
 
-    void setupDistribution();
+    bool setupDistribution();
+    // Missing groups are returned rather than reported, since the setup
+    // commands may still create them
+    bool provisionUser(const WslFs &rootfs, WslDistribution &dist,
+                       std::vector<std::string> &missingGroups);
+    QPlainTextEdit *createSetupLog(const QString &distName);
 };
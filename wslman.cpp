@@ -19,8 +19,10 @@
 
 #include "wslui.h"
 #include "wslutils.h"
+#include "wslregstore.h"
 
 #include <QApplication>
+#include <QCommandLineParser>
 #include <QMessageBox>
 
 int main(int argc, char *argv[])
@@ -34,6 +36,25 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    // Work on a file instead of the real registry, e.g. for testing with
+    // synthetic distributions
+    QCommandLineParser parser;
+    QCommandLineOption registryFileOption(QStringLiteral("registry-file"),
+                QObject::tr("Use a registry file instead of the Lxss registry key."),
+                QObject::tr("file"));
+    parser.addOption(registryFileOption);
+    parser.process(app);
+    if (parser.isSet(registryFileOption)) {
+        try {
+            WslRegistryStore::setCurrent(std::make_unique<WslFileRegistryStore>(
+                        parser.value(registryFileOption).toStdWString()));
+        } catch (const std::runtime_error &err) {
+            QMessageBox::critical(nullptr, QString(),
+                    QObject::tr("Failed to load registry file: %1").arg(err.what()));
+            return 1;
+        }
+    }
+
     WslUi ui;
     ui.show();
 
@@ -0,0 +1,261 @@
+/* This file is part of wslman.
+ *
+ * wslman is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * wslman is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with wslman.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "wslmove.h"
+
+#include "wslregistry.h"
+#include "wsltreecopy.h"
+#include "wslui.h"
+#include "wslutils.h"
+#include <QLabel>
+#include <QLineEdit>
+#include <QDialogButtonBox>
+#include <QPushButton>
+#include <QToolButton>
+#include <QGridLayout>
+#include <QCompleter>
+#include <QFileSystemModel>
+#include <QFileInfo>
+#include <QFileDialog>
+#include <QProgressDialog>
+#include <QMessageBox>
+
+// Number of differing paths listed when the verification fails
+#define MAX_REPORTED_MISMATCHES 20
+
+static std::wstring nativeAbsolutePath(const QString &path)
+{
+    return QDir::toNativeSeparators(QFileInfo(path).absoluteFilePath()).toStdWString();
+}
+
+WslMoveDialog::WslMoveDialog(const QString &uuid, QWidget *parent)
+    : QDialog(parent), m_uuid(uuid.toStdWString())
+{
+    setWindowTitle(tr("Move WSL Distribution"));
+
+    auto lblSource = new QLabel(tr("Current Location:"), this);
+    auto sourcePath = new QLineEdit(this);
+    sourcePath->setReadOnly(true);
+
+    auto lblTarget = new QLabel(tr("New &Location:"), this);
+    m_targetPath = new QLineEdit(this);
+    auto dirModel = new QFileSystemModel(m_targetPath);
+    dirModel->setFilter(QDir::AllDirs | QDir::NoDotAndDotDot);
+    dirModel->setRootPath(QDir::rootPath());
+    auto targetPathCompleter = new QCompleter(dirModel, m_targetPath);
+    m_targetPath->setCompleter(targetPathCompleter);
+    lblTarget->setBuddy(m_targetPath);
+    auto selectTargetPath = new QToolButton(this);
+    selectTargetPath->setIconSize(QSize(16, 16));
+    selectTargetPath->setIcon(QIcon(":/icons/document-open.ico"));
+
+    try {
+        WslDistribution dist = WslRegistry::findDistByUuid(m_uuid);
+        sourcePath->setText(QString::fromStdWString(dist.path()));
+    } catch (const std::runtime_error &) {
+        // The distribution will be validated later
+    }
+
+    auto buttons = new QDialogButtonBox(QDialogButtonBox::Ok | QDialogButtonBox::Cancel, this);
+    connect(buttons, &QDialogButtonBox::accepted, this, &QDialog::accept);
+    connect(buttons, &QDialogButtonBox::rejected, this, &QDialog::reject);
+    buttons->button(QDialogButtonBox::Ok)->setText(tr("&Move"));
+
+    connect(selectTargetPath, &QAbstractButton::clicked, this, [this](bool) {
+        QString path = QFileDialog::getExistingDirectory(this,
+                            tr("Select New Location..."), m_targetPath->text());
+        if (!path.isEmpty())
+            m_targetPath->setText(path);
+    });
+
+    auto layout = new QGridLayout(this);
+    int layoutRow = 0;
+    layout->addWidget(lblSource, layoutRow, 0);
+    layout->addWidget(sourcePath, layoutRow, 1, 1, 2);
+    layout->addWidget(lblTarget, ++layoutRow, 0);
+    layout->addWidget(m_targetPath, layoutRow, 1);
+    layout->addWidget(selectTargetPath, layoutRow, 2);
+    layout->addItem(new QSpacerItem(0, 10), ++layoutRow, 0, 1, 3);
+    layout->addWidget(buttons, ++layoutRow, 0, 1, 3);
+}
+
+bool WslMoveDialog::validate()
+{
+    if (m_targetPath->text().isEmpty()) {
+        QMessageBox::critical(this, QString(), tr("Missing required fields"));
+        return false;
+    }
+
+    WslDistribution dist;
+    try {
+        dist = WslRegistry::findDistByUuid(m_uuid);
+    } catch (const std::runtime_error &err) {
+        QMessageBox::critical(this, QString(),
+                tr("Failed to query WSL distributions: %1").arg(err.what()));
+        return false;
+    }
+    if (!dist.isValid() || dist.path().empty()) {
+        QMessageBox::critical(this, QString(), tr("The distribution no longer exists"));
+        return false;
+    }
+    if (!WslUi::checkStopped(this, dist,
+            tr("The distribution is running.  Stop it with \"wsl --terminate\" "
+               "before moving it."))) {
+        return false;
+    }
+
+    QString targetPath = m_targetPath->text();
+    if (QFileInfo(targetPath).exists() && !WslUtil::isDirectoryEmpty(targetPath)) {
+        QMessageBox::critical(this, QString(),
+                tr("The path \"%1\" already exists and is not empty").arg(targetPath));
+        return false;
+    }
+
+    // The new location may not be inside the rootfs being moved
+    const QString sourceDir = QFileInfo(QString::fromStdWString(dist.path())).absoluteFilePath();
+    const QString targetDir = QFileInfo(targetPath).absoluteFilePath();
+    if (targetDir.compare(sourceDir, Qt::CaseInsensitive) == 0
+            || targetDir.startsWith(sourceDir + QLatin1Char('/'), Qt::CaseInsensitive)) {
+        QMessageBox::critical(this, QString(),
+                tr("The new location cannot be inside the current location"));
+        return false;
+    }
+
+    return true;
+}
+
+void WslMoveDialog::performMove()
+{
+    if (!QDir::current().mkpath(m_targetPath->text())) {
+        QMessageBox::critical(parentWidget(), QString(),
+                tr("Failed to create distribution directory"));
+        return;
+    }
+
+    try {
+        WslDistribution dist = WslRegistry::findDistByUuid(m_uuid);
+        if (!dist.isValid())
+            throw std::runtime_error("Distribution no longer exists");
+
+        const std::wstring sourceDir = nativeAbsolutePath(QString::fromStdWString(dist.path()));
+        const std::wstring targetDir = nativeAbsolutePath(m_targetPath->text());
+        const std::wstring sourceRootfs = sourceDir + L"\\rootfs";
+        const std::wstring targetRootfs = targetDir + L"\\rootfs";
+
+        // Within a volume, the rootfs can simply be renamed.  Only the
+        // rootfs is moved, since the base path may be shared with other
+        // files (e.g. the LocalState of a Store distribution).
+        bool copied = false;
+        if (!MoveFileExW(sourceRootfs.c_str(), targetRootfs.c_str(), 0)) {
+            if (GetLastError() != ERROR_NOT_SAME_DEVICE)
+                throw std::runtime_error("Could not move the rootfs directory");
+            if (!copyRootfs(sourceRootfs, targetRootfs))
+                return;
+            copied = true;
+        }
+
+        try {
+            dist.setPath(targetDir);
+        } catch (const std::runtime_error &) {
+            // BasePath still points to the old location, so put the rootfs
+            // back there
+            if (copied)
+                WslUi::deleteTree(parentWidget(), targetRootfs);
+            else if (!MoveFileExW(targetRootfs.c_str(), sourceRootfs.c_str(), 0))
+                throw std::runtime_error("Could not update the distribution's path, or move its rootfs back");
+            throw;
+        }
+
+        // Nothing refers to the old files any more, so failures below only
+        // leave some garbage behind.
+        const std::wstring sourceTemp = sourceDir + L"\\temp";
+        try {
+            if (copied)
+                WslUi::deleteTree(parentWidget(), sourceRootfs);
+            if (QFileInfo::exists(QString::fromStdWString(sourceTemp)))
+                WslUi::deleteTree(parentWidget(), sourceTemp);
+        } catch (const std::runtime_error &) {
+            // The distribution has been moved successfully regardless
+        }
+        RemoveDirectoryW(sourceDir.c_str());
+    } catch (const std::runtime_error &err) {
+        QMessageBox::critical(parentWidget(), QString(),
+                tr("Failed to move distribution: %1").arg(err.what()));
+    }
+}
+
+bool WslMoveDialog::copyRootfs(const std::wstring &sourcePath, const std::wstring &targetPath)
+{
+    QProgressDialog progressDialog(parentWidget());
+    progressDialog.setLabelText(tr("Copying distribution rootfs..."));
+    progressDialog.setWindowModality(Qt::WindowModal);
+    progressDialog.setMinimumDuration(0);
+
+    std::atomic<bool> cancel = false;
+    WslTreeCopy copy(WslFs(sourcePath), targetPath);
+    try {
+        WslUtil::runInBackground([&]() { copy.run(&cancel); }, [&]() {
+            if (progressDialog.wasCanceled())
+                cancel = true;
+
+            // QProgressDialog only supports int progress
+            progressDialog.setMaximum(static_cast<int>(copy.entriesFound()));
+            progressDialog.setValue(static_cast<int>(copy.entriesCopied()));
+        });
+    } catch (const std::runtime_error &) {
+        WslUi::deleteTree(parentWidget(), targetPath);
+        throw;
+    }
+    if (cancel) {
+        WslUi::deleteTree(parentWidget(), targetPath);
+        return false;
+    }
+
+    // The source is deleted afterwards, so make sure everything arrived
+    progressDialog.setLabelText(tr("Verifying the copied files..."));
+    progressDialog.setMaximum(0);
+    progressDialog.setValue(0);
+    std::vector<std::string> mismatches;
+    try {
+        WslUtil::runInBackground([&]() { mismatches = copy.verify(&cancel); }, [&]() {
+            if (progressDialog.wasCanceled())
+                cancel = true;
+        });
+    } catch (const std::runtime_error &) {
+        WslUi::deleteTree(parentWidget(), targetPath);
+        throw;
+    }
+    if (cancel || !mismatches.empty()) {
+        if (!cancel) {
+            QStringList paths;
+            for (size_t i = 0; i < mismatches.size() && i < MAX_REPORTED_MISMATCHES; ++i)
+                paths << QString::fromStdString(mismatches[i]);
+            if (mismatches.size() > MAX_REPORTED_MISMATCHES)
+                paths << tr("...");
+
+            QMessageBox msgBox(QMessageBox::Critical, QString(),
+                    tr("The copied rootfs does not match the original in %1 entries.  "
+                       "The distribution was not moved.").arg(mismatches.size()),
+                    QMessageBox::Ok, parentWidget());
+            msgBox.setDetailedText(paths.join(QLatin1Char('\n')));
+            msgBox.exec();
+        }
+        WslUi::deleteTree(parentWidget(), targetPath);
+        return false;
+    }
+
+    return true;
+}
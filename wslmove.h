@@ -0,0 +1,36 @@
+/* This file is part of wslman.
+ *
+ * wslman is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * wslman is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with wslman.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <QDialog>
+
+class QLineEdit;
+
+class WslMoveDialog : public QDialog
+{
+public:
+    WslMoveDialog(const QString &uuid, QWidget *parent = nullptr);
+
+    bool validate();
+    void performMove();
+
+private:
+    std::wstring m_uuid;
+    QLineEdit *m_targetPath;
+
+    bool copyRootfs(const std::wstring &sourcePath, const std::wstring &targetPath);
+};
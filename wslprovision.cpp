@@ -0,0 +1,456 @@
+/* This file is part of wslman.
+ *
+ * wslman is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * wslman is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with wslman.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "wslprovision.h"
+
+#include "wslusers.h"
+#include "wsltreedelete.h"
+
+#include <charconv>
+#include <chrono>
+#include <unordered_set>
+
+static std::string_view nextLine(std::string_view &content)
+{
+    const size_t end = content.find('\n');
+    std::string_view line = content.substr(0, end);
+    content.remove_prefix(end == content.npos ? content.size() : end + 1);
+    if (!line.empty() && line.back() == '\r')
+        line.remove_suffix(1);
+    return line;
+}
+
+// Look up a numeric "KEY value" setting from /etc/login.defs
+static uint32_t loginDefsValue(std::string_view loginDefs, const std::string_view &key,
+                               uint32_t defaultValue, int base = 10)
+{
+    while (!loginDefs.empty()) {
+        std::string_view line = nextLine(loginDefs);
+        if (!starts_with(line, key) || line.size() == key.size()
+                || (line[key.size()] != ' ' && line[key.size()] != '\t')) {
+            continue;
+        }
+        line.remove_prefix(key.size());
+        while (!line.empty() && (line.front() == ' ' || line.front() == '\t'))
+            line.remove_prefix(1);
+
+        uint32_t value;
+        auto result = std::from_chars(line.data(), line.data() + line.size(), value, base);
+        if (result.ec == std::errc())
+            return value;
+    }
+    return defaultValue;
+}
+
+static bool isValidUsername(const std::string &name)
+{
+    if (name.empty() || name.size() > 32 || name.front() == '-')
+        return false;
+    for (size_t i = 0; i < name.size(); ++i) {
+        const char ch = name[i];
+        if ((ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || ch == '_'
+                || (i > 0 && ((ch >= '0' && ch <= '9') || ch == '-' || ch == '.'))
+                || (ch == '$' && i == name.size() - 1)) {
+            continue;
+        }
+        return false;
+    }
+    return true;
+}
+
+// Append a line, making sure the previous line was terminated
+static void appendLine(std::string &content, const std::string &line)
+{
+    if (!content.empty() && content.back() != '\n')
+        content.push_back('\n');
+    content.append(line);
+    content.push_back('\n');
+}
+
+// Add a user to the member list (the last field) of the listed groups, for
+// both /etc/group and /etc/gshadow.  Groups which were found are removed
+// from the set.
+static std::string addGroupMember(const std::string &content, const std::string &user,
+                                  std::unordered_set<std::string> &groups)
+{
+    std::string result;
+    result.reserve(content.size() + groups.size() * (user.size() + 1));
+    std::string_view remaining = content;
+    while (!remaining.empty()) {
+        const bool terminated = remaining.find('\n') != remaining.npos;
+        const std::string_view line = nextLine(remaining);
+        result.append(line);
+
+        const std::string group(line.substr(0, line.find(':')));
+        auto found = groups.find(group);
+        if (found != groups.end() && line.find(':') != line.npos) {
+            const std::string_view members = line.substr(line.rfind(':') + 1);
+            bool isMember = false;
+            std::string_view scan = members;
+            while (!scan.empty() && !isMember) {
+                const size_t end = scan.find(',');
+                isMember = scan.substr(0, end) == user;
+                scan.remove_prefix(end == scan.npos ? scan.size() : end + 1);
+            }
+            if (!isMember) {
+                if (!members.empty())
+                    result.push_back(',');
+                result.append(user);
+            }
+            groups.erase(found);
+        }
+        if (terminated)
+            result.push_back('\n');
+    }
+    return result;
+}
+
+static uint64_t currentUnixTime()
+{
+    using namespace std::chrono;
+    return static_cast<uint64_t>(
+                duration_cast<seconds>(system_clock::now().time_since_epoch()).count());
+}
+
+WslProvision::WslProvision(const WslFs &rootfs)
+    : m_rootfs(rootfs)
+{ }
+
+bool WslProvision::isSupported() const
+{
+    if (!fileExists("/etc/passwd") || !fileExists("/etc/group"))
+        return false;
+
+    // Only local sources may provide passwd, group or shadow entries
+    static const std::unordered_set<std::string_view> localSources = {
+        "files", "compat", "systemd",
+    };
+    const std::string nsswitch = readFile("/etc/nsswitch.conf");
+    std::string_view remaining = nsswitch;
+    while (!remaining.empty()) {
+        std::string_view line = nextLine(remaining);
+        line = line.substr(0, line.find('#'));
+        const size_t colon = line.find(':');
+        if (colon == line.npos)
+            continue;
+        std::string_view database = line.substr(0, colon);
+        while (!database.empty() && (database.front() == ' ' || database.front() == '\t'))
+            database.remove_prefix(1);
+        if (database != "passwd" && database != "group" && database != "shadow"
+                && database != "gshadow") {
+            continue;
+        }
+
+        std::string_view sources = line.substr(colon + 1);
+        while (!sources.empty()) {
+            const size_t start = sources.find_first_not_of(" \t");
+            if (start == sources.npos)
+                break;
+            sources.remove_prefix(start);
+            if (sources.front() == '[') {
+                // Action items like [NOTFOUND=return]
+                const size_t end = sources.find(']');
+                sources.remove_prefix(end == sources.npos ? sources.size() : end + 1);
+                continue;
+            }
+            const size_t end = sources.find_first_of(" \t");
+            if (localSources.count(sources.substr(0, end)) == 0)
+                return false;
+            sources.remove_prefix(end == sources.npos ? sources.size() : end);
+        }
+    }
+
+    // NIS compat entries
+    for (const char *unixPath : {"/etc/passwd", "/etc/group"}) {
+        const std::string content = readFile(unixPath);
+        std::string_view lines = content;
+        while (!lines.empty()) {
+            const std::string_view line = nextLine(lines);
+            if (!line.empty() && (line.front() == '+' || line.front() == '-'))
+                return false;
+        }
+    }
+    return true;
+}
+
+uint32_t WslProvision::addUser(const std::string &name, const std::string &gecos,
+                               const std::vector<std::string> &groups,
+                               std::vector<std::string> &missingGroups)
+{
+    if (!isValidUsername(name))
+        throw std::runtime_error("Invalid user name: " + name);
+    if (gecos.find_first_of(":\n") != gecos.npos)
+        throw std::runtime_error("Invalid user information: " + gecos);
+
+    auto userDb = WslUserDb::forRootfs(m_rootfs.rootPath());
+    if (!userDb)
+        throw std::runtime_error("Could not read /etc/passwd");
+    if (userDb->findUser(name))
+        throw std::runtime_error("User " + name + " already exists");
+    if (userDb->findGroup(name))
+        throw std::runtime_error("Group " + name + " already exists");
+
+    const std::string loginDefs = readFile("/etc/login.defs");
+    const uint32_t uidMin = loginDefsValue(loginDefs, "UID_MIN", 1000);
+    const uint32_t uidMax = loginDefsValue(loginDefs, "UID_MAX", 60000);
+    const uint32_t gidMin = loginDefsValue(loginDefs, "GID_MIN", 1000);
+    const uint32_t gidMax = loginDefsValue(loginDefs, "GID_MAX", 60000);
+    const uint32_t homeMode = loginDefsValue(loginDefs, "HOME_MODE", 0755, 8);
+
+    // Like useradd, prefer a matching UID and GID for the user's own group
+    uint32_t uid = INVALID_UID;
+    for (uint32_t id = uidMin; id <= uidMax; ++id) {
+        if (userDb->findUser(id))
+            continue;
+        if (uid == INVALID_UID)
+            uid = id;
+        if (!userDb->findGroup(id)) {
+            uid = id;
+            break;
+        }
+    }
+    if (uid == INVALID_UID)
+        throw std::runtime_error("No free UID available");
+
+    uint32_t gid = uid;
+    if (userDb->findGroup(gid) || gid < gidMin || gid > gidMax) {
+        gid = INVALID_UID;
+        for (uint32_t id = gidMin; id <= gidMax && gid == INVALID_UID; ++id) {
+            if (!userDb->findGroup(id))
+                gid = id;
+        }
+        if (gid == INVALID_UID)
+            throw std::runtime_error("No free GID available");
+    }
+
+    // Nothing may be changed before everything that can fail early is checked
+    const std::string home = "/home/" + name;
+    if (fileExists(home.c_str()))
+        throw std::runtime_error(home + " already exists");
+
+    const std::string shell = (fileExists("/bin/bash") || fileExists("/usr/bin/bash"))
+                            ? "/bin/bash" : "/bin/sh";
+    const std::string days = std::to_string(currentUnixTime() / 86400);
+
+    std::unordered_set<std::string> wantGroups(groups.begin(), groups.end());
+    wantGroups.erase(std::string());
+    std::unordered_set<std::string> gshadowGroups = wantGroups;
+
+    // All databases are staged and the home directory is created before any
+    // database is replaced, so a failure leaves the accounts unchanged.
+    // Groups are replaced before the users that refer to them.
+    std::vector<std::pair<std::string, const char *>> staged;
+    auto discardStaged = [&]() {
+        for (const auto &file : staged)
+            discardFile(file.first);
+    };
+    try {
+        std::string group = readFile("/etc/group");
+        group = addGroupMember(group, name, wantGroups);
+        appendLine(group, name + ":x:" + std::to_string(gid) + ":");
+        staged.emplace_back(stageFile("/etc/group", group), "/etc/group");
+
+        if (fileExists("/etc/gshadow")) {
+            std::string gshadow = readFile("/etc/gshadow");
+            gshadow = addGroupMember(gshadow, name, gshadowGroups);
+            appendLine(gshadow, name + ":!::");
+            staged.emplace_back(stageFile("/etc/gshadow", gshadow), "/etc/gshadow");
+        }
+
+        std::string passwd = readFile("/etc/passwd");
+        appendLine(passwd, name + ":x:" + std::to_string(uid) + ":" + std::to_string(gid)
+                           + ":" + gecos + ":" + home + ":" + shell);
+        staged.emplace_back(stageFile("/etc/passwd", passwd), "/etc/passwd");
+
+        if (fileExists("/etc/shadow")) {
+            std::string shadow = readFile("/etc/shadow");
+            appendLine(shadow, name + ":!:" + days + ":0:99999:7:::");
+            staged.emplace_back(stageFile("/etc/shadow", shadow), "/etc/shadow");
+        }
+    } catch (const std::runtime_error &) {
+        discardStaged();
+        throw;
+    }
+
+    try {
+        createHome(home, uid, gid, homeMode & 07777);
+    } catch (const std::runtime_error &) {
+        discardStaged();
+        try {
+            WslTreeDelete(m_rootfs.path(home)).run();
+        } catch (const std::runtime_error &) {
+            // Only the partial home directory is left behind
+        }
+        throw;
+    }
+
+    for (const auto &file : staged)
+        commitFile(file.first, file.second);
+    missingGroups.assign(wantGroups.begin(), wantGroups.end());
+    return uid;
+}
+
+bool WslProvision::fileExists(const char *unixPath) const
+{
+    return GetFileAttributesW(m_rootfs.path(unixPath).c_str()) != INVALID_FILE_ATTRIBUTES;
+}
+
+std::string WslProvision::readFile(const char *unixPath) const
+{
+    UniqueHandle hFile = m_rootfs.openFile(unixPath);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return std::string();
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(hFile.get(), &fileSize))
+        throw std::runtime_error(std::string("Could not read ") + unixPath);
+
+    std::string content(static_cast<size_t>(fileSize.QuadPart), '\0');
+    size_t offset = 0;
+    while (offset < content.size()) {
+        DWORD nRead = 0;
+        if (!ReadFile(hFile.get(), content.data() + offset,
+                      static_cast<DWORD>(content.size() - offset), &nRead, nullptr))
+            throw std::runtime_error(std::string("Could not read ") + unixPath);
+        if (nRead == 0)
+            break;
+        offset += nRead;
+    }
+    content.resize(offset);
+    return content;
+}
+
+std::string WslProvision::stageFile(const char *unixPath, const std::string &content) const
+{
+    // The same name shadow's own tools use while updating a database
+    const std::string stagedPath = std::string(unixPath) + "+";
+
+    WslAttr attr;
+    {
+        UniqueHandle hOriginal = m_rootfs.openFile(unixPath);
+        if (hOriginal == INVALID_HANDLE_VALUE)
+            throw std::runtime_error(std::string("Could not open ") + unixPath);
+        attr = m_rootfs.getAttr(hOriginal.get());
+    }
+    attr.mtime = attr.ctime = currentUnixTime();
+    attr.mtime_nsec = attr.ctime_nsec = 0;
+
+    // Left over from an interrupted update
+    discardFile(stagedPath);
+
+    UniqueHandle hFile = m_rootfs.createFile(stagedPath, attr);
+    if (hFile == INVALID_HANDLE_VALUE)
+        throw std::runtime_error("Could not create " + stagedPath);
+
+    try {
+        DWORD nWritten;
+        if (!WriteFile(hFile.get(), content.data(), static_cast<DWORD>(content.size()),
+                       &nWritten, nullptr) || nWritten != content.size()
+                || !FlushFileBuffers(hFile.get())) {
+            throw std::runtime_error(std::string("Could not write ") + unixPath);
+        }
+
+        // Writing the data updated the modification time
+        m_rootfs.setAttr(hFile.get(), attr);
+    } catch (const std::runtime_error &) {
+        hFile.release();
+        discardFile(stagedPath);
+        throw;
+    }
+    return stagedPath;
+}
+
+void WslProvision::commitFile(const std::string &stagedPath, const char *unixPath) const
+{
+    if (!MoveFileExW(m_rootfs.path(stagedPath).c_str(), m_rootfs.path(unixPath).c_str(),
+                     MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+        throw std::runtime_error(std::string("Could not replace ") + unixPath);
+    }
+}
+
+void WslProvision::discardFile(const std::string &stagedPath) const
+{
+    DeleteFileW(m_rootfs.path(stagedPath).c_str());
+}
+
+void WslProvision::createHome(const std::string &home, uint32_t uid, uint32_t gid,
+                              uint32_t mode)
+{
+    const uint64_t now = currentUnixTime();
+    if (!fileExists("/home")) {
+        const WslAttr homeRoot(LX_IFDIR | 0755, 0, 0, now, 0, now, 0, now, 0);
+        if (!m_rootfs.createDirectory("/home", homeRoot))
+            throw std::runtime_error("Could not create /home");
+    }
+
+    const WslAttr homeAttr(LX_IFDIR | mode, uid, gid, now, 0, now, 0, now, 0);
+    if (!m_rootfs.createDirectory(home, homeAttr))
+        throw std::runtime_error("Could not create " + home);
+    if (!fileExists("/etc/skel"))
+        return;
+
+    // Directories are visited before their contents, so each parent exists
+    // by the time its entries are copied.
+    const std::string skel = "/etc/skel";
+    m_rootfs.walk(skel, [&](const WslDirEntry &entry) {
+        const std::string target = home + entry.unixPath.substr(skel.size());
+        UniqueHandle hSource = CreateFileW(entry.ntPath.c_str(), GENERIC_READ,
+                                           FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                                           FILE_FLAG_BACKUP_SEMANTICS
+                                               | FILE_FLAG_OPEN_REPARSE_POINT,
+                                           nullptr);
+        if (hSource == INVALID_HANDLE_VALUE)
+            throw std::runtime_error("Could not open " + entry.unixPath);
+
+        WslAttr attr = m_rootfs.getAttr(hSource.get());
+        attr.uid = uid;
+        attr.gid = gid;
+        switch (attr.mode & LX_IFMT) {
+        case LX_IFDIR:
+            if (!m_rootfs.createDirectory(target, attr))
+                throw std::runtime_error("Could not create " + target);
+            break;
+        case LX_IFLNK:
+            if (!m_rootfs.createSymlink(target, m_rootfs.readSymlink(hSource.get()), attr))
+                throw std::runtime_error("Could not create " + target);
+            break;
+        case LX_IFREG:
+            {
+                UniqueHandle hTarget = m_rootfs.createFile(target, attr);
+                if (hTarget == INVALID_HANDLE_VALUE)
+                    throw std::runtime_error("Could not create " + target);
+                char buffer[16384];
+                for ( ;; ) {
+                    DWORD nRead = 0, nWritten;
+                    if (!ReadFile(hSource.get(), buffer, sizeof(buffer), &nRead, nullptr))
+                        throw std::runtime_error("Could not read " + entry.unixPath);
+                    if (nRead == 0)
+                        break;
+                    if (!WriteFile(hTarget.get(), buffer, nRead, &nWritten, nullptr))
+                        throw std::runtime_error("Could not write " + target);
+                }
+
+                // Writing the data updated the modification time
+                m_rootfs.setAttr(hTarget.get(), attr);
+            }
+            break;
+        default:
+            // Devices, FIFOs and sockets don't belong in a home directory
+            break;
+        }
+    });
+}
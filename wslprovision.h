@@ -0,0 +1,57 @@
+/* This file is part of wslman.
+ *
+ * wslman is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * wslman is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with wslman.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "wslfs.h"
+
+#include <vector>
+
+// Creates users directly in the account databases of an offline rootfs
+// (/etc/passwd, /etc/shadow, /etc/group and /etc/gshadow), following the
+// useradd defaults from /etc/login.defs.
+class WslProvision
+{
+public:
+    WslProvision(const WslFs &rootfs);
+
+    // Returns false if accounts may come from somewhere other than the local
+    // files (NIS compat entries, sssd, LDAP, ...), in which case the
+    // distribution's own adduser should be used instead.
+    bool isSupported() const;
+
+    // Adds a user with its own primary group, a locked password and a home
+    // directory populated from /etc/skel, and adds it to any of the listed
+    // supplementary groups which exist.  Returns the new UID.
+    uint32_t addUser(const std::string &name, const std::string &gecos,
+                     const std::vector<std::string> &groups,
+                     std::vector<std::string> &missingGroups);
+
+private:
+    WslFs m_rootfs;
+
+    std::string readFile(const char *unixPath) const;
+    bool fileExists(const char *unixPath) const;
+
+    // Writes the new content to a sibling file with the original's LX
+    // attributes, which commitFile() then renames over the original
+    std::string stageFile(const char *unixPath, const std::string &content) const;
+    void commitFile(const std::string &stagedPath, const char *unixPath) const;
+    void discardFile(const std::string &stagedPath) const;
+
+    void createHome(const std::string &home, uint32_t uid, uint32_t gid, uint32_t mode);
+};
@@ -16,118 +16,172 @@
 
 #include "wslregistry.h"
 
+#include "wslregstore.h"
 #include "wslutils.h"
 #include <objbase.h>
 
+#include <algorithm>
+#include <atomic>
 #include <memory>
+#include <unordered_map>
 
-#define LXSS_ROOT_PATH L"Software\\Microsoft\\Windows\\CurrentVersion\\Lxss"
-
-static std::wstring winregGetWstring(const std::wstring &path, LPCWSTR name)
+static std::wstring parseWstring(const uint8_t *data, size_t size)
 {
-    DWORD length;
-    auto rc = RegGetValueW(HKEY_CURRENT_USER, path.c_str(), name, RRF_RT_REG_SZ,
-                           nullptr, nullptr, &length);
-    if (rc != ERROR_SUCCESS)
-        return std::wstring();
-
-    auto buffer = std::make_unique<wchar_t[]>(length);
-    rc = RegGetValueW(HKEY_CURRENT_USER, path.c_str(), name, RRF_RT_REG_SZ,
-                      nullptr, buffer.get(), &length);
-    if (rc != ERROR_SUCCESS)
-        return std::wstring();
-
-    return std::wstring(buffer.get());
+    // The stored string may or may not include its terminator
+    auto chars = reinterpret_cast<const wchar_t *>(data);
+    const size_t length = size / sizeof(wchar_t);
+    return std::wstring(chars, std::find(chars, chars + length, L'\0'));
 }
 
-static std::vector<std::wstring>
-winregGetWstringArray(const std::wstring &path, LPCWSTR name)
+static std::vector<std::wstring> parseWstringArray(const uint8_t *data, size_t size)
 {
-    DWORD length;
-    auto rc = RegGetValueW(HKEY_CURRENT_USER, path.c_str(), name, RRF_RT_REG_MULTI_SZ,
-                           nullptr, nullptr, &length);
-    if (rc != ERROR_SUCCESS)
-        return {};
-
-    auto buffer = std::make_unique<wchar_t[]>(length);
-    rc = RegGetValueW(HKEY_CURRENT_USER, path.c_str(), name, RRF_RT_REG_MULTI_SZ,
-                      nullptr, buffer.get(), &length);
-    if (rc != ERROR_SUCCESS)
-        return {};
-
     std::vector<std::wstring> result;
-    wchar_t *bufp = buffer.get();
-    for ( ;; ) {
-        auto slen = wcslen(bufp);
-        if (slen == 0)
+    auto bufp = reinterpret_cast<const wchar_t *>(data);
+    auto bufend = bufp + size / sizeof(wchar_t);
+    while (bufp < bufend) {
+        auto strend = std::find(bufp, bufend, L'\0');
+        if (strend == bufp)
             break;
 
-        result.emplace_back(bufp, slen);
-        bufp += slen + 1;
+        result.emplace_back(bufp, strend);
+        bufp = strend + 1;
     }
 
     return result;
 }
 
-static uint32_t winregGetDword(const std::wstring &path, LPCWSTR name)
+static uint32_t parseDword(const uint8_t *data, size_t size)
 {
     DWORD value;
-    DWORD length = sizeof(value);
-    auto rc = RegGetValueW(HKEY_CURRENT_USER, path.c_str(), name, RRF_RT_REG_DWORD,
-                           nullptr, &value, &length);
-    if (rc != ERROR_SUCCESS)
+    if (size != sizeof(value))
         return 0;
 
+    memcpy(&value, data, sizeof(value));
     return static_cast<uint32_t>(value);
 }
 
+// Key paths are relative to the Lxss key; see WslRegistryStore
+static std::wstring winregGetWstring(const std::wstring &path, LPCWSTR name)
+{
+    std::vector<uint8_t> data;
+    if (!WslRegistryStore::current().getValue(path, name, REG_SZ, data))
+        return std::wstring();
+    return parseWstring(data.data(), data.size());
+}
+
 static bool winregSetWstring(const std::wstring &path, LPCWSTR name,
                              const std::wstring &value)
 {
-    LSTATUS rc;
-    if (value.empty()) {
-        rc = RegDeleteKeyValueW(HKEY_CURRENT_USER, path.c_str(), name);
-    } else {
-        auto size = static_cast<DWORD>((value.size() + 1) * sizeof(wchar_t));
-        rc = RegSetKeyValueW(HKEY_CURRENT_USER, path.c_str(), name, REG_SZ,
-                             value.c_str(), size);
+    WslRegistryStore &store = WslRegistryStore::current();
+    if (value.empty())
+        return store.deleteValue(path, name);
+
+    auto size = (value.size() + 1) * sizeof(wchar_t);
+    return store.setValue(path, name, REG_SZ, value.c_str(), size);
+}
+
+// Encoders for WslRegistryStore::writeValues().  As above, empty strings
+// and arrays delete the value.
+static WslRegistryWrite encodeWstring(LPCWSTR name, const std::wstring &value)
+{
+    if (value.empty())
+        return {name, REG_NONE, {}};
+
+    auto bytes = reinterpret_cast<const uint8_t *>(value.c_str());
+    const size_t size = (value.size() + 1) * sizeof(wchar_t);
+    return {name, REG_SZ, std::vector<uint8_t>(bytes, bytes + size)};
+}
+
+static WslRegistryWrite encodeWstringArray(LPCWSTR name, const std::vector<std::wstring> &value)
+{
+    if (value.empty())
+        return {name, REG_NONE, {}};
+
+    std::wstring buffer;
+    for (const std::wstring &str : value) {
+        buffer += str;
+        buffer += L'\0';
     }
-    return rc == ERROR_SUCCESS;
-}
-
-static bool winregSetWstringArray(const std::wstring &path, LPCWSTR name,
-                                  const std::vector<std::wstring> &value)
-{
-    LSTATUS rc;
-    if (value.empty()) {
-        rc = RegDeleteKeyValueW(HKEY_CURRENT_USER, path.c_str(), name);
-    } else {
-        size_t length = 1;
-        for (const std::wstring &str : value)
-            length += str.size() + 1;
-
-        auto buffer = std::make_unique<wchar_t[]>(length);
-        wchar_t *bufp = buffer.get();
-        for (const std::wstring &str : value) {
-            std::char_traits<wchar_t>::copy(bufp, str.c_str(), str.size());
-            bufp += str.size();
-            *bufp++ = 0;
-        }
-        *bufp = 0;
 
-        auto size = static_cast<DWORD>(length * sizeof(wchar_t));
-        rc = RegSetKeyValueW(HKEY_CURRENT_USER, path.c_str(), name, REG_MULTI_SZ,
-                             buffer.get(), size);
+    // The terminator of the string itself ends the array
+    auto bytes = reinterpret_cast<const uint8_t *>(buffer.c_str());
+    const size_t size = (buffer.size() + 1) * sizeof(wchar_t);
+    return {name, REG_MULTI_SZ, std::vector<uint8_t>(bytes, bytes + size)};
+}
+
+static WslRegistryWrite encodeDword(LPCWSTR name, uint32_t value)
+{
+    const DWORD dwValue = static_cast<DWORD>(value);
+    auto bytes = reinterpret_cast<const uint8_t *>(&dwValue);
+    return {name, REG_DWORD, std::vector<uint8_t>(bytes, bytes + sizeof(dwValue))};
+}
+
+// New distributions are written to a temporary key first, which is renamed
+// to the distribution's uuid once it is complete.  The key is named after
+// the process which writes it (~<pid>~<uuid>), so another instance can
+// tell whether the registration is still in progress.
+static std::wstring pendingKey(const std::wstring &uuid)
+{
+    return L"~" + std::to_wstring(GetCurrentProcessId()) + L"~" + uuid;
+}
+
+static bool isPendingKey(const std::wstring &key)
+{
+    return !key.empty() && key.front() == L'~';
+}
+
+static std::vector<std::wstring> distributionUuids()
+{
+    std::vector<std::wstring> keys;
+    try {
+        keys = WslRegistryStore::current().subKeys(std::wstring());
+    } catch (const std::runtime_error &) {
+        throw std::runtime_error("Could not list distributions");
     }
-    return rc == ERROR_SUCCESS;
+
+    keys.erase(std::remove_if(keys.begin(), keys.end(), isPendingKey), keys.end());
+    return keys;
+}
+
+// Maps distribution names to their uuids, so looking up a name doesn't
+// need to read every distribution key.  It is rebuilt when the store
+// reports a change, and after our own changes to the names.
+struct WslNameIndex
+{
+    std::mutex mutex;
+    const WslRegistryStore *store = nullptr;
+    uint64_t changeCount = 0;
+    bool valid = false;
+    std::unordered_map<std::wstring, std::wstring> uuids;
+};
+static WslNameIndex s_nameIndex;
+
+static std::wstring indexedUuid(const std::wstring &name, bool forceRebuild)
+{
+    WslRegistryStore &store = WslRegistryStore::current();
+    const uint64_t changeCount = store.changeCount();
+
+    std::lock_guard<std::mutex> lock(s_nameIndex.mutex);
+    if (forceRebuild || !s_nameIndex.valid || s_nameIndex.store != &store
+            || s_nameIndex.changeCount != changeCount) {
+        s_nameIndex.valid = false;
+        s_nameIndex.uuids.clear();
+        for (const std::wstring &uuid : distributionUuids())
+            s_nameIndex.uuids.emplace(winregGetWstring(uuid, L"DistributionName"), uuid);
+
+        s_nameIndex.store = &store;
+        s_nameIndex.changeCount = changeCount;
+        s_nameIndex.valid = true;
+    }
+
+    auto iter = s_nameIndex.uuids.find(name);
+    return (iter != s_nameIndex.uuids.end()) ? iter->second : std::wstring();
 }
 
-static bool winregSetDword(const std::wstring &path, LPCWSTR name, uint32_t value)
+static void invalidateNameIndex()
 {
-    DWORD dwValue = static_cast<DWORD>(value);
-    auto rc = RegSetKeyValueW(HKEY_CURRENT_USER, path.c_str(), name, REG_DWORD,
-                              &dwValue, sizeof(value));
-    return rc == ERROR_SUCCESS;
+    std::lock_guard<std::mutex> lock(s_nameIndex.mutex);
+    s_nameIndex.valid = false;
 }
 
 
@@ -137,6 +191,20 @@ WslDistribution::WslDistribution()
     memset(&m_uuid, 0, sizeof(m_uuid));
 }
 
+bool WslDistribution::operator==(const WslDistribution &other) const
+{
+    return m_uuid == other.m_uuid
+        && m_name == other.m_name
+        && m_version == other.m_version
+        && m_defaultUID == other.m_defaultUID
+        && m_flags == other.m_flags
+        && m_defaultEnvironment == other.m_defaultEnvironment
+        && m_state == other.m_state
+        && m_path == other.m_path
+        && m_kernelCmdLine == other.m_kernelCmdLine
+        && m_packageFamilyName == other.m_packageFamilyName;
+}
+
 std::wstring WslDistribution::rootfsPath() const
 {
     if (m_path.empty())
@@ -149,144 +217,126 @@ std::wstring WslDistribution::rootfsPath() const
         return m_path + L"\\rootfs";
 }
 
-void WslDistribution::setName(const std::wstring &name)
+std::wstring WslDistribution::vhdFileName() const
 {
-    if (!isValid())
-        throw std::runtime_error("Cannot set properties on invalid distributions");
-
-    WslRegistry registry;
-    WslDistribution match = registry.findDistByName(name);
-    if (match.isValid())
-        throw std::runtime_error("Name \"" + WslUtil::toUtf8(name) + "\" is already in use");
+    const std::wstring fileName = winregGetWstring(m_uuid, L"VhdFileName");
+    return fileName.empty() ? std::wstring(L"ext4.vhdx") : fileName;
+}
 
-    if (winregSetWstring(LXSS_ROOT_PATH L"\\" + m_uuid, L"DistributionName", name))
-        m_name = name;
+// Each of the setters writes a single property; use WslDistributionUpdate
+// to change several of them at once
+void WslDistribution::setName(const std::wstring &name)
+{
+    WslDistributionUpdate update(*this);
+    update.setName(name);
+    update.commit();
 }
 
 void WslDistribution::setVersion(WslApi::Version version)
 {
-    if (!isValid())
-        throw std::runtime_error("Cannot set properties on invalid distributions");
-
-    if (winregSetDword(LXSS_ROOT_PATH L"\\" + m_uuid, L"Version", static_cast<uint32_t>(version)))
-        m_version = version;
+    WslDistributionUpdate update(*this);
+    update.setVersion(version);
+    update.commit();
 }
 
 void WslDistribution::setDefaultUID(uint32_t uid)
 {
-    if (!isValid())
-        throw std::runtime_error("Cannot set properties on invalid distributions");
-
-    if (winregSetDword(LXSS_ROOT_PATH L"\\" + m_uuid, L"DefaultUid", uid))
-        m_defaultUID = uid;
+    WslDistributionUpdate update(*this);
+    update.setDefaultUID(uid);
+    update.commit();
 }
 
 void WslDistribution::setFlags(WslApi::DistributionFlags flags)
 {
-    if (!isValid())
-        throw std::runtime_error("Cannot set properties on invalid distributions");
-
-    if (winregSetDword(LXSS_ROOT_PATH L"\\" + m_uuid, L"Flags", static_cast<uint32_t>(flags)))
-        m_flags = flags;
+    WslDistributionUpdate update(*this);
+    update.setFlags(flags);
+    update.commit();
 }
 
 void WslDistribution::setState(uint32_t state)
 {
-    if (!isValid())
-        throw std::runtime_error("Cannot set properties on invalid distributions");
-
-    if (winregSetDword(LXSS_ROOT_PATH L"\\" + m_uuid, L"State", state))
-        m_state = state;
+    WslDistributionUpdate update(*this);
+    update.setState(state);
+    update.commit();
 }
 
 void WslDistribution::setPath(const std::wstring &path)
 {
-    if (!isValid())
-        throw std::runtime_error("Cannot set properties on invalid distributions");
-
-    if (winregSetWstring(LXSS_ROOT_PATH L"\\" + m_uuid, L"BasePath", path))
-        m_path = path;
+    WslDistributionUpdate update(*this);
+    update.setPath(path);
+    update.commit();
 }
 
 void WslDistribution::setKernelCmdLine(const std::wstring &cmdline)
 {
-    if (!isValid())
-        throw std::runtime_error("Cannot set properties on invalid distributions");
-
-    if (winregSetWstring(LXSS_ROOT_PATH L"\\" + m_uuid, L"KernelCommandLine", cmdline))
-        m_kernelCmdLine = cmdline;
+    WslDistributionUpdate update(*this);
+    update.setKernelCmdLine(cmdline);
+    update.commit();
 }
 
 void WslDistribution::setPackageFamilyName(const std::wstring &packageFamilyName)
 {
-    if (!isValid())
-        throw std::runtime_error("Cannot set properties on invalid distributions");
-
-    if (winregSetWstring(LXSS_ROOT_PATH L"\\" + m_uuid, L"PackageFamilyName", packageFamilyName))
-        m_packageFamilyName = packageFamilyName;
+    WslDistributionUpdate update(*this);
+    update.setPackageFamilyName(packageFamilyName);
+    update.commit();
 }
 
 void WslDistribution::addEnvironment(const std::wstring &key, const std::wstring &value)
 {
-    std::vector<std::wstring> newEnv = m_defaultEnvironment;
-    const std::wstring keySearch = key + L"=";
-    bool found = false;
-    for (auto ei = newEnv.begin(); ei != newEnv.end(); ++ei) {
-        if (starts_with(*ei, keySearch)) {
-            *ei = keySearch + value;
-            found = true;
-            break;
-        }
-    }
-    if (!found)
-        newEnv.emplace_back(keySearch + value);
-
-    setEnvironment(newEnv);
+    WslDistributionUpdate update(*this);
+    update.addEnvironment(key, value);
+    update.commit();
 }
 
 void WslDistribution::delEnvironment(const std::wstring &key)
 {
-    std::vector<std::wstring> newEnv = m_defaultEnvironment;
-    const std::wstring keySearch = key + L"=";
-    auto ei = newEnv.begin();
-    while (ei != newEnv.end()) {
-        if (starts_with(*ei, keySearch))
-            ei = newEnv.erase(ei);
-        else
-            ++ei;
-    }
-
-    setEnvironment(newEnv);
+    WslDistributionUpdate update(*this);
+    update.delEnvironment(key);
+    update.commit();
 }
 
 void WslDistribution::setEnvironment(const std::vector<std::wstring> &env)
 {
-    if (!isValid())
-        throw std::runtime_error("Cannot set properties on invalid distributions");
-
-    if (winregSetWstringArray(LXSS_ROOT_PATH L"\\" + m_uuid, L"DefaultEnvironment", env))
-        m_defaultEnvironment = env;
+    WslDistributionUpdate update(*this);
+    update.setEnvironment(env);
+    update.commit();
 }
 
-WslDistribution WslDistribution::loadFromRegistry(const std::wstring &path)
+WslDistribution WslDistribution::loadFromRegistry(const std::wstring &uuid)
 {
     WslDistribution dist;
-
-    auto uuidStart = path.rfind(L'\\');
-    if (uuidStart == std::wstring::npos)
-        throw std::runtime_error("Invalid registry key format");
-    dist.m_uuid = path.substr(uuidStart + 1);
-
-    dist.m_name = winregGetWstring(path, L"DistributionName");
-    dist.m_version = static_cast<WslApi::Version>(winregGetDword(path, L"Version"));
-    dist.m_defaultUID = winregGetDword(path, L"DefaultUid");
-    dist.m_flags = static_cast<WslApi::DistributionFlags>(winregGetDword(path, L"Flags"));
-    dist.m_defaultEnvironment = winregGetWstringArray(path, L"DefaultEnvironment");
-
-    dist.m_state = winregGetDword(path, L"State");
-    dist.m_path = winregGetWstring(path, L"BasePath");
-    dist.m_kernelCmdLine = winregGetWstring(path, L"KernelCommandLine");
-    dist.m_packageFamilyName = winregGetWstring(path, L"PackageFamilyName");
+    dist.m_uuid = uuid;
+
+    // Read all values with a single pass over the key, instead of looking
+    // up each of them by name
+    const bool found = WslRegistryStore::current().enumValues(uuid,
+            [&dist](const wchar_t *name, DWORD type, const uint8_t *data, size_t size) {
+        if (type == REG_SZ) {
+            if (_wcsicmp(name, L"DistributionName") == 0)
+                dist.m_name = parseWstring(data, size);
+            else if (_wcsicmp(name, L"BasePath") == 0)
+                dist.m_path = parseWstring(data, size);
+            else if (_wcsicmp(name, L"KernelCommandLine") == 0)
+                dist.m_kernelCmdLine = parseWstring(data, size);
+            else if (_wcsicmp(name, L"PackageFamilyName") == 0)
+                dist.m_packageFamilyName = parseWstring(data, size);
+        } else if (type == REG_DWORD) {
+            const uint32_t value = parseDword(data, size);
+            if (_wcsicmp(name, L"Version") == 0)
+                dist.m_version = static_cast<WslApi::Version>(value);
+            else if (_wcsicmp(name, L"DefaultUid") == 0)
+                dist.m_defaultUID = value;
+            else if (_wcsicmp(name, L"Flags") == 0)
+                dist.m_flags = static_cast<WslApi::DistributionFlags>(value);
+            else if (_wcsicmp(name, L"State") == 0)
+                dist.m_state = value;
+        } else if (type == REG_MULTI_SZ) {
+            if (_wcsicmp(name, L"DefaultEnvironment") == 0)
+                dist.m_defaultEnvironment = WslEnvironment(parseWstringArray(data, size));
+        }
+    });
+    if (!found)
+        return WslDistribution();
 
     return dist;
 }
@@ -311,38 +361,101 @@ WslDistribution WslDistribution::create()
     return dist;
 }
 
+WslDistribution WslDistribution::detached(const std::wstring &uuid)
+{
+    WslDistribution dist;
+    dist.m_uuid = uuid;
+    return dist;
+}
 
-WslRegistry::WslRegistry()
-    : m_lxssKey()
+
+WslDistributionUpdate::WslDistributionUpdate(WslDistribution &dist)
+    : m_dist(dist), m_staged(dist)
 {
-    auto rc = RegCreateKeyExW(HKEY_CURRENT_USER, LXSS_ROOT_PATH, 0, nullptr,
-                              0, KEY_READ, nullptr, &m_lxssKey, nullptr);
-    if (rc != ERROR_SUCCESS)
-        throw std::runtime_error("Could not open LXSS registry key");
 }
 
-WslRegistry::~WslRegistry()
+void WslDistributionUpdate::checkNameAvailable() const
 {
-    if (m_lxssKey)
-        RegCloseKey(m_lxssKey);
+    WslRegistry registry;
+    WslDistribution match = registry.findDistByName(m_staged.m_name);
+    if (match.isValid() && match.uuid() != m_staged.m_uuid) {
+        throw std::runtime_error("Name \"" + WslUtil::toUtf8(m_staged.m_name)
+                                 + "\" is already in use");
+    }
 }
 
-std::vector<WslDistribution> WslRegistry::getDistributions() const
+std::vector<WslRegistryWrite> WslDistributionUpdate::writes(bool all) const
 {
-    std::vector<WslDistribution> result;
+    std::vector<WslRegistryWrite> result;
+    if (all || m_staged.m_name != m_dist.m_name)
+        result.push_back(encodeWstring(L"DistributionName", m_staged.m_name));
+    if (all || m_staged.m_path != m_dist.m_path)
+        result.push_back(encodeWstring(L"BasePath", m_staged.m_path));
+    if (all || m_staged.m_state != m_dist.m_state)
+        result.push_back(encodeDword(L"State", m_staged.m_state));
+    if (all || m_staged.m_version != m_dist.m_version)
+        result.push_back(encodeDword(L"Version", static_cast<uint32_t>(m_staged.m_version)));
+    if (all || m_staged.m_defaultUID != m_dist.m_defaultUID)
+        result.push_back(encodeDword(L"DefaultUid", m_staged.m_defaultUID));
+    if (all || m_staged.m_flags != m_dist.m_flags)
+        result.push_back(encodeDword(L"Flags", static_cast<uint32_t>(m_staged.m_flags)));
+    if (all || m_staged.m_kernelCmdLine != m_dist.m_kernelCmdLine)
+        result.push_back(encodeWstring(L"KernelCommandLine", m_staged.m_kernelCmdLine));
+    if (all || m_staged.m_packageFamilyName != m_dist.m_packageFamilyName)
+        result.push_back(encodeWstring(L"PackageFamilyName", m_staged.m_packageFamilyName));
+    if (all || m_staged.m_defaultEnvironment != m_dist.m_defaultEnvironment) {
+        result.push_back(encodeWstringArray(L"DefaultEnvironment",
+                                            m_staged.m_defaultEnvironment.toList()));
+    }
+    return result;
+}
 
-    wchar_t buffer[MAX_PATH];
-    DWORD idx = 0;
-    for ( ;; ) {
-        DWORD cchResult = MAX_PATH;
-        auto rc = RegEnumKeyExW(m_lxssKey, idx++, buffer, &cchResult, nullptr,
-                                nullptr, nullptr, nullptr);
-        if (rc == ERROR_NO_MORE_ITEMS)
-            break;
-        else if (rc != ERROR_SUCCESS)
-            throw std::runtime_error("Could not list distributions");
+void WslDistributionUpdate::commit()
+{
+    if (!m_dist.isValid())
+        throw std::runtime_error("Cannot set properties on invalid distributions");
+    if (isEmpty())
+        return;
+
+    const bool renamed = (m_staged.m_name != m_dist.m_name);
+    if (renamed)
+        checkNameAvailable();
+
+    if (!WslRegistryStore::current().writeValues(m_dist.m_uuid, writes(false)))
+        throw std::runtime_error("Could not write distribution properties");
+    if (renamed)
+        invalidateNameIndex();
+    m_dist = m_staged;
+}
+
+void WslDistributionUpdate::commitNew()
+{
+    if (!m_dist.isValid())
+        throw std::runtime_error("Cannot set properties on invalid distributions");
+    checkNameAvailable();
+
+    WslRegistryStore &store = WslRegistryStore::current();
+    const std::wstring tempKey = pendingKey(m_staged.m_uuid);
+    if (!store.writeValues(tempKey, writes(true))
+            || !store.renameKey(tempKey, m_staged.m_uuid)) {
+        store.deleteKey(tempKey);
+        throw std::runtime_error("Could not create distribution registry key");
+    }
+    invalidateNameIndex();
+    m_dist = m_staged;
+}
+
+
+WslRegistry::WslRegistry()
+{
+    if (!WslRegistryStore::current().createKey(std::wstring()))
+        throw std::runtime_error("Could not open LXSS registry key");
+}
 
-        auto uuid = std::wstring(buffer, cchResult);
+std::vector<WslDistribution> WslRegistry::getDistributions() const
+{
+    std::vector<WslDistribution> result;
+    for (const std::wstring &uuid : distributionUuids()) {
         auto distro = findDistByUuid(uuid);
         if (distro.isValid())
             result.emplace_back(std::move(distro));
@@ -353,7 +466,7 @@ std::vector<WslDistribution> WslRegistry::getDistributions() const
 
 WslDistribution WslRegistry::defaultDistribution() const
 {
-    std::wstring uuid = winregGetWstring(LXSS_ROOT_PATH, L"DefaultDistribution");
+    std::wstring uuid = winregGetWstring(std::wstring(), L"DefaultDistribution");
     if (uuid.empty())
         return WslDistribution();
     return findDistByUuid(uuid);
@@ -361,27 +474,21 @@ WslDistribution WslRegistry::defaultDistribution() const
 
 void WslRegistry::setDefaultDistribution(const std::wstring &uuid)
 {
-    winregSetWstring(LXSS_ROOT_PATH, L"DefaultDistribution", uuid);
+    winregSetWstring(std::wstring(), L"DefaultDistribution", uuid);
 }
 
 WslDistribution WslRegistry::findDistByName(const std::wstring &name) const
 {
-    wchar_t buffer[MAX_PATH];
-    DWORD idx = 0;
-    for ( ;; ) {
-        DWORD cchResult = MAX_PATH;
-        auto rc = RegEnumKeyExW(m_lxssKey, idx++, buffer, &cchResult, nullptr,
-                                nullptr, nullptr, nullptr);
-        if (rc == ERROR_NO_MORE_ITEMS)
+    // If the index missed a change, the name won't match and the index is
+    // rebuilt once
+    for (bool forceRebuild : {false, true}) {
+        const std::wstring uuid = indexedUuid(name, forceRebuild);
+        if (uuid.empty())
             break;
-        else if (rc != ERROR_SUCCESS)
-            throw std::runtime_error("Could not list distributions");
-
-        auto uuid = std::wstring(buffer, cchResult);
-        std::wstring regPath = LXSS_ROOT_PATH L"\\" + uuid;
-        auto distroName = winregGetWstring(regPath, L"DistributionName");
-        if (distroName == name)
-            return WslDistribution::loadFromRegistry(regPath);
+
+        WslDistribution dist = WslDistribution::loadFromRegistry(uuid);
+        if (dist.name() == name)
+            return dist;
     }
 
     return WslDistribution();
@@ -389,44 +496,222 @@ WslDistribution WslRegistry::findDistByName(const std::wstring &name) const
 
 WslDistribution WslRegistry::findDistByUuid(const std::wstring &uuid)
 {
-    return WslDistribution::loadFromRegistry(LXSS_ROOT_PATH L"\\" + uuid);
+    return WslDistribution::loadFromRegistry(uuid);
 }
 
-WslDistribution WslRegistry::registerDistribution(const std::wstring &name,
-                                                  const std::wstring &path)
+static void stageDefaults(WslDistributionUpdate &update, const std::wstring &name,
+                          const std::wstring &path)
 {
-    WslRegistry registry;
-    WslDistribution match = registry.findDistByName(name);
-    if (match.isValid())
-        throw std::runtime_error("Name \"" + WslUtil::toUtf8(name) + "\" is already in use");
-
-    // This just allocates a UUID, but doesn't create the registry node yet
-    auto dist = WslDistribution::create();
-    HKEY distKey;
-    std::wstring keyPath = LXSS_ROOT_PATH L"\\" + dist.uuid();
-    auto rc = RegCreateKeyExW(HKEY_CURRENT_USER, keyPath.c_str(), 0, nullptr,
-                              0, KEY_READ, nullptr, &distKey, nullptr);
-    if (rc != ERROR_SUCCESS)
-        throw std::runtime_error("Could not create distribution registry key");
-
-    // These populate the registry with the appropriate default values
-    dist.setName(name);
-    dist.setPath(path);
-    dist.setState(1);
-    dist.setVersion(WslApi::InvalidVersion);    // To be configured later by WslFs
-    dist.setDefaultUID(0);
-    dist.setFlags(WslApi::DistributionFlags_All);
-    dist.setKernelCmdLine(L"BOOT_IMAGE=/kernel init=/init");
-    dist.setEnvironment({
+    update.setName(name);
+    update.setPath(path);
+    update.setState(WslDistribution::StateInstalled);
+    update.setVersion(WslApi::InvalidVersion);  // To be configured later by WslFs
+    update.setDefaultUID(0);
+    update.setFlags(WslApi::DistributionFlags_All);
+    update.setKernelCmdLine(L"BOOT_IMAGE=/kernel init=/init");
+    update.setEnvironment({
         L"HOSTTYPE=x86_64",
         L"LANG=en_US.UTF-8",
         L"PATH=/usr/local/sbin:/usr/local/bin:/usr/sbin:/usr/bin:/sbin:/bin:/usr/games:/usr/local/games",
         L"TERM=xterm-256color"
     });
+}
+
+WslDistribution WslRegistry::registerDistribution(const std::wstring &name,
+                                                  const std::wstring &path)
+{
+    // This just allocates a UUID, but doesn't create the registry node yet
+    auto dist = WslDistribution::create();
+
+    WslDistributionUpdate update(dist);
+    stageDefaults(update, name, path);
+    update.commitNew();
+
+    WslDistribution match = defaultDistribution();
+    if (!match.isValid())
+        setDefaultDistribution(dist.uuid());
+
+    return dist;
+}
 
-    match = defaultDistribution();
+WslDistribution WslRegistry::cloneDistribution(const WslDistribution &source,
+                                               const std::wstring &name,
+                                               const std::wstring &path)
+{
+    auto dist = WslDistribution::create();
+
+    // The copied rootfs keeps the source's format and users
+    WslDistributionUpdate update(dist);
+    stageDefaults(update, name, path);
+    update.setVersion(source.version());
+    update.setDefaultUID(source.defaultUID());
+    update.setFlags(source.flags());
+    update.setKernelCmdLine(source.kernelCmdLine());
+    update.setEnvironment(source.defaultEnvironment());
+    update.commitNew();
+
+    WslDistribution match = defaultDistribution();
     if (!match.isValid())
         setDefaultDistribution(dist.uuid());
 
     return dist;
 }
+
+WslRegistryWatcher::WslRegistryWatcher(const Callback &callback)
+    : m_callback(callback)
+{
+    m_stopEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    if (!m_stopEvent)
+        throw std::runtime_error("Could not create event");
+
+    // The first scan only records the current state
+    auto watch = WslRegistryStore::current().watch();
+    scan();
+    m_thread = std::thread(&WslRegistryWatcher::run, this, std::move(watch));
+}
+
+WslRegistryWatcher::~WslRegistryWatcher()
+{
+    SetEvent(m_stopEvent);
+    if (m_thread.joinable())
+        m_thread.join();
+    CloseHandle(m_stopEvent);
+}
+
+WslRegistryChanges WslRegistryWatcher::scan()
+{
+    WslRegistryStore &store = WslRegistryStore::current();
+    WslRegistryChanges changes;
+
+    // Only the key versions are compared, so unchanged distributions
+    // aren't reloaded or reported
+    std::map<std::wstring, uint64_t> keyVersions;
+    for (const std::wstring &uuid : distributionUuids()) {
+        const uint64_t version = store.keyVersion(uuid);
+        keyVersions.emplace(uuid, version);
+
+        auto iter = m_keyVersions.find(uuid);
+        if (iter == m_keyVersions.end() || iter->second != version)
+            changes.changed.push_back(uuid);
+    }
+    for (const auto &[uuid, version] : m_keyVersions) {
+        if (keyVersions.find(uuid) == keyVersions.end())
+            changes.removed.push_back(uuid);
+    }
+    m_keyVersions = std::move(keyVersions);
+
+    const std::wstring defaultUuid = winregGetWstring(std::wstring(), L"DefaultDistribution");
+    changes.defaultChanged = (defaultUuid != m_defaultUuid);
+    m_defaultUuid = defaultUuid;
+
+    return changes;
+}
+
+void WslRegistryWatcher::run(std::unique_ptr<WslRegistryWatch> watch)
+{
+    const HANDLE waitHandles[] = {m_stopEvent, watch->event()};
+    for ( ;; ) {
+        const DWORD rc = WaitForMultipleObjects(2, waitHandles, FALSE, INFINITE);
+        if (rc != WAIT_OBJECT_0 + 1)
+            break;
+
+        try {
+            watch->rearm();
+        } catch (const std::runtime_error &) {
+            // Changes can no longer be seen, so stop watching
+            break;
+        }
+
+        try {
+            const WslRegistryChanges changes = scan();
+            if (!changes.isEmpty())
+                m_callback(changes);
+        } catch (const std::runtime_error &) {
+            // The next change will try again
+        }
+    }
+}
+
+void WslRegistry::unregisterDistribution(const std::wstring &uuid)
+{
+    if (uuid.empty())
+        throw std::invalid_argument("Invalid distribution ID");
+
+    if (!WslRegistryStore::current().deleteKey(uuid))
+        throw std::runtime_error("Could not delete distribution registry key");
+    invalidateNameIndex();
+
+    // Don't leave the default pointing at a distribution that doesn't exist
+    std::wstring defaultUuid = winregGetWstring(std::wstring(), L"DefaultDistribution");
+    if (defaultUuid == uuid) {
+        std::vector<WslDistribution> remaining = getDistributions();
+        setDefaultDistribution(remaining.empty() ? std::wstring() : remaining.front().uuid());
+    }
+}
+
+std::vector<WslBulkUpdateResult>
+WslRegistry::updateDistributions(const std::vector<WslDistribution> &dists,
+                                 const StageChanges &stage)
+{
+    std::vector<WslBulkUpdateResult> results(dists.size());
+
+    // Each commit is only a few small writes, so a handful of threads is
+    // enough to hide the latency of the registry calls
+    const std::vector<std::exception_ptr> errors =
+            WslUtil::parallelForEach(dists.size(), [&](size_t idx) {
+        WslBulkUpdateResult &result = results[idx];
+        result.dist = dists[idx];
+        WslDistributionUpdate update(result.dist);
+        stage(update);
+        update.commit();
+    }, 8);
+
+    for (size_t idx = 0; idx < errors.size(); ++idx) {
+        if (!errors[idx])
+            continue;
+        try {
+            std::rethrow_exception(errors[idx]);
+        } catch (const std::exception &err) {
+            results[idx].error = err.what();
+        } catch (...) {
+            results[idx].error = "Unknown error";
+        }
+    }
+    return results;
+}
+
+static bool isProcessRunning(DWORD pid)
+{
+    HANDLE hProcess = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, pid);
+    if (!hProcess)
+        return GetLastError() == ERROR_ACCESS_DENIED;
+
+    DWORD exitCode = 0;
+    const bool running = GetExitCodeProcess(hProcess, &exitCode) && exitCode == STILL_ACTIVE;
+    CloseHandle(hProcess);
+    return running;
+}
+
+void WslRegistry::removePendingRegistrations()
+{
+    WslRegistryStore &store = WslRegistryStore::current();
+    for (const std::wstring &key : store.subKeys(std::wstring())) {
+        if (!isPendingKey(key))
+            continue;
+
+        // Keys of processes which are still running may be in the middle
+        // of commitNew(), including our own.  Keys without a pid can only
+        // have been left by an older version.
+        const size_t pidEnd = key.find(L'~', 1);
+        if (pidEnd != std::wstring::npos && pidEnd > 1) {
+            const std::wstring pidText = key.substr(1, pidEnd - 1);
+            if (std::all_of(pidText.begin(), pidText.end(),
+                            [](wchar_t ch) { return ch >= L'0' && ch <= L'9'; })) {
+                const DWORD pid = wcstoul(pidText.c_str(), nullptr, 10);
+                if (pid == GetCurrentProcessId() || isProcessRunning(pid))
+                    continue;
+            }
+        }
+        store.deleteKey(key);
+    }
+}
@@ -16,25 +16,44 @@
 
 #pragma once
 
+#include "wslenviron.h"
 #include "wslwrap.h"
 
+#include <functional>
+#include <map>
+#include <memory>
 #include <string>
+#include <thread>
 #include <vector>
 
+class WslRegistryWatch;
+struct WslRegistryWrite;
+
 class WslDistribution
 {
 public:
+    enum State
+    {
+        StateInstalled = 1,
+        StateInstalling = 2,
+        StateUninstalling = 3,
+    };
+
     WslDistribution();
 
     bool isValid() const { return !m_uuid.empty(); }
 
+    bool operator==(const WslDistribution &other) const;
+    bool operator!=(const WslDistribution &other) const { return !(*this == other); }
+
     const std::wstring &name() const { return m_name; }
     std::wstring uuid() const { return m_uuid; }
 
     WslApi::Version version() const { return m_version; }
     uint32_t defaultUID() const { return m_defaultUID; }
     WslApi::DistributionFlags flags() const { return m_flags; }
-    const std::vector<std::wstring> &defaultEnvironment() const { return m_defaultEnvironment; }
+    std::vector<std::wstring> defaultEnvironment() const { return m_defaultEnvironment.toList(); }
+    const WslEnvironment &environment() const { return m_defaultEnvironment; }
 
     uint32_t state() const { return m_state; }
     const std::wstring &path() const { return m_path; }
@@ -43,6 +62,12 @@ public:
 
     std::wstring rootfsPath() const;
 
+    bool isVmMode() const { return m_flags & WslApi::DistributionFlags_VmMode; }
+
+    // The name of the virtual disk in the base path of a WSL2 distribution.
+    // This is read from the registry on each call.
+    std::wstring vhdFileName() const;
+
     void setName(const std::wstring &name);
     void setVersion(WslApi::Version version);
     void setDefaultUID(uint32_t uid);
@@ -57,16 +82,21 @@ public:
     void delEnvironment(const std::wstring &key);
     void setEnvironment(const std::vector<std::wstring> &env);
 
-    static WslDistribution loadFromRegistry(const std::wstring &path);
+    static WslDistribution loadFromRegistry(const std::wstring &uuid);
     static WslDistribution create();
 
+    // A distribution which is neither read from nor written to the registry,
+    // e.g. one saved by the UI.  Its properties can be filled in through
+    // WslDistributionUpdate::staged().
+    static WslDistribution detached(const std::wstring &uuid);
+
 private:
     // Available in WSL API
     std::wstring m_name;
     WslApi::Version m_version;
     uint32_t m_defaultUID;
     WslApi::DistributionFlags m_flags;
-    std::vector<std::wstring> m_defaultEnvironment;
+    WslEnvironment m_defaultEnvironment;
 
     // Available only in the Registry
     std::wstring m_uuid;
@@ -74,13 +104,80 @@ private:
     std::wstring m_path;
     std::wstring m_kernelCmdLine;
     std::wstring m_packageFamilyName;
+
+    friend class WslDistributionUpdate;
+};
+
+// Stages changes to several properties of a distribution, and writes them
+// to its registry key as one batch.  The distribution itself is only
+// modified once the batch has been written successfully.
+class WslDistributionUpdate
+{
+public:
+    explicit WslDistributionUpdate(WslDistribution &dist);
+
+    void setName(const std::wstring &name) { m_staged.m_name = name; }
+    void setVersion(WslApi::Version version) { m_staged.m_version = version; }
+    void setDefaultUID(uint32_t uid) { m_staged.m_defaultUID = uid; }
+    void setFlags(WslApi::DistributionFlags flags) { m_staged.m_flags = flags; }
+
+    void setState(uint32_t state) { m_staged.m_state = state; }
+    void setPath(const std::wstring &path) { m_staged.m_path = path; }
+    void setKernelCmdLine(const std::wstring &cmdline) { m_staged.m_kernelCmdLine = cmdline; }
+    void setPackageFamilyName(const std::wstring &packageFamilyName)
+    {
+        m_staged.m_packageFamilyName = packageFamilyName;
+    }
+
+    void addEnvironment(const std::wstring &key, const std::wstring &value)
+    {
+        m_staged.m_defaultEnvironment.set(key, value);
+    }
+    void delEnvironment(const std::wstring &key) { m_staged.m_defaultEnvironment.remove(key); }
+    void setEnvironment(const std::vector<std::wstring> &env)
+    {
+        m_staged.m_defaultEnvironment = WslEnvironment(env);
+    }
+    void setEnvironment(const WslEnvironment &env) { m_staged.m_defaultEnvironment = env; }
+
+    // The distribution with all changes staged so far
+    const WslDistribution &staged() const { return m_staged; }
+
+    // True if none of the staged values differ from the current ones
+    bool isEmpty() const { return m_staged == m_dist; }
+
+    // Writes only the properties which were changed
+    void commit();
+
+    // Registers a distribution from WslDistribution::create() with all of
+    // the staged properties.  They are written to a temporary key which is
+    // then renamed into place, so a partial registration is never visible.
+    void commitNew();
+
+private:
+    WslDistribution &m_dist;
+    WslDistribution m_staged;
+
+    void checkNameAvailable() const;
+    std::vector<WslRegistryWrite> writes(bool all) const;
+};
+
+// The outcome of a bulk update for one distribution
+struct WslBulkUpdateResult
+{
+    // With the changes applied, if they were written successfully
+    WslDistribution dist;
+    std::string error;
+
+    bool succeeded() const { return error.empty(); }
 };
 
 class WslRegistry
 {
 public:
     WslRegistry();
-    ~WslRegistry();
+
+    typedef std::function<void (WslDistributionUpdate &)> StageChanges;
 
     std::vector<WslDistribution> getDistributions() const;
     WslDistribution defaultDistribution() const;
@@ -91,7 +188,54 @@ public:
 
     WslDistribution registerDistribution(const std::wstring &name,
                                          const std::wstring &path);
+    WslDistribution cloneDistribution(const WslDistribution &source,
+                                      const std::wstring &name,
+                                      const std::wstring &path);
+    void unregisterDistribution(const std::wstring &uuid);
+
+    // Stages and commits the same changes for each of the distributions.
+    // The commits are spread over several threads, and a failure only
+    // affects the distribution it occurred on.  The results are in the
+    // same order as the distributions.
+    static std::vector<WslBulkUpdateResult>
+    updateDistributions(const std::vector<WslDistribution> &dists,
+                        const StageChanges &stage);
+
+    // Deletes the temporary keys of registrations which were interrupted,
+    // i.e. whose process has exited
+    void removePendingRegistrations();
+};
+
+struct WslRegistryChanges
+{
+    // Distributions which were added or modified
+    std::vector<std::wstring> changed;
+    std::vector<std::wstring> removed;
+    bool defaultChanged = false;
+
+    bool isEmpty() const { return changed.empty() && removed.empty() && !defaultChanged; }
+};
+
+// Watches the distribution keys from a background thread, and reports
+// which of them have changed since the last notification.  The callback
+// is called from the watcher thread.
+class WslRegistryWatcher
+{
+public:
+    typedef std::function<void (const WslRegistryChanges &)> Callback;
+
+    explicit WslRegistryWatcher(const Callback &callback);
+    ~WslRegistryWatcher();
 
 private:
-    HKEY m_lxssKey;
+    Callback m_callback;
+    HANDLE m_stopEvent;
+    std::thread m_thread;
+
+    // Only used by the watcher thread
+    std::map<std::wstring, uint64_t> m_keyVersions;
+    std::wstring m_defaultUuid;
+
+    WslRegistryChanges scan();
+    void run(std::unique_ptr<WslRegistryWatch> watch);
 };
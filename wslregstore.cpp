@@ -0,0 +1,740 @@
+/* This file is part of wslman.
+ *
+ * wslman is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * wslman is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with wslman.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "wslregstore.h"
+
+#include "wslutils.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#define LXSS_ROOT_PATH L"Software\\Microsoft\\Windows\\CurrentVersion\\Lxss"
+
+#define REGISTRY_FILE_MAGIC "WSLREG01"
+
+static std::unique_ptr<WslRegistryStore> s_currentStore;
+static std::mutex s_currentMutex;
+
+WslRegistryStore &WslRegistryStore::current()
+{
+    std::lock_guard<std::mutex> lock(s_currentMutex);
+    if (!s_currentStore)
+        s_currentStore = std::make_unique<WslWinRegistryStore>();
+    return *s_currentStore;
+}
+
+void WslRegistryStore::setCurrent(std::unique_ptr<WslRegistryStore> store)
+{
+    // This should only be done before anything is using the current store
+    std::lock_guard<std::mutex> lock(s_currentMutex);
+    s_currentStore = std::move(store);
+}
+
+
+WslWinRegistryStore::WslWinRegistryStore()
+    : m_lxssKey(), m_changeEvent(), m_changeCount()
+{
+    auto rc = RegCreateKeyExW(HKEY_CURRENT_USER, LXSS_ROOT_PATH, 0, nullptr, 0,
+                              KEY_READ | KEY_WRITE | DELETE, nullptr, &m_lxssKey, nullptr);
+    if (rc != ERROR_SUCCESS)
+        throw std::runtime_error("Could not open LXSS registry key");
+
+    m_changeEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    watchChanges();
+}
+
+WslWinRegistryStore::~WslWinRegistryStore()
+{
+    if (m_lxssKey)
+        RegCloseKey(m_lxssKey);
+    if (m_changeEvent)
+        CloseHandle(m_changeEvent);
+}
+
+void WslWinRegistryStore::watchChanges()
+{
+    // The notification is not tied to this thread, so it stays armed after
+    // a worker thread which called this has exited
+    auto rc = ERROR_INVALID_HANDLE;
+    if (m_changeEvent) {
+        rc = RegNotifyChangeKeyValue(m_lxssKey, TRUE,
+                        REG_NOTIFY_CHANGE_NAME | REG_NOTIFY_CHANGE_LAST_SET
+                            | REG_NOTIFY_THREAD_AGNOSTIC,
+                        m_changeEvent, TRUE);
+    }
+
+    // Without notifications, every check has to assume a change
+    if (rc != ERROR_SUCCESS && m_changeEvent) {
+        CloseHandle(m_changeEvent);
+        m_changeEvent = nullptr;
+    }
+}
+
+uint64_t WslWinRegistryStore::changeCount()
+{
+    std::lock_guard<std::mutex> lock(m_notifyMutex);
+    if (!m_changeEvent)
+        return ++m_changeCount;
+
+    if (WaitForSingleObject(m_changeEvent, 0) == WAIT_OBJECT_0) {
+        ResetEvent(m_changeEvent);
+        watchChanges();
+        ++m_changeCount;
+    }
+    return m_changeCount;
+}
+
+// The empty path refers to the Lxss key itself
+static LPCWSTR subKeyName(const std::wstring &path)
+{
+    return path.empty() ? nullptr : path.c_str();
+}
+
+bool WslWinRegistryStore::getValue(const std::wstring &path, const std::wstring &name,
+                                   DWORD type, std::vector<uint8_t> &data)
+{
+    DWORD valueType;
+    DWORD size = 0;
+    auto rc = RegGetValueW(m_lxssKey, subKeyName(path), name.c_str(),
+                           RRF_RT_ANY | RRF_NOEXPAND, &valueType, nullptr, &size);
+    for ( ;; ) {
+        if (rc != ERROR_SUCCESS || valueType != type)
+            return false;
+
+        data.resize(size);
+        rc = RegGetValueW(m_lxssKey, subKeyName(path), name.c_str(),
+                          RRF_RT_ANY | RRF_NOEXPAND, &valueType, data.data(), &size);
+        if (rc == ERROR_SUCCESS && valueType == type) {
+            data.resize(size);
+            return true;
+        }
+
+        // The value grew in the meantime, so try again with the new size
+        if (rc != ERROR_MORE_DATA)
+            return false;
+        rc = ERROR_SUCCESS;
+    }
+}
+
+bool WslWinRegistryStore::setValue(const std::wstring &path, const std::wstring &name,
+                                   DWORD type, const void *data, size_t size)
+{
+    auto rc = RegSetKeyValueW(m_lxssKey, subKeyName(path), name.c_str(),
+                              type, data, static_cast<DWORD>(size));
+    return rc == ERROR_SUCCESS;
+}
+
+bool WslWinRegistryStore::deleteValue(const std::wstring &path, const std::wstring &name)
+{
+    auto rc = RegDeleteKeyValueW(m_lxssKey, subKeyName(path), name.c_str());
+    return rc == ERROR_SUCCESS || rc == ERROR_FILE_NOT_FOUND;
+}
+
+bool WslWinRegistryStore::writeValues(const std::wstring &path,
+                                      const std::vector<WslRegistryWrite> &writes)
+{
+    HKEY key;
+    auto rc = RegCreateKeyExW(m_lxssKey, path.c_str(), 0, nullptr,
+                              0, KEY_SET_VALUE, nullptr, &key, nullptr);
+    if (rc != ERROR_SUCCESS)
+        return false;
+
+    for (const WslRegistryWrite &write : writes) {
+        if (write.type == REG_NONE) {
+            rc = RegDeleteValueW(key, write.name.c_str());
+            if (rc == ERROR_FILE_NOT_FOUND)
+                rc = ERROR_SUCCESS;
+        } else {
+            rc = RegSetValueExW(key, write.name.c_str(), 0, write.type,
+                                write.data.data(), static_cast<DWORD>(write.data.size()));
+        }
+        if (rc != ERROR_SUCCESS)
+            break;
+    }
+
+    RegCloseKey(key);
+    return rc == ERROR_SUCCESS;
+}
+
+bool WslWinRegistryStore::enumValues(const std::wstring &path, const ValueCallback &callback)
+{
+    HKEY key;
+    auto rc = RegOpenKeyExW(m_lxssKey, subKeyName(path), 0, KEY_QUERY_VALUE, &key);
+    if (rc != ERROR_SUCCESS)
+        return false;
+
+    // The buffers are kept between calls, so loading many keys in a row
+    // doesn't allocate for each of them
+    thread_local std::vector<wchar_t> nameBuffer;
+    thread_local std::vector<uint8_t> dataBuffer;
+
+    DWORD valueCount, maxNameLength, maxDataSize;
+    rc = RegQueryInfoKeyW(key, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr,
+                          &valueCount, &maxNameLength, &maxDataSize, nullptr, nullptr);
+    if (rc != ERROR_SUCCESS) {
+        RegCloseKey(key);
+        return false;
+    }
+    if (nameBuffer.size() < maxNameLength + 1)
+        nameBuffer.resize(maxNameLength + 1);
+    if (dataBuffer.size() < maxDataSize)
+        dataBuffer.resize(maxDataSize);
+
+    for (DWORD idx = 0; ; ) {
+        DWORD nameLength = static_cast<DWORD>(nameBuffer.size());
+        DWORD dataSize = static_cast<DWORD>(dataBuffer.size());
+        DWORD type;
+        rc = RegEnumValueW(key, idx, nameBuffer.data(), &nameLength, nullptr, &type,
+                           dataBuffer.data(), &dataSize);
+        if (rc == ERROR_NO_MORE_ITEMS)
+            break;
+        if (rc == ERROR_MORE_DATA) {
+            // A value was changed while we were reading
+            nameBuffer.resize(nameBuffer.size() * 2);
+            dataBuffer.resize(std::max<size_t>(dataSize, dataBuffer.size() * 2));
+            continue;
+        }
+        if (rc == ERROR_SUCCESS)
+            callback(nameBuffer.data(), type, dataBuffer.data(), dataSize);
+        ++idx;
+    }
+
+    RegCloseKey(key);
+    return true;
+}
+
+bool WslWinRegistryStore::createKey(const std::wstring &path)
+{
+    HKEY key;
+    auto rc = RegCreateKeyExW(m_lxssKey, path.c_str(), 0, nullptr,
+                              0, KEY_READ, nullptr, &key, nullptr);
+    if (rc != ERROR_SUCCESS)
+        return false;
+    RegCloseKey(key);
+    return true;
+}
+
+bool WslWinRegistryStore::deleteKey(const std::wstring &path)
+{
+    auto rc = RegDeleteTreeW(m_lxssKey, subKeyName(path));
+    return rc == ERROR_SUCCESS || rc == ERROR_FILE_NOT_FOUND;
+}
+
+bool WslWinRegistryStore::renameKey(const std::wstring &path, const std::wstring &newName)
+{
+    if (path.empty())
+        return false;
+
+    auto rc = RegRenameKey(m_lxssKey, path.c_str(), newName.c_str());
+    return rc == ERROR_SUCCESS;
+}
+
+static void fnv1a(uint64_t &hash, const void *data, size_t size)
+{
+    auto bytes = static_cast<const uint8_t *>(data);
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+}
+
+uint64_t WslWinRegistryStore::keyVersion(const std::wstring &path)
+{
+    // The key's LastWriteTime only has a resolution of a few milliseconds,
+    // so several writes in a row (e.g. by wsl.exe) could keep the same
+    // time.  Hashing the values catches every change that matters.
+    uint64_t hash = 14695981039346656037ULL;
+    bool found = enumValues(path, [&hash](const wchar_t *name, DWORD type,
+                                          const uint8_t *data, size_t size) {
+        fnv1a(hash, name, (wcslen(name) + 1) * sizeof(wchar_t));
+        fnv1a(hash, &type, sizeof(type));
+        fnv1a(hash, &size, sizeof(size));
+        fnv1a(hash, data, size);
+    });
+    if (!found)
+        return 0;
+    return hash ? hash : 1;
+}
+
+class WslWinRegistryWatch : public WslRegistryWatch
+{
+public:
+    explicit WslWinRegistryWatch(HKEY lxssKey)
+        : m_key()
+    {
+        // A separate handle, so the notification isn't shared with the store
+        auto rc = RegOpenKeyExW(lxssKey, nullptr, 0, KEY_NOTIFY, &m_key);
+        if (rc != ERROR_SUCCESS)
+            throw std::runtime_error("Could not open LXSS registry key");
+
+        m_event = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+        if (!m_event.isValid())
+            throw std::runtime_error("Could not create event");
+        rearm();
+    }
+
+    ~WslWinRegistryWatch() override
+    {
+        RegCloseKey(m_key);
+    }
+
+    HANDLE event() const override { return m_event.get(); }
+
+    void rearm() override
+    {
+        ResetEvent(m_event.get());
+        auto rc = RegNotifyChangeKeyValue(m_key, TRUE,
+                        REG_NOTIFY_CHANGE_NAME | REG_NOTIFY_CHANGE_LAST_SET
+                            | REG_NOTIFY_THREAD_AGNOSTIC,
+                        m_event.get(), TRUE);
+        if (rc != ERROR_SUCCESS)
+            throw std::runtime_error("Could not watch LXSS registry key");
+    }
+
+private:
+    HKEY m_key;
+    UniqueHandle m_event;
+};
+
+std::unique_ptr<WslRegistryWatch> WslWinRegistryStore::watch()
+{
+    return std::make_unique<WslWinRegistryWatch>(m_lxssKey);
+}
+
+std::vector<std::wstring> WslWinRegistryStore::subKeys(const std::wstring &path)
+{
+    HKEY key;
+    auto rc = RegOpenKeyExW(m_lxssKey, subKeyName(path), 0, KEY_READ, &key);
+    if (rc != ERROR_SUCCESS)
+        throw std::runtime_error("Could not open registry key");
+
+    std::vector<std::wstring> result;
+    wchar_t buffer[MAX_PATH];
+    DWORD idx = 0;
+    for ( ;; ) {
+        DWORD cchResult = MAX_PATH;
+        rc = RegEnumKeyExW(key, idx++, buffer, &cchResult, nullptr,
+                           nullptr, nullptr, nullptr);
+        if (rc == ERROR_NO_MORE_ITEMS)
+            break;
+        if (rc != ERROR_SUCCESS) {
+            RegCloseKey(key);
+            throw std::runtime_error("Could not list registry keys");
+        }
+        result.emplace_back(buffer, cchResult);
+    }
+
+    RegCloseKey(key);
+    return result;
+}
+
+
+WslMemoryRegistryStore::WslMemoryRegistryStore()
+    : m_changeCount()
+{ }
+
+uint64_t WslMemoryRegistryStore::changeCount()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_changeCount;
+}
+
+void WslMemoryRegistryStore::changed()
+{
+    ++m_changeCount;
+    for (HANDLE event : m_watchEvents)
+        SetEvent(event);
+}
+
+uint64_t WslMemoryRegistryStore::keyVersion(const std::wstring &path)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Key *key = findKey(path, false);
+    return key ? key->version : 0;
+}
+
+class WslMemoryRegistryWatch : public WslRegistryWatch
+{
+public:
+    explicit WslMemoryRegistryWatch(WslMemoryRegistryStore *store)
+        : m_store(store)
+    {
+        m_event = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+        if (!m_event.isValid())
+            throw std::runtime_error("Could not create event");
+
+        std::lock_guard<std::mutex> lock(m_store->m_mutex);
+        m_store->m_watchEvents.push_back(m_event.get());
+    }
+
+    ~WslMemoryRegistryWatch() override
+    {
+        std::lock_guard<std::mutex> lock(m_store->m_mutex);
+        auto &events = m_store->m_watchEvents;
+        events.erase(std::remove(events.begin(), events.end(), m_event.get()), events.end());
+    }
+
+    HANDLE event() const override { return m_event.get(); }
+    void rearm() override { ResetEvent(m_event.get()); }
+
+private:
+    WslMemoryRegistryStore *m_store;
+    UniqueHandle m_event;
+};
+
+std::unique_ptr<WslRegistryWatch> WslMemoryRegistryStore::watch()
+{
+    return std::make_unique<WslMemoryRegistryWatch>(this);
+}
+
+WslMemoryRegistryStore::Key *WslMemoryRegistryStore::findKey(const std::wstring &path,
+                                                             bool create)
+{
+    Key *key = &m_root;
+    size_t start = 0;
+    while (start < path.size()) {
+        size_t end = path.find(L'\\', start);
+        if (end == std::wstring::npos)
+            end = path.size();
+
+        const std::wstring name = path.substr(start, end - start);
+        auto iter = key->subKeys.find(name);
+        if (iter == key->subKeys.end()) {
+            if (!create)
+                return nullptr;
+            iter = key->subKeys.emplace(name, std::make_unique<Key>()).first;
+        }
+        key = iter->second.get();
+        start = end + 1;
+    }
+    return key;
+}
+
+bool WslMemoryRegistryStore::getValue(const std::wstring &path, const std::wstring &name,
+                                      DWORD type, std::vector<uint8_t> &data)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Key *key = findKey(path, false);
+    if (!key)
+        return false;
+
+    auto iter = key->values.find(name);
+    if (iter == key->values.end() || iter->second.type != type)
+        return false;
+
+    data = iter->second.data;
+    return true;
+}
+
+bool WslMemoryRegistryStore::setValue(const std::wstring &path, const std::wstring &name,
+                                      DWORD type, const void *data, size_t size)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Key *key = findKey(path, true);
+
+    Value &value = key->values[name];
+    value.type = type;
+    value.data.assign(static_cast<const uint8_t *>(data),
+                      static_cast<const uint8_t *>(data) + size);
+    changed();
+    key->version = m_changeCount;
+    return true;
+}
+
+bool WslMemoryRegistryStore::deleteValue(const std::wstring &path, const std::wstring &name)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Key *key = findKey(path, false);
+    if (key && key->values.erase(name) != 0) {
+        changed();
+        key->version = m_changeCount;
+    }
+    return true;
+}
+
+bool WslMemoryRegistryStore::writeValues(const std::wstring &path,
+                                         const std::vector<WslRegistryWrite> &writes)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Key *key = findKey(path, true);
+
+    for (const WslRegistryWrite &write : writes) {
+        if (write.type == REG_NONE) {
+            key->values.erase(write.name);
+        } else {
+            Value &value = key->values[write.name];
+            value.type = write.type;
+            value.data = write.data;
+        }
+    }
+    changed();
+    key->version = m_changeCount;
+    return true;
+}
+
+bool WslMemoryRegistryStore::createKey(const std::wstring &path)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!findKey(path, false)) {
+        findKey(path, true);
+        changed();
+    }
+    return true;
+}
+
+bool WslMemoryRegistryStore::deleteKey(const std::wstring &path)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const auto sep = path.rfind(L'\\');
+    Key *parent = (sep == std::wstring::npos) ? &m_root
+                                              : findKey(path.substr(0, sep), false);
+    if (path.empty()) {
+        m_root.values.clear();
+        m_root.subKeys.clear();
+        changed();
+    } else if (parent) {
+        const std::wstring name = (sep == std::wstring::npos) ? path : path.substr(sep + 1);
+        if (parent->subKeys.erase(name) != 0)
+            changed();
+    }
+    return true;
+}
+
+bool WslMemoryRegistryStore::renameKey(const std::wstring &path, const std::wstring &newName)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const auto sep = path.rfind(L'\\');
+    Key *parent = (sep == std::wstring::npos) ? &m_root
+                                              : findKey(path.substr(0, sep), false);
+    if (path.empty() || !parent)
+        return false;
+
+    const std::wstring name = (sep == std::wstring::npos) ? path : path.substr(sep + 1);
+    auto iter = parent->subKeys.find(name);
+    if (iter == parent->subKeys.end() || parent->subKeys.count(newName) != 0)
+        return false;
+
+    std::unique_ptr<Key> key = std::move(iter->second);
+    parent->subKeys.erase(iter);
+    changed();
+    key->version = m_changeCount;
+    parent->subKeys.emplace(newName, std::move(key));
+    return true;
+}
+
+bool WslMemoryRegistryStore::enumValues(const std::wstring &path,
+                                        const ValueCallback &callback)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Key *key = findKey(path, false);
+    if (!key)
+        return false;
+
+    for (const auto &[name, value] : key->values)
+        callback(name.c_str(), value.type, value.data.data(), value.data.size());
+    return true;
+}
+
+std::vector<std::wstring> WslMemoryRegistryStore::subKeys(const std::wstring &path)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Key *key = findKey(path, false);
+    if (!key)
+        throw std::runtime_error("Could not open registry key");
+
+    std::vector<std::wstring> result;
+    result.reserve(key->subKeys.size());
+    for (const auto &subKey : key->subKeys)
+        result.emplace_back(subKey.first);
+    return result;
+}
+
+
+WslFileRegistryStore::WslFileRegistryStore(const std::wstring &filename)
+    : m_filename(filename), m_dirty()
+{
+    load();
+}
+
+WslFileRegistryStore::~WslFileRegistryStore()
+{
+    try {
+        flush();
+    } catch (const std::runtime_error &) {
+        // Nothing more can be done about it here
+    }
+}
+
+// Reads from the mapped file, with bounds checking
+class RegistryFileReader
+{
+public:
+    RegistryFileReader(const uint8_t *data, size_t size)
+        : m_data(data), m_end(data + size) { }
+
+    const uint8_t *read(size_t size)
+    {
+        if (size > static_cast<size_t>(m_end - m_data))
+            throw std::runtime_error("Registry file is truncated");
+        const uint8_t *result = m_data;
+        m_data += size;
+        return result;
+    }
+
+    uint32_t readUInt32()
+    {
+        uint32_t value;
+        memcpy(&value, read(sizeof(value)), sizeof(value));
+        return value;
+    }
+
+    std::wstring readString()
+    {
+        const uint32_t length = readUInt32();
+        const uint8_t *chars = read(length * sizeof(wchar_t));
+        std::wstring result(length, L'\0');
+        memcpy(result.data(), chars, length * sizeof(wchar_t));
+        return result;
+    }
+
+private:
+    const uint8_t *m_data;
+    const uint8_t *m_end;
+};
+
+void WslFileRegistryStore::load()
+{
+    UniqueHandle hFile = CreateFileW(m_filename.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                                     nullptr, OPEN_EXISTING, 0, nullptr);
+    if (hFile == INVALID_HANDLE_VALUE) {
+        if (GetLastError() == ERROR_FILE_NOT_FOUND)
+            return;
+        throw std::runtime_error("Could not open registry file");
+    }
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(hFile.get(), &fileSize))
+        throw std::runtime_error("Could not open registry file");
+    if (fileSize.QuadPart == 0)
+        return;
+
+    UniqueHandle hMapping = CreateFileMappingW(hFile.get(), nullptr, PAGE_READONLY,
+                                               0, 0, nullptr);
+    if (!hMapping.isValid())
+        throw std::runtime_error("Could not map registry file");
+    auto view = static_cast<const uint8_t *>(MapViewOfFile(hMapping.get(), FILE_MAP_READ,
+                                                           0, 0, 0));
+    if (!view)
+        throw std::runtime_error("Could not map registry file");
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    try {
+        RegistryFileReader reader(view, static_cast<size_t>(fileSize.QuadPart));
+        if (memcmp(reader.read(8), REGISTRY_FILE_MAGIC, 8) != 0)
+            throw std::runtime_error("Invalid registry file");
+
+        const uint32_t keyCount = reader.readUInt32();
+        for (uint32_t i = 0; i < keyCount; ++i) {
+            Key *key = findKey(reader.readString(), true);
+            const uint32_t valueCount = reader.readUInt32();
+            for (uint32_t j = 0; j < valueCount; ++j) {
+                const std::wstring name = reader.readString();
+                Value &value = key->values[name];
+                value.type = reader.readUInt32();
+                const uint32_t size = reader.readUInt32();
+                const uint8_t *data = reader.read(size);
+                value.data.assign(data, data + size);
+            }
+        }
+    } catch (...) {
+        UnmapViewOfFile(view);
+        throw;
+    }
+    UnmapViewOfFile(view);
+}
+
+static void appendUInt32(std::vector<uint8_t> &image, uint32_t value)
+{
+    const auto bytes = reinterpret_cast<const uint8_t *>(&value);
+    image.insert(image.end(), bytes, bytes + sizeof(value));
+}
+
+static void appendString(std::vector<uint8_t> &image, const std::wstring &text)
+{
+    appendUInt32(image, static_cast<uint32_t>(text.size()));
+    const auto bytes = reinterpret_cast<const uint8_t *>(text.data());
+    image.insert(image.end(), bytes, bytes + text.size() * sizeof(wchar_t));
+}
+
+void WslFileRegistryStore::flush()
+{
+    std::vector<uint8_t> image(REGISTRY_FILE_MAGIC, REGISTRY_FILE_MAGIC + 8);
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_dirty)
+            return;
+
+        // Every key is written with its full path, so the file can be
+        // read back without recursion
+        appendUInt32(image, 0);
+        uint32_t keyCount = 0;
+        std::vector<std::pair<std::wstring, const Key *>> pending {{std::wstring(), &m_root}};
+        while (!pending.empty()) {
+            const auto [path, key] = pending.back();
+            pending.pop_back();
+
+            appendString(image, path);
+            appendUInt32(image, static_cast<uint32_t>(key->values.size()));
+            for (const auto &[name, value] : key->values) {
+                appendString(image, name);
+                appendUInt32(image, value.type);
+                appendUInt32(image, static_cast<uint32_t>(value.data.size()));
+                image.insert(image.end(), value.data.begin(), value.data.end());
+            }
+            ++keyCount;
+
+            for (const auto &[name, subKey] : key->subKeys)
+                pending.emplace_back(path.empty() ? name : path + L"\\" + name, subKey.get());
+        }
+        memcpy(image.data() + 8, &keyCount, sizeof(keyCount));
+        m_dirty = false;
+    }
+
+    // Replace the file as a whole, so a failed write can't corrupt it
+    const std::wstring tempFilename = m_filename + L".tmp";
+    try {
+        {
+            UniqueHandle hFile = CreateFileW(tempFilename.c_str(), GENERIC_WRITE, 0, nullptr,
+                                             CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+            if (hFile == INVALID_HANDLE_VALUE)
+                throw std::runtime_error("Could not create registry file");
+
+            DWORD nWritten;
+            if (!WriteFile(hFile.get(), image.data(), static_cast<DWORD>(image.size()),
+                           &nWritten, nullptr) || nWritten != image.size()) {
+                throw std::runtime_error("Could not write registry file");
+            }
+        }
+        if (!MoveFileExW(tempFilename.c_str(), m_filename.c_str(), MOVEFILE_REPLACE_EXISTING))
+            throw std::runtime_error("Could not replace registry file");
+    } catch (const std::runtime_error &) {
+        DeleteFileW(tempFilename.c_str());
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_dirty = true;
+        throw;
+    }
+}
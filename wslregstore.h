@@ -0,0 +1,223 @@
+/* This file is part of wslman.
+ *
+ * wslman is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * wslman is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with wslman.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Signals an event when the tree changes, for threads waiting for changes
+class WslRegistryWatch
+{
+public:
+    virtual ~WslRegistryWatch() { }
+
+    // A manual reset event, which is signalled after a change
+    virtual HANDLE event() const = 0;
+
+    // Resets the event and waits for the next change.  Call this before
+    // reading the tree, so changes made while reading aren't missed.
+    virtual void rearm() = 0;
+};
+
+// One value of a batch for WslRegistryStore::writeValues().  A type of
+// REG_NONE deletes the value instead.
+struct WslRegistryWrite
+{
+    std::wstring name;
+    DWORD type;
+    std::vector<uint8_t> data;
+};
+
+// Storage for the Lxss registry tree.  Key paths are relative to the Lxss
+// key, which itself is the empty path; subkeys are separated by '\'.
+// Values are stored as raw registry data, with the usual REG_* types.
+class WslRegistryStore
+{
+public:
+    virtual ~WslRegistryStore() { }
+
+    // Returns false if the value does not exist or has a different type
+    virtual bool getValue(const std::wstring &path, const std::wstring &name,
+                          DWORD type, std::vector<uint8_t> &data) = 0;
+    virtual bool setValue(const std::wstring &path, const std::wstring &name,
+                          DWORD type, const void *data, size_t size) = 0;
+    virtual bool deleteValue(const std::wstring &path, const std::wstring &name) = 0;
+
+    // Applies all writes to the key, which is created if necessary, through
+    // a single open of the key.  Watchers see the batch as one change.
+    virtual bool writeValues(const std::wstring &path,
+                             const std::vector<WslRegistryWrite> &writes) = 0;
+
+    // Reads all values of the key in one pass.  The data is only valid
+    // during the callback, which must not use the store itself.  Returns
+    // false if the key doesn't exist.
+    typedef std::function<void (const wchar_t *name, DWORD type,
+                                const uint8_t *data, size_t size)> ValueCallback;
+    virtual bool enumValues(const std::wstring &path, const ValueCallback &callback) = 0;
+
+    virtual bool createKey(const std::wstring &path) = 0;
+
+    // Deletes the key with all of its values and subkeys.  Deleting a key
+    // which doesn't exist is not an error.
+    virtual bool deleteKey(const std::wstring &path) = 0;
+
+    // Gives the key a new name below the same parent.  Fails if the new
+    // name already exists.
+    virtual bool renameKey(const std::wstring &path, const std::wstring &newName) = 0;
+
+    // Throws if the key can't be listed
+    virtual std::vector<std::wstring> subKeys(const std::wstring &path) = 0;
+
+    // Increases when anything in the tree may have changed, including
+    // changes made by other processes, so caches can tell they are stale.
+    // One increment may cover several changes.
+    virtual uint64_t changeCount() = 0;
+
+    // Changes whenever a value of the key is modified, and is 0 if the key
+    // doesn't exist.  This tells which keys to reload after a change.
+    virtual uint64_t keyVersion(const std::wstring &path) = 0;
+
+    // Throws if changes can't be watched
+    virtual std::unique_ptr<WslRegistryWatch> watch() = 0;
+
+    // The store used by WslRegistry and WslDistribution.  This is the real
+    // registry unless another store has been installed.
+    static WslRegistryStore &current();
+    static void setCurrent(std::unique_ptr<WslRegistryStore> store);
+};
+
+// HKEY_CURRENT_USER\Software\Microsoft\Windows\CurrentVersion\Lxss
+class WslWinRegistryStore : public WslRegistryStore
+{
+public:
+    WslWinRegistryStore();
+    ~WslWinRegistryStore() override;
+
+    bool getValue(const std::wstring &path, const std::wstring &name,
+                  DWORD type, std::vector<uint8_t> &data) override;
+    bool setValue(const std::wstring &path, const std::wstring &name,
+                  DWORD type, const void *data, size_t size) override;
+    bool deleteValue(const std::wstring &path, const std::wstring &name) override;
+    bool writeValues(const std::wstring &path,
+                     const std::vector<WslRegistryWrite> &writes) override;
+    bool enumValues(const std::wstring &path, const ValueCallback &callback) override;
+    bool createKey(const std::wstring &path) override;
+    bool deleteKey(const std::wstring &path) override;
+    bool renameKey(const std::wstring &path, const std::wstring &newName) override;
+    std::vector<std::wstring> subKeys(const std::wstring &path) override;
+    uint64_t changeCount() override;
+    uint64_t keyVersion(const std::wstring &path) override;
+    std::unique_ptr<WslRegistryWatch> watch() override;
+
+private:
+    // All paths are resolved relative to this, instead of from HKCU
+    HKEY m_lxssKey;
+
+    std::mutex m_notifyMutex;
+    HANDLE m_changeEvent;
+    uint64_t m_changeCount;
+
+    void watchChanges();
+};
+
+// A stand-in for the registry which only exists in memory, e.g. for tests
+// and benchmarks with synthetic distributions.
+class WslMemoryRegistryStore : public WslRegistryStore
+{
+public:
+    WslMemoryRegistryStore();
+
+    bool getValue(const std::wstring &path, const std::wstring &name,
+                  DWORD type, std::vector<uint8_t> &data) override;
+    bool setValue(const std::wstring &path, const std::wstring &name,
+                  DWORD type, const void *data, size_t size) override;
+    bool deleteValue(const std::wstring &path, const std::wstring &name) override;
+    bool writeValues(const std::wstring &path,
+                     const std::vector<WslRegistryWrite> &writes) override;
+    bool enumValues(const std::wstring &path, const ValueCallback &callback) override;
+    bool createKey(const std::wstring &path) override;
+    bool deleteKey(const std::wstring &path) override;
+    bool renameKey(const std::wstring &path, const std::wstring &newName) override;
+    std::vector<std::wstring> subKeys(const std::wstring &path) override;
+    uint64_t changeCount() override;
+    uint64_t keyVersion(const std::wstring &path) override;
+    std::unique_ptr<WslRegistryWatch> watch() override;
+
+protected:
+    // Registry names are case insensitive, but keep their original case
+    struct NameLess
+    {
+        bool operator()(const std::wstring &lhs, const std::wstring &rhs) const
+        {
+            return _wcsicmp(lhs.c_str(), rhs.c_str()) < 0;
+        }
+    };
+
+    struct Value
+    {
+        DWORD type;
+        std::vector<uint8_t> data;
+    };
+
+    struct Key
+    {
+        uint64_t version = 1;
+        std::map<std::wstring, Value, NameLess> values;
+        std::map<std::wstring, std::unique_ptr<Key>, NameLess> subKeys;
+    };
+
+    std::mutex m_mutex;
+    Key m_root;
+    uint64_t m_changeCount;
+    std::vector<HANDLE> m_watchEvents;
+
+    // These must be called with m_mutex held
+    Key *findKey(const std::wstring &path, bool create);
+    virtual void changed();
+
+    friend class WslMemoryRegistryWatch;
+};
+
+// An in-memory store which is loaded from a file through a read-only
+// mapping, and written back to the file by flush().  Changes are flushed
+// automatically when the store is destroyed.
+class WslFileRegistryStore : public WslMemoryRegistryStore
+{
+public:
+    explicit WslFileRegistryStore(const std::wstring &filename);
+    ~WslFileRegistryStore() override;
+
+    void flush();
+
+private:
+    std::wstring m_filename;
+    bool m_dirty;
+
+    void load();
+    void changed() override
+    {
+        WslMemoryRegistryStore::changed();
+        m_dirty = true;
+    }
+};
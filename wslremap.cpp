@@ -0,0 +1,409 @@
+/* This file is part of wslman.
+ *
+ * wslman is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * wslman is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with wslman.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "wslremap.h"
+
+#include "wslregistry.h"
+#include "wslui.h"
+#include <QLabel>
+#include <QLineEdit>
+#include <QPlainTextEdit>
+#include <QDialogButtonBox>
+#include <QPushButton>
+#include <QGridLayout>
+#include <QProgressDialog>
+#include <QMessageBox>
+#include <QRegularExpression>
+
+#include <algorithm>
+
+#if QT_VERSION >= QT_VERSION_CHECK(5, 14, 0)
+#   define QT_SKIP_EMPTY_PARTS Qt::SkipEmptyParts
+#else
+#   define QT_SKIP_EMPTY_PARTS QString::SkipEmptyParts
+#endif
+
+WslRemap::WslRemap(const WslFs &rootfs)
+    : m_rootfs(rootfs), m_dryRun(), m_entriesScanned(), m_entriesChanged(),
+      m_entriesSkipped()
+{ }
+
+bool WslRemap::addModeRule(const QString &rule)
+{
+    ModeRule modeRule;
+    if (!parseModeRule(rule, modeRule))
+        return false;
+    m_modeRules.push_back(std::move(modeRule));
+    return true;
+}
+
+bool WslRemap::isValidModeRule(const QString &rule)
+{
+    ModeRule modeRule;
+    return parseModeRule(rule, modeRule);
+}
+
+bool WslRemap::parseModeRule(const QString &rule, ModeRule &modeRule)
+{
+    const QStringList parts = rule.split(QRegularExpression(QStringLiteral("\\s+")),
+                                         QT_SKIP_EMPTY_PARTS);
+    if (parts.size() < 2 || parts.size() > 3)
+        return false;
+
+    if (parts[0] == QLatin1String("a"))
+        modeRule.scope = AllEntries;
+    else if (parts[0] == QLatin1String("f"))
+        modeRule.scope = FilesOnly;
+    else if (parts[0] == QLatin1String("d"))
+        modeRule.scope = DirectoriesOnly;
+    else
+        return false;
+
+    const QString &mode = parts[1];
+    if (mode.size() < 2 || !QStringLiteral("+-=").contains(mode[0]))
+        return false;
+    modeRule.op = mode[0].toLatin1();
+    bool ok;
+    modeRule.bits = mode.mid(1).toUInt(&ok, 8);
+    if (!ok || (modeRule.bits & ~07777u) != 0)
+        return false;
+
+    if (parts.size() == 3) {
+        if (!parts[2].startsWith(QLatin1Char('/')))
+            return false;
+        modeRule.unixPath = parts[2].toStdString();
+        while (!modeRule.unixPath.empty() && modeRule.unixPath.back() == '/')
+            modeRule.unixPath.pop_back();
+    }
+    return true;
+}
+
+void WslRemap::run(const std::atomic<bool> *cancel)
+{
+    m_entriesScanned = 0;
+    m_entriesChanged = 0;
+    m_entriesSkipped = 0;
+
+    m_linkedFiles.clear();
+
+    remapEntry(m_rootfs.rootPath(), "/");
+    m_rootfs.walk("", [&](const WslDirEntry &dirEntry) {
+        remapEntry(dirEntry.ntPath, dirEntry.unixPath);
+    }, cancel);
+
+    for (auto &[fileId, linked] : m_linkedFiles) {
+        if (cancel && *cancel)
+            break;
+        UniqueHandle hFile = openEntry(linked.ntPath, linked.unixPaths.front());
+        remapFile(hFile.get(), linked.unixPaths);
+    }
+    m_linkedFiles.clear();
+}
+
+WslOwnership WslRemap::remapped(const WslOwnership &ownership,
+                                const std::vector<std::string> &unixPaths) const
+{
+    WslOwnership result = ownership;
+
+    auto uid = m_uidMap.find(ownership.uid);
+    if (uid != m_uidMap.end())
+        result.uid = uid->second;
+    auto gid = m_gidMap.find(ownership.gid);
+    if (gid != m_gidMap.end())
+        result.gid = gid->second;
+
+    const uint32_t type = ownership.mode & LX_IFMT;
+    if (type == LX_IFLNK)
+        return result;
+
+    for (const ModeRule &rule : m_modeRules) {
+        if (rule.scope == FilesOnly && type == LX_IFDIR)
+            continue;
+        if (rule.scope == DirectoriesOnly && type != LX_IFDIR)
+            continue;
+        if (!rule.unixPath.empty()
+                && std::none_of(unixPaths.begin(), unixPaths.end(), [&](const std::string &path) {
+                    return path == rule.unixPath || starts_with(path, rule.unixPath + "/");
+                })) {
+            continue;
+        }
+
+        switch (rule.op) {
+        case '+':
+            result.mode |= rule.bits;
+            break;
+        case '-':
+            result.mode &= ~rule.bits;
+            break;
+        case '=':
+            result.mode = (result.mode & ~07777u) | rule.bits;
+            break;
+        }
+    }
+    return result;
+}
+
+UniqueHandle WslRemap::openEntry(const std::wstring &ntPath, const std::string &unixPath) const
+{
+    DWORD access = FILE_READ_EA | FILE_READ_ATTRIBUTES;
+    if (!m_dryRun)
+        access |= FILE_WRITE_EA;
+    UniqueHandle hFile = CreateFileW(ntPath.c_str(), access,
+                                     FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                     nullptr, OPEN_EXISTING,
+                                     FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OPEN_REPARSE_POINT,
+                                     nullptr);
+    if (hFile == INVALID_HANDLE_VALUE)
+        throw std::runtime_error("Could not open " + unixPath);
+    return hFile;
+}
+
+void WslRemap::remapEntry(const std::wstring &ntPath, const std::string &unixPath)
+{
+    UniqueHandle hFile = openEntry(ntPath, unixPath);
+    ++m_entriesScanned;
+
+    // Remapping each name of a hard linked file would apply the maps again,
+    // e.g. swapping two UIDs back, and race on the same extended attributes
+    BY_HANDLE_FILE_INFORMATION info;
+    if (GetFileInformationByHandle(hFile.get(), &info) && info.nNumberOfLinks > 1
+            && !(info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+        const uint64_t fileId = (uint64_t(info.nFileIndexHigh) << 32) | info.nFileIndexLow;
+        std::lock_guard<std::mutex> lock(m_linkedMutex);
+        LinkedFile &linked = m_linkedFiles[fileId];
+        if (linked.ntPath.empty())
+            linked.ntPath = ntPath;
+        linked.unixPaths.push_back(unixPath);
+        return;
+    }
+
+    remapFile(hFile.get(), {unixPath});
+}
+
+void WslRemap::remapFile(HANDLE hFile, const std::vector<std::string> &unixPaths)
+{
+    WslOwnership ownership;
+    try {
+        ownership = m_rootfs.getOwnership(hFile);
+    } catch (const std::runtime_error &) {
+        // Files created from Windows have no LX metadata to remap
+        ++m_entriesSkipped;
+        return;
+    }
+
+    const WslOwnership newOwnership = remapped(ownership, unixPaths);
+    if (newOwnership == ownership)
+        return;
+
+    if (!m_dryRun)
+        m_rootfs.setOwnership(hFile, newOwnership);
+    ++m_entriesChanged;
+}
+
+static bool parseIdMap(const QString &text, std::vector<std::pair<uint32_t, uint32_t>> &map)
+{
+    const QStringList pairs = text.split(QLatin1Char(','), QT_SKIP_EMPTY_PARTS);
+    for (const QString &pair : pairs) {
+        const QStringList ids = pair.split(QLatin1Char(':'));
+        if (ids.size() != 2)
+            return false;
+        bool fromOk, toOk;
+        const uint32_t from = ids[0].trimmed().toUInt(&fromOk);
+        const uint32_t to = ids[1].trimmed().toUInt(&toOk);
+        if (!fromOk || !toOk)
+            return false;
+        map.emplace_back(from, to);
+    }
+    return true;
+}
+
+WslRemapDialog::WslRemapDialog(const QString &uuid, QWidget *parent)
+    : QDialog(parent), m_uuid(uuid.toStdWString())
+{
+    setWindowTitle(tr("Remap Ownership and Permissions"));
+
+    auto lblUidMap = new QLabel(tr("&UID map:"), this);
+    m_uidMap = new QLineEdit(this);
+    m_uidMap->setPlaceholderText(tr("old:new, e.g. 1000:1001, 1001:1000"));
+    lblUidMap->setBuddy(m_uidMap);
+
+    auto lblGidMap = new QLabel(tr("&GID map:"), this);
+    m_gidMap = new QLineEdit(this);
+    m_gidMap->setPlaceholderText(tr("old:new, e.g. 1000:1001, 1001:1000"));
+    lblGidMap->setBuddy(m_gidMap);
+
+    auto lblModeRules = new QLabel(tr("&Mode rules:"), this);
+    m_modeRules = new QPlainTextEdit(this);
+    m_modeRules->setPlaceholderText(
+            tr("One rule per line: <a|f|d> <+|-|=><octal mode> [path]\n"
+               "e.g. \"f -0022 /home\" or \"d =0755 /srv\""));
+    lblModeRules->setBuddy(m_modeRules);
+
+    auto buttons = new QDialogButtonBox(QDialogButtonBox::Ok | QDialogButtonBox::Cancel, this);
+    buttons->button(QDialogButtonBox::Ok)->setText(tr("&Remap"));
+    connect(buttons, &QDialogButtonBox::accepted, this, &QDialog::accept);
+    connect(buttons, &QDialogButtonBox::rejected, this, &QDialog::reject);
+
+    auto layout = new QGridLayout(this);
+    int layoutRow = 0;
+    layout->addWidget(lblUidMap, layoutRow, 0);
+    layout->addWidget(m_uidMap, layoutRow, 1);
+    layout->addWidget(lblGidMap, ++layoutRow, 0);
+    layout->addWidget(m_gidMap, layoutRow, 1);
+    layout->addWidget(lblModeRules, ++layoutRow, 0, Qt::AlignTop);
+    layout->addWidget(m_modeRules, layoutRow, 1);
+    layout->addItem(new QSpacerItem(0, 10), ++layoutRow, 0, 1, 2);
+    layout->addWidget(buttons, ++layoutRow, 0, 1, 2);
+
+    resize(480, 300);
+}
+
+bool WslRemapDialog::validate()
+{
+    std::vector<std::pair<uint32_t, uint32_t>> idMap;
+    if (!parseIdMap(m_uidMap->text(), idMap)) {
+        QMessageBox::critical(this, QString(), tr("Invalid UID map"));
+        return false;
+    }
+    if (!parseIdMap(m_gidMap->text(), idMap)) {
+        QMessageBox::critical(this, QString(), tr("Invalid GID map"));
+        return false;
+    }
+
+    const QStringList rules = m_modeRules->toPlainText().split(QLatin1Char('\n'));
+    for (const QString &rule : rules) {
+        if (rule.trimmed().isEmpty())
+            continue;
+        if (!WslRemap::isValidModeRule(rule)) {
+            QMessageBox::critical(this, QString(), tr("Invalid mode rule: %1").arg(rule));
+            return false;
+        }
+    }
+    if (idMap.empty() && m_modeRules->toPlainText().trimmed().isEmpty()) {
+        QMessageBox::critical(this, QString(), tr("Nothing to remap"));
+        return false;
+    }
+
+    // A running instance caches the metadata, and may write it back over
+    // the remapped attributes
+    WslDistribution dist;
+    try {
+        dist = WslRegistry::findDistByUuid(m_uuid);
+    } catch (const std::runtime_error &err) {
+        QMessageBox::critical(this, QString(),
+                tr("Failed to query WSL distributions: %1").arg(err.what()));
+        return false;
+    }
+    if (!dist.isValid()) {
+        QMessageBox::critical(this, QString(), tr("The distribution no longer exists"));
+        return false;
+    }
+    if (!WslUi::checkStopped(this, dist,
+            tr("The distribution is running.  Stop it with \"wsl --terminate\" "
+               "before remapping it."))) {
+        return false;
+    }
+    return true;
+}
+
+bool WslRemapDialog::applySettings(WslRemap &remap) const
+{
+    std::vector<std::pair<uint32_t, uint32_t>> uidMap, gidMap;
+    if (!parseIdMap(m_uidMap->text(), uidMap) || !parseIdMap(m_gidMap->text(), gidMap))
+        return false;
+    for (const auto &[from, to] : uidMap)
+        remap.mapUid(from, to);
+    for (const auto &[from, to] : gidMap)
+        remap.mapGid(from, to);
+
+    const QStringList rules = m_modeRules->toPlainText().split(QLatin1Char('\n'));
+    for (const QString &rule : rules) {
+        if (!rule.trimmed().isEmpty() && !remap.addModeRule(rule))
+            return false;
+    }
+    return true;
+}
+
+void WslRemapDialog::performRemap()
+{
+    QProgressDialog progressDialog(parentWidget());
+    progressDialog.setWindowModality(Qt::WindowModal);
+    progressDialog.setMinimumDuration(0);
+    progressDialog.setMaximum(0);
+
+    std::atomic<bool> cancel = false;
+    try {
+        WslDistribution dist = WslRegistry::findDistByUuid(m_uuid);
+        if (!dist.isValid())
+            throw std::runtime_error("Distribution no longer exists");
+
+        WslRemap remap{WslFs(dist.rootfsPath())};
+        if (!applySettings(remap))
+            throw std::runtime_error("Invalid remap settings");
+
+        // Count what would change first, so the user can back out before
+        // anything is modified
+        remap.setDryRun(true);
+        WslUtil::runInBackground([&]() { remap.run(&cancel); }, [&]() {
+            if (progressDialog.wasCanceled())
+                cancel = true;
+            progressDialog.setLabelText(tr("Scanning files... (%1 found)")
+                                        .arg(remap.entriesScanned()));
+        });
+        progressDialog.reset();
+        if (cancel)
+            return;
+
+        if (remap.entriesChanged() == 0) {
+            QMessageBox::information(parentWidget(), windowTitle(),
+                    tr("No entries need to be changed."));
+            return;
+        }
+        const auto answer = QMessageBox::question(parentWidget(), windowTitle(),
+                tr("%1 of %2 entries will be changed.  Make sure the distribution "
+                   "is not running before continuing.\n\nApply the changes now?")
+                .arg(remap.entriesChanged()).arg(remap.entriesScanned()));
+        if (answer != QMessageBox::Yes)
+            return;
+
+        const uint64_t expected = remap.entriesScanned();
+        remap.setDryRun(false);
+        progressDialog.setMaximum(static_cast<int>(expected));
+        WslUtil::runInBackground([&]() { remap.run(&cancel); }, [&]() {
+            if (progressDialog.wasCanceled())
+                cancel = true;
+            progressDialog.setLabelText(tr("Updating files... (%1 changed)")
+                                        .arg(remap.entriesChanged()));
+            progressDialog.setValue(static_cast<int>(
+                        std::min(remap.entriesScanned(), expected)));
+        });
+        progressDialog.reset();
+        if (cancel) {
+            QMessageBox::warning(parentWidget(), windowTitle(),
+                    tr("Remapping was canceled after %1 entries were changed.")
+                    .arg(remap.entriesChanged()));
+            return;
+        }
+
+        QMessageBox::information(parentWidget(), windowTitle(),
+                tr("Changed %1 of %2 entries.").arg(remap.entriesChanged())
+                .arg(remap.entriesScanned()));
+    } catch (const std::runtime_error &err) {
+        QMessageBox::critical(parentWidget(), QString(),
+                tr("Failed to remap distribution files: %1").arg(err.what()));
+    }
+}
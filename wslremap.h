@@ -0,0 +1,120 @@
+/* This file is part of wslman.
+ *
+ * wslman is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * wslman is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with wslman.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "wslfs.h"
+
+#include <QDialog>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+class QLineEdit;
+class QPlainTextEdit;
+
+// Offline equivalent of chown -R and chmod -R over a whole rootfs, for
+// renumbering users and groups or fixing up permissions without starting
+// the distribution.
+class WslRemap
+{
+public:
+    enum Scope
+    {
+        AllEntries,
+        FilesOnly,
+        DirectoriesOnly,
+    };
+
+    WslRemap(const WslFs &rootfs);
+
+    void mapUid(uint32_t from, uint32_t to) { m_uidMap[from] = to; }
+    void mapGid(uint32_t from, uint32_t to) { m_gidMap[from] = to; }
+
+    // Mode rules are applied in order, to the permission bits of every
+    // entry in scope below the (optional) path.  Symlinks are never changed.
+    // A file with several hard links is remapped once, and is below the path
+    // if any of its names is.
+    // Rules have the form "<a|f|d> <+|-|=><octal> [path]", e.g. "f -0022 /home"
+    // Returns false if the rule is malformed.
+    bool addModeRule(const QString &rule);
+    static bool isValidModeRule(const QString &rule);
+
+    // Count the entries which would change, without modifying anything
+    void setDryRun(bool dryRun) { m_dryRun = dryRun; }
+    bool isDryRun() const { return m_dryRun; }
+
+    void run(const std::atomic<bool> *cancel = nullptr);
+
+    // These may be queried from another thread while run() is active
+    uint64_t entriesScanned() const { return m_entriesScanned; }
+    uint64_t entriesChanged() const { return m_entriesChanged; }
+    uint64_t entriesSkipped() const { return m_entriesSkipped; }
+
+private:
+    struct ModeRule
+    {
+        Scope scope;
+        char op;
+        uint32_t bits;
+        std::string unixPath;
+    };
+
+    WslFs m_rootfs;
+    std::unordered_map<uint32_t, uint32_t> m_uidMap;
+    std::unordered_map<uint32_t, uint32_t> m_gidMap;
+    std::vector<ModeRule> m_modeRules;
+    bool m_dryRun;
+
+    std::atomic<uint64_t> m_entriesScanned;
+    std::atomic<uint64_t> m_entriesChanged;
+    std::atomic<uint64_t> m_entriesSkipped;
+
+    // Files with more than one hard link, by file ID, which are remapped
+    // after the walk has found all of their names
+    struct LinkedFile
+    {
+        std::wstring ntPath;
+        std::vector<std::string> unixPaths;
+    };
+    std::mutex m_linkedMutex;
+    std::unordered_map<uint64_t, LinkedFile> m_linkedFiles;
+
+    static bool parseModeRule(const QString &rule, ModeRule &modeRule);
+    WslOwnership remapped(const WslOwnership &ownership,
+                          const std::vector<std::string> &unixPaths) const;
+    UniqueHandle openEntry(const std::wstring &ntPath, const std::string &unixPath) const;
+    void remapEntry(const std::wstring &ntPath, const std::string &unixPath);
+    void remapFile(HANDLE hFile, const std::vector<std::string> &unixPaths);
+};
+
+class WslRemapDialog : public QDialog
+{
+public:
+    WslRemapDialog(const QString &uuid, QWidget *parent = nullptr);
+
+    bool validate();
+    void performRemap();
+
+private:
+    std::wstring m_uuid;
+    QLineEdit *m_uidMap;
+    QLineEdit *m_gidMap;
+    QPlainTextEdit *m_modeRules;
+
+    bool applySettings(WslRemap &remap) const;
+};
@@ -0,0 +1,276 @@
+/* This file is part of wslman.
+ *
+ * wslman is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * wslman is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with wslman.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "wslrunner.h"
+
+#include "wslwrap.h"
+
+#include <algorithm>
+#include <cstring>
+
+#define PIPE_BUFFER_SIZE    65536
+
+// How long to keep reading after the command exits, in case something it
+// started in the background still holds the pipes open
+#define DRAIN_TIMEOUT_MS    500
+
+WslRingBuffer::WslRingBuffer(size_t capacity)
+    : m_buffer(capacity), m_written()
+{ }
+
+void WslRingBuffer::append(const char *data, size_t size)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const size_t capacity = m_buffer.size();
+    if (size > capacity) {
+        m_written += size - capacity;
+        data += size - capacity;
+        size = capacity;
+    }
+
+    const size_t offset = static_cast<size_t>(m_written % capacity);
+    const size_t first = std::min(size, capacity - offset);
+    memcpy(m_buffer.data() + offset, data, first);
+    memcpy(m_buffer.data(), data + first, size - first);
+    m_written += size;
+}
+
+std::string WslRingBuffer::readFrom(uint64_t &position) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const size_t capacity = m_buffer.size();
+    if (m_written - position > capacity)
+        position = m_written - capacity;
+
+    const auto size = static_cast<size_t>(m_written - position);
+    const size_t offset = static_cast<size_t>(position % capacity);
+    const size_t first = std::min(size, capacity - offset);
+    std::string result(size, '\0');
+    memcpy(result.data(), m_buffer.data() + offset, first);
+    memcpy(result.data() + first, m_buffer.data(), size - first);
+    position = m_written;
+    return result;
+}
+
+uint64_t WslRingBuffer::bytesWritten() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_written;
+}
+
+HANDLE WslDistLauncher::launch(const std::wstring &command, HANDLE hStdIn,
+                               HANDLE hStdOut, HANDLE hStdErr)
+{
+    HANDLE hProcess = nullptr;
+    auto rc = WslApi::Launch(m_distName.c_str(), command.c_str(), FALSE, hStdIn,
+                             hStdOut, hStdErr, &hProcess);
+    if (FAILED(rc))
+        throw std::runtime_error("Failed to launch " + WslUtil::toUtf8(m_distName));
+    return hProcess;
+}
+
+HANDLE WslProcessLauncher::launch(const std::wstring &command, HANDLE hStdIn,
+                                  HANDLE hStdOut, HANDLE hStdErr)
+{
+    // Only pass down this command's own handles, so concurrent runners don't
+    // keep each other's pipes open
+    SIZE_T attrSize = 0;
+    InitializeProcThreadAttributeList(nullptr, 1, 0, &attrSize);
+    auto attrBuffer = std::make_unique<std::byte[]>(attrSize);
+    auto attrList = reinterpret_cast<LPPROC_THREAD_ATTRIBUTE_LIST>(attrBuffer.get());
+    if (!InitializeProcThreadAttributeList(attrList, 1, 0, &attrSize))
+        throw std::runtime_error("Failed to initialize process attributes");
+
+    HANDLE inherit[] = {hStdIn, hStdOut, hStdErr};
+    UpdateProcThreadAttribute(attrList, 0, PROC_THREAD_ATTRIBUTE_HANDLE_LIST,
+                              inherit, sizeof(inherit), nullptr, nullptr);
+
+    STARTUPINFOEXW startupInfo;
+    memset(&startupInfo, 0, sizeof(startupInfo));
+    startupInfo.StartupInfo.cb = sizeof(startupInfo);
+    startupInfo.StartupInfo.dwFlags = STARTF_USESTDHANDLES;
+    startupInfo.StartupInfo.hStdInput = hStdIn;
+    startupInfo.StartupInfo.hStdOutput = hStdOut;
+    startupInfo.StartupInfo.hStdError = hStdErr;
+    startupInfo.lpAttributeList = attrList;
+
+    std::wstring commandLine = command;
+    PROCESS_INFORMATION processInfo;
+    const BOOL started = CreateProcessW(nullptr, commandLine.data(), nullptr, nullptr, TRUE,
+                                        EXTENDED_STARTUPINFO_PRESENT | CREATE_NO_WINDOW,
+                                        nullptr, nullptr, &startupInfo.StartupInfo,
+                                        &processInfo);
+    DeleteProcThreadAttributeList(attrList);
+    if (!started)
+        throw std::runtime_error("Failed to start " + WslUtil::toUtf8(command));
+
+    CloseHandle(processInfo.hThread);
+    return processInfo.hProcess;
+}
+
+// Anonymous pipes don't support overlapped I/O, so use a uniquely named
+// pipe with an overlapped server end and an inheritable client end.
+static UniqueHandle createOutputPipe(UniqueHandle &hClient)
+{
+    static std::atomic<unsigned> pipeSerial = 0;
+    wchar_t name[64];
+    swprintf(name, std::size(name), L"\\\\.\\pipe\\wslman-%lu-%u",
+             GetCurrentProcessId(), ++pipeSerial);
+
+    UniqueHandle hServer = CreateNamedPipeW(name,
+                                PIPE_ACCESS_INBOUND | FILE_FLAG_OVERLAPPED
+                                    | FILE_FLAG_FIRST_PIPE_INSTANCE,
+                                PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT
+                                    | PIPE_REJECT_REMOTE_CLIENTS,
+                                1, 0, PIPE_BUFFER_SIZE, 0, nullptr);
+    if (hServer == INVALID_HANDLE_VALUE)
+        throw std::runtime_error("Failed to create output pipe");
+
+    SECURITY_ATTRIBUTES security = {sizeof(security), nullptr, TRUE};
+    hClient = CreateFileW(name, GENERIC_WRITE, 0, &security, OPEN_EXISTING,
+                          FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (hClient == INVALID_HANDLE_VALUE)
+        throw std::runtime_error("Failed to connect output pipe");
+
+    return hServer;
+}
+
+WslCommandRunner::WslCommandRunner(std::unique_ptr<WslLauncher> launcher, size_t bufferSize)
+    : m_launcher(std::move(launcher)), m_output(bufferSize), m_finished()
+{ }
+
+WslCommandRunner::~WslCommandRunner()
+{
+    if (m_readerThread.joinable()) {
+        if (!m_finished)
+            TerminateProcess(m_process.get(), 1);
+        m_readerThread.join();
+    }
+}
+
+void WslCommandRunner::start(const std::wstring &command)
+{
+    if (m_readerThread.joinable())
+        throw std::logic_error("Command already started");
+
+    // The write ends are closed again once the command has them, so the
+    // pipes report EOF when the command exits.
+    UniqueHandle hStdOut, hStdErr;
+    m_stdoutPipe = createOutputPipe(hStdOut);
+    m_stderrPipe = createOutputPipe(hStdErr);
+
+    SECURITY_ATTRIBUTES security = {sizeof(security), nullptr, TRUE};
+    UniqueHandle hStdIn = CreateFileW(L"NUL", GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                      &security, OPEN_EXISTING, 0, nullptr);
+    if (hStdIn == INVALID_HANDLE_VALUE)
+        throw std::runtime_error("Failed to open NUL device");
+
+    m_process = m_launcher->launch(command, hStdIn.get(), hStdOut.get(), hStdErr.get());
+    m_finished = false;
+    m_readerThread = std::thread(&WslCommandRunner::readOutput, this);
+}
+
+DWORD WslCommandRunner::wait()
+{
+    if (m_readerThread.joinable())
+        m_readerThread.join();
+
+    DWORD exitCode = 0;
+    WaitForSingleObject(m_process.get(), INFINITE);
+    if (!GetExitCodeProcess(m_process.get(), &exitCode))
+        throw std::runtime_error("Failed to get command exit status");
+    return exitCode;
+}
+
+void WslCommandRunner::readOutput()
+{
+    struct PendingRead
+    {
+        HANDLE hPipe;
+        UniqueHandle event;
+        OVERLAPPED overlapped;
+        bool open;
+        char buffer[PIPE_BUFFER_SIZE];
+    };
+    auto reads = std::make_unique<PendingRead[]>(2);
+    reads[0].hPipe = m_stdoutPipe.get();
+    reads[1].hPipe = m_stderrPipe.get();
+
+    // A read that completes immediately still signals its event, so all
+    // results are collected in the wait loop below
+    auto beginRead = [](PendingRead &read) {
+        memset(&read.overlapped, 0, sizeof(read.overlapped));
+        read.overlapped.hEvent = read.event.get();
+        if (!ReadFile(read.hPipe, read.buffer, PIPE_BUFFER_SIZE, nullptr, &read.overlapped)
+                && GetLastError() != ERROR_IO_PENDING) {
+            read.open = false;
+        }
+    };
+    for (size_t i = 0; i < 2; ++i) {
+        reads[i].event = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+        reads[i].open = true;
+        beginRead(reads[i]);
+    }
+
+    bool processExited = false;
+    for ( ;; ) {
+        HANDLE waitHandles[3];
+        PendingRead *waitReads[2];
+        DWORD readCount = 0;
+        for (size_t i = 0; i < 2; ++i) {
+            if (reads[i].open) {
+                waitHandles[readCount] = reads[i].event.get();
+                waitReads[readCount++] = &reads[i];
+            }
+        }
+        if (readCount == 0)
+            break;
+
+        DWORD waitCount = readCount;
+        if (!processExited)
+            waitHandles[waitCount++] = m_process.get();
+        const DWORD rc = WaitForMultipleObjects(waitCount, waitHandles, FALSE,
+                                                processExited ? DRAIN_TIMEOUT_MS : INFINITE);
+        if (rc == WAIT_TIMEOUT || rc == WAIT_FAILED)
+            break;
+
+        const DWORD index = rc - WAIT_OBJECT_0;
+        if (index == readCount) {
+            processExited = true;
+            continue;
+        }
+
+        PendingRead &read = *waitReads[index];
+        DWORD nRead = 0;
+        if (GetOverlappedResult(read.hPipe, &read.overlapped, &nRead, FALSE)) {
+            m_output.append(read.buffer, nRead);
+            beginRead(read);
+        } else {
+            read.open = false;
+        }
+    }
+
+    // Reads which are still pending must finish before their buffers go away
+    for (size_t i = 0; i < 2; ++i) {
+        if (reads[i].open) {
+            DWORD nRead;
+            CancelIoEx(reads[i].hPipe, &reads[i].overlapped);
+            GetOverlappedResult(reads[i].hPipe, &reads[i].overlapped, &nRead, TRUE);
+        }
+    }
+    m_finished = true;
+}
@@ -0,0 +1,112 @@
+/* This file is part of wslman.
+ *
+ * wslman is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * wslman is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with wslman.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "wslutils.h"
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Fixed size buffer holding the most recent output of a command.  Readers
+// keep their own position, and skip ahead if the data they have not read
+// yet was already overwritten.
+class WslRingBuffer
+{
+public:
+    WslRingBuffer(size_t capacity);
+
+    void append(const char *data, size_t size);
+
+    // Returns everything written since position, and advances position
+    std::string readFrom(uint64_t &position) const;
+
+    uint64_t bytesWritten() const;
+
+private:
+    mutable std::mutex m_mutex;
+    std::vector<char> m_buffer;
+    uint64_t m_written;
+};
+
+// Starts a command with the given standard handles, and returns a handle
+// to the started process.
+class WslLauncher
+{
+public:
+    virtual ~WslLauncher() = default;
+    virtual HANDLE launch(const std::wstring &command, HANDLE hStdIn, HANDLE hStdOut,
+                          HANDLE hStdErr) = 0;
+};
+
+// Runs the command inside a distribution with WslApi::Launch
+class WslDistLauncher : public WslLauncher
+{
+public:
+    WslDistLauncher(const std::wstring &distName) : m_distName(distName) { }
+
+    HANDLE launch(const std::wstring &command, HANDLE hStdIn, HANDLE hStdOut,
+                  HANDLE hStdErr) override;
+
+private:
+    std::wstring m_distName;
+};
+
+// Runs the command as a local Windows process instead, which is useful for
+// exercising WslCommandRunner without a distribution.
+class WslProcessLauncher : public WslLauncher
+{
+public:
+    HANDLE launch(const std::wstring &command, HANDLE hStdIn, HANDLE hStdOut,
+                  HANDLE hStdErr) override;
+};
+
+// Runs a command with its stdout and stderr connected to pipes, which are
+// read with overlapped I/O on a dedicated thread into a ring buffer.  Each
+// runner is independent, so any number of commands (in any number of
+// distributions) can run concurrently.
+class WslCommandRunner
+{
+public:
+    WslCommandRunner(std::unique_ptr<WslLauncher> launcher, size_t bufferSize = 1024 * 1024);
+    ~WslCommandRunner();
+
+    WslCommandRunner(const WslCommandRunner &) = delete;
+    WslCommandRunner &operator=(const WslCommandRunner &) = delete;
+
+    void start(const std::wstring &command);
+
+    // Waits for the command to exit and all of its output to be read
+    DWORD wait();
+    bool isFinished() const { return m_finished; }
+
+    const WslRingBuffer &output() const { return m_output; }
+
+private:
+    std::unique_ptr<WslLauncher> m_launcher;
+    WslRingBuffer m_output;
+    UniqueHandle m_process;
+    UniqueHandle m_stdoutPipe;
+    UniqueHandle m_stderrPipe;
+    std::thread m_readerThread;
+    std::atomic<bool> m_finished;
+
+    void readOutput();
+};
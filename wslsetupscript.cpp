@@ -0,0 +1,225 @@
+/* This file is part of wslman.
+ *
+ * wslman is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * wslman is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with wslman.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "wslsetupscript.h"
+
+#include "wslrunner.h"
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+
+#define SETUP_SCRIPT_PATH   "/tmp/wslman-setup.sh"
+#define SETUP_STATUS_PATH   "/tmp/wslman-setup.status"
+
+static std::string shellQuote(const QString &text)
+{
+    std::string quoted = "'";
+    for (char ch : text.toStdString()) {
+        if (ch == '\'')
+            quoted.append("'\\''");
+        else
+            quoted.push_back(ch);
+    }
+    quoted.push_back('\'');
+    return quoted;
+}
+
+static std::wstring wslError(HRESULT rc)
+{
+    wchar_t buffer[512];
+    swprintf(buffer, std::size(buffer), L"0x%08x", rc);
+    FormatMessageW(FORMAT_MESSAGE_FROM_SYSTEM, nullptr, rc,
+                   MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
+                   buffer, static_cast<DWORD>(std::size(buffer)), nullptr);
+    return buffer;
+}
+
+// Length of text without a trailing incomplete UTF-8 sequence, which is
+// kept back until the rest of it arrives
+static size_t completeUtf8Length(const std::string &text)
+{
+    for (size_t back = 1; back <= 4 && back <= text.size(); ++back) {
+        const auto ch = static_cast<unsigned char>(text[text.size() - back]);
+        if ((ch & 0xc0) == 0x80)
+            continue;
+        const size_t length = (ch >= 0xf0) ? 4 : (ch >= 0xe0) ? 3 : (ch >= 0xc0) ? 2 : 1;
+        return (length > back) ? text.size() - back : text.size();
+    }
+    return text.size();
+}
+
+void WslSetupScript::addStep(const QString &command, const QString &label, bool interactive)
+{
+    m_steps.push_back({command, label, interactive, -1});
+}
+
+bool WslSetupScript::hasCapturedSteps() const
+{
+    return std::any_of(m_steps.begin(), m_steps.end(),
+                       [](const Step &step) { return !step.interactive; });
+}
+
+std::string WslSetupScript::script(bool interactive) const
+{
+    // Each step runs in its own shell, so a syntax error in one line can't
+    // break the rest of the script
+    std::string script = "#!/bin/sh\n"
+                         "# Generated by wslman to run the post-install setup\n"
+                         "status=" SETUP_STATUS_PATH "\n";
+    for (size_t i = 0; i < m_steps.size(); ++i) {
+        const Step &step = m_steps[i];
+        if (step.interactive != interactive)
+            continue;
+        script += "printf '%s\\n' " + shellQuote(QStringLiteral("Running %1").arg(step.command))
+                + "\n/bin/sh -c " + shellQuote(step.command)
+                + "\necho \"" + std::to_string(i + 1) + " $?\" >> \"$status\"\n";
+    }
+    return script;
+}
+
+void WslSetupScript::writeScript(const WslFs &rootfs, bool interactive) const
+{
+    DeleteFileW(rootfs.path(SETUP_SCRIPT_PATH).c_str());
+
+    using namespace std::chrono;
+    const auto now = static_cast<uint64_t>(
+                duration_cast<seconds>(system_clock::now().time_since_epoch()).count());
+    const WslAttr attr(LX_IFREG | 0700, 0, 0, now, 0, now, 0, now, 0);
+    UniqueHandle hScript = rootfs.createFile(SETUP_SCRIPT_PATH, attr);
+    if (hScript == INVALID_HANDLE_VALUE)
+        throw std::runtime_error("Could not create " SETUP_SCRIPT_PATH);
+
+    const std::string content = script(interactive);
+    DWORD nWritten;
+    if (!WriteFile(hScript.get(), content.data(), static_cast<DWORD>(content.size()),
+                   &nWritten, nullptr))
+        throw std::runtime_error("Could not write " SETUP_SCRIPT_PATH);
+}
+
+bool WslSetupScript::run(const std::wstring &distName, const WslFs &rootfs,
+                         const LogOutput &logOutput)
+{
+    if (m_steps.empty())
+        return true;
+
+    DeleteFileW(rootfs.path(SETUP_STATUS_PATH).c_str());
+
+    bool launched = true;
+    if (hasCapturedSteps()) {
+        writeScript(rootfs, false);
+        launched = runCaptured(distName, logOutput);
+    }
+    if (std::any_of(m_steps.begin(), m_steps.end(),
+                    [](const Step &step) { return step.interactive; })) {
+        writeScript(rootfs, true);
+        launched = runInteractive(distName) && launched;
+    }
+    readStatus(rootfs);
+
+    for (const Step &step : m_steps) {
+        if (step.exitStatus < 0) {
+            wprintf(L"%s did not run\n", step.label.toStdWString().c_str());
+        } else if (step.exitStatus != 0) {
+            wprintf(L"%s returned exit status %d\n", step.label.toStdWString().c_str(),
+                    step.exitStatus);
+        }
+    }
+
+    DeleteFileW(rootfs.path(SETUP_SCRIPT_PATH).c_str());
+    DeleteFileW(rootfs.path(SETUP_STATUS_PATH).c_str());
+    return launched;
+}
+
+bool WslSetupScript::runCaptured(const std::wstring &distName, const LogOutput &logOutput)
+{
+    WslCommandRunner runner(std::make_unique<WslDistLauncher>(distName));
+    try {
+        runner.start(L"/bin/sh " SETUP_SCRIPT_PATH);
+    } catch (const std::runtime_error &err) {
+        wprintf(L"Running setup commands failed: %S\n", err.what());
+        return false;
+    }
+
+    uint64_t position = 0;
+    std::string pending;
+    WslUtil::runInBackground([&]() { runner.wait(); }, [&]() {
+        pending += runner.output().readFrom(position);
+        const size_t length = completeUtf8Length(pending);
+        if (length == 0)
+            return;
+        if (logOutput) {
+            QString text = QString::fromUtf8(pending.data(), static_cast<int>(length));
+            logOutput(text.remove(QLatin1Char('\r')));
+        }
+        pending.erase(0, length);
+    });
+    return true;
+}
+
+bool WslSetupScript::runInteractive(const std::wstring &distName)
+{
+    DWORD exitCode;
+    auto rc = WslApi::LaunchInteractive(distName.c_str(), L"/bin/sh " SETUP_SCRIPT_PATH,
+                                        TRUE, &exitCode);
+    if (FAILED(rc)) {
+        std::wstring errMessage = wslError(rc);
+        wprintf(L"Running setup commands failed: %s\n", errMessage.c_str());
+        return false;
+    }
+    return true;
+}
+
+void WslSetupScript::readStatus(const WslFs &rootfs)
+{
+    UniqueHandle hStatus = rootfs.openFile(SETUP_STATUS_PATH);
+    if (hStatus == INVALID_HANDLE_VALUE)
+        return;
+
+    std::string status;
+    for ( ;; ) {
+        char buffer[4096];
+        DWORD nRead = 0;
+        if (!ReadFile(hStatus.get(), buffer, static_cast<DWORD>(std::size(buffer)),
+                      &nRead, nullptr) || nRead == 0) {
+            break;
+        }
+        status.append(buffer, nRead);
+    }
+
+    // One "<step> <exit status>" line per completed step
+    std::string_view lines = status;
+    while (!lines.empty()) {
+        const size_t end = lines.find('\n');
+        const std::string_view line = lines.substr(0, end);
+        lines.remove_prefix(end == lines.npos ? lines.size() : end + 1);
+
+        const size_t space = line.find(' ');
+        if (space == line.npos)
+            continue;
+        size_t index;
+        int exitStatus;
+        auto indexResult = std::from_chars(line.data(), line.data() + space, index);
+        auto statusResult = std::from_chars(line.data() + space + 1,
+                                            line.data() + line.size(), exitStatus);
+        if (indexResult.ec != std::errc() || statusResult.ec != std::errc()
+                || index < 1 || index > m_steps.size()) {
+            continue;
+        }
+        m_steps[index - 1].exitStatus = exitStatus;
+    }
+}
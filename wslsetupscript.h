@@ -0,0 +1,65 @@
+/* This file is part of wslman.
+ *
+ * wslman is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * wslman is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with wslman.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "wslfs.h"
+
+#include <QString>
+#include <functional>
+#include <vector>
+
+// Collects the post-install setup commands into a shell script in the
+// rootfs, so they all run with a single launch of the distribution.  The
+// script records the exit status of each step in a status file, which is
+// read back afterwards to report the result of every step.
+//
+// Steps which need the console (e.g. to prompt for a password) run in a
+// second, interactive launch after the others.  The output of the other
+// steps is captured and passed to the log callback instead.
+class WslSetupScript
+{
+public:
+    struct Step
+    {
+        QString command;
+        QString label;
+        bool interactive;
+        int exitStatus;     // -1 if the step never ran
+    };
+
+    // The label names the step in progress and failure messages
+    void addStep(const QString &command, const QString &label, bool interactive = false);
+    bool isEmpty() const { return m_steps.empty(); }
+    bool hasCapturedSteps() const;
+    const std::vector<Step> &steps() const { return m_steps; }
+
+    // The log callback is called on the calling thread as output arrives.
+    // Returns false if the distribution could not be launched at all.
+    typedef std::function<void (const QString &)> LogOutput;
+    bool run(const std::wstring &distName, const WslFs &rootfs,
+             const LogOutput &logOutput = nullptr);
+
+private:
+    std::vector<Step> m_steps;
+
+    std::string script(bool interactive) const;
+    void writeScript(const WslFs &rootfs, bool interactive) const;
+    bool runCaptured(const std::wstring &distName, const LogOutput &logOutput);
+    bool runInteractive(const std::wstring &distName);
+    void readStatus(const WslFs &rootfs);
+};
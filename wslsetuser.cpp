@@ -18,8 +18,10 @@
 
 #include "wslregistry.h"
 #include "wslutils.h"
+#include "wslusers.h"
 #include <QLabel>
 #include <QLineEdit>
+#include <QCompleter>
 #include <QDialogButtonBox>
 #include <QVBoxLayout>
 
@@ -32,6 +34,18 @@ WslSetUser::WslSetUser(const std::wstring &distName, QWidget *parent)
     m_userEntry = new QLineEdit(this);
     lblUserEntry->setBuddy(m_userEntry);
 
+    auto userDb = WslUserDb::forDistribution(distName);
+    if (userDb) {
+        QStringList usernames;
+        for (const WslUser &user : userDb->users())
+            usernames << QString::fromUtf8(user.name.data(), static_cast<int>(user.name.size()));
+        usernames.sort(Qt::CaseInsensitive);
+
+        auto completer = new QCompleter(usernames, this);
+        completer->setCaseSensitivity(Qt::CaseInsensitive);
+        m_userEntry->setCompleter(completer);
+    }
+
     auto buttons = new QDialogButtonBox(QDialogButtonBox::Ok | QDialogButtonBox::Cancel, this);
     connect(buttons, &QDialogButtonBox::accepted, this, &QDialog::accept);
     connect(buttons, &QDialogButtonBox::rejected, this, &QDialog::reject);
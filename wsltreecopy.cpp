@@ -0,0 +1,373 @@
+/* This file is part of wslman.
+ *
+ * wslman is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * wslman is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with wslman.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "wsltreecopy.h"
+
+#include <winioctl.h>
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#define COPY_BLOCK_SIZE     (1024 * 1024)
+
+// Block clones must be a multiple of the cluster size, and each request
+// must stay below 4 GiB.
+#define MAX_CLONE_SIZE      (0x80000000ULL)
+
+static std::wstring rootPrefix(const WslFs &rootfs)
+{
+    std::wstring root = rootfs.rootPath();
+    if (!root.empty() && root.back() == L'\\')
+        root.pop_back();
+    return root;
+}
+
+static uint32_t blockCloneSize(const WslFs &source, const WslFs &target)
+{
+    UniqueHandle hSource = CreateFileW(source.rootPath().c_str(), FILE_READ_ATTRIBUTES,
+                                       FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                                       OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr);
+    UniqueHandle hTarget = CreateFileW(target.rootPath().c_str(), FILE_READ_ATTRIBUTES,
+                                       FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                                       OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr);
+    if (hSource == INVALID_HANDLE_VALUE || hTarget == INVALID_HANDLE_VALUE)
+        return 0;
+
+    // Blocks can only be shared within a single volume
+    BY_HANDLE_FILE_INFORMATION sourceInfo, targetInfo;
+    if (!GetFileInformationByHandle(hSource.get(), &sourceInfo)
+            || !GetFileInformationByHandle(hTarget.get(), &targetInfo)
+            || sourceInfo.dwVolumeSerialNumber != targetInfo.dwVolumeSerialNumber)
+        return 0;
+
+    DWORD fsFlags = 0;
+    if (!GetVolumeInformationByHandleW(hTarget.get(), nullptr, 0, nullptr, nullptr,
+                                       &fsFlags, nullptr, 0)
+            || (fsFlags & FILE_SUPPORTS_BLOCK_REFCOUNTING) == 0)
+        return 0;
+
+    FSCTL_GET_INTEGRITY_INFORMATION_BUFFER integrity;
+    DWORD nReturned;
+    if (!DeviceIoControl(hTarget.get(), FSCTL_GET_INTEGRITY_INFORMATION, nullptr, 0,
+                         &integrity, sizeof(integrity), &nReturned, nullptr))
+        return 0;
+    return integrity.ClusterSizeInBytes;
+}
+
+static bool cloneFileData(HANDLE hSource, HANDLE hTarget, uint64_t size,
+                          uint32_t clusterSize)
+{
+    FILE_END_OF_FILE_INFO eofInfo;
+    eofInfo.EndOfFile.QuadPart = static_cast<LONGLONG>(size);
+    if (!SetFileInformationByHandle(hTarget, FileEndOfFileInfo, &eofInfo, sizeof(eofInfo)))
+        return false;
+
+    for (uint64_t offset = 0; offset < size; offset += MAX_CLONE_SIZE) {
+        // The final cluster may extend past the end of the file
+        uint64_t count = std::min<uint64_t>(size - offset, MAX_CLONE_SIZE);
+        count = (count + clusterSize - 1) / clusterSize * clusterSize;
+
+        DUPLICATE_EXTENTS_DATA extents;
+        extents.FileHandle = hSource;
+        extents.SourceFileOffset.QuadPart = static_cast<LONGLONG>(offset);
+        extents.TargetFileOffset.QuadPart = static_cast<LONGLONG>(offset);
+        extents.ByteCount.QuadPart = static_cast<LONGLONG>(count);
+        DWORD nReturned;
+        if (!DeviceIoControl(hTarget, FSCTL_DUPLICATE_EXTENTS_TO_FILE, &extents,
+                             sizeof(extents), nullptr, 0, &nReturned, nullptr))
+            return false;
+    }
+    return true;
+}
+
+WslTreeCopy::WslTreeCopy(const WslFs &source, const std::wstring &targetPath)
+    : m_source(source), m_target(targetPath), m_blockCloneSize(),
+      m_entriesFound(), m_entriesCopied(), m_bytesCopied()
+{
+    if (m_source.version() == WslApi::InvalidVersion)
+        throw std::runtime_error("Unsupported source rootfs format");
+}
+
+std::wstring WslTreeCopy::sourcePath(const std::wstring &relPath) const
+{
+    return rootPrefix(m_source) + relPath;
+}
+
+std::wstring WslTreeCopy::targetPath(const std::wstring &relPath) const
+{
+    return rootPrefix(m_target) + relPath;
+}
+
+bool WslTreeCopy::isLinkedPath(const std::string &unixPath) const
+{
+    for (const std::string &linkedPath : m_linkedPaths) {
+        if (starts_with(unixPath, linkedPath)
+                && (unixPath.size() == linkedPath.size() || linkedPath.back() == '/'
+                    || unixPath[linkedPath.size()] == '/'))
+            return true;
+    }
+    return false;
+}
+
+void WslTreeCopy::run(const std::atomic<bool> *cancel)
+{
+    // The copy always keeps the format of the source, since the entry names
+    // and metadata are copied without translation.
+    m_target = WslFs::create(m_target.rootPath(), m_source.version());
+    m_blockCloneSize = blockCloneSize(m_source, m_target);
+    m_entriesFound = 0;
+    m_entriesCopied = 0;
+    m_bytesCopied = 0;
+
+    copyDirectory(std::wstring(), "/");
+
+    // Directories are created as soon as they are found, so the walker can
+    // descend into them, and files are copied by the walker threads while
+    // the enumeration continues.  Names which share a file ID are hard links
+    // to the same file: the first name found is copied, and the remaining
+    // names are linked to it once all copies have finished.
+    const size_t rootLength = rootPrefix(m_source).size();
+    std::mutex entriesMutex;
+    std::unordered_map<uint64_t, std::wstring> copiedFiles;
+    std::vector<std::pair<std::wstring, FileEntry>> links;
+    std::vector<std::pair<std::wstring, std::string>> directories;
+    m_source.walk("", [&](const WslDirEntry &entry) {
+        ++m_entriesFound;
+        std::wstring relPath = entry.ntPath.substr(rootLength);
+        if (entry.isDirectory() && !entry.isReparsePoint()) {
+            copyDirectory(relPath, entry.unixPath);
+            ++m_entriesCopied;
+
+            std::lock_guard<std::mutex> lock(entriesMutex);
+            directories.emplace_back(std::move(relPath), entry.unixPath);
+            return;
+        }
+
+        FileEntry file{std::move(relPath), entry.unixPath, entry.fileId,
+                       entry.size, entry.attributes};
+        {
+            std::lock_guard<std::mutex> lock(entriesMutex);
+            auto copied = copiedFiles.find(file.fileId);
+            if (copied != copiedFiles.end()) {
+                links.emplace_back(copied->second, std::move(file));
+                return;
+            }
+            copiedFiles.emplace(file.fileId, file.relPath);
+        }
+        copyFile(file);
+        ++m_entriesCopied;
+    }, cancel);
+    if (cancel && *cancel)
+        return;
+
+    WslUtil::parallelFor(links.size(), [&](size_t index) {
+        const std::wstring firstPath = targetPath(links[index].first);
+        const FileEntry &link = links[index].second;
+        if (!CreateHardLinkW(targetPath(link.relPath).c_str(), firstPath.c_str(), nullptr))
+            throw std::runtime_error("Could not create hard link " + link.unixPath);
+        ++m_entriesCopied;
+    }, cancel);
+    if (cancel && *cancel)
+        return;
+
+    // Creating the directory contents updated the directory timestamps, so
+    // they can only be restored once everything else is done.
+    directories.emplace_back(std::wstring(), "/");
+    WslUtil::parallelFor(directories.size(), [&](size_t index) {
+        copyTimes(directories[index].first, directories[index].second);
+    }, cancel);
+}
+
+std::vector<std::string> WslTreeCopy::verify(const std::atomic<bool> *cancel) const
+{
+    struct Summary
+    {
+        std::string unixPath;
+        uint32_t attributes;
+        uint64_t size;
+        int64_t lastWriteTime;
+
+        bool operator==(const Summary &other) const
+        {
+            return attributes == other.attributes && size == other.size
+                && lastWriteTime == other.lastWriteTime;
+        }
+    };
+    const uint32_t attributeMask = FILE_ATTRIBUTE_DIRECTORY | FILE_ATTRIBUTE_REPARSE_POINT;
+
+    auto summarize = [attributeMask](const WslDirEntry &entry) {
+        // Directory sizes and times depend on the file system and the
+        // order in which the entries were created.
+        if (entry.isDirectory() && !entry.isReparsePoint())
+            return Summary{entry.unixPath, entry.attributes & attributeMask, 0, 0};
+        return Summary{entry.unixPath, entry.attributes & attributeMask, entry.size,
+                       entry.lastWriteTime};
+    };
+
+    std::mutex entriesMutex;
+    std::unordered_map<std::wstring, Summary> sourceEntries;
+    const size_t sourceRootLength = rootPrefix(m_source).size();
+    m_source.walk("", [&](const WslDirEntry &entry) {
+        Summary summary = summarize(entry);
+        std::lock_guard<std::mutex> lock(entriesMutex);
+        sourceEntries.emplace(entry.ntPath.substr(sourceRootLength), std::move(summary));
+    }, cancel);
+
+    std::vector<std::string> mismatches;
+    const size_t targetRootLength = rootPrefix(m_target).size();
+    m_target.walk("", [&](const WslDirEntry &entry) {
+        Summary summary = summarize(entry);
+        std::lock_guard<std::mutex> lock(entriesMutex);
+        auto source = sourceEntries.find(entry.ntPath.substr(targetRootLength));
+        if (source == sourceEntries.end()) {
+            mismatches.push_back(entry.unixPath);
+            return;
+        }
+        if (!(source->second == summary))
+            mismatches.push_back(entry.unixPath);
+        sourceEntries.erase(source);
+    }, cancel);
+
+    for (const auto &missing : sourceEntries)
+        mismatches.push_back(missing.second.unixPath);
+    std::sort(mismatches.begin(), mismatches.end());
+    return mismatches;
+}
+
+void WslTreeCopy::copyDirectory(const std::wstring &relPath, const std::string &unixPath)
+{
+    const std::wstring newPath = targetPath(relPath);
+    if (!CreateDirectoryW(newPath.c_str(), nullptr) && GetLastError() != ERROR_ALREADY_EXISTS)
+        throw std::runtime_error("Could not create directory " + unixPath);
+
+    UniqueHandle hSource = CreateFileW(sourcePath(relPath).c_str(),
+                                       FILE_READ_EA | FILE_READ_ATTRIBUTES,
+                                       FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                                       OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr);
+    UniqueHandle hTarget = CreateFileW(newPath.c_str(), MAXIMUM_ALLOWED,
+                                       FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                                       FILE_FLAG_BACKUP_SEMANTICS, nullptr);
+    if (hSource == INVALID_HANDLE_VALUE || hTarget == INVALID_HANDLE_VALUE)
+        throw std::runtime_error("Could not open directory " + unixPath);
+
+    if (!WslFs::copyExtendedAttributes(hSource.get(), hTarget.get()))
+        throw std::runtime_error("Could not copy attributes of " + unixPath);
+    if (WslFs::isCaseSensitive(hSource.get()) && !m_target.setCaseSensitive(hTarget.get()))
+        throw std::runtime_error("Could not set case sensitivity of " + unixPath);
+}
+
+void WslTreeCopy::copyFile(const FileEntry &entry)
+{
+    const std::wstring srcPath = sourcePath(entry.relPath);
+    const std::wstring newPath = targetPath(entry.relPath);
+    const bool isReparsePoint = (entry.attributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0;
+
+    // Hard links share their data and metadata with the source
+    if (!isReparsePoint && isLinkedPath(entry.unixPath)
+            && CreateHardLinkW(newPath.c_str(), srcPath.c_str(), nullptr))
+        return;
+
+    UniqueHandle hSource = CreateFileW(srcPath.c_str(),
+                                       GENERIC_READ | FILE_READ_EA | FILE_READ_ATTRIBUTES,
+                                       FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                                       FILE_FLAG_OPEN_REPARSE_POINT | FILE_FLAG_SEQUENTIAL_SCAN,
+                                       nullptr);
+    if (hSource == INVALID_HANDLE_VALUE)
+        throw std::runtime_error("Could not open " + entry.unixPath);
+
+    UniqueHandle hTarget = CreateFileW(newPath.c_str(),
+                                       GENERIC_READ | GENERIC_WRITE | FILE_WRITE_EA
+                                       | FILE_WRITE_ATTRIBUTES,
+                                       0, nullptr, CREATE_NEW,
+                                       FILE_FLAG_OPEN_REPARSE_POINT | FILE_FLAG_SEQUENTIAL_SCAN,
+                                       nullptr);
+    if (hTarget == INVALID_HANDLE_VALUE)
+        throw std::runtime_error("Could not create " + entry.unixPath);
+
+    // Symlinks and special files on WslFs are reparse points with LX
+    // metadata, so the EAs must be in place before the reparse data.
+    if (!WslFs::copyExtendedAttributes(hSource.get(), hTarget.get()))
+        throw std::runtime_error("Could not copy attributes of " + entry.unixPath);
+    if (isReparsePoint) {
+        if (!WslFs::copyReparsePoint(hSource.get(), hTarget.get()))
+            throw std::runtime_error("Could not copy reparse data of " + entry.unixPath);
+    } else {
+        copyFileData(hSource.get(), hTarget.get(), entry);
+    }
+
+    FILE_BASIC_INFO info;
+    if (!GetFileInformationByHandleEx(hSource.get(), FileBasicInfo, &info, sizeof(info)))
+        throw std::runtime_error("Failed to query file extended info");
+    info.FileAttributes = 0;
+    if (!SetFileInformationByHandle(hTarget.get(), FileBasicInfo, &info, sizeof(info)))
+        throw std::runtime_error("Failed to set file extended info");
+}
+
+void WslTreeCopy::copyFileData(HANDLE hSource, HANDLE hTarget, const FileEntry &entry)
+{
+    if (entry.size == 0)
+        return;
+
+    if (entry.attributes & FILE_ATTRIBUTE_SPARSE_FILE) {
+        DWORD nReturned;
+        DeviceIoControl(hTarget, FSCTL_SET_SPARSE, nullptr, 0, nullptr, 0, &nReturned, nullptr);
+    }
+
+    if (m_blockCloneSize != 0 && cloneFileData(hSource, hTarget, entry.size, m_blockCloneSize)) {
+        m_bytesCopied += entry.size;
+        return;
+    }
+
+    // Fall back to copying the data, after discarding any partial clone
+    FILE_END_OF_FILE_INFO eofInfo;
+    eofInfo.EndOfFile.QuadPart = 0;
+    SetFileInformationByHandle(hTarget, FileEndOfFileInfo, &eofInfo, sizeof(eofInfo));
+
+    auto buffer = std::make_unique<std::byte[]>(COPY_BLOCK_SIZE);
+    for ( ;; ) {
+        DWORD nRead = 0;
+        if (!ReadFile(hSource, buffer.get(), COPY_BLOCK_SIZE, &nRead, nullptr))
+            throw std::runtime_error("Could not read " + entry.unixPath);
+        if (nRead == 0)
+            break;
+
+        DWORD nWritten;
+        if (!WriteFile(hTarget, buffer.get(), nRead, &nWritten, nullptr))
+            throw std::runtime_error("Could not write " + entry.unixPath);
+        m_bytesCopied += nRead;
+    }
+}
+
+void WslTreeCopy::copyTimes(const std::wstring &relPath, const std::string &unixPath)
+{
+    UniqueHandle hSource = CreateFileW(sourcePath(relPath).c_str(), FILE_READ_ATTRIBUTES,
+                                       FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                                       OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr);
+    UniqueHandle hTarget = CreateFileW(targetPath(relPath).c_str(), FILE_WRITE_ATTRIBUTES,
+                                       FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                                       OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr);
+    if (hSource == INVALID_HANDLE_VALUE || hTarget == INVALID_HANDLE_VALUE)
+        throw std::runtime_error("Could not open directory " + unixPath);
+
+    FILE_BASIC_INFO info;
+    if (!GetFileInformationByHandleEx(hSource.get(), FileBasicInfo, &info, sizeof(info)))
+        throw std::runtime_error("Failed to query file extended info");
+    info.FileAttributes = 0;
+    if (!SetFileInformationByHandle(hTarget.get(), FileBasicInfo, &info, sizeof(info)))
+        throw std::runtime_error("Failed to set file extended info");
+}
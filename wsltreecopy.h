@@ -0,0 +1,80 @@
+/* This file is part of wslman.
+ *
+ * wslman is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * wslman is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with wslman.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "wslfs.h"
+
+#include <vector>
+
+// Copies a complete rootfs, preserving the LX metadata, symlinks and special
+// files, case sensitive directories and hard links.
+class WslTreeCopy
+{
+public:
+    WslTreeCopy(const WslFs &source, const std::wstring &targetPath);
+
+    // Files below these paths are hard linked to the source instead of
+    // being copied.  Only use this for content that is treated as read-only.
+    void setLinkedPaths(const std::vector<std::string> &unixPaths)
+    {
+        m_linkedPaths = unixPaths;
+    }
+
+    void run(const std::atomic<bool> *cancel = nullptr);
+
+    // Quick comparison of the copy against the source, using the entry
+    // names, types, sizes and modification times from the directory
+    // listings.  Returns the paths which are missing, extra or different.
+    std::vector<std::string> verify(const std::atomic<bool> *cancel = nullptr) const;
+
+    const WslFs &target() const { return m_target; }
+
+    // These may be queried from another thread while run() is active
+    uint64_t entriesFound() const { return m_entriesFound; }
+    uint64_t entriesCopied() const { return m_entriesCopied; }
+    uint64_t bytesCopied() const { return m_bytesCopied; }
+    bool usedBlockCloning() const { return m_blockCloneSize != 0; }
+
+private:
+    struct FileEntry
+    {
+        std::wstring relPath;
+        std::string unixPath;
+        uint64_t fileId;
+        uint64_t size;
+        uint32_t attributes;
+    };
+
+    WslFs m_source;
+    WslFs m_target;
+    std::vector<std::string> m_linkedPaths;
+    uint32_t m_blockCloneSize;
+
+    std::atomic<uint64_t> m_entriesFound;
+    std::atomic<uint64_t> m_entriesCopied;
+    std::atomic<uint64_t> m_bytesCopied;
+
+    // Paths relative to the rootfs, in their escaped NT form
+    std::wstring sourcePath(const std::wstring &relPath) const;
+    std::wstring targetPath(const std::wstring &relPath) const;
+
+    bool isLinkedPath(const std::string &unixPath) const;
+    void copyDirectory(const std::wstring &relPath, const std::string &unixPath);
+    void copyFile(const FileEntry &entry);
+    void copyFileData(HANDLE hSource, HANDLE hTarget, const FileEntry &entry);
+    void copyTimes(const std::wstring &relPath, const std::string &unixPath);
+};
@@ -0,0 +1,185 @@
+/* This file is part of wslman.
+ *
+ * wslman is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * wslman is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with wslman.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "wsltreedelete.h"
+
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+
+struct WslTreeDelete::Directory
+{
+    UniqueHandle handle;
+    std::shared_ptr<Directory> parent;
+    std::string name;
+
+    // One reference for listing the directory itself, plus one for each
+    // subdirectory which has not been deleted yet.
+    std::atomic<size_t> pending = 1;
+};
+
+static bool deleteByHandle(HANDLE hFile)
+{
+    // POSIX semantics remove the name immediately, rather than when the
+    // last handle is closed, so the parent can be deleted right after.
+    FILE_DISPOSITION_INFO_EX infoEx;
+    infoEx.Flags = FILE_DISPOSITION_FLAG_DELETE | FILE_DISPOSITION_FLAG_POSIX_SEMANTICS
+                 | FILE_DISPOSITION_FLAG_IGNORE_READONLY_ATTRIBUTE;
+    if (SetFileInformationByHandle(hFile, FileDispositionInfoEx, &infoEx, sizeof(infoEx)))
+        return true;
+
+    // Not supported before Windows 10 1709
+    FILE_DISPOSITION_INFO info;
+    info.DeleteFile = TRUE;
+    return SetFileInformationByHandle(hFile, FileDispositionInfo, &info, sizeof(info));
+}
+
+WslTreeDelete::WslTreeDelete(const std::wstring &path)
+    : m_entriesDeleted()
+{
+    if (starts_with(path, LR"(\\?\)"))
+        m_path = path;
+    else
+        m_path = LR"(\\?\)" + path;
+}
+
+bool WslTreeDelete::run(const std::atomic<bool> *cancel)
+{
+    auto root = std::make_shared<Directory>();
+    root->handle = CreateFileW(m_path.c_str(), DELETE | FILE_LIST_DIRECTORY | SYNCHRONIZE,
+                               FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                               nullptr, OPEN_EXISTING,
+                               FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OPEN_REPARSE_POINT,
+                               nullptr);
+    if (root->handle == INVALID_HANDLE_VALUE) {
+        auto err = GetLastError();
+        if (err == ERROR_FILE_NOT_FOUND || err == ERROR_PATH_NOT_FOUND)
+            return false;
+        throw std::runtime_error("Could not open " + WslUtil::toUtf8(m_path));
+    }
+    root->name = WslUtil::toUtf8(m_path);
+
+    // Every directory is its own unit of work, so large subtrees are spread
+    // across all of the workers.
+    std::mutex queueMutex;
+    std::condition_variable queueCond;
+    std::deque<std::shared_ptr<Directory>> queue;
+    size_t busyWorkers = 0;
+    std::exception_ptr error;
+
+    queue.push_back(std::move(root));
+
+    auto worker = [&]() {
+        std::vector<std::shared_ptr<Directory>> subdirs;
+        for ( ;; ) {
+            std::shared_ptr<Directory> dir;
+            {
+                std::unique_lock<std::mutex> lock(queueMutex);
+                queueCond.wait(lock, [&]() {
+                    return !queue.empty() || busyWorkers == 0 || error;
+                });
+                if (queue.empty() || error)
+                    return;
+                dir = std::move(queue.front());
+                queue.pop_front();
+                ++busyWorkers;
+            }
+
+            subdirs.clear();
+            try {
+                if (!cancel || !*cancel) {
+                    deleteContents(dir, subdirs);
+                    releaseDirectory(std::move(dir));
+                }
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(queueMutex);
+                if (!error)
+                    error = std::current_exception();
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(queueMutex);
+                for (auto &subdir : subdirs)
+                    queue.push_back(std::move(subdir));
+                --busyWorkers;
+            }
+            queueCond.notify_all();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    const unsigned threadCount = std::max(2u, std::thread::hardware_concurrency());
+    for (unsigned i = 0; i < threadCount; ++i)
+        threads.emplace_back(worker);
+    for (auto &thread : threads)
+        thread.join();
+
+    if (error)
+        std::rethrow_exception(error);
+    return true;
+}
+
+void WslTreeDelete::deleteContents(const std::shared_ptr<Directory> &dir,
+                                   std::vector<std::shared_ptr<Directory>> &subdirs)
+{
+    // Collect the names first, so the directory isn't modified while it is
+    // being enumerated.
+    std::vector<std::pair<std::wstring, uint32_t>> entries;
+    WslFs::listDirectory(dir->handle.get(), [&](const FILE_ID_BOTH_DIR_INFO &info) {
+        entries.emplace_back(std::wstring(info.FileName, info.FileNameLength / sizeof(wchar_t)),
+                             info.FileAttributes);
+    });
+
+    for (const auto &entry : entries) {
+        const bool isDirectory = (entry.second & FILE_ATTRIBUTE_DIRECTORY) != 0;
+        const bool isReparsePoint = (entry.second & FILE_ATTRIBUTE_REPARSE_POINT) != 0;
+        if (isDirectory && !isReparsePoint) {
+            auto subdir = std::make_shared<Directory>();
+            subdir->handle = WslFs::openRelative(dir->handle.get(), entry.first,
+                                                 DELETE | FILE_LIST_DIRECTORY, true);
+            subdir->name = dir->name + "\\" + WslUtil::toUtf8(entry.first);
+            if (subdir->handle == INVALID_HANDLE_VALUE)
+                throw std::runtime_error("Could not open " + subdir->name);
+            subdir->parent = dir;
+            ++dir->pending;
+            subdirs.push_back(std::move(subdir));
+        } else {
+            // Directory reparse points (junctions) are removed without
+            // following them.
+            UniqueHandle hFile = WslFs::openRelative(dir->handle.get(), entry.first,
+                                                     DELETE, isDirectory);
+            if (hFile == INVALID_HANDLE_VALUE || !deleteByHandle(hFile.get())) {
+                throw std::runtime_error("Could not delete " + dir->name + "\\"
+                                         + WslUtil::toUtf8(entry.first));
+            }
+            ++m_entriesDeleted;
+        }
+    }
+}
+
+void WslTreeDelete::releaseDirectory(std::shared_ptr<Directory> dir)
+{
+    // The last one out deletes the directory, and then releases its parent
+    while (dir && --dir->pending == 0) {
+        if (!deleteByHandle(dir->handle.get()))
+            throw std::runtime_error("Could not delete " + dir->name);
+        dir->handle.release();
+        ++m_entriesDeleted;
+        dir = dir->parent;
+    }
+}
@@ -0,0 +1,47 @@
+/* This file is part of wslman.
+ *
+ * wslman is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * wslman is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with wslman.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "wslfs.h"
+
+#include <memory>
+
+// Deletes a directory tree bottom-up from a pool of worker threads.  Each
+// directory is removed only once all of its contents are gone, so an
+// interrupted delete leaves a consistent tree which can simply be deleted
+// again.
+class WslTreeDelete
+{
+public:
+    explicit WslTreeDelete(const std::wstring &path);
+
+    // Returns false if the path does not exist
+    bool run(const std::atomic<bool> *cancel = nullptr);
+
+    // May be queried from another thread while run() is active
+    uint64_t entriesDeleted() const { return m_entriesDeleted; }
+
+private:
+    struct Directory;
+
+    std::wstring m_path;
+    std::atomic<uint64_t> m_entriesDeleted;
+
+    void deleteContents(const std::shared_ptr<Directory> &dir,
+                        std::vector<std::shared_ptr<Directory>> &subdirs);
+    void releaseDirectory(std::shared_ptr<Directory> dir);
+};
@@ -17,10 +17,23 @@
 #include "wslui.h"
 
 #include "wslregistry.h"
+#include "wsldistcache.h"
+#include "wsldistmodel.h"
 #include "wslsetuser.h"
 #include "wslinstall.h"
+#include "wsldedupe.h"
+#include "wslbulkedit.h"
+#include "wslclone.h"
+#include "wslmove.h"
+#include "wslindex.h"
+#include "wslusage.h"
+#include "wslverify.h"
+#include "wslremap.h"
+#include "wslconvert.h"
+#include "wsltreedelete.h"
 #include "wslutils.h"
-#include <QListWidget>
+#include <QListView>
+#include <QSortFilterProxyModel>
 #include <QToolBar>
 #include <QLabel>
 #include <QLineEdit>
@@ -31,11 +44,24 @@
 #include <QSplitter>
 #include <QGridLayout>
 #include <QMessageBox>
+#include <QProgressDialog>
+#include <QFileInfo>
+#include <QFileDialog>
+#include <QFile>
+#include <QDir>
+#include <QTimer>
+#include <QLocale>
+#include <QSaveFile>
+#include <QStandardPaths>
+
+#if QT_VERSION >= QT_VERSION_CHECK(5, 14, 0)
+#   define QT_SKIP_EMPTY_PARTS Qt::SkipEmptyParts
+#else
+#   define QT_SKIP_EMPTY_PARTS QString::SkipEmptyParts
+#endif
 
 enum {
-    DistUuidRole = Qt::UserRole,
-    DistNameRole,
-    EnvSavedKeyRole,
+    EnvSavedKeyRole = Qt::UserRole,
 };
 
 QIcon WslUi::pickDistIcon(const QString &name)
@@ -62,11 +88,33 @@ QIcon WslUi::pickDistIcon(const QString &name)
 }
 
 WslUi::WslUi()
-    : m_registry()
+    : m_usageCancel(), m_distsLoaded()
 {
-    m_distList = new QListWidget(this);
+    m_startupTimer.start();
+
+    // The proxy sorts the list by name and filters it while typing a search
+    m_distModel = new WslDistributionModel(this);
+    m_distFilter = new QSortFilterProxyModel(this);
+    m_distFilter->setSourceModel(m_distModel);
+    m_distFilter->setSortRole(WslDistributionModel::NameRole);
+    m_distFilter->setSortCaseSensitivity(Qt::CaseInsensitive);
+    m_distFilter->setFilterRole(WslDistributionModel::NameRole);
+    m_distFilter->setFilterCaseSensitivity(Qt::CaseInsensitive);
+    m_distFilter->sort(0);
+
+    auto distPane = new QWidget(this);
+    auto distPaneLayout = new QVBoxLayout(distPane);
+    distPaneLayout->setContentsMargins(0, 0, 0, 0);
+    m_distSearch = new QLineEdit(distPane);
+    m_distSearch->setPlaceholderText(tr("Search distributions"));
+    m_distSearch->setClearButtonEnabled(true);
+    m_distList = new QListView(distPane);
     m_distList->setIconSize(QSize(32, 32));
+    m_distList->setUniformItemSizes(true);
     m_distList->setContextMenuPolicy(Qt::ActionsContextMenu);
+    m_distList->setModel(m_distFilter);
+    distPaneLayout->addWidget(m_distSearch);
+    distPaneLayout->addWidget(m_distList);
 
     m_distDetails = new QFrame(this);
     m_distDetails->setFrameStyle(QFrame::StyledPanel);
@@ -147,9 +195,13 @@ WslUi::WslUi()
     m_envEdit->setEnabled(false);
     m_envDel = new QAction(QIcon(":/icons/edit-delete.ico"), tr("Remove"));
     m_envDel->setEnabled(false);
+    m_envImport = new QAction(QIcon(":/icons/document-open.ico"), tr("Import .env File..."));
+    m_envExport = new QAction(tr("Export .env File..."));
     m_defaultEnvironment->addAction(m_envAdd);
     m_defaultEnvironment->addAction(m_envEdit);
     m_defaultEnvironment->addAction(m_envDel);
+    m_defaultEnvironment->addAction(m_envImport);
+    m_defaultEnvironment->addAction(m_envExport);
 
     auto envAddButton = new QToolButton(envButtons);
     envAddButton->setIconSize(QSize(16, 16));
@@ -160,14 +212,18 @@ WslUi::WslUi()
     auto envDelButton = new QToolButton(envButtons);
     envDelButton->setIconSize(QSize(16, 16));
     envDelButton->setDefaultAction(m_envDel);
+    auto envImportButton = new QToolButton(envButtons);
+    envImportButton->setIconSize(QSize(16, 16));
+    envImportButton->setDefaultAction(m_envImport);
 
     envLayout->addWidget(envAddButton);
     envLayout->addWidget(envEditButton);
     envLayout->addWidget(envDelButton);
+    envLayout->addWidget(envImportButton);
     envLayout->addItem(new QSpacerItem(0, 0, QSizePolicy::Minimum, QSizePolicy::MinimumExpanding));
 
     auto split = new QSplitter(this);
-    split->addWidget(m_distList);
+    split->addWidget(distPane);
     split->addWidget(m_distDetails);
     split->setStretchFactor(0, 2);
     split->setStretchFactor(1, 3);
@@ -178,9 +234,27 @@ WslUi::WslUi()
     m_openShell->setEnabled(false);
     m_setDefault = new QAction(tr("Set Default"), this);
     m_setDefault->setEnabled(false);
+    m_cloneDist = new QAction(tr("Clone..."), this);
+    m_cloneDist->setEnabled(false);
+    m_moveDist = new QAction(tr("Move..."), this);
+    m_moveDist->setEnabled(false);
+    m_searchFiles = new QAction(tr("Search Files..."), this);
+    m_searchFiles->setEnabled(false);
+    m_diskUsage = new QAction(tr("Disk Usage..."), this);
+    m_diskUsage->setEnabled(false);
+    m_verifyDist = new QAction(tr("Verify Files..."), this);
+    m_verifyDist->setEnabled(false);
+    m_remapDist = new QAction(tr("Remap Ownership..."), this);
+    m_remapDist->setEnabled(false);
+    m_convertDist = new QAction(tr("Convert to WslFs Format..."), this);
+    m_convertDist->setEnabled(false);
+    m_removeDist = new QAction(QIcon(":/icons/edit-delete.ico"), tr("Unregister and Delete..."), this);
+    m_removeDist->setEnabled(false);
     auto separator1 = new QAction(this);
     separator1->setSeparator(true);
     m_installDist = new QAction(QIcon(":/icons/edit-download.ico"), tr("Install..."), this);
+    m_dedupeDists = new QAction(tr("Deduplicate Files..."), this);
+    m_bulkEdit = new QAction(tr("Edit Multiple..."), this);
     auto separator2 = new QAction(this);
     separator2->setSeparator(true);
     auto refreshDists = new QAction(QIcon(":/icons/view-refresh.ico"), tr("Refresh"), this);
@@ -197,22 +271,75 @@ WslUi::WslUi()
 
     m_distList->addAction(m_openShell);
     m_distList->addAction(m_setDefault);
+    m_distList->addAction(m_cloneDist);
+    m_distList->addAction(m_moveDist);
+    m_distList->addAction(m_searchFiles);
+    m_distList->addAction(m_diskUsage);
+    m_distList->addAction(m_verifyDist);
+    m_distList->addAction(m_remapDist);
+    m_distList->addAction(m_convertDist);
+    m_distList->addAction(m_removeDist);
     m_distList->addAction(separator1);
     m_distList->addAction(m_installDist);
+    m_distList->addAction(m_dedupeDists);
+    m_distList->addAction(m_bulkEdit);
     m_distList->addAction(separator2);
     m_distList->addAction(refreshDists);
 
-    connect(m_distList, &QListWidget::currentItemChanged, this, &WslUi::distSelected);
-    connect(m_distList, &QListWidget::itemActivated, this, &WslUi::distActivated);
+    connect(m_distList->selectionModel(), &QItemSelectionModel::currentChanged,
+            this, [this](const QModelIndex &current, const QModelIndex &) {
+        distSelected(current);
+    });
+
+    // The default user is looked up in the background
+    connect(m_distModel, &QAbstractItemModel::dataChanged, this,
+            [this](const QModelIndex &topLeft, const QModelIndex &bottomRight) {
+        const QModelIndex shown = m_distModel->indexOf(QString::fromStdWString(m_shownDist.uuid()));
+        if (shown.isValid() && shown.row() >= topLeft.row() && shown.row() <= bottomRight.row())
+            updateDefaultUser();
+    });
+    connect(m_distList, &QListView::activated, this, &WslUi::distActivated);
+    connect(m_distSearch, &QLineEdit::textChanged, m_distFilter,
+            &QSortFilterProxyModel::setFilterFixedString);
     connect(m_openShell, &QAction::triggered, this, [this](bool) {
-        distActivated(m_distList->currentItem());
+        distActivated(m_distList->currentIndex());
     });
     connect(m_setDefault, &QAction::triggered, this, [this](bool) {
         setCurrentDistAsDefault();
     });
+    connect(m_cloneDist, &QAction::triggered, this, [this](bool) {
+        cloneDistribution();
+    });
+    connect(m_moveDist, &QAction::triggered, this, [this](bool) {
+        moveDistribution();
+    });
+    connect(m_searchFiles, &QAction::triggered, this, [this](bool) {
+        searchFiles();
+    });
+    connect(m_diskUsage, &QAction::triggered, this, [this](bool) {
+        showDiskUsage();
+    });
+    connect(m_verifyDist, &QAction::triggered, this, [this](bool) {
+        verifyDistribution();
+    });
+    connect(m_remapDist, &QAction::triggered, this, [this](bool) {
+        remapDistribution();
+    });
+    connect(m_convertDist, &QAction::triggered, this, [this](bool) {
+        convertDistribution();
+    });
+    connect(m_removeDist, &QAction::triggered, this, [this](bool) {
+        unregisterDistribution();
+    });
     connect(m_installDist, &QAction::triggered, this, [this](bool) {
         installDistribution();
     });
+    connect(m_dedupeDists, &QAction::triggered, this, [this](bool) {
+        dedupeDistributions();
+    });
+    connect(m_bulkEdit, &QAction::triggered, this, [this](bool) {
+        bulkEditDistributions();
+    });
     connect(refreshDists, &QAction::triggered, this, [this](bool) {
         loadDistributions();
     });
@@ -223,6 +350,11 @@ WslUi::WslUi()
     connect(m_enableDriveMounting, &QCheckBox::clicked, this, &WslUi::commitDistFlags);
     connect(m_kernelCmdLine, &QLineEdit::editingFinished, this, &WslUi::commitKernelCmdLine);
 
+    m_commitTimer = new QTimer(this);
+    m_commitTimer->setSingleShot(true);
+    m_commitTimer->setInterval(250);
+    connect(m_commitTimer, &QTimer::timeout, this, &WslUi::commitPendingEdits);
+
     connect(m_defaultEnvironment, &QTreeWidget::currentItemChanged,
             this, &WslUi::environSelected);
     connect(m_defaultEnvironment, &QTreeWidget::itemChanged,
@@ -241,17 +373,82 @@ WslUi::WslUi()
             m_defaultEnvironment->editItem(item, 1);
     });
     connect(m_envDel, &QAction::triggered, this, &WslUi::deleteSelectedEnviron);
+    connect(m_envImport, &QAction::triggered, this, [this](bool) {
+        importEnvironment();
+    });
+    connect(m_envExport, &QAction::triggered, this, [this](bool) {
+        exportEnvironment();
+    });
 
-    loadDistributions();
+    // Show the distributions of the last session right away, and read the
+    // registry in the background.  Nothing can be changed until then.
+    m_distList->viewport()->installEventFilter(this);
+    if (m_distModel->loadState(WslDistributionModel::statePath()))
+        selectInitialDistribution();
+
+    m_installDist->setEnabled(false);
+    m_dedupeDists->setEnabled(false);
+    m_bulkEdit->setEnabled(false);
+    m_loadThread = std::thread([this]() {
+        // Pick up distributions which are added, changed or removed by other
+        // tools without waiting for a refresh.  The watcher's first scan
+        // reads the registry too, so it isn't done on the GUI thread.  It's
+        // started before the load, so changes in between aren't lost; they
+        // are deferred until the load has finished.  m_watcher isn't used
+        // by the GUI thread until it has joined this thread.
+        try {
+            m_watcher = std::make_unique<WslRegistryWatcher>([this](const WslRegistryChanges &changes) {
+                QMetaObject::invokeMethod(this, [this, changes]() {
+                    applyRegistryChanges(changes);
+                }, Qt::QueuedConnection);
+            });
+        } catch (const std::runtime_error &) {
+            // Refreshing manually still works
+        }
+
+        WslDistributionCache::SnapshotPtr snapshot;
+        QString error;
+        try {
+            snapshot = WslDistributionCache::instance().reloadAll();
+        } catch (const std::runtime_error &err) {
+            error = QString::fromUtf8(err.what());
+        }
+        QMetaObject::invokeMethod(this, [this, snapshot, error]() {
+            finishLoading(snapshot, error);
+        }, Qt::QueuedConnection);
+    });
 }
 
 WslUi::~WslUi()
 {
-    delete m_registry;
+    if (m_loadThread.joinable())
+        m_loadThread.join();
+
+    if (m_commitTimer->isActive())
+        commitPendingEdits();
+
+    if (m_distsLoaded) {
+        try {
+            m_distModel->saveState(WslDistributionModel::statePath());
+        } catch (const std::runtime_error &) {
+            // The next start just has to wait for the registry
+        }
+    }
+
+    m_watcher.reset();
+    m_usageCancel = true;
+    if (m_usageThread.joinable())
+        m_usageThread.join();
 }
 
-void WslUi::distSelected(QListWidgetItem *current, QListWidgetItem *)
+void WslUi::distSelected(const QModelIndex &current)
 {
+    // Don't lose edits of the previously shown distribution
+    if (m_commitTimer->isActive())
+        commitPendingEdits();
+
+    m_shownDist = WslDistribution();
+    m_pendingEnvironment.reset();
     m_name->setText(QString());
     m_fsType->setText(QString());
     m_defaultUser->setText(QString());
@@ -264,31 +461,53 @@ void WslUi::distSelected(QListWidgetItem *current, QListWidgetItem *)
 
     m_openShell->setEnabled(false);
     m_setDefault->setEnabled(false);
+    m_cloneDist->setEnabled(false);
+    m_moveDist->setEnabled(false);
+    m_searchFiles->setEnabled(false);
+    m_diskUsage->setEnabled(false);
+    m_verifyDist->setEnabled(false);
+    m_remapDist->setEnabled(false);
+    m_convertDist->setEnabled(false);
+    m_removeDist->setEnabled(false);
     m_distDetails->setEnabled(false);
 
+    if (!m_distsLoaded) {
+        // Only shown until the registry has been read
+        auto saved = m_distModel->distribution(m_distFilter->mapToSource(current));
+        if (saved)
+            updateDistProperties(*saved);
+        return;
+    }
+
     WslDistribution dist = getDistribution(current);
     if (dist.isValid()) {
         updateDistProperties(dist);
         m_openShell->setEnabled(true);
         m_setDefault->setEnabled(true);
+        m_cloneDist->setEnabled(true);
+        m_moveDist->setEnabled(true);
+        m_searchFiles->setEnabled(true);
+        m_diskUsage->setEnabled(true);
+        m_verifyDist->setEnabled(true);
+        m_remapDist->setEnabled(true);
+        m_convertDist->setEnabled(dist.version() == WslApi::v1);
+        m_removeDist->setEnabled(true);
         m_distDetails->setEnabled(true);
     }
 }
 
-void WslUi::distActivated(QListWidgetItem *item)
+void WslUi::distActivated(const QModelIndex &index)
 {
-    WslDistribution dist = getDistribution(item);
+    WslDistribution dist = getDistribution(index);
     if (dist.isValid()) {
-        AllocConsole();
-        auto context = WslConsoleContext::createConsole(dist.name(), item->icon());
-        context->startConsoleThread(this);
-        FreeConsole();
+        const QIcon icon = index.data(Qt::DecorationRole).value<QIcon>();
+        WslConsoleContext::launchShell(dist.name(), icon, this);
     }
 }
 
 void WslUi::chooseUser(bool)
 {
-    WslDistribution dist = getDistribution(m_distList->currentItem());
+    WslDistribution dist = getDistribution(m_distList->currentIndex());
     if (dist.isValid()) {
         WslSetUser dialog(dist.name(), this);
         dialog.setUID(dist.defaultUID());
@@ -300,7 +519,9 @@ void WslUi::chooseUser(bool)
             return;
 
         try {
-            dist.setDefaultUID(uid);
+            updateDistribution(dist, [uid](WslDistribution &updated) {
+                updated.setDefaultUID(uid);
+            });
         } catch (const std::runtime_error &err) {
             QMessageBox::critical(this, QString(),
                     tr("Failed to set property: %1").arg(err.what()));
@@ -311,7 +532,22 @@ void WslUi::chooseUser(bool)
 
 void WslUi::commitDistFlags(bool)
 {
-    WslDistribution dist = getDistribution(m_distList->currentItem());
+    // Toggling several flags in a row only writes them once
+    m_commitTimer->start();
+}
+
+void WslUi::commitKernelCmdLine()
+{
+    commitPendingEdits();
+}
+
+void WslUi::commitPendingEdits()
+{
+    m_commitTimer->stop();
+
+    // The shown distribution may be hidden by the search in the meantime
+    WslDistribution dist = getDistribution(
+            m_distModel->indexOf(QString::fromStdWString(m_shownDist.uuid())));
     if (dist.isValid()) {
         // Preserve any flags we don't know about...
         int flags = dist.flags() & ~WslApi::DistributionFlags_All;
@@ -321,28 +557,22 @@ void WslUi::commitDistFlags(bool)
             flags |= WslApi::DistributionFlags_AppendNTPath;
         if (m_enableDriveMounting->isChecked())
             flags |= WslApi::DistributionFlags_EnableDriveMounting;
+        const std::wstring cmdline = m_kernelCmdLine->text().toStdWString();
 
         try {
-            dist.setFlags(static_cast<WslApi::DistributionFlags>(flags));
-        } catch (const std::runtime_error &err) {
-            QMessageBox::critical(this, QString(),
-                    tr("Failed to set property: %1").arg(err.what()));
-        }
-        updateDistProperties(dist);
-    }
-}
-
-void WslUi::commitKernelCmdLine()
-{
-    WslDistribution dist = getDistribution(m_distList->currentItem());
-    if (dist.isValid()) {
-        std::wstring cmdline = m_kernelCmdLine->text().toStdWString();
-        try {
-            dist.setKernelCmdLine(cmdline);
+            updateDistribution(dist, [this, flags, &cmdline](WslDistribution &updated) {
+                WslDistributionUpdate update(updated);
+                update.setFlags(static_cast<WslApi::DistributionFlags>(flags));
+                update.setKernelCmdLine(cmdline);
+                if (m_pendingEnvironment)
+                    update.setEnvironment(*m_pendingEnvironment);
+                update.commit();
+            });
         } catch (const std::runtime_error &err) {
             QMessageBox::critical(this, QString(),
                     tr("Failed to set property: %1").arg(err.what()));
         }
+        m_pendingEnvironment.reset();
         updateDistProperties(dist);
     }
 }
@@ -358,46 +588,102 @@ void WslUi::environSelected(QTreeWidgetItem *current, QTreeWidgetItem *)
     }
 }
 
+// Environment edits are collected in m_pendingEnvironment, and written
+// together by commitPendingEdits() once the editing pauses
 void WslUi::environChanged(QTreeWidgetItem *item, int column)
 {
-    WslDistribution dist = getDistribution(m_distList->currentItem());
-    if (dist.isValid()) {
-        try {
-            if (column == 0) {
-                // Changed the key...  Delete the old one if it exists
-                const QString oldKey = item->data(0, EnvSavedKeyRole).toString();
-                if (!oldKey.isEmpty())
-                    dist.delEnvironment(oldKey.toStdWString());
-
-                m_defaultEnvironment->blockSignals(true);
-                item->setData(0, EnvSavedKeyRole, item->text(0));
-                m_defaultEnvironment->blockSignals(false);
-            }
-            const QString key = item->text(0);
-            const QString value = item->text(1);
-            if (!key.isEmpty())
-                dist.addEnvironment(key.toStdWString(), value.toStdWString());
-        } catch (const std::runtime_error &err) {
-            QMessageBox::critical(this, QString(),
-                    tr("Failed to set environment variable: %1").arg(err.what()));
-        }
-        updateDistProperties(dist);
+    if (!m_shownDist.isValid())
+        return;
+    if (!m_pendingEnvironment)
+        m_pendingEnvironment = m_shownDist.environment();
+
+    const std::wstring oldKey = item->data(0, EnvSavedKeyRole).toString().toStdWString();
+    const std::wstring key = item->text(0).toStdWString();
+    const std::wstring value = item->text(1).toStdWString();
+
+    // A renamed variable keeps its position
+    if (column == 0 && !oldKey.empty() && oldKey != key) {
+        if (key.empty())
+            m_pendingEnvironment->remove(oldKey);
+        else
+            m_pendingEnvironment->rename(oldKey, key);
     }
+    if (!key.empty())
+        m_pendingEnvironment->set(key, value);
+
+    m_defaultEnvironment->blockSignals(true);
+    item->setData(0, EnvSavedKeyRole, item->text(0));
+    m_defaultEnvironment->blockSignals(false);
+
+    m_commitTimer->start();
 }
 
 void WslUi::deleteSelectedEnviron(bool)
 {
     QTreeWidgetItem *envItem = m_defaultEnvironment->currentItem();
-    WslDistribution dist = getDistribution(m_distList->currentItem());
-    if (envItem && dist.isValid()) {
-        QString envKey = envItem->data(0, EnvSavedKeyRole).toString();
-        try {
-            dist.delEnvironment(envKey.toStdWString());
-        } catch (const std::runtime_error &err) {
-            QMessageBox::critical(this, QString(),
-                    tr("Failed to delete environment variable: %1").arg(err.what()));
-        }
-        updateDistProperties(dist);
+    if (envItem && m_shownDist.isValid()) {
+        if (!m_pendingEnvironment)
+            m_pendingEnvironment = m_shownDist.environment();
+
+        const QString envKey = envItem->data(0, EnvSavedKeyRole).toString();
+        m_pendingEnvironment->remove(envKey.toStdWString());
+        delete envItem;
+        m_commitTimer->start();
+    }
+}
+
+void WslUi::importEnvironment()
+{
+    if (!m_shownDist.isValid())
+        return;
+
+    const QString filename = QFileDialog::getOpenFileName(this, tr("Import Environment"),
+            QString(), tr("Environment files (*.env);;All files (*)"));
+    if (filename.isEmpty())
+        return;
+
+    QFile file(filename);
+    if (!file.open(QIODevice::ReadOnly)) {
+        QMessageBox::critical(this, QString(),
+                tr("Failed to open %1: %2").arg(filename).arg(file.errorString()));
+        return;
+    }
+
+    try {
+        const WslEnvironment imported = WslEnvironment::fromEnvFile(file.readAll().toStdString());
+        if (!m_pendingEnvironment)
+            m_pendingEnvironment = m_shownDist.environment();
+        m_pendingEnvironment->merge(imported);
+    } catch (const std::runtime_error &err) {
+        QMessageBox::critical(this, QString(),
+                tr("Failed to import %1: %2").arg(filename).arg(err.what()));
+        return;
+    }
+
+    // An import is a single edit already, so don't wait for more
+    commitPendingEdits();
+}
+
+void WslUi::exportEnvironment()
+{
+    if (!m_shownDist.isValid())
+        return;
+
+    const WslEnvironment env = m_pendingEnvironment ? *m_pendingEnvironment
+                                                    : m_shownDist.environment();
+    const QString filename = QFileDialog::getSaveFileName(this, tr("Export Environment"),
+            QString::fromStdWString(m_shownDist.name()) + QStringLiteral(".env"),
+            tr("Environment files (*.env);;All files (*)"));
+    if (filename.isEmpty())
+        return;
+
+    QFile file(filename);
+    const std::string text = env.toEnvFile();
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)
+            || file.write(text.data(), static_cast<qint64>(text.size()))
+                    != static_cast<qint64>(text.size())) {
+        QMessageBox::critical(this, QString(),
+                tr("Failed to write %1: %2").arg(filename).arg(file.errorString()));
     }
 }
 
@@ -416,82 +702,576 @@ void WslUi::installDistribution()
     loadDistributions();
 }
 
-void WslUi::loadDistributions()
+void WslUi::cloneDistribution()
 {
-    QString selectedUuid;
-    QListWidgetItem *current = m_distList->currentItem();
-    if (current)
-        selectedUuid = current->data(DistUuidRole).toString();
+    const QString uuid = currentUuid();
+    if (uuid.isEmpty())
+        return;
+
+    WslCloneDialog dialog(uuid, this);
+    for ( ;; ) {
+        if (dialog.exec() != QDialog::Accepted)
+            return;
+
+        if (dialog.validate())
+            break;
+    }
 
-    m_distList->clear();
+    dialog.performClone();
+    loadDistributions();
+}
+
+void WslUi::moveDistribution()
+{
+    const QString uuid = currentUuid();
+    if (uuid.isEmpty())
+        return;
+
+    WslMoveDialog dialog(uuid, this);
+    for ( ;; ) {
+        if (dialog.exec() != QDialog::Accepted)
+            return;
+
+        if (dialog.validate())
+            break;
+    }
+
+    dialog.performMove();
+    distSelected(m_distList->currentIndex());
+}
+
+void WslUi::searchFiles()
+{
+    const QString uuid = currentUuid();
+    if (uuid.isEmpty())
+        return;
+
+    WslIndexDialog dialog(uuid, this);
+    dialog.exec();
+}
+
+void WslUi::showDiskUsage()
+{
+    const QString uuid = currentUuid();
+    if (uuid.isEmpty())
+        return;
 
-    std::vector<WslDistribution> distributions;
+    WslUsageDialog dialog(uuid, this);
+    QTimer::singleShot(0, &dialog, [&dialog]() { dialog.refresh(false); });
+    dialog.exec();
+
+    WslUsageTotals totals;
+    if (WslDiskUsage::loadTotals(WslDiskUsage::cachePath(uuid.toStdWString()), totals))
+        m_distModel->setUsage(uuid, totals);
+}
+
+void WslUi::verifyDistribution()
+{
+    const QString uuid = currentUuid();
+    if (uuid.isEmpty())
+        return;
+
+    WslVerifyDialog dialog(uuid, this);
+    for ( ;; ) {
+        if (dialog.exec() != QDialog::Accepted)
+            return;
+
+        if (dialog.validate())
+            break;
+    }
+
+    dialog.performVerify();
+}
+
+void WslUi::remapDistribution()
+{
+    const QString uuid = currentUuid();
+    if (uuid.isEmpty())
+        return;
+
+    WslRemapDialog dialog(uuid, this);
+    for ( ;; ) {
+        if (dialog.exec() != QDialog::Accepted)
+            return;
+
+        if (dialog.validate())
+            break;
+    }
+
+    dialog.performRemap();
+}
+
+void WslUi::convertDistribution()
+{
+    WslDistribution dist = getDistribution(m_distList->currentIndex());
+    if (!dist.isValid() || dist.version() != WslApi::v1)
+        return;
+
+    if (!WslUtil::checkWindowsVersion(WslUtil::Windows1809)) {
+        QMessageBox::critical(this, QString(),
+                tr("The WslFs format requires Windows 10 version 1809 or later."));
+        return;
+    }
+
+    // Entries are renamed and their attributes rewritten in place
+    const QString distName = QString::fromStdWString(dist.name());
+    if (!checkStopped(this, dist,
+            tr("%1 is running.  Stop it with \"wsl --terminate\" before converting it.")
+            .arg(distName))) {
+        return;
+    }
+
+    const QString journalPath = WslConvert::journalPath(dist.uuid());
+    const QString prompt = QFileInfo::exists(journalPath)
+            ? tr("Resume converting %1 to the WslFs format?")
+            : tr("Convert %1 to the WslFs format?  If the conversion is interrupted, "
+                 "it can be resumed later.");
+    if (QMessageBox::question(this, tr("Convert Distribution"), prompt.arg(distName))
+            != QMessageBox::Yes)
+        return;
+
+    QProgressDialog progressDialog(this);
+    progressDialog.setWindowModality(Qt::WindowModal);
+    progressDialog.setMinimumDuration(0);
+    progressDialog.setMaximum(0);
+
+    std::atomic<bool> cancel = false;
     try {
-        if (!m_registry)
-            m_registry = new WslRegistry;
-        distributions = m_registry->getDistributions();
+        WslConvert convert(dist.rootfsPath(), journalPath);
+        WslUtil::runInBackground([&]() { convert.run(&cancel); }, [&]() {
+            if (progressDialog.wasCanceled())
+                cancel = true;
+            progressDialog.setLabelText(tr("Converting files... (%1 converted, %2 renamed)")
+                                        .arg(convert.entriesConverted())
+                                        .arg(convert.entriesRenamed()));
+        });
+        progressDialog.reset();
+        if (cancel)
+            return;
+
+        updateDistribution(dist, [](WslDistribution &updated) {
+            updated.setVersion(WslApi::v2);
+        });
     } catch (const std::runtime_error &err) {
         QMessageBox::critical(this, QString(),
-                tr("Failed to get distribution list: %1").arg(err.what()));
+                tr("Failed to convert %1: %2").arg(distName).arg(err.what()));
+    }
+    distSelected(m_distList->currentIndex());
+}
+
+void WslUi::unregisterDistribution()
+{
+    WslDistribution dist = getDistribution(m_distList->currentIndex());
+    if (!dist.isValid())
+        return;
+
+    const QString distName = QString::fromStdWString(dist.name());
+    if (!checkStopped(this, dist,
+            tr("%1 is running.  Stop it with \"wsl --terminate\" before removing it.")
+            .arg(distName))) {
+        return;
     }
 
-    for (const auto &dist : distributions) {
-        auto distName = QString::fromStdWString(dist.name());
-        auto item = new QListWidgetItem(distName, m_distList);
-        item->setData(DistUuidRole, QString::fromStdWString(dist.uuid()));
-        item->setData(DistNameRole, distName);
-        item->setIcon(pickDistIcon(distName));
+    auto answer = QMessageBox::question(this, QString(),
+            tr("This will unregister %1 and permanently delete all of its files.  Continue?")
+            .arg(distName));
+    if (answer != QMessageBox::Yes)
+        return;
+
+    removeDistribution(this, dist);
+    loadDistributions();
+}
+
+// Distributions which wslman started to remove.  wsl.exe marks the
+// distributions it unregisters as uninstalling too, so the state alone
+// doesn't tell whether an interrupted removal is ours to finish.
+static QString pendingRemovalsPath()
+{
+    return QStandardPaths::writableLocation(QStandardPaths::AppLocalDataLocation)
+            + QStringLiteral("/removals.txt");
+}
+
+static QStringList pendingRemovals()
+{
+    QFile file(pendingRemovalsPath());
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text))
+        return QStringList();
+    return QString::fromUtf8(file.readAll()).split(QLatin1Char('\n'), QT_SKIP_EMPTY_PARTS);
+}
+
+static void setPendingRemoval(const std::wstring &uuid, bool pending)
+{
+    const QString uuidString = QString::fromStdWString(uuid);
+    QStringList uuids = pendingRemovals();
+    uuids.removeAll(uuidString);
+    if (pending)
+        uuids << uuidString;
+
+    const QString path = pendingRemovalsPath();
+    QDir().mkpath(QFileInfo(path).absolutePath());
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Text))
+        throw std::runtime_error("Could not record the pending removal");
+    file.write(uuids.join(QLatin1Char('\n')).toUtf8());
+    if (!file.commit())
+        throw std::runtime_error("Could not record the pending removal");
+}
+
+void WslUi::resumeRemovals()
+{
+    WslDistributionCache::SnapshotPtr snapshot;
+    try {
+        WslRegistry registry;
+        registry.removePendingRegistrations();
+        snapshot = WslDistributionCache::instance().snapshot();
+    } catch (const std::runtime_error &) {
+        return;
     }
-    m_distList->sortItems();
 
-    WslDistribution defaultDist;
+    bool removed = false;
+    for (const QString &uuid : pendingRemovals()) {
+        auto cached = snapshot->find(uuid.toStdWString());
+        if (!cached || cached->state() != WslDistribution::StateUninstalling) {
+            // Finished or reverted by someone else
+            try {
+                setPendingRemoval(uuid.toStdWString(), false);
+            } catch (const std::runtime_error &) {
+                // Checked again next time
+            }
+            continue;
+        }
+
+        // Asked again next time
+        WslDistribution dist = *cached;
+        try {
+            if (WslUtil::isDistributionRunning(dist.name()))
+                continue;
+        } catch (const std::runtime_error &) {
+            continue;
+        }
+
+        auto answer = QMessageBox::question(this, QString(),
+                tr("Removing %1 was interrupted.  Finish removing it now?  This permanently "
+                   "deletes all of its remaining files in %2.")
+                .arg(QString::fromStdWString(dist.name()))
+                .arg(QString::fromStdWString(dist.path())));
+        if (answer != QMessageBox::Yes)
+            continue;
+
+        removeDistribution(this, dist);
+        removed = true;
+    }
+    if (removed)
+        loadDistributions();
+}
+
+bool WslUi::checkStopped(QWidget *parent, const WslDistribution &dist,
+                         const QString &runningMessage)
+{
     try {
-        defaultDist = m_registry->defaultDistribution();
+        if (!WslUtil::isDistributionRunning(dist.name()))
+            return true;
+        QMessageBox::critical(parent, QString(), runningMessage);
     } catch (const std::runtime_error &err) {
-        QMessageBox::critical(this, QString(),
-                tr("Failed to query default distribution: %1").arg(err.what()));
+        QMessageBox::critical(parent, QString(),
+                tr("Could not tell whether %1 is running: %2")
+                .arg(QString::fromStdWString(dist.name())).arg(err.what()));
+    }
+    return false;
+}
+
+void WslUi::refreshUsageTotals()
+{
+    if (m_usageThread.joinable())
+        return;
+
+    std::vector<std::pair<std::wstring, std::wstring>> rootfsPaths;
+    try {
+        auto snapshot = WslDistributionCache::instance().snapshot();
+        for (const auto &[uuid, dist] : snapshot->distributions) {
+            if (dist->state() == WslDistribution::StateInstalled)
+                rootfsPaths.emplace_back(uuid, dist->rootfsPath());
+        }
+    } catch (const std::runtime_error &) {
+        return;
     }
 
-    QListWidgetItem *defaultItem = nullptr;
-    if (defaultDist.isValid()) {
-        auto distUuid = QString::fromStdWString(defaultDist.uuid());
-        defaultItem = findDistByUuid(distUuid);
-        if (defaultItem)
-            defaultItem->setText(tr("%1 (Default)").arg(defaultItem->text()));
-    } else if (m_distList->count() != 0) {
-        defaultItem = m_distList->item(0);
+    m_usageThread = std::thread([this, rootfsPaths]() {
+        for (const auto &rootfsPath : rootfsPaths) {
+            if (m_usageCancel)
+                return;
+
+            const QString cachePath = WslDiskUsage::cachePath(rootfsPath.first);
+            WslDiskUsage usage;
+            try {
+                usage.load(cachePath);
+                usage.scan(WslFs(rootfsPath.second), false, &m_usageCancel);
+                if (m_usageCancel)
+                    return;
+                usage.save(cachePath);
+            } catch (const std::runtime_error &) {
+                // The disk usage dialog reports errors for a single distribution
+                continue;
+            }
+
+            const QString uuid = QString::fromStdWString(rootfsPath.first);
+            const WslUsageTotals totals = usage.totals();
+            QMetaObject::invokeMethod(this, [this, uuid, totals]() {
+                m_distModel->setUsage(uuid, totals);
+            }, Qt::QueuedConnection);
+        }
+    });
+}
+
+void WslUi::dedupeDistributions()
+{
+    const QString selectedUuid = currentUuid();
+    WslDedupeDialog dialog(selectedUuid, this);
+    for ( ;; ) {
+        if (dialog.exec() != QDialog::Accepted)
+            return;
+
+        if (dialog.validate())
+            break;
     }
 
-    // Select the previously selected item if applicable, or the WSL default
-    // if one exists.
-    if (!selectedUuid.isEmpty())
-        defaultItem = findDistByUuid(selectedUuid);
-    if (defaultItem)
-        m_distList->setCurrentItem(defaultItem);
+    dialog.performDedupe();
+}
+
+void WslUi::bulkEditDistributions()
+{
+    // The dialog's changes must not be overwritten by an older edit
+    if (m_commitTimer->isActive())
+        commitPendingEdits();
+
+    const QString selectedUuid = currentUuid();
+    WslBulkEditDialog dialog(selectedUuid, this);
+    for ( ;; ) {
+        if (dialog.exec() != QDialog::Accepted)
+            return;
+
+        if (dialog.validate())
+            break;
+    }
+
+    dialog.performBulkEdit();
+
+    try {
+        m_distModel->setSnapshot(WslDistributionCache::instance().snapshot());
+    } catch (const std::runtime_error &) {
+        // The list is updated by the next refresh
+    }
+    distSelected(m_distList->currentIndex());
+}
+
+void WslUi::loadDistributions()
+{
+    // The startup load reads everything anyway
+    if (!m_distsLoaded)
+        return;
+
+    // This is the only place which rereads everything, to recover from
+    // anything the change notifications might have missed.  The model only
+    // applies the differences, so the selection is kept.
+    try {
+        m_distModel->setSnapshot(WslDistributionCache::instance().reloadAll());
+    } catch (const std::runtime_error &err) {
+        QMessageBox::critical(this, QString(),
+                tr("Failed to get distribution list: %1").arg(err.what()));
+    }
+
+    if (!m_distList->currentIndex().isValid())
+        selectInitialDistribution();
+}
+
+void WslUi::selectInitialDistribution()
+{
+    // The WSL default if one exists, or else the first one
+    QModelIndex index = findDistByUuid(m_distModel->defaultUuid());
+    if (!index.isValid())
+        index = m_distFilter->index(0, 0);
+    if (index.isValid())
+        m_distList->setCurrentIndex(index);
 }
 
 void WslUi::setCurrentDistAsDefault()
 {
-    QListWidgetItem *current = m_distList->currentItem();
-    if (current) {
-        const QString uuid = current->data(DistUuidRole).toString();
-        m_registry->setDefaultDistribution(uuid.toStdWString());
-        loadDistributions();
+    const QString uuid = currentUuid();
+    if (!uuid.isEmpty()) {
+        try {
+            auto &cache = WslDistributionCache::instance();
+            cache.setDefaultDistribution(uuid.toStdWString());
+            m_distModel->setSnapshot(cache.snapshot());
+        } catch (const std::runtime_error &err) {
+            QMessageBox::critical(this, QString(),
+                    tr("Failed to set the default distribution: %1").arg(err.what()));
+        }
     }
 }
 
-QListWidgetItem *WslUi::findDistByUuid(const QString &uuid)
+bool WslUi::deleteTree(QWidget *parent, const std::wstring &path)
 {
-    for (int i = 0; i < m_distList->count(); ++i) {
-        QListWidgetItem *item = m_distList->item(i);
-        if (m_distList->item(i)->data(DistUuidRole).toString() == uuid)
-            return item;
+    const QString label = tr("Deleting %1...").arg(QString::fromStdWString(path));
+    QProgressDialog progressDialog(parent);
+    progressDialog.setLabelText(label);
+    progressDialog.setWindowModality(Qt::WindowModal);
+    progressDialog.setMinimumDuration(0);
+    progressDialog.setMaximum(0);
+
+    std::atomic<bool> cancel = false;
+    WslTreeDelete deleter(path);
+    WslUtil::runInBackground([&]() { deleter.run(&cancel); }, [&]() {
+        if (progressDialog.wasCanceled())
+            cancel = true;
+        progressDialog.setLabelText(tr("%1 (%2 files removed)").arg(label)
+                                    .arg(deleter.entriesDeleted()));
+    });
+    return !cancel;
+}
+
+bool WslUi::removeDistribution(QWidget *parent, WslDistribution &dist)
+{
+    const QString distName = QString::fromStdWString(dist.name());
+    try {
+        // Mark the distribution first, so an interrupted removal is picked
+        // up again the next time wslman starts.
+        setPendingRemoval(dist.uuid(), true);
+        dist.setState(WslDistribution::StateUninstalling);
+
+        if (!dist.path().empty()) {
+            const std::wstring basePath = QDir::toNativeSeparators(
+                    QFileInfo(QString::fromStdWString(dist.path())).absoluteFilePath())
+                    .toStdWString();
+
+            // A WSL2 distribution's files are all in its virtual disk, which
+            // is usually far larger than anything else in the base path
+            if (dist.isVmMode()) {
+                const std::wstring vhdPath = basePath + L"\\" + dist.vhdFileName();
+                if (!DeleteFileW(vhdPath.c_str()) && GetLastError() != ERROR_FILE_NOT_FOUND) {
+                    throw std::runtime_error("Could not delete "
+                                             + WslUtil::toUtf8(vhdPath));
+                }
+            }
+
+            for (const wchar_t *subdir : {L"rootfs", L"temp"}) {
+                if (!deleteTree(parent, basePath + L"\\" + subdir))
+                    return false;
+            }
+
+            // Only remove the base directory if nothing else was left in it
+            RemoveDirectoryW(basePath.c_str());
+        }
+
+        WslRegistry registry;
+        registry.unregisterDistribution(dist.uuid());
+        setPendingRemoval(dist.uuid(), false);
+        QFile::remove(WslIndex::indexPath(dist.uuid()));
+        QFile::remove(WslDiskUsage::cachePath(dist.uuid()));
+        QFile::remove(WslConvert::journalPath(dist.uuid()));
+    } catch (const std::runtime_error &err) {
+        QMessageBox::critical(parent, QString(),
+                tr("Failed to remove %1: %2").arg(distName).arg(err.what()));
+        return false;
+    }
+    return true;
+}
+
+void WslUi::applyRegistryChanges(const WslRegistryChanges &changes)
+{
+    // These might not be included in the startup load
+    if (!m_distsLoaded) {
+        m_deferredChanges.push_back(changes);
+        return;
+    }
+
+    WslDistributionCache::SnapshotPtr snapshot;
+    try {
+        snapshot = WslDistributionCache::instance().reload(changes);
+    } catch (const std::runtime_error &) {
+        // The next notification or refresh will try again
+        return;
+    }
+
+    m_distModel->setSnapshot(snapshot);
+
+    // Only reload the details if they are out of date, so an edit in
+    // progress isn't interrupted by our own changes
+    const QModelIndex current = m_distList->currentIndex();
+    if (current.isValid()) {
+        WslDistribution dist = getDistribution(current);
+        if (dist != m_shownDist)
+            distSelected(current);
+    } else {
+        selectInitialDistribution();
     }
-    return nullptr;
+}
+
+void WslUi::finishLoading(const WslDistributionCache::SnapshotPtr &snapshot,
+                          const QString &error)
+{
+    m_loadThread.join();
+    m_distsLoaded = true;
+    m_installDist->setEnabled(true);
+    m_dedupeDists->setEnabled(true);
+    m_bulkEdit->setEnabled(true);
+
+    // Without the registry, the last session's list can't be trusted either
+    if (snapshot)
+        m_distModel->setSnapshot(snapshot);
+    else
+        m_distModel->setSnapshot(std::make_shared<WslDistributionCache::Snapshot>());
+
+    const QModelIndex current = m_distList->currentIndex();
+    if (current.isValid())
+        distSelected(current);
+    else
+        selectInitialDistribution();
+
+    OutputDebugStringW(QStringLiteral("wslman: distributions usable after %1 ms\n")
+                       .arg(m_startupTimer.elapsed()).toStdWString().c_str());
+
+    if (!snapshot) {
+        QMessageBox::critical(this, QString(),
+                tr("Failed to get distribution list: %1").arg(error));
+    }
+
+    const std::vector<WslRegistryChanges> deferred = std::move(m_deferredChanges);
+    m_deferredChanges.clear();
+    for (const WslRegistryChanges &changes : deferred)
+        applyRegistryChanges(changes);
+
+    // Finish removing any distributions that were interrupted last time
+    QTimer::singleShot(0, this, &WslUi::resumeRemovals);
+
+    // The cached disk usage is shown right away, and updated in the
+    // background once the list is complete.
+    QTimer::singleShot(0, this, &WslUi::refreshUsageTotals);
+}
+
+bool WslUi::eventFilter(QObject *watched, QEvent *event)
+{
+    // Installed on the list's viewport, only until it is first painted
+    if (watched == m_distList->viewport() && event->type() == QEvent::Paint) {
+        m_distList->viewport()->removeEventFilter(this);
+        OutputDebugStringW(QStringLiteral("wslman: distribution list painted after %1 ms\n")
+                           .arg(m_startupTimer.elapsed()).toStdWString().c_str());
+    }
+    return QMainWindow::eventFilter(watched, event);
+}
+
+QModelIndex WslUi::findDistByUuid(const QString &uuid) const
+{
+    return m_distFilter->mapFromSource(m_distModel->indexOf(uuid));
+}
+
+QString WslUi::currentUuid() const
+{
+    return m_distList->currentIndex().data(WslDistributionModel::UuidRole).toString();
 }
 
 void WslUi::updateDistProperties(const WslDistribution &dist)
 {
+    m_shownDist = dist;
     m_name->setText(QString::fromStdWString(dist.name()));
 
     switch (dist.version()) {
@@ -503,40 +1283,96 @@ void WslUi::updateDistProperties(const WslDistribution &dist)
         break;
     }
 
-    m_defaultUser->setText(QStringLiteral("%1 (%2)")
-                           .arg(WslUtil::getUsername(dist.name(), dist.defaultUID()))
-                           .arg(QString::number(dist.defaultUID())));
+    updateDefaultUser();
     m_location->setText(QString::fromStdWString(dist.path()));
     m_enableInterop->setChecked(dist.flags() & WslApi::DistributionFlags_EnableInterop);
     m_appendNTPath->setChecked(dist.flags() & WslApi::DistributionFlags_AppendNTPath);
     m_enableDriveMounting->setChecked(dist.flags() & WslApi::DistributionFlags_EnableDriveMounting);
     m_kernelCmdLine->setText(QString::fromStdWString(dist.kernelCmdLine()));
+    updateEnvironmentTree(m_pendingEnvironment ? *m_pendingEnvironment : dist.environment());
+}
 
-    m_defaultEnvironment->clear();
-    for (const std::wstring &envLine : dist.defaultEnvironment()) {
-        auto env = QString::fromStdWString(envLine);
-        QStringList parts = env.split(QLatin1Char('='));
-        if (parts.count() != 2) {
-            QMessageBox::critical(this, QString(),
-                            tr("Invalid environment line: %1").arg(env));
+void WslUi::updateDefaultUser()
+{
+    // Filled in once the model has looked the name up
+    const QModelIndex index = m_distModel->indexOf(QString::fromStdWString(m_shownDist.uuid()));
+    const QVariant userName = index.data(WslDistributionModel::DefaultUserRole);
+    m_defaultUser->setText(QStringLiteral("%1 (%2)")
+                           .arg(userName.isValid() ? userName.toString() : tr("Loading..."))
+                           .arg(QString::number(m_shownDist.defaultUID())));
+}
+
+void WslUi::updateEnvironmentTree(const WslEnvironment &env)
+{
+    // Existing items are updated in place, so the selection and an item
+    // which is being added survive the refresh
+    m_defaultEnvironment->blockSignals(true);
+    std::map<std::wstring, QTreeWidgetItem *> items;
+    int index = 0;
+    while (index < m_defaultEnvironment->topLevelItemCount()) {
+        QTreeWidgetItem *item = m_defaultEnvironment->topLevelItem(index);
+        const QString savedKey = item->data(0, EnvSavedKeyRole).toString();
+        if (savedKey.isEmpty() && item == m_defaultEnvironment->currentItem()) {
+            ++index;
             continue;
         }
 
-        m_defaultEnvironment->blockSignals(true);
-        auto envItem = new QTreeWidgetItem(m_defaultEnvironment, parts);
-        envItem->setFlags(envItem->flags() | Qt::ItemIsEditable);
-        envItem->setData(0, EnvSavedKeyRole, parts.first());
-        m_defaultEnvironment->blockSignals(false);
+        const std::wstring key = savedKey.toStdWString();
+        if (!env.contains(key) || !items.emplace(key, item).second) {
+            delete item;
+            continue;
+        }
+        ++index;
+    }
+
+    for (const auto &[key, value] : env.entries()) {
+        const QString keyText = QString::fromStdWString(key);
+        const QString valueText = QString::fromStdWString(value);
+        auto iter = items.find(key);
+        QTreeWidgetItem *item;
+        if (iter != items.end()) {
+            item = iter->second;
+        } else {
+            item = new QTreeWidgetItem(m_defaultEnvironment);
+            item->setFlags(item->flags() | Qt::ItemIsEditable);
+            item->setData(0, EnvSavedKeyRole, keyText);
+        }
+        if (item->text(0) != keyText)
+            item->setText(0, keyText);
+        if (item->text(1) != valueText)
+            item->setText(1, valueText);
+    }
+    m_defaultEnvironment->blockSignals(false);
+}
+
+void WslUi::updateDistribution(WslDistribution &dist,
+                               const std::function<void (WslDistribution &)> &change)
+{
+    auto &cache = WslDistributionCache::instance();
+    WslDistributionCache::DistPtr updated;
+    try {
+        updated = cache.update(dist.uuid(), change);
+    } catch (const std::runtime_error &) {
+        // The cache has reloaded whatever was written before the failure
+        m_distModel->setSnapshot(cache.snapshot());
+        throw;
     }
+
+    m_distModel->setSnapshot(cache.snapshot());
+    if (updated)
+        dist = *updated;
 }
 
-WslDistribution WslUi::getDistribution(QListWidgetItem *item)
+WslDistribution WslUi::getDistribution(const QModelIndex &index)
 {
-    if (item) {
-        auto uuid = item->data(DistUuidRole).toString();
-        auto distName = item->data(DistNameRole).toString();
+    // The cache would block until the startup load is done
+    if (index.isValid() && m_distsLoaded) {
+        auto uuid = index.data(WslDistributionModel::UuidRole).toString();
+        auto distName = index.data(WslDistributionModel::NameRole).toString();
         try {
-            return WslRegistry::findDistByUuid(uuid.toStdWString());
+            auto dist = WslDistributionCache::instance().find(uuid.toStdWString());
+            if (dist)
+                return *dist;
         } catch (const std::runtime_error &err) {
             QMessageBox::critical(this, QString(),
                     tr("Failed to query distribution %1: %2")
@@ -16,12 +16,21 @@
 
 #pragma once
 
+#include "wsldistcache.h"
+
 #include <QMainWindow>
+#include <QElapsedTimer>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <functional>
+#include <optional>
 
-class WslRegistry;
-class WslDistribution;
-class QListWidget;
-class QListWidgetItem;
+class WslDistributionModel;
+class QListView;
+class QModelIndex;
+class QSortFilterProxyModel;
 class QTreeWidget;
 class QTreeWidgetItem;
 class QLabel;
@@ -29,6 +38,7 @@ class QLineEdit;
 class QCheckBox;
 class QFrame;
 class QAction;
+class QTimer;
 
 class WslUi : public QMainWindow
 {
@@ -37,23 +47,55 @@ public:
     ~WslUi();
 
     static QIcon pickDistIcon(const QString &name);
+    static bool deleteTree(QWidget *parent, const std::wstring &path);
+    static bool removeDistribution(QWidget *parent, WslDistribution &dist);
+
+    // True if the distribution is known to be stopped.  Otherwise shows
+    // runningMessage, or why its state couldn't be determined.
+    static bool checkStopped(QWidget *parent, const WslDistribution &dist,
+                             const QString &runningMessage);
+
+protected:
+    bool eventFilter(QObject *watched, QEvent *event) override;
 
 private slots:
-    void distSelected(QListWidgetItem *current, QListWidgetItem *);
-    void distActivated(QListWidgetItem *item);
+    void distSelected(const QModelIndex &current);
+    void distActivated(const QModelIndex &index);
     void chooseUser(bool);
     void commitDistFlags(bool);
     void commitKernelCmdLine();
+    void commitPendingEdits();
     void environSelected(QTreeWidgetItem *current, QTreeWidgetItem *);
     void environChanged(QTreeWidgetItem *item, int column);
     void deleteSelectedEnviron(bool);
+    void importEnvironment();
+    void exportEnvironment();
     void installDistribution();
+    void dedupeDistributions();
+    void bulkEditDistributions();
+    void cloneDistribution();
+    void moveDistribution();
+    void searchFiles();
+    void showDiskUsage();
+    void verifyDistribution();
+    void remapDistribution();
+    void convertDistribution();
+    void unregisterDistribution();
+    void resumeRemovals();
+    void refreshUsageTotals();
     void loadDistributions();
     void setCurrentDistAsDefault();
+    void applyRegistryChanges(const WslRegistryChanges &changes);
+    void finishLoading(const WslDistributionCache::SnapshotPtr &snapshot,
+                       const QString &error);
 
 private:
-    WslRegistry *m_registry;
-    QListWidget *m_distList;
+    std::unique_ptr<WslRegistryWatcher> m_watcher;
+    WslDistribution m_shownDist;
+    WslDistributionModel *m_distModel;
+    QSortFilterProxyModel *m_distFilter;
+    QLineEdit *m_distSearch;
+    QListView *m_distList;
     QFrame *m_distDetails;
     QLabel *m_name;
     QLabel *m_fsType;
@@ -67,13 +109,55 @@ private:
     QAction *m_envAdd;
     QAction *m_envEdit;
     QAction *m_envDel;
+    QAction *m_envImport;
+    QAction *m_envExport;
+
+    // Environment edits of the shown distribution which haven't been
+    // committed yet
+    std::optional<WslEnvironment> m_pendingEnvironment;
+
+    // Coalesces quick successive edits of the shown distribution into
+    // a single registry write
+    QTimer *m_commitTimer;
 
     QAction *m_openShell;
     QAction *m_setDefault;
+    QAction *m_cloneDist;
+    QAction *m_moveDist;
+    QAction *m_searchFiles;
+    QAction *m_diskUsage;
+    QAction *m_verifyDist;
+    QAction *m_remapDist;
+    QAction *m_convertDist;
+    QAction *m_removeDist;
     QAction *m_installDist;
+    QAction *m_dedupeDists;
+    QAction *m_bulkEdit;
 
-    QListWidgetItem *findDistByUuid(const QString &uuid);
+    std::thread m_usageThread;
+    std::atomic<bool> m_usageCancel;
+
+    // The registry is read in the background at startup.  Until then the
+    // list shows the distributions of the last session, which can't be
+    // edited, and change notifications are kept for later.
+    std::thread m_loadThread;
+    bool m_distsLoaded;
+    std::vector<WslRegistryChanges> m_deferredChanges;
+
+    // For the startup timings, which are reported with OutputDebugString
+    QElapsedTimer m_startupTimer;
+
+    // Indexes are in terms of m_distFilter, as used by m_distList
+    QModelIndex findDistByUuid(const QString &uuid) const;
+    QString currentUuid() const;
+    void selectInitialDistribution();
     void updateDistProperties(const WslDistribution &dist);
+    void updateDefaultUser();
+    void updateEnvironmentTree(const WslEnvironment &env);
+
+    WslDistribution getDistribution(const QModelIndex &index);
 
-    WslDistribution getDistribution(QListWidgetItem *item);
+    // Writes the change through the distribution cache, and updates dist
+    void updateDistribution(WslDistribution &dist,
+                            const std::function<void (WslDistribution &)> &change);
 };
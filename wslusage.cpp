@@ -0,0 +1,513 @@
+/* This file is part of wslman.
+ *
+ * wslman is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * wslman is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with wslman.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "wslusage.h"
+
+#include "wslregistry.h"
+#include "wslutils.h"
+#include <QLabel>
+#include <QPushButton>
+#include <QDialogButtonBox>
+#include <QTreeWidget>
+#include <QHeaderView>
+#include <QTabWidget>
+#include <QGridLayout>
+#include <QProgressDialog>
+#include <QMessageBox>
+#include <QStandardPaths>
+#include <QSaveFile>
+#include <QDataStream>
+#include <QFileInfo>
+#include <QDir>
+#include <QLocale>
+
+#include <algorithm>
+#include <mutex>
+#include <unordered_set>
+
+#define USAGE_MAGIC         0x57534c55  // "WSLU"
+#define USAGE_VERSION       1
+
+// Number of files shown in the largest files list
+#define LARGEST_FILE_COUNT  100
+
+enum {
+    UsagePathRole = Qt::UserRole,
+};
+
+static std::string parentPath(const std::string &unixPath)
+{
+    return unixPath.substr(0, unixPath.rfind('/'));
+}
+
+static QDataStream &operator<<(QDataStream &stream, const WslUsageTotals &totals)
+{
+    return stream << quint64(totals.files) << quint64(totals.directories)
+                  << quint64(totals.size) << quint64(totals.allocated);
+}
+
+static QDataStream &operator>>(QDataStream &stream, WslUsageTotals &totals)
+{
+    quint64 files, directories, size, allocated;
+    stream >> files >> directories >> size >> allocated;
+    totals.files = files;
+    totals.directories = directories;
+    totals.size = size;
+    totals.allocated = allocated;
+    return stream;
+}
+
+static QDataStream &operator<<(QDataStream &stream, const std::string &str)
+{
+    return stream << QByteArray::fromRawData(str.data(), static_cast<int>(str.size()));
+}
+
+static QDataStream &operator>>(QDataStream &stream, std::string &str)
+{
+    QByteArray data;
+    stream >> data;
+    str.assign(data.constData(), static_cast<size_t>(data.size()));
+    return stream;
+}
+
+WslDiskUsage::WslDiskUsage()
+    : m_directoriesScanned(), m_directoriesReused()
+{
+}
+
+QString WslDiskUsage::cachePath(const std::wstring &uuid)
+{
+    return QStandardPaths::writableLocation(QStandardPaths::AppLocalDataLocation)
+            + QStringLiteral("/usage/") + QString::fromStdWString(uuid)
+            + QStringLiteral(".dat");
+}
+
+static bool readHeader(QDataStream &stream, WslUsageTotals &totals)
+{
+    quint32 magic, version;
+    stream >> magic >> version;
+    if (magic != USAGE_MAGIC || version != USAGE_VERSION)
+        return false;
+    stream >> totals;
+    return stream.status() == QDataStream::Ok;
+}
+
+bool WslDiskUsage::loadTotals(const QString &path, WslUsageTotals &totals)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+
+    QDataStream stream(&file);
+    return readHeader(stream, totals);
+}
+
+bool WslDiskUsage::load(const QString &path)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+
+    QDataStream stream(&file);
+    WslUsageTotals totals;
+    if (!readHeader(stream, totals))
+        return false;
+
+    std::unordered_map<std::string, Directory> directories;
+    quint32 directoryCount;
+    stream >> directoryCount;
+    for (quint32 i = 0; i < directoryCount && stream.status() == QDataStream::Ok; ++i) {
+        std::string unixPath;
+        Directory dir;
+        qint64 lastWriteTime;
+        quint32 fileCount, subdirCount;
+        stream >> unixPath >> lastWriteTime >> fileCount;
+        dir.lastWriteTime = lastWriteTime;
+        for (quint32 j = 0; j < fileCount && stream.status() == QDataStream::Ok; ++j) {
+            File entry;
+            quint64 fileId, size, allocated;
+            stream >> entry.name >> fileId >> size >> allocated;
+            entry.fileId = fileId;
+            entry.size = size;
+            entry.allocated = allocated;
+            dir.files.push_back(std::move(entry));
+        }
+        stream >> subdirCount;
+        for (quint32 j = 0; j < subdirCount && stream.status() == QDataStream::Ok; ++j) {
+            std::string name;
+            stream >> name;
+            dir.subdirs.push_back(std::move(name));
+        }
+        directories.emplace(std::move(unixPath), std::move(dir));
+    }
+    if (stream.status() != QDataStream::Ok)
+        return false;
+
+    m_directories.swap(directories);
+    computeTotals();
+    return true;
+}
+
+void WslDiskUsage::save(const QString &path) const
+{
+    QDir().mkpath(QFileInfo(path).absolutePath());
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly))
+        throw std::runtime_error("Could not create disk usage cache");
+
+    // The totals come first, so the distribution list can show them without
+    // loading the rest of the file.
+    QDataStream stream(&file);
+    stream << quint32(USAGE_MAGIC) << quint32(USAGE_VERSION) << m_totals;
+    stream << quint32(m_directories.size());
+    for (const auto &dir : m_directories) {
+        stream << dir.first << qint64(dir.second.lastWriteTime)
+               << quint32(dir.second.files.size());
+        for (const File &entry : dir.second.files) {
+            stream << entry.name << quint64(entry.fileId) << quint64(entry.size)
+                   << quint64(entry.allocated);
+        }
+        stream << quint32(dir.second.subdirs.size());
+        for (const std::string &name : dir.second.subdirs)
+            stream << name;
+    }
+
+    if (stream.status() != QDataStream::Ok || !file.commit())
+        throw std::runtime_error("Could not write disk usage cache");
+}
+
+static std::wstring directoryPath(const WslFs &rootfs, const std::string &unixPath)
+{
+    std::wstring ntPath = rootfs.path(unixPath);
+    if (ntPath.back() == L'\\')
+        ntPath.pop_back();
+    return ntPath;
+}
+
+static int64_t directoryWriteTime(const std::wstring &ntPath, const std::string &unixPath)
+{
+    UniqueHandle hDir = CreateFileW(ntPath.c_str(), FILE_READ_ATTRIBUTES,
+                                    FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                    nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr);
+    FILE_BASIC_INFO info;
+    if (hDir == INVALID_HANDLE_VALUE
+            || !GetFileInformationByHandleEx(hDir.get(), FileBasicInfo, &info, sizeof(info)))
+        throw std::runtime_error("Could not open directory " + unixPath);
+    return info.LastWriteTime.QuadPart;
+}
+
+WslDiskUsage::Directory WslDiskUsage::listDirectory(const WslFs &rootfs,
+                                                    const std::wstring &ntPath,
+                                                    const PendingDirectory &pending,
+                                                    std::vector<PendingDirectory> &subdirs)
+{
+    UniqueHandle hDir = CreateFileW(ntPath.c_str(), FILE_LIST_DIRECTORY | SYNCHRONIZE,
+                                    FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                    nullptr, OPEN_EXISTING,
+                                    FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OPEN_REPARSE_POINT,
+                                    nullptr);
+    if (hDir == INVALID_HANDLE_VALUE)
+        throw std::runtime_error("Could not open directory " + pending.unixPath);
+
+    Directory dir;
+    dir.lastWriteTime = pending.lastWriteTime;
+    WslFs::listDirectory(hDir.get(), [&](const FILE_ID_BOTH_DIR_INFO &info) {
+        std::string name = rootfs.unixName(std::wstring_view(info.FileName,
+                                           info.FileNameLength / sizeof(wchar_t)));
+        if ((info.FileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+                && !(info.FileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)) {
+            subdirs.push_back({pending.unixPath + "/" + name, info.LastWriteTime.QuadPart, true});
+            dir.subdirs.push_back(std::move(name));
+        } else {
+            File entry;
+            entry.name = std::move(name);
+            entry.fileId = static_cast<uint64_t>(info.FileId.QuadPart);
+            entry.size = static_cast<uint64_t>(info.EndOfFile.QuadPart);
+            entry.allocated = static_cast<uint64_t>(info.AllocationSize.QuadPart);
+            dir.files.push_back(std::move(entry));
+        }
+    });
+    return dir;
+}
+
+void WslDiskUsage::scan(const WslFs &rootfs, bool full, const std::atomic<bool> *cancel)
+{
+    m_directoriesScanned = 0;
+    m_directoriesReused = 0;
+
+    // Directories are processed one level at a time.  A listed directory
+    // also provides the timestamps of its subdirectories; for a directory
+    // taken from the cache, each subdirectory has to be opened to check it.
+    std::unordered_map<std::string, Directory> directories;
+    std::mutex directoriesMutex;
+    std::vector<PendingDirectory> level{{std::string(), 0, false}};
+    std::vector<PendingDirectory> nextLevel;
+    auto processDirectory = [&](size_t index) {
+        PendingDirectory &pending = level[index];
+        const std::wstring ntPath = directoryPath(rootfs, pending.unixPath);
+        if (!pending.timeKnown)
+            pending.lastWriteTime = directoryWriteTime(ntPath, pending.unixPath);
+
+        Directory dir;
+        std::vector<PendingDirectory> subdirs;
+        auto cached = full ? m_directories.end() : m_directories.find(pending.unixPath);
+        if (cached != m_directories.end()
+                && cached->second.lastWriteTime == pending.lastWriteTime) {
+            // Each cached entry is only ever touched by one thread
+            dir = std::move(cached->second);
+            for (const std::string &name : dir.subdirs)
+                subdirs.push_back({pending.unixPath + "/" + name, 0, false});
+            ++m_directoriesReused;
+        } else {
+            dir = listDirectory(rootfs, ntPath, pending, subdirs);
+            ++m_directoriesScanned;
+        }
+
+        std::lock_guard<std::mutex> lock(directoriesMutex);
+        directories.emplace(std::move(pending.unixPath), std::move(dir));
+        nextLevel.insert(nextLevel.end(), std::make_move_iterator(subdirs.begin()),
+                         std::make_move_iterator(subdirs.end()));
+    };
+
+    // Entries may have been moved out of the cache already, so it has to be
+    // rebuilt from scratch after an interrupted scan.
+    try {
+        while (!level.empty() && (!cancel || !*cancel)) {
+            WslUtil::parallelFor(level.size(), processDirectory, cancel);
+            level.swap(nextLevel);
+            nextLevel.clear();
+        }
+    } catch (...) {
+        m_directories.clear();
+        computeTotals();
+        throw;
+    }
+    if (cancel && *cancel) {
+        m_directories.clear();
+        computeTotals();
+        return;
+    }
+
+    m_directories.swap(directories);
+    computeTotals();
+}
+
+void WslDiskUsage::computeTotals()
+{
+    std::vector<std::string> paths;
+    paths.reserve(m_directories.size());
+    for (auto &dir : m_directories) {
+        dir.second.totals = WslUsageTotals();
+        paths.push_back(dir.first);
+    }
+
+    // Count each hard linked file for whichever of its names sorts first,
+    // so the result doesn't depend on the order of the scan.
+    std::sort(paths.begin(), paths.end());
+    std::unordered_set<uint64_t> seenFiles;
+    for (const std::string &unixPath : paths) {
+        Directory &dir = m_directories[unixPath];
+        dir.totals.directories = dir.subdirs.size();
+        for (const File &entry : dir.files) {
+            if (!seenFiles.insert(entry.fileId).second)
+                continue;
+            ++dir.totals.files;
+            dir.totals.size += entry.size;
+            dir.totals.allocated += entry.allocated;
+        }
+    }
+
+    // Descendants always sort after their ancestors, so walking the list
+    // backwards accumulates the totals bottom-up.
+    for (auto iter = paths.rbegin(); iter != paths.rend(); ++iter) {
+        if (iter->empty())
+            continue;
+        auto parent = m_directories.find(parentPath(*iter));
+        if (parent == m_directories.end())
+            continue;
+        const WslUsageTotals &totals = m_directories[*iter].totals;
+        parent->second.totals.files += totals.files;
+        parent->second.totals.directories += totals.directories;
+        parent->second.totals.size += totals.size;
+        parent->second.totals.allocated += totals.allocated;
+    }
+
+    auto root = m_directories.find(std::string());
+    m_totals = (root != m_directories.end()) ? root->second.totals : WslUsageTotals();
+}
+
+WslUsageTotals WslDiskUsage::directoryTotals(const std::string &unixPath) const
+{
+    auto dir = m_directories.find(unixPath);
+    return (dir != m_directories.end()) ? dir->second.totals : WslUsageTotals();
+}
+
+std::vector<std::string> WslDiskUsage::subdirectories(const std::string &unixPath) const
+{
+    std::vector<std::string> result;
+    auto dir = m_directories.find(unixPath);
+    if (dir != m_directories.end()) {
+        for (const std::string &name : dir->second.subdirs)
+            result.push_back(unixPath + "/" + name);
+    }
+    return result;
+}
+
+std::vector<WslUsageFile> WslDiskUsage::largestFiles(size_t count) const
+{
+    std::vector<WslUsageFile> result;
+    std::unordered_set<uint64_t> seenFiles;
+    for (const auto &dir : m_directories) {
+        for (const File &entry : dir.second.files) {
+            if (seenFiles.insert(entry.fileId).second)
+                result.push_back({dir.first + "/" + entry.name, entry.size, entry.allocated});
+        }
+    }
+
+    count = std::min(count, result.size());
+    std::partial_sort(result.begin(), result.begin() + count, result.end(),
+                      [](const WslUsageFile &a, const WslUsageFile &b) {
+        return a.allocated > b.allocated;
+    });
+    result.resize(count);
+    return result;
+}
+
+WslUsageDialog::WslUsageDialog(const QString &uuid, QWidget *parent)
+    : QDialog(parent), m_uuid(uuid.toStdWString())
+{
+    setWindowTitle(tr("Disk Usage"));
+
+    m_summary = new QLabel(this);
+    auto rescanButton = new QPushButton(tr("&Full Rescan"), this);
+
+    auto tabs = new QTabWidget(this);
+    m_directories = new QTreeWidget(tabs);
+    m_directories->setHeaderLabels(QStringList{tr("Directory"), tr("On Disk"),
+                                               tr("Size"), tr("Files")});
+    m_directories->setUniformRowHeights(true);
+    m_directories->header()->setSectionResizeMode(0, QHeaderView::Stretch);
+    tabs->addTab(m_directories, tr("&Directories"));
+
+    m_largestFiles = new QTreeWidget(tabs);
+    m_largestFiles->setHeaderLabels(QStringList{tr("File"), tr("On Disk"), tr("Size")});
+    m_largestFiles->setRootIsDecorated(false);
+    m_largestFiles->setUniformRowHeights(true);
+    m_largestFiles->header()->setSectionResizeMode(0, QHeaderView::Stretch);
+    tabs->addTab(m_largestFiles, tr("&Largest Files"));
+
+    auto buttons = new QDialogButtonBox(QDialogButtonBox::Close, this);
+    connect(buttons, &QDialogButtonBox::rejected, this, &QDialog::reject);
+    connect(rescanButton, &QPushButton::clicked, this, [this](bool) { refresh(true); });
+    connect(m_directories, &QTreeWidget::itemExpanded, this,
+            [this](QTreeWidgetItem *item) { directoryExpanded(item); });
+
+    auto layout = new QGridLayout(this);
+    layout->addWidget(m_summary, 0, 0);
+    layout->addWidget(rescanButton, 0, 1);
+    layout->addWidget(tabs, 1, 0, 1, 2);
+    layout->addWidget(buttons, 2, 0, 1, 2);
+    resize(700, 500);
+
+    m_usage.load(WslDiskUsage::cachePath(m_uuid));
+}
+
+void WslUsageDialog::refresh(bool full)
+{
+    QProgressDialog progressDialog(this);
+    progressDialog.setLabelText(tr("Scanning directories..."));
+    progressDialog.setWindowModality(Qt::WindowModal);
+    progressDialog.setMinimumDuration(500);
+    progressDialog.setMaximum(0);
+
+    std::atomic<bool> cancel = false;
+    try {
+        WslDistribution dist = WslRegistry::findDistByUuid(m_uuid);
+        if (!dist.isValid())
+            throw std::runtime_error("Distribution no longer exists");
+
+        const WslFs rootfs(dist.rootfsPath());
+        WslUtil::runInBackground([&]() { m_usage.scan(rootfs, full, &cancel); }, [&]() {
+            if (progressDialog.wasCanceled())
+                cancel = true;
+            progressDialog.setLabelText(tr("Scanning directories... (%1 scanned, %2 unchanged)")
+                                        .arg(m_usage.directoriesScanned())
+                                        .arg(m_usage.directoriesReused()));
+        });
+        if (!cancel)
+            m_usage.save(WslDiskUsage::cachePath(m_uuid));
+    } catch (const std::runtime_error &err) {
+        QMessageBox::critical(this, QString(),
+                tr("Failed to scan distribution: %1").arg(err.what()));
+    }
+
+    const WslUsageTotals &totals = m_usage.totals();
+    m_summary->setText(tr("%1 on disk (%2 apparent size), %3 files, %4 directories")
+                       .arg(QLocale().formattedDataSize(static_cast<qint64>(totals.allocated)))
+                       .arg(QLocale().formattedDataSize(static_cast<qint64>(totals.size)))
+                       .arg(totals.files).arg(totals.directories));
+
+    m_directories->clear();
+    addDirectoryItems(m_directories->invisibleRootItem(), std::string());
+
+    m_largestFiles->clear();
+    QList<QTreeWidgetItem *> items;
+    for (const WslUsageFile &entry : m_usage.largestFiles(LARGEST_FILE_COUNT)) {
+        items << new QTreeWidgetItem(QStringList{
+            QString::fromStdString(entry.unixPath),
+            QLocale().formattedDataSize(static_cast<qint64>(entry.allocated)),
+            QLocale().formattedDataSize(static_cast<qint64>(entry.size)),
+        });
+    }
+    m_largestFiles->addTopLevelItems(items);
+}
+
+void WslUsageDialog::addDirectoryItems(QTreeWidgetItem *parent, const std::string &unixPath)
+{
+    std::vector<std::pair<std::string, WslUsageTotals>> subdirs;
+    for (std::string &subdir : m_usage.subdirectories(unixPath))
+        subdirs.emplace_back(std::move(subdir), WslUsageTotals());
+    for (auto &subdir : subdirs)
+        subdir.second = m_usage.directoryTotals(subdir.first);
+    std::sort(subdirs.begin(), subdirs.end(), [](const auto &a, const auto &b) {
+        return a.second.allocated > b.second.allocated;
+    });
+
+    for (const auto &subdir : subdirs) {
+        const QString name = QString::fromStdString(
+                    subdir.first.substr(subdir.first.rfind('/') + 1));
+        auto item = new QTreeWidgetItem(parent, QStringList{
+            name,
+            QLocale().formattedDataSize(static_cast<qint64>(subdir.second.allocated)),
+            QLocale().formattedDataSize(static_cast<qint64>(subdir.second.size)),
+            QString::number(subdir.second.files),
+        });
+        item->setData(0, UsagePathRole, QString::fromStdString(subdir.first));
+
+        // Children are only added once the item is expanded
+        if (subdir.second.directories != 0)
+            item->setChildIndicatorPolicy(QTreeWidgetItem::ShowIndicator);
+    }
+}
+
+void WslUsageDialog::directoryExpanded(QTreeWidgetItem *item)
+{
+    if (item->childCount() != 0)
+        return;
+
+    addDirectoryItems(item, item->data(0, UsagePathRole).toString().toStdString());
+    item->setChildIndicatorPolicy(QTreeWidgetItem::DontShowIndicatorWhenChildless);
+}
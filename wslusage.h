@@ -0,0 +1,133 @@
+/* This file is part of wslman.
+ *
+ * wslman is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * wslman is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with wslman.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "wslfs.h"
+
+#include <QDialog>
+#include <unordered_map>
+#include <vector>
+
+class QLabel;
+class QTreeWidget;
+class QTreeWidgetItem;
+
+struct WslUsageTotals
+{
+    uint64_t files;
+    uint64_t directories;
+    uint64_t size;          // Apparent size
+    uint64_t allocated;     // Space actually used on disk
+
+    WslUsageTotals() : files(), directories(), size(), allocated() { }
+};
+
+struct WslUsageFile
+{
+    std::string unixPath;
+    uint64_t size;
+    uint64_t allocated;
+};
+
+// Disk usage of a rootfs, cached per directory.  A refresh only lists the
+// directories whose timestamp changed since the previous scan, and reuses the
+// cached contents of the rest.  Hard links are only counted once.
+class WslDiskUsage
+{
+public:
+    WslDiskUsage();
+
+    static QString cachePath(const std::wstring &uuid);
+
+    // Read only the totals from a cache file, which is much cheaper than
+    // loading the whole file.
+    static bool loadTotals(const QString &path, WslUsageTotals &totals);
+
+    bool load(const QString &path);
+    void save(const QString &path) const;
+
+    // Update the usage data from the rootfs.  Unless full is set, only the
+    // changed directories are listed again; note that a file which grew in
+    // place doesn't change its directory's timestamp.
+    void scan(const WslFs &rootfs, bool full, const std::atomic<bool> *cancel = nullptr);
+
+    // These may be queried from another thread while scan() is active
+    uint64_t directoriesScanned() const { return m_directoriesScanned; }
+    uint64_t directoriesReused() const { return m_directoriesReused; }
+
+    const WslUsageTotals &totals() const { return m_totals; }
+    WslUsageTotals directoryTotals(const std::string &unixPath) const;
+    std::vector<std::string> subdirectories(const std::string &unixPath) const;
+    std::vector<WslUsageFile> largestFiles(size_t count) const;
+
+private:
+    struct File
+    {
+        std::string name;
+        uint64_t fileId;
+        uint64_t size;
+        uint64_t allocated;
+    };
+
+    struct PendingDirectory
+    {
+        std::string unixPath;
+        int64_t lastWriteTime;
+        bool timeKnown;
+    };
+
+    struct Directory
+    {
+        int64_t lastWriteTime;
+        std::vector<File> files;
+        std::vector<std::string> subdirs;
+
+        // Everything below this directory; not persisted
+        WslUsageTotals totals;
+    };
+
+    // Keyed by Unix path, with "" for the root
+    std::unordered_map<std::string, Directory> m_directories;
+    WslUsageTotals m_totals;
+
+    std::atomic<uint64_t> m_directoriesScanned;
+    std::atomic<uint64_t> m_directoriesReused;
+
+    static Directory listDirectory(const WslFs &rootfs, const std::wstring &ntPath,
+                                   const PendingDirectory &pending,
+                                   std::vector<PendingDirectory> &subdirs);
+    void computeTotals();
+};
+
+class WslUsageDialog : public QDialog
+{
+public:
+    WslUsageDialog(const QString &uuid, QWidget *parent = nullptr);
+
+    // Refresh the cached usage data and show it
+    void refresh(bool full);
+
+private:
+    std::wstring m_uuid;
+    WslDiskUsage m_usage;
+    QLabel *m_summary;
+    QTreeWidget *m_directories;
+    QTreeWidget *m_largestFiles;
+
+    void addDirectoryItems(QTreeWidgetItem *parent, const std::string &unixPath);
+    void directoryExpanded(QTreeWidgetItem *item);
+};
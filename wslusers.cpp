@@ -0,0 +1,227 @@
+/* This file is part of wslman.
+ *
+ * wslman is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * wslman is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with wslman.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "wslusers.h"
+
+#include "wslregistry.h"
+
+#include <charconv>
+#include <mutex>
+
+// Rootfs path -> latest snapshot
+static std::mutex s_cacheMutex;
+static std::unordered_map<std::wstring, std::shared_ptr<const WslUserDb>> s_userDbs;
+
+std::shared_ptr<const WslUserDb> WslUserDb::forDistribution(const std::wstring &distName)
+{
+    // Names are reused after a rename, so the name is resolved every time.
+    // The registry's name index makes that a single key read.
+    WslRegistry registry;
+    WslDistribution dist = registry.findDistByName(distName);
+    if (!dist.isValid())
+        return nullptr;
+    return forRootfs(dist.rootfsPath());
+}
+
+std::shared_ptr<const WslUserDb> WslUserDb::forRootfs(const std::wstring &rootfsPath)
+{
+    // The paths used here need no escaping, so the rootfs format does not
+    // need to be detected.
+    const WslFs rootfs = WslFs::open(rootfsPath, WslApi::v2);
+
+    std::shared_ptr<const WslUserDb> cached;
+    {
+        std::lock_guard<std::mutex> lock(s_cacheMutex);
+        auto iter = s_userDbs.find(rootfsPath);
+        if (iter != s_userDbs.end())
+            cached = iter->second;
+    }
+    if (cached && cached->isCurrent(rootfs))
+        return cached;
+
+    std::shared_ptr<WslUserDb> userDb(new WslUserDb);
+    if (!userDb->m_passwd.load(rootfs, "/etc/passwd")) {
+        std::lock_guard<std::mutex> lock(s_cacheMutex);
+        s_userDbs.erase(rootfsPath);
+        return nullptr;
+    }
+    userDb->m_group.load(rootfs, "/etc/group");
+    userDb->parsePasswd();
+    userDb->parseGroup();
+
+    std::lock_guard<std::mutex> lock(s_cacheMutex);
+    s_userDbs[rootfsPath] = userDb;
+    return userDb;
+}
+
+const WslUser *WslUserDb::findUser(const std::string_view &name) const
+{
+    auto iter = m_userNames.find(name);
+    return (iter != m_userNames.end()) ? &m_users[iter->second] : nullptr;
+}
+
+const WslUser *WslUserDb::findUser(uint32_t uid) const
+{
+    auto iter = m_userIds.find(uid);
+    return (iter != m_userIds.end()) ? &m_users[iter->second] : nullptr;
+}
+
+const WslGroup *WslUserDb::findGroup(const std::string_view &name) const
+{
+    auto iter = m_groupNames.find(name);
+    return (iter != m_groupNames.end()) ? &m_groups[iter->second] : nullptr;
+}
+
+const WslGroup *WslUserDb::findGroup(uint32_t gid) const
+{
+    auto iter = m_groupIds.find(gid);
+    return (iter != m_groupIds.end()) ? &m_groups[iter->second] : nullptr;
+}
+
+bool WslUserDb::DbFile::load(const WslFs &rootfs, const char *unixPath)
+{
+    content.clear();
+    size = 0;
+    lastWriteTime = 0;
+
+    UniqueHandle hFile = rootfs.openFile(unixPath);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return false;
+
+    FILE_BASIC_INFO info;
+    LARGE_INTEGER fileSize;
+    if (!GetFileInformationByHandleEx(hFile.get(), FileBasicInfo, &info, sizeof(info))
+            || !GetFileSizeEx(hFile.get(), &fileSize)) {
+        return false;
+    }
+
+    // Read the whole file at once; the parsed entries refer directly into it
+    content.resize(static_cast<size_t>(fileSize.QuadPart));
+    size_t offset = 0;
+    while (offset < content.size()) {
+        DWORD nRead = 0;
+        if (!ReadFile(hFile.get(), content.data() + offset,
+                      static_cast<DWORD>(content.size() - offset), &nRead, nullptr)
+                || nRead == 0) {
+            break;
+        }
+        offset += nRead;
+    }
+    content.resize(offset);
+
+    size = static_cast<uint64_t>(fileSize.QuadPart);
+    lastWriteTime = info.LastWriteTime.QuadPart;
+    return true;
+}
+
+bool WslUserDb::DbFile::isCurrent(const WslFs &rootfs, const char *unixPath) const
+{
+    WIN32_FILE_ATTRIBUTE_DATA info;
+    if (!GetFileAttributesExW(rootfs.path(unixPath).c_str(), GetFileExInfoStandard, &info))
+        return lastWriteTime == 0;
+
+    const uint64_t fileSize = (static_cast<uint64_t>(info.nFileSizeHigh) << 32)
+                            | info.nFileSizeLow;
+    const int64_t fileTime = static_cast<int64_t>(
+                (static_cast<uint64_t>(info.ftLastWriteTime.dwHighDateTime) << 32)
+                | info.ftLastWriteTime.dwLowDateTime);
+    return fileSize == size && fileTime == lastWriteTime;
+}
+
+bool WslUserDb::isCurrent(const WslFs &rootfs) const
+{
+    return m_passwd.isCurrent(rootfs, "/etc/passwd")
+        && m_group.isCurrent(rootfs, "/etc/group");
+}
+
+// Split a line into exactly count colon-separated fields
+static bool splitFields(std::string_view line, std::string_view *fields, size_t count)
+{
+    for (size_t i = 0; i < count - 1; ++i) {
+        const size_t end = line.find(':');
+        if (end == line.npos)
+            return false;
+        fields[i] = line.substr(0, end);
+        line.remove_prefix(end + 1);
+    }
+    fields[count - 1] = line;
+    return true;
+}
+
+static bool parseId(const std::string_view &field, uint32_t &id)
+{
+    const char *end = field.data() + field.size();
+    auto result = std::from_chars(field.data(), end, id);
+    return result.ec == std::errc() && result.ptr == end;
+}
+
+template <typename LineVisitor>
+static void forEachLine(std::string_view content, const LineVisitor &visitor)
+{
+    while (!content.empty()) {
+        size_t end = content.find('\n');
+        std::string_view line = content.substr(0, end);
+        content.remove_prefix(end == content.npos ? content.size() : end + 1);
+
+        if (!line.empty() && line.back() == '\r')
+            line.remove_suffix(1);
+
+        // NIS compat entries (+/-) are resolved by the distribution itself
+        if (line.empty() || line.front() == '#' || line.front() == '+'
+                || line.front() == '-') {
+            continue;
+        }
+        visitor(line);
+    }
+}
+
+void WslUserDb::parsePasswd()
+{
+    forEachLine(m_passwd.content, [this](const std::string_view &line) {
+        std::string_view fields[7];
+        WslUser user;
+        if (!splitFields(line, fields, std::size(fields)) || !parseId(fields[2], user.uid)
+                || !parseId(fields[3], user.gid)) {
+            return;
+        }
+        user.name = fields[0];
+        user.gecos = fields[4];
+        user.home = fields[5];
+        user.shell = fields[6];
+
+        // As with getpwnam() and getpwuid(), the first match wins
+        m_userNames.emplace(user.name, m_users.size());
+        m_userIds.emplace(user.uid, m_users.size());
+        m_users.push_back(user);
+    });
+}
+
+void WslUserDb::parseGroup()
+{
+    forEachLine(m_group.content, [this](const std::string_view &line) {
+        std::string_view fields[4];
+        WslGroup group;
+        if (!splitFields(line, fields, std::size(fields)) || !parseId(fields[2], group.gid))
+            return;
+        group.name = fields[0];
+        group.members = fields[3];
+
+        m_groupNames.emplace(group.name, m_groups.size());
+        m_groupIds.emplace(group.gid, m_groups.size());
+        m_groups.push_back(group);
+    });
+}
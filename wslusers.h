@@ -0,0 +1,89 @@
+/* This file is part of wslman.
+ *
+ * wslman is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * wslman is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with wslman.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "wslfs.h"
+
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+// Fields are views into the file contents held by the owning WslUserDb
+struct WslUser
+{
+    std::string_view name;
+    uint32_t uid;
+    uint32_t gid;
+    std::string_view gecos;
+    std::string_view home;
+    std::string_view shell;
+};
+
+struct WslGroup
+{
+    std::string_view name;
+    uint32_t gid;
+    std::string_view members;
+};
+
+// Immutable snapshot of a distribution's /etc/passwd and /etc/group, indexed
+// by name and ID.  Snapshots are cached per distribution, and are reloaded
+// only when the size or modification time of either file changes.
+class WslUserDb
+{
+public:
+    static std::shared_ptr<const WslUserDb> forDistribution(const std::wstring &distName);
+    static std::shared_ptr<const WslUserDb> forRootfs(const std::wstring &rootfsPath);
+
+    const std::vector<WslUser> &users() const { return m_users; }
+    const std::vector<WslGroup> &groups() const { return m_groups; }
+
+    const WslUser *findUser(const std::string_view &name) const;
+    const WslUser *findUser(uint32_t uid) const;
+    const WslGroup *findGroup(const std::string_view &name) const;
+    const WslGroup *findGroup(uint32_t gid) const;
+
+private:
+    struct DbFile
+    {
+        std::string content;
+        uint64_t size;
+        int64_t lastWriteTime;
+
+        bool load(const WslFs &rootfs, const char *unixPath);
+        bool isCurrent(const WslFs &rootfs, const char *unixPath) const;
+    };
+
+    DbFile m_passwd;
+    DbFile m_group;
+
+    std::vector<WslUser> m_users;
+    std::vector<WslGroup> m_groups;
+    std::unordered_map<std::string_view, size_t> m_userNames;
+    std::unordered_map<uint32_t, size_t> m_userIds;
+    std::unordered_map<std::string_view, size_t> m_groupNames;
+    std::unordered_map<uint32_t, size_t> m_groupIds;
+
+    WslUserDb() = default;
+    WslUserDb(const WslUserDb &) = delete;
+    WslUserDb &operator=(const WslUserDb &) = delete;
+
+    bool isCurrent(const WslFs &rootfs) const;
+    void parsePasswd();
+    void parseGroup();
+};
@@ -16,22 +16,63 @@
 
 #include "wslutils.h"
 
-#include "wslregistry.h"
 #include "wslfs.h"
+#include "wslusers.h"
+#include "wslrunner.h"
 #include <QMessageBox>
 #include <QIcon>
+#include <QCoreApplication>
+#include <QDir>
+#include <QWinEventNotifier>
+#include <QTimer>
 #if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
 #include <QtWin>
 #endif
 #include <process.h>
+#include <bcrypt.h>
+
+#include <thread>
+#include <future>
+#include <deque>
+#include <algorithm>
+
+// How long createConsole() waits for a previous shell to attach to its
+// console, e.g. while a WSL2 VM is starting
+#define CONSOLE_ATTACH_TIMEOUT  30000
+
+// The context which currently has this process's console, if any
+static WslConsoleContext *s_consoleOwner = nullptr;
+
+// Shells which were requested while the console was in use
+struct PendingShell
+{
+    std::wstring name;
+    QIcon icon;
+    QPointer<QWidget> parent;
+};
+static std::deque<PendingShell> s_pendingShells;
 
 WslConsoleContext *WslConsoleContext::createConsole(const std::wstring &name,
                                                     const QIcon &icon)
 {
+    // Only one console can be attached to this process at a time.  This
+    // only waits if another shell was started just before.
+    if (s_consoleOwner && s_consoleOwner->attachNotifier) {
+        if (WaitForSingleObject(s_consoleOwner->attachedEvent, CONSOLE_ATTACH_TIMEOUT)
+                == WAIT_OBJECT_0) {
+            s_consoleOwner->finishAttach();
+        }
+    }
+    if (s_consoleOwner)
+        throw std::runtime_error("Another shell is still starting");
+
+    AllocConsole();
     SetConsoleTitleW(name.c_str());
 
     auto context = new WslConsoleContext;
+    s_consoleOwner = context;
     context->distName = name;
+    context->launcher = std::make_shared<WslDistLauncher>(name);
 
     const QIcon distIcon = icon;
 #if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
@@ -55,24 +96,55 @@ static unsigned _startShell(void *pvContext)
 {
     auto context = reinterpret_cast<WslConsoleContext *>(pvContext);
 
-    DWORD exitCode;
+    DWORD exitCode = 1;
     try {
-        WslApi::LaunchInteractive(context->distName.c_str(), L"", FALSE, &exitCode);
+        // The shell process is attached to the console as soon as it has
+        // been created, so it's ready once launch() returns
+        SECURITY_ATTRIBUTES security = {sizeof(security), nullptr, TRUE};
+        UniqueHandle hConIn = CreateFileW(L"CONIN$", GENERIC_READ | GENERIC_WRITE,
+                                          FILE_SHARE_READ | FILE_SHARE_WRITE, &security,
+                                          OPEN_EXISTING, 0, nullptr);
+        UniqueHandle hConOut = CreateFileW(L"CONOUT$", GENERIC_READ | GENERIC_WRITE,
+                                           FILE_SHARE_READ | FILE_SHARE_WRITE, &security,
+                                           OPEN_EXISTING, 0, nullptr);
+        if (hConIn == INVALID_HANDLE_VALUE || hConOut == INVALID_HANDLE_VALUE)
+            throw std::runtime_error("Could not open the console");
+
+        UniqueHandle hProcess = context->launcher->launch(std::wstring(), hConIn.get(),
+                                                          hConOut.get(), hConOut.get());
+        context->timeToShell = std::chrono::steady_clock::now() - context->startTime;
+        SetEvent(context->attachedEvent);
+
+        hConIn.release();
+        hConOut.release();
+        WaitForSingleObject(hProcess.get(), INFINITE);
+        GetExitCodeProcess(hProcess.get(), &exitCode);
     } catch (const std::runtime_error &err) {
         context->errorMessage = QObject::tr("Failed to start %1: %2")
                                 .arg(context->distName).arg(err.what());
+        SetEvent(context->attachedEvent);
     }
 
     fclose(context->stdoutStream);
     fclose(context->stderrStream);
 
-    context->shellTerminated = true;
     context->unref();
     return exitCode;
 }
 
-void WslConsoleContext::startConsoleThread(QWidget *parent)
+void WslConsoleContext::startConsoleThread(QWidget *parentWidget)
 {
+    parent = parentWidget;
+    attachedEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    if (!attachedEvent) {
+        QMessageBox::critical(parentWidget, QString(),
+                              QObject::tr("Failed to start %1: Could not create event")
+                              .arg(distName));
+        cancelConsole();
+        return;
+    }
+    startTime = std::chrono::steady_clock::now();
+
     // Add a ref for the thread.  When the thread exits, it should call unref()
     ref();
 
@@ -81,110 +153,97 @@ void WslConsoleContext::startConsoleThread(QWidget *parent)
                         reinterpret_cast<void *>(this), 0, &threadId));
     CloseHandle(th);
 
-    // Detach from the console once the WSL process starts using it
-    DWORD processList[4];
-    DWORD processCount = 4;
-    for ( ;; ) {
-        DWORD activeProcs = GetConsoleProcessList(processList, processCount);
-        if (activeProcs > 1 || shellTerminated)
-            break;
-        Sleep(100);
-    }
-    if (!errorMessage.isEmpty())
+    // The caller's reference is dropped by finishAttach()
+    attachNotifier = new QWinEventNotifier(attachedEvent);
+    QObject::connect(attachNotifier, &QWinEventNotifier::activated,
+                     attachNotifier, [this]() { finishAttach(); });
+}
+
+void WslConsoleContext::finishAttach()
+{
+    attachNotifier->setEnabled(false);
+    attachNotifier->deleteLater();
+    attachNotifier = nullptr;
+
+    // Detach from the console, now that the WSL process is using it
+    releaseConsole();
+
+    if (errorMessage.isEmpty()) {
+        using namespace std::chrono;
+        const auto msecs = duration_cast<milliseconds>(timeToShell).count();
+        OutputDebugStringW(QStringLiteral("wslman: shell for %1 attached after %2 ms\n")
+                           .arg(QString::fromStdWString(distName)).arg(msecs)
+                           .toStdWString().c_str());
+    } else {
         QMessageBox::critical(parent, QString(), errorMessage);
+    }
     unref();
 }
 
-typedef std::tuple<std::string, uint32_t, uint32_t> UserInfo;
-
-static std::list<UserInfo> readPasswdFile(const std::wstring &distName)
+void WslConsoleContext::cancelConsole()
 {
-    WslRegistry registry;
-    WslDistribution dist = registry.findDistByName(distName);
-    if (!dist.isValid())
-        return {};
+    fclose(stdoutStream);
+    fclose(stderrStream);
+    releaseConsole();
+    unref();
+}
 
-    UniqueHandle hPasswd;
-    try {
-        WslFs rootfs(dist.rootfsPath());
-        hPasswd = rootfs.openFile("/etc/passwd");
-        if (hPasswd == INVALID_HANDLE_VALUE)
-            return {};
-    } catch (const std::runtime_error &) {
-        return {};
+void WslConsoleContext::releaseConsole()
+{
+    FreeConsole();
+    if (s_consoleOwner == this)
+        s_consoleOwner = nullptr;
+
+    // The next shell is started from the event loop, so it doesn't take
+    // over the console in the middle of whatever released it
+    if (!s_pendingShells.empty()) {
+        QTimer::singleShot(0, []() {
+            // Otherwise this is posted again when the new owner releases it
+            if (s_consoleOwner || s_pendingShells.empty())
+                return;
+            PendingShell shell = std::move(s_pendingShells.front());
+            s_pendingShells.pop_front();
+            launchShell(shell.name, shell.icon, shell.parent);
+        });
     }
+}
 
-    std::string content;
-    for ( ;; ) {
-        char buffer[1024];
-        DWORD nRead = 0;
-        if (!ReadFile(hPasswd.get(), buffer, static_cast<DWORD>(std::size(buffer)),
-                      &nRead, nullptr) || nRead == 0) {
-            break;
-        }
-        content += std::string_view(buffer, nRead);
+void WslConsoleContext::launchShell(const std::wstring &name, const QIcon &icon,
+                                    QWidget *parentWidget)
+{
+    // The console is released from the event loop, so this never has to
+    // wait for a previous shell to attach
+    if (s_consoleOwner) {
+        s_pendingShells.push_back({name, icon, parentWidget});
+        return;
     }
 
-    std::list<UserInfo> result;
-    size_t start = 0;
-    for ( ;; ) {
-        size_t end = content.find(':', start);
-        if (end == content.npos)
-            break;
-        std::string_view username(content.c_str() + start, end - start);
-        start = end + 1;
-
-        // Password hash
-        end = content.find(':', start);
-        if (end == content.npos)
-            break;
-        start = end + 1;
-
-        // UID
-        uint32_t uid = static_cast<uint32_t>(std::strtoul(content.c_str() + start, nullptr, 10));
-        end = content.find(':', start);
-        if (end == content.npos)
-            break;
-        start = end + 1;
-
-        // GID
-        uint32_t gid = static_cast<uint32_t>(std::strtoul(content.c_str() + start, nullptr, 10));
-        end = content.find(':', start);
-        if (end == content.npos)
-            break;
-        start = end + 1;
-
-        result.emplace_back(username, uid, gid);
-
-        // Advance to next line
-        end = content.find('\n', start);
-        if (end == content.npos)
-            break;
-        start = end + 1;
+    WslConsoleContext *context;
+    try {
+        context = createConsole(name, icon);
+    } catch (const std::runtime_error &err) {
+        QMessageBox::critical(parentWidget, QString(),
+                              QObject::tr("Failed to start %1: %2")
+                              .arg(QString::fromStdWString(name)).arg(err.what()));
+        return;
     }
-
-    return result;
+    context->startConsoleThread(parentWidget);
 }
 
 QString WslUtil::getUsername(const std::wstring &distName, uint32_t uid)
 {
-    auto passwd = readPasswdFile(distName);
-    for (const auto &user : passwd) {
-        if (std::get<1>(user) == uid)
-            return QString::fromStdString(std::get<0>(user));
-    }
-    return QString();
+    auto userDb = WslUserDb::forDistribution(distName);
+    const WslUser *user = userDb ? userDb->findUser(uid) : nullptr;
+    if (!user)
+        return QString();
+    return QString::fromUtf8(user->name.data(), static_cast<int>(user->name.size()));
 }
 
 uint32_t WslUtil::getUid(const std::wstring &distName, const QString &username)
 {
-    auto passwd = readPasswdFile(distName);
-    const std::string u8Username = username.toStdString();
-    for (const auto &user : passwd) {
-        if (std::get<0>(user) == u8Username)
-            return std::get<1>(user);
-    }
-    return INVALID_UID;
+    auto userDb = WslUserDb::forDistribution(distName);
+    const WslUser *user = userDb ? userDb->findUser(username.toStdString()) : nullptr;
+    return user ? user->uid : INVALID_UID;
 }
 
 std::wstring WslUtil::fromUtf8(const std::string_view &utf8)
@@ -237,3 +296,218 @@ bool WslUtil::checkWindowsVersion(unsigned build)
 
     return false;
 }
+
+// Runs wsl.exe --list with the given options, and returns whether it
+// succeeded.  The names are written as UTF-16, one per line.
+static bool listDistributions(const std::wstring &options, std::wstring &names)
+{
+    wchar_t systemDir[MAX_PATH];
+    const UINT length = GetSystemDirectoryW(systemDir, MAX_PATH);
+    if (length == 0 || length >= MAX_PATH)
+        throw std::runtime_error("Could not find wsl.exe");
+
+    WslCommandRunner runner(std::make_unique<WslProcessLauncher>());
+    runner.start(L"\"" + std::wstring(systemDir) + L"\\wsl.exe\" --list " + options);
+    if (runner.wait() != 0)
+        return false;
+
+    uint64_t position = 0;
+    const std::string output = runner.output().readFrom(position);
+    names.assign(output.size() / sizeof(wchar_t), L'\0');
+    memcpy(names.data(), output.data(), names.size() * sizeof(wchar_t));
+    return true;
+}
+
+bool WslUtil::isDistributionRunning(const std::wstring &distName)
+{
+    if (!checkWindowsVersion(Windows1903))
+        throw std::runtime_error("Running distributions can't be queried on this version of Windows");
+
+    // wsl.exe fails with a (localized) message instead of listing nothing.
+    // That's only taken to mean nothing is running if listing all of the
+    // distributions works, so any other failure isn't mistaken for it.
+    std::wstring names;
+    if (!listDistributions(L"--running --quiet", names)) {
+        std::wstring allNames;
+        if (!listDistributions(L"--quiet", allNames))
+            throw std::runtime_error("Could not query the running distributions");
+        return false;
+    }
+
+    size_t start = 0;
+    while (start < names.size()) {
+        size_t end = names.find(L'\n', start);
+        if (end == std::wstring::npos)
+            end = names.size();
+        std::wstring line = names.substr(start, end - start);
+        while (!line.empty() && (line.back() == L'\r' || line.back() == L' ' || line.back() == L'\0'))
+            line.pop_back();
+        if (CompareStringOrdinal(line.c_str(), static_cast<int>(line.size()),
+                                 distName.c_str(), static_cast<int>(distName.size()),
+                                 TRUE) == CSTR_EQUAL) {
+            return true;
+        }
+        start = end + 1;
+    }
+    return false;
+}
+
+bool WslUtil::isDirectoryEmpty(const QString &path)
+{
+    const QFileInfoList entries = QDir(path).entryInfoList(
+            QDir::NoDotAndDotDot | QDir::AllEntries | QDir::AllDirs
+            | QDir::Hidden | QDir::System);
+    return entries.count() == 0;
+}
+
+static void runWorkers(size_t count, size_t maxThreads, const std::function<void ()> &worker)
+{
+    size_t threadCount = std::min<size_t>(count,
+                                std::max(2u, std::thread::hardware_concurrency()));
+    if (maxThreads != 0)
+        threadCount = std::min(threadCount, maxThreads);
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < threadCount; ++i)
+        threads.emplace_back(worker);
+    for (auto &thread : threads)
+        thread.join();
+}
+
+void WslUtil::parallelFor(size_t count, const std::function<void (size_t)> &func,
+                          const std::atomic<bool> *cancel)
+{
+    std::atomic<size_t> nextIndex = 0;
+    std::mutex errorMutex;
+    std::exception_ptr error;
+
+    runWorkers(count, 0, [&]() {
+        for ( ;; ) {
+            const size_t index = nextIndex++;
+            if (index >= count || (cancel && *cancel))
+                break;
+            try {
+                func(index);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(errorMutex);
+                if (!error)
+                    error = std::current_exception();
+                nextIndex = count;
+            }
+        }
+    });
+
+    if (error)
+        std::rethrow_exception(error);
+}
+
+std::vector<std::exception_ptr>
+WslUtil::parallelForEach(size_t count, const std::function<void (size_t)> &func,
+                         size_t maxThreads)
+{
+    // Each index only writes its own slot, so this needs no locking
+    std::vector<std::exception_ptr> errors(count);
+    std::atomic<size_t> nextIndex = 0;
+
+    runWorkers(count, maxThreads, [&]() {
+        for ( ;; ) {
+            const size_t index = nextIndex++;
+            if (index >= count)
+                break;
+            try {
+                func(index);
+            } catch (...) {
+                errors[index] = std::current_exception();
+            }
+        }
+    });
+
+    return errors;
+}
+
+void WslUtil::runInBackground(const std::function<void ()> &job,
+                              const std::function<void ()> &pollProgress)
+{
+    auto result = std::async(std::launch::async, job);
+    while (result.wait_for(std::chrono::milliseconds(50)) != std::future_status::ready) {
+        pollProgress();
+        QCoreApplication::processEvents();
+    }
+    pollProgress();
+
+    // Rethrows any exception from the job
+    result.get();
+}
+
+void WslIoBudget::consume(uint64_t bytes)
+{
+    if (m_limit == 0)
+        return;
+
+    std::chrono::steady_clock::time_point wakeTime;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        const auto now = std::chrono::steady_clock::now();
+        if (m_nextSlot < now)
+            m_nextSlot = now;
+        wakeTime = m_nextSlot;
+        m_nextSlot += std::chrono::microseconds(bytes * 1000000 / m_limit);
+    }
+    std::this_thread::sleep_until(wakeTime);
+}
+
+static BCRYPT_ALG_HANDLE sha256Provider()
+{
+    struct ProviderHandle
+    {
+        BCRYPT_ALG_HANDLE handle = nullptr;
+
+        ProviderHandle()
+        {
+            if (!BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(&handle, BCRYPT_SHA256_ALGORITHM,
+                                                           nullptr, 0)))
+                handle = nullptr;
+        }
+
+        ~ProviderHandle()
+        {
+            if (handle)
+                BCryptCloseAlgorithmProvider(handle, 0);
+        }
+    };
+
+    static ProviderHandle s_provider;
+    if (!s_provider.handle)
+        throw std::runtime_error("SHA-256 provider is unavailable");
+    return s_provider.handle;
+}
+
+WslHash::WslHash()
+    : m_hash()
+{
+    if (!BCRYPT_SUCCESS(BCryptCreateHash(sha256Provider(), &m_hash, nullptr, 0,
+                                         nullptr, 0, 0)))
+        throw std::runtime_error("Failed to create hash object");
+}
+
+WslHash::~WslHash()
+{
+    if (m_hash)
+        BCryptDestroyHash(m_hash);
+}
+
+void WslHash::update(const void *data, size_t size)
+{
+    auto bytes = reinterpret_cast<PUCHAR>(const_cast<void *>(data));
+    if (!BCRYPT_SUCCESS(BCryptHashData(m_hash, bytes, static_cast<ULONG>(size), 0)))
+        throw std::runtime_error("Failed to hash data");
+}
+
+WslHash::Digest WslHash::finish()
+{
+    Digest digest;
+    if (!BCRYPT_SUCCESS(BCryptFinishHash(m_hash, digest.data(),
+                                         static_cast<ULONG>(digest.size()), 0)))
+        throw std::runtime_error("Failed to finish hash");
+    return digest;
+}
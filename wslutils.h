@@ -20,24 +20,45 @@
 #include <windows.h>
 
 #include <QString>
+#include <QPointer>
 #include <string>
+#include <array>
 #include <atomic>
+#include <mutex>
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <vector>
 
 class QWidget;
 class QIcon;
+class QWinEventNotifier;
+class WslLauncher;
 
 #define INVALID_UID 0xffffffff
 
 struct WslConsoleContext
 {
     std::wstring distName;
-    std::atomic<bool> shellTerminated = false;
     QString errorMessage;
     HICON distIconBig = nullptr;
     HICON distIconSmall = nullptr;
     FILE *stdoutStream = nullptr;
     FILE *stderrStream = nullptr;
 
+    // The shell is started through this, so another backend can be
+    // substituted for the distribution
+    std::shared_ptr<WslLauncher> launcher;
+
+    // Signalled once the shell has attached to the console, or has failed
+    // to start.  Our own console can only be released after that.
+    HANDLE attachedEvent = nullptr;
+    QWinEventNotifier *attachNotifier = nullptr;
+    QPointer<QWidget> parent;
+    std::chrono::steady_clock::time_point startTime;
+    std::chrono::steady_clock::duration timeToShell {};
+
     std::atomic<int> refs = 1;
     void ref() { ++refs; }
     void unref()
@@ -50,11 +71,30 @@ struct WslConsoleContext
     {
         DestroyIcon(distIconBig);
         DestroyIcon(distIconSmall);
+        if (attachedEvent)
+            CloseHandle(attachedEvent);
     }
 
+    // Allocates a new console for the distribution, after any previous
+    // shell has taken over its own console.  Throws if that takes too long.
     static WslConsoleContext *createConsole(const std::wstring &name, const QIcon &icon);
 
-    void startConsoleThread(QWidget *parent);
+    // Starts a shell in a new console without blocking.  If the console is
+    // still in use, the shell is started once it has been released.
+    static void launchShell(const std::wstring &name, const QIcon &icon,
+                            QWidget *parentWidget);
+
+    // Returns without waiting for the shell.  The console is released from
+    // the event loop once the shell has attached to it.
+    void startConsoleThread(QWidget *parentWidget);
+    void finishAttach();
+
+    // Releases the console without starting a shell in it
+    void cancelConsole();
+
+    // Frees this process's console, and then starts the next shell which
+    // was waiting for it
+    void releaseConsole();
 };
 
 class UniqueHandle
@@ -125,6 +165,46 @@ private:
     HANDLE m_handle;
 };
 
+// Limits the I/O throughput of a single operation.  The budget is shared
+// between all worker threads of that operation.
+class WslIoBudget
+{
+public:
+    explicit WslIoBudget(uint64_t bytesPerSecond = 0)
+        : m_limit(bytesPerSecond) { }
+
+    uint64_t limit() const { return m_limit; }
+    void setLimit(uint64_t bytesPerSecond) { m_limit = bytesPerSecond; }
+
+    // Blocks the calling thread until the budget allows another `bytes`
+    // bytes of I/O.  Does nothing for an unlimited (zero) budget.
+    void consume(uint64_t bytes);
+
+private:
+    std::mutex m_mutex;
+    uint64_t m_limit;
+    std::chrono::steady_clock::time_point m_nextSlot;
+};
+
+// SHA-256 digest, backed by the Windows CNG provider
+class WslHash
+{
+public:
+    typedef std::array<uint8_t, 32> Digest;
+
+    WslHash();
+    ~WslHash();
+
+    WslHash(const WslHash &) = delete;
+    WslHash &operator=(const WslHash &) = delete;
+
+    void update(const void *data, size_t size);
+    Digest finish();
+
+private:
+    void *m_hash;
+};
+
 namespace WslUtil
 {
     QString getUsername(const std::wstring &distName, uint32_t uid);
@@ -137,8 +217,34 @@ namespace WslUtil
     {
         Windows1803 = 17134,
         Windows1809 = 17763,
+        Windows1903 = 18362,
     };
     bool checkWindowsVersion(unsigned build);
+
+    // Asks wsl.exe whether the distribution has any running instance.
+    // Throws if that can't be determined, e.g. before Windows 1903 or if
+    // wsl.exe fails.
+    bool isDistributionRunning(const std::wstring &distName);
+
+    bool isDirectoryEmpty(const QString &path);
+
+    // Calls func(0) through func(count - 1) from a pool of worker threads.
+    // The first exception thrown by any call is rethrown to the caller.
+    void parallelFor(size_t count, const std::function<void (size_t)> &func,
+                     const std::atomic<bool> *cancel = nullptr);
+
+    // Like parallelFor(), but every call runs even if others throw.  The
+    // exception of each call is returned at its index (null if it didn't
+    // throw).  A maxThreads of 0 uses the same number of threads as
+    // parallelFor().
+    std::vector<std::exception_ptr>
+    parallelForEach(size_t count, const std::function<void (size_t)> &func,
+                    size_t maxThreads = 0);
+
+    // Runs job on a worker thread, and calls pollProgress periodically on
+    // the calling (GUI) thread while keeping its event loop alive.
+    void runInBackground(const std::function<void ()> &job,
+                         const std::function<void ()> &pollProgress);
 }
 
 // TODO: Use C++20
@@ -0,0 +1,735 @@
+/* This file is part of wslman.
+ *
+ * wslman is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * wslman is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with wslman.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "wslverify.h"
+
+#include "wslregistry.h"
+#include <QLabel>
+#include <QLineEdit>
+#include <QRadioButton>
+#include <QCheckBox>
+#include <QDialogButtonBox>
+#include <QPushButton>
+#include <QToolButton>
+#include <QGridLayout>
+#include <QFileDialog>
+#include <QProgressDialog>
+#include <QMessageBox>
+#include <QLocale>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QDir>
+
+#include <archive.h>
+#include <archive_entry.h>
+
+#include <algorithm>
+#include <charconv>
+#include <future>
+#include <mutex>
+
+#define HASH_BLOCK_SIZE     (1024 * 1024)
+#define ARCHIVE_BLOCK_SIZE  16384
+
+#define MANIFEST_HEADER     "# wslman manifest 1"
+
+static std::string archiveError(archive *arc)
+{
+    return std::string("Failed to read archive: ") + archive_error_string(arc);
+}
+
+// Tarball paths may be relative, or start with "./", and directories may
+// have a trailing slash.  Returns an empty string for the root.
+static std::string archivePath(const char *u8path, const wchar_t *wpath)
+{
+    std::string path;
+    if (u8path)
+        path = u8path;
+    else if (wpath)
+        path = WslUtil::toUtf8(wpath);
+    else
+        return path;
+
+    if (starts_with(path, "./"))
+        path = path.substr(1);
+    else if (!starts_with(path, "/"))
+        path = "/" + path;
+    while (!path.empty() && path.back() == '/')
+        path.pop_back();
+    if (path == "/.")
+        path.clear();
+    return path;
+}
+
+// Manifest fields are tab separated, so escape anything that would break
+// the line structure.
+static std::string escapeField(const std::string &field)
+{
+    std::string result;
+    for (char ch : field) {
+        if (ch == '%' || ch == '\t' || ch == '\n' || ch == '\r') {
+            char escape[4];
+            snprintf(escape, sizeof(escape), "%%%02X", static_cast<unsigned char>(ch));
+            result.append(escape);
+        } else {
+            result.push_back(ch);
+        }
+    }
+    return result;
+}
+
+// The whole field must be a number.  Unlike std::stoul, this rejects signs,
+// whitespace and trailing garbage, and reports errors as runtime_error.
+template <typename Number>
+static Number parseNumber(const std::string_view &field, int base = 10)
+{
+    Number value = 0;
+    const char *end = field.data() + field.size();
+    auto result = std::from_chars(field.data(), end, value, base);
+    if (field.empty() || result.ec != std::errc() || result.ptr != end)
+        throw std::runtime_error("Invalid number \"" + std::string(field) + "\"");
+    return value;
+}
+
+static std::string unescapeField(const std::string &field)
+{
+    std::string result;
+    for (size_t i = 0; i < field.size(); ++i) {
+        if (field[i] == '%') {
+            if (i + 2 >= field.size())
+                throw std::runtime_error("Truncated escape sequence");
+            const std::string_view escape(field.data() + i + 1, 2);
+            result.push_back(static_cast<char>(parseNumber<uint8_t>(escape, 16)));
+            i += 2;
+        } else {
+            result.push_back(field[i]);
+        }
+    }
+    return result;
+}
+
+static std::string digestToHex(const WslHash::Digest &digest)
+{
+    static const char hexDigits[] = "0123456789abcdef";
+    std::string result;
+    for (uint8_t byte : digest) {
+        result.push_back(hexDigits[byte >> 4]);
+        result.push_back(hexDigits[byte & 0x0f]);
+    }
+    return result;
+}
+
+static WslHash::Digest digestFromHex(const std::string &hex)
+{
+    WslHash::Digest digest;
+    if (hex.size() != digest.size() * 2)
+        throw std::runtime_error("Invalid digest length");
+    for (size_t i = 0; i < digest.size(); ++i)
+        digest[i] = parseNumber<uint8_t>(std::string_view(hex.data() + i * 2, 2), 16);
+    return digest;
+}
+
+WslVerify::WslVerify(const WslFs &rootfs)
+    : m_rootfs(rootfs), m_quick(), m_phase(Scanning), m_entriesScanned(),
+      m_bytesToHash(), m_bytesHashed()
+{
+    if (m_rootfs.version() == WslApi::InvalidVersion)
+        throw std::runtime_error("Unsupported rootfs format");
+}
+
+WslVerify::EntryMap WslVerify::readTarball(const std::atomic<bool> *cancel) const
+{
+    std::unique_ptr<archive, decltype(&archive_read_free)> tarball(
+        archive_read_new(), &archive_read_free
+    );
+    archive_read_support_filter_all(tarball.get());
+    archive_read_support_format_all(tarball.get());
+    if (archive_read_open_filename_w(tarball.get(), m_tarball.c_str(),
+                                     ARCHIVE_BLOCK_SIZE) != ARCHIVE_OK)
+        throw std::runtime_error(archiveError(tarball.get()));
+
+    // The archive can only be read sequentially, so its contents are hashed
+    // here while the rootfs side is hashed in parallel.
+    EntryMap entries;
+    for ( ;; ) {
+        if (cancel && *cancel)
+            break;
+
+        archive_entry *ent;
+        int rc = archive_read_next_header(tarball.get(), &ent);
+        if (rc == ARCHIVE_EOF)
+            break;
+        else if (rc != ARCHIVE_OK)
+            throw std::runtime_error(archiveError(tarball.get()));
+
+        const std::string path = archivePath(archive_entry_pathname(ent),
+                                             archive_entry_pathname_w(ent));
+        if (path.empty())
+            continue;
+
+        Entry entry = {};
+        const std::string hardLink = archivePath(archive_entry_hardlink(ent),
+                                                 archive_entry_hardlink_w(ent));
+        if (!hardLink.empty()) {
+            auto target = entries.find(hardLink);
+            if (target != entries.end())
+                entry = target->second;
+            entry.isHardLink = true;
+            entry.target = hardLink;
+            entries[path] = std::move(entry);
+            continue;
+        }
+
+        auto astat = archive_entry_stat(ent);
+        entry.mode = astat->st_mode;
+        entry.uid = astat->st_uid;
+        entry.gid = astat->st_gid;
+        entry.size = static_cast<uint64_t>(archive_entry_size(ent));
+
+        const auto type = archive_entry_filetype(ent);
+        if (type == AE_IFLNK) {
+            // Symlink targets are compared exactly as written
+            const char *u8target = archive_entry_symlink(ent);
+            const wchar_t *wtarget = archive_entry_symlink_w(ent);
+            if (u8target)
+                entry.target = u8target;
+            else if (wtarget)
+                entry.target = WslUtil::toUtf8(wtarget);
+        } else if (type == AE_IFREG && !m_quick) {
+            WslHash hash;
+            for ( ;; ) {
+                const void *buffer;
+                size_t size;
+                int64_t offset;
+                rc = archive_read_data_block(tarball.get(), &buffer, &size, &offset);
+                if (rc == ARCHIVE_EOF)
+                    break;
+                else if (rc != ARCHIVE_OK)
+                    throw std::runtime_error(archiveError(tarball.get()));
+                hash.update(buffer, size);
+            }
+            entry.digest = hash.finish();
+            entry.hasDigest = true;
+        }
+        entries[path] = std::move(entry);
+    }
+    return entries;
+}
+
+WslVerify::EntryMap WslVerify::readManifest() const
+{
+    QFile manifest(QString::fromStdWString(m_manifest));
+    if (!manifest.open(QIODevice::ReadOnly)
+            || manifest.readLine().trimmed() != QByteArray(MANIFEST_HEADER))
+        throw std::runtime_error("Not a valid manifest file");
+
+    EntryMap entries;
+    int lineNumber = 1;
+    while (!manifest.atEnd()) {
+        ++lineNumber;
+        const std::string line = manifest.readLine().trimmed().toStdString();
+        if (line.empty())
+            continue;
+
+        std::vector<std::string> fields;
+        size_t start = 0;
+        for ( ;; ) {
+            const size_t end = line.find('\t', start);
+            fields.push_back(line.substr(start, end - start));
+            if (end == std::string::npos)
+                break;
+            start = end + 1;
+        }
+        const std::string location = "Invalid manifest entry on line "
+                                   + std::to_string(lineNumber);
+        if (fields.size() != 7)
+            throw std::runtime_error(location + ": expected 7 fields");
+
+        Entry entry = {};
+        try {
+            entry.mode = parseNumber<uint32_t>(fields[1], 8);
+            entry.uid = parseNumber<uint32_t>(fields[2]);
+            entry.gid = parseNumber<uint32_t>(fields[3]);
+            entry.size = parseNumber<uint64_t>(fields[4]);
+            if (fields[5] != "-") {
+                entry.digest = digestFromHex(fields[5]);
+                entry.hasDigest = true;
+            }
+
+            // The link field is "=path" for a hard link, "@target" for a symlink
+            if (starts_with(fields[6], "=")) {
+                entry.isHardLink = true;
+                entry.target = unescapeField(fields[6].substr(1));
+            } else if (starts_with(fields[6], "@")) {
+                entry.target = unescapeField(fields[6].substr(1));
+            }
+            entries[unescapeField(fields[0])] = std::move(entry);
+        } catch (const std::runtime_error &err) {
+            throw std::runtime_error(location + ": " + err.what());
+        }
+    }
+    return entries;
+}
+
+WslVerify::EntryMap WslVerify::scanRootfs(const std::atomic<bool> *cancel)
+{
+    EntryMap entries;
+    std::mutex entriesMutex;
+    m_rootfs.walk("", [&](const WslDirEntry &dirEntry) {
+        Entry entry = {};
+        entry.ntPath = dirEntry.ntPath;
+        entry.fileId = dirEntry.fileId;
+        entry.size = dirEntry.size;
+
+        UniqueHandle hFile = CreateFileW(dirEntry.ntPath.c_str(),
+                                         GENERIC_READ | FILE_READ_EA | FILE_READ_ATTRIBUTES,
+                                         FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                         nullptr, OPEN_EXISTING,
+                                         FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OPEN_REPARSE_POINT,
+                                         nullptr);
+        if (hFile == INVALID_HANDLE_VALUE)
+            throw std::runtime_error("Could not open " + dirEntry.unixPath);
+
+        try {
+            const WslAttr attr = m_rootfs.getAttr(hFile.get());
+            entry.mode = attr.mode;
+            entry.uid = attr.uid;
+            entry.gid = attr.gid;
+        } catch (const std::runtime_error &) {
+            // Files created from Windows have no LX metadata at all
+            const bool isDirectory = dirEntry.isDirectory() && !dirEntry.isReparsePoint();
+            entry.mode = isDirectory ? LX_IFDIR : LX_IFREG;
+        }
+        if ((entry.mode & LX_IFMT) == LX_IFLNK) {
+            entry.target = m_rootfs.readSymlink(hFile.get());
+            entry.size = entry.target.size();
+        }
+        ++m_entriesScanned;
+
+        std::lock_guard<std::mutex> lock(entriesMutex);
+        entries.emplace(dirEntry.unixPath, std::move(entry));
+    }, cancel);
+    if (cancel && *cancel)
+        return entries;
+
+    // Names which share a file ID are hard links; the first name (in sorted
+    // order) holds the metadata and digest for the whole group.
+    std::unordered_map<uint64_t, std::vector<std::string>> linkGroups;
+    for (const auto &entry : entries) {
+        if ((entry.second.mode & LX_IFMT) != LX_IFDIR)
+            linkGroups[entry.second.fileId].push_back(entry.first);
+    }
+
+    std::vector<Entry *> toHash;
+    for (auto &group : linkGroups) {
+        std::sort(group.second.begin(), group.second.end());
+        for (size_t i = 1; i < group.second.size(); ++i) {
+            Entry &link = entries[group.second[i]];
+            link.isHardLink = true;
+            link.target = group.second.front();
+        }
+
+        Entry &first = entries[group.second.front()];
+        if (!m_quick && (first.mode & LX_IFMT) == LX_IFREG) {
+            toHash.push_back(&first);
+            m_bytesToHash += first.size;
+        }
+    }
+
+    m_phase = Hashing;
+    WslUtil::parallelFor(toHash.size(), [&](size_t index) {
+        hashFile(*toHash[index]);
+    }, cancel);
+    return entries;
+}
+
+void WslVerify::hashFile(Entry &entry)
+{
+    UniqueHandle hFile = CreateFileW(entry.ntPath.c_str(), GENERIC_READ,
+                                     FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                     nullptr, OPEN_EXISTING,
+                                     FILE_FLAG_OPEN_REPARSE_POINT | FILE_FLAG_SEQUENTIAL_SCAN,
+                                     nullptr);
+    if (hFile == INVALID_HANDLE_VALUE) {
+        // Reported as a content difference
+        m_bytesHashed += entry.size;
+        return;
+    }
+
+    WslHash hash;
+    auto buffer = std::make_unique<std::byte[]>(HASH_BLOCK_SIZE);
+    uint64_t hashed = 0;
+    for ( ;; ) {
+        DWORD nRead = 0;
+        if (!ReadFile(hFile.get(), buffer.get(), HASH_BLOCK_SIZE, &nRead, nullptr))
+            break;
+        if (nRead == 0) {
+            entry.digest = hash.finish();
+            entry.hasDigest = true;
+            break;
+        }
+        hash.update(buffer.get(), nRead);
+        hashed += nRead;
+        m_bytesHashed += nRead;
+    }
+    if (hashed < entry.size)
+        m_bytesHashed += entry.size - hashed;
+}
+
+void WslVerify::compare(const EntryMap &expected, const EntryMap &actual)
+{
+    // Hard links share the metadata of the first name in their group
+    auto resolveLink = [](const EntryMap &entries, const Entry &entry) -> const Entry & {
+        if (entry.isHardLink) {
+            auto target = entries.find(entry.target);
+            if (target != entries.end())
+                return target->second;
+        }
+        return entry;
+    };
+
+    char buffer[64];
+    for (const auto &expectedEntry : expected) {
+        auto actualEntry = actual.find(expectedEntry.first);
+        if (actualEntry == actual.end()) {
+            m_missing.push_back(expectedEntry.first);
+            continue;
+        }
+
+        const Entry &want = resolveLink(expected, expectedEntry.second);
+        const Entry &have = resolveLink(actual, actualEntry->second);
+        std::vector<std::string> reasons;
+        if ((want.mode & LX_IFMT) != (have.mode & LX_IFMT)) {
+            reasons.push_back("file type");
+        } else {
+            if (want.mode != have.mode) {
+                snprintf(buffer, sizeof(buffer), "mode %04o -> %04o",
+                         want.mode & ~LX_IFMT, have.mode & ~LX_IFMT);
+                reasons.push_back(buffer);
+            }
+            if (want.uid != have.uid || want.gid != have.gid) {
+                snprintf(buffer, sizeof(buffer), "owner %u:%u -> %u:%u",
+                         want.uid, want.gid, have.uid, have.gid);
+                reasons.push_back(buffer);
+            }
+            if ((want.mode & LX_IFMT) == LX_IFREG) {
+                if (want.size != have.size)
+                    reasons.push_back("size");
+                else if (want.hasDigest && (!have.hasDigest || want.digest != have.digest))
+                    reasons.push_back("content");
+            } else if ((want.mode & LX_IFMT) == LX_IFLNK && want.target != have.target) {
+                reasons.push_back("symlink target " + want.target + " -> " + have.target);
+            }
+        }
+
+        // Extra links (e.g. from deduplication) are fine, but files which
+        // should be linked must still share their data.
+        if (expectedEntry.second.isHardLink) {
+            auto linkTarget = actual.find(expectedEntry.second.target);
+            if (linkTarget == actual.end()
+                    || linkTarget->second.fileId != actualEntry->second.fileId)
+                reasons.push_back("not hard linked to " + expectedEntry.second.target);
+        }
+
+        if (!reasons.empty()) {
+            std::string reason = reasons.front();
+            for (size_t i = 1; i < reasons.size(); ++i)
+                reason += ", " + reasons[i];
+            m_modified.push_back({expectedEntry.first, std::move(reason)});
+        }
+    }
+
+    for (const auto &actualEntry : actual) {
+        if (expected.find(actualEntry.first) == expected.end())
+            m_extra.push_back(actualEntry.first);
+    }
+
+    std::sort(m_missing.begin(), m_missing.end());
+    std::sort(m_modified.begin(), m_modified.end(), [](const Difference &a, const Difference &b) {
+        return a.unixPath < b.unixPath;
+    });
+    std::sort(m_extra.begin(), m_extra.end());
+}
+
+void WslVerify::run(const std::atomic<bool> *cancel)
+{
+    m_phase = Scanning;
+    m_entriesScanned = 0;
+    m_bytesToHash = 0;
+    m_bytesHashed = 0;
+    m_missing.clear();
+    m_modified.clear();
+    m_extra.clear();
+
+    // The reference is read on its own thread while the rootfs is scanned
+    auto reference = std::async(std::launch::async, [this, cancel]() {
+        return m_tarball.empty() ? readManifest() : readTarball(cancel);
+    });
+    const EntryMap actual = scanRootfs(cancel);
+    const EntryMap expected = reference.get();
+    if (cancel && *cancel)
+        return;
+
+    m_phase = Comparing;
+    compare(expected, actual);
+    m_phase = Finished;
+}
+
+void WslVerify::saveManifest(const std::wstring &path, const std::atomic<bool> *cancel)
+{
+    m_phase = Scanning;
+    m_entriesScanned = 0;
+    m_bytesToHash = 0;
+    m_bytesHashed = 0;
+
+    const EntryMap entries = scanRootfs(cancel);
+    if (cancel && *cancel)
+        return;
+
+    std::vector<const EntryMap::value_type *> sorted;
+    sorted.reserve(entries.size());
+    for (const auto &entry : entries)
+        sorted.push_back(&entry);
+    std::sort(sorted.begin(), sorted.end(), [](const auto *a, const auto *b) {
+        return a->first < b->first;
+    });
+
+    QSaveFile manifest(QString::fromStdWString(path));
+    if (!manifest.open(QIODevice::WriteOnly))
+        throw std::runtime_error("Could not create manifest file");
+    manifest.write(MANIFEST_HEADER "\n");
+
+    char buffer[64];
+    for (const auto *entry : sorted) {
+        const Entry &info = entry->second;
+        std::string line = escapeField(entry->first);
+        snprintf(buffer, sizeof(buffer), "\t%o\t%u\t%u\t%llu\t", info.mode, info.uid,
+                 info.gid, static_cast<unsigned long long>(info.size));
+        line += buffer;
+        line += info.hasDigest ? digestToHex(info.digest) : std::string("-");
+        if (info.isHardLink)
+            line += "\t=" + escapeField(info.target);
+        else if ((info.mode & LX_IFMT) == LX_IFLNK)
+            line += "\t@" + escapeField(info.target);
+        else
+            line += "\t-";
+        line += '\n';
+        manifest.write(line.data(), static_cast<qint64>(line.size()));
+    }
+
+    if (!manifest.commit())
+        throw std::runtime_error("Could not write manifest file");
+    m_phase = Finished;
+}
+
+QString WslVerify::report() const
+{
+    QString text;
+    if (m_missing.empty() && m_modified.empty() && m_extra.empty()) {
+        text = QObject::tr("Checked %1 entries, no differences found.\n")
+                    .arg(m_entriesScanned.load());
+        return text;
+    }
+
+    text = QObject::tr("Checked %1 entries: %2 missing, %3 modified, %4 extra.\n")
+                .arg(m_entriesScanned.load()).arg(m_missing.size())
+                .arg(m_modified.size()).arg(m_extra.size());
+    if (!m_missing.empty()) {
+        text += QObject::tr("\nMissing:\n");
+        for (const std::string &path : m_missing)
+            text += QStringLiteral("    %1\n").arg(QString::fromStdString(path));
+    }
+    if (!m_modified.empty()) {
+        text += QObject::tr("\nModified:\n");
+        for (const Difference &diff : m_modified) {
+            text += QStringLiteral("    %1 (%2)\n").arg(QString::fromStdString(diff.unixPath))
+                                                .arg(QString::fromStdString(diff.reason));
+        }
+    }
+    if (!m_extra.empty()) {
+        text += QObject::tr("\nExtra:\n");
+        for (const std::string &path : m_extra)
+            text += QStringLiteral("    %1\n").arg(QString::fromStdString(path));
+    }
+    return text;
+}
+
+WslVerifyDialog::WslVerifyDialog(const QString &uuid, QWidget *parent)
+    : QDialog(parent), m_uuid(uuid.toStdWString())
+{
+    setWindowTitle(tr("Verify Distribution Files"));
+
+    auto lblReference = new QLabel(tr("Compare with:"), this);
+    m_useTarball = new QRadioButton(tr("Original &tarball"), this);
+    m_useManifest = new QRadioButton(tr("Saved &manifest"), this);
+    m_useTarball->setChecked(true);
+
+    m_referencePath = new QLineEdit(this);
+    auto selectReference = new QToolButton(this);
+    selectReference->setIconSize(QSize(16, 16));
+    selectReference->setIcon(QIcon(":/icons/document-open.ico"));
+
+    m_quick = new QCheckBox(tr("&Quick check (metadata only, no file contents)"), this);
+
+    auto buttons = new QDialogButtonBox(QDialogButtonBox::Ok | QDialogButtonBox::Cancel, this);
+    buttons->button(QDialogButtonBox::Ok)->setText(tr("&Verify"));
+    auto saveButton = buttons->addButton(tr("&Save Manifest..."), QDialogButtonBox::ActionRole);
+    connect(buttons, &QDialogButtonBox::accepted, this, &QDialog::accept);
+    connect(buttons, &QDialogButtonBox::rejected, this, &QDialog::reject);
+    connect(saveButton, &QPushButton::clicked, this, [this](bool) { saveManifest(); });
+
+    connect(selectReference, &QAbstractButton::clicked, this, [this](bool) {
+        const QString filter = m_useTarball->isChecked()
+                ? tr("Tarballs (*.tar *.tgz *.tar.gz *.tar.xz *.tar.bz2);;All Files (*)")
+                : tr("Manifests (*.manifest);;All Files (*)");
+        QString path = QFileDialog::getOpenFileName(this, tr("Select Reference..."),
+                            m_referencePath->text(), filter);
+        if (!path.isEmpty())
+            m_referencePath->setText(QDir::toNativeSeparators(path));
+    });
+
+    auto layout = new QGridLayout(this);
+    int layoutRow = 0;
+    layout->addWidget(lblReference, layoutRow, 0);
+    layout->addWidget(m_useTarball, layoutRow, 1, 1, 2);
+    layout->addWidget(m_useManifest, ++layoutRow, 1, 1, 2);
+    layout->addWidget(m_referencePath, ++layoutRow, 1);
+    layout->addWidget(selectReference, layoutRow, 2);
+    layout->addWidget(m_quick, ++layoutRow, 1, 1, 2);
+    layout->addItem(new QSpacerItem(0, 10), ++layoutRow, 0, 1, 3);
+    layout->addWidget(buttons, ++layoutRow, 0, 1, 3);
+}
+
+bool WslVerifyDialog::validate()
+{
+    if (m_referencePath->text().isEmpty()) {
+        QMessageBox::critical(this, QString(), tr("Missing required fields"));
+        return false;
+    }
+    if (!QFileInfo(m_referencePath->text()).isFile()) {
+        QMessageBox::critical(this, QString(),
+                tr("The file \"%1\" does not exist").arg(m_referencePath->text()));
+        return false;
+    }
+    return true;
+}
+
+void WslVerifyDialog::performVerify()
+{
+    QProgressDialog progressDialog(parentWidget());
+    progressDialog.setWindowModality(Qt::WindowModal);
+    progressDialog.setMinimumDuration(0);
+
+    std::atomic<bool> cancel = false;
+    try {
+        WslDistribution dist = WslRegistry::findDistByUuid(m_uuid);
+        if (!dist.isValid())
+            throw std::runtime_error("Distribution no longer exists");
+
+        WslVerify verify{WslFs(dist.rootfsPath())};
+        if (m_useTarball->isChecked())
+            verify.setTarball(m_referencePath->text().toStdWString());
+        else
+            verify.setManifest(m_referencePath->text().toStdWString());
+        verify.setQuick(m_quick->isChecked());
+
+        WslUtil::runInBackground([&]() { verify.run(&cancel); }, [&]() {
+            if (progressDialog.wasCanceled())
+                cancel = true;
+
+            // QProgressDialog only supports int progress, so adjust to KiB
+            switch (verify.phase()) {
+            case WslVerify::Scanning:
+                progressDialog.setLabelText(tr("Scanning files... (%1 found)")
+                                            .arg(verify.entriesScanned()));
+                progressDialog.setMaximum(0);
+                break;
+            case WslVerify::Hashing:
+                progressDialog.setLabelText(tr("Checking file contents..."));
+                progressDialog.setMaximum(static_cast<int>(verify.bytesToHash() / 1024));
+                progressDialog.setValue(static_cast<int>(verify.bytesHashed() / 1024));
+                break;
+            case WslVerify::Comparing:
+                progressDialog.setLabelText(tr("Comparing..."));
+                progressDialog.setMaximum(0);
+                break;
+            case WslVerify::Finished:
+                break;
+            }
+        });
+        progressDialog.reset();
+        if (cancel)
+            return;
+
+        const bool clean = verify.missing().empty() && verify.modified().empty()
+                        && verify.extra().empty();
+        QMessageBox result(clean ? QMessageBox::Information : QMessageBox::Warning,
+                           windowTitle(), verify.report().section(QLatin1Char('\n'), 0, 0),
+                           QMessageBox::Ok, parentWidget());
+        if (!clean)
+            result.setDetailedText(verify.report());
+        result.exec();
+    } catch (const std::runtime_error &err) {
+        QMessageBox::critical(parentWidget(), QString(),
+                tr("Failed to verify distribution: %1").arg(err.what()));
+    }
+}
+
+void WslVerifyDialog::saveManifest()
+{
+    QString path = QFileDialog::getSaveFileName(this, tr("Save Manifest..."), QString(),
+                                                tr("Manifests (*.manifest);;All Files (*)"));
+    if (path.isEmpty())
+        return;
+
+    QProgressDialog progressDialog(this);
+    progressDialog.setWindowModality(Qt::WindowModal);
+    progressDialog.setMinimumDuration(0);
+
+    std::atomic<bool> cancel = false;
+    try {
+        WslDistribution dist = WslRegistry::findDistByUuid(m_uuid);
+        if (!dist.isValid())
+            throw std::runtime_error("Distribution no longer exists");
+
+        WslVerify verify{WslFs(dist.rootfsPath())};
+        verify.setQuick(m_quick->isChecked());
+        const std::wstring manifestPath = path.toStdWString();
+        WslUtil::runInBackground([&]() { verify.saveManifest(manifestPath, &cancel); }, [&]() {
+            if (progressDialog.wasCanceled())
+                cancel = true;
+
+            if (verify.phase() == WslVerify::Hashing) {
+                progressDialog.setLabelText(tr("Hashing file contents..."));
+                progressDialog.setMaximum(static_cast<int>(verify.bytesToHash() / 1024));
+                progressDialog.setValue(static_cast<int>(verify.bytesHashed() / 1024));
+            } else {
+                progressDialog.setLabelText(tr("Scanning files... (%1 found)")
+                                            .arg(verify.entriesScanned()));
+                progressDialog.setMaximum(0);
+            }
+        });
+        progressDialog.reset();
+        if (cancel)
+            return;
+
+        m_useManifest->setChecked(true);
+        m_referencePath->setText(QDir::toNativeSeparators(path));
+    } catch (const std::runtime_error &err) {
+        QMessageBox::critical(this, QString(),
+                tr("Failed to save manifest: %1").arg(err.what()));
+    }
+}
@@ -0,0 +1,130 @@
+/* This file is part of wslman.
+ *
+ * wslman is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * wslman is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with wslman.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "wslfs.h"
+
+#include <QDialog>
+#include <unordered_map>
+#include <vector>
+
+class QLineEdit;
+class QRadioButton;
+class QCheckBox;
+
+// Checks a rootfs against the original tarball or a previously saved
+// manifest, comparing the file type, mode, owner, size, content digest,
+// symlink target and hard link grouping of every entry.
+class WslVerify
+{
+public:
+    enum Phase
+    {
+        Scanning,
+        Hashing,
+        Comparing,
+        Finished,
+    };
+
+    struct Difference
+    {
+        std::string unixPath;
+        std::string reason;
+    };
+
+    WslVerify(const WslFs &rootfs);
+
+    void setTarball(const std::wstring &path) { m_tarball = path; m_manifest.clear(); }
+    void setManifest(const std::wstring &path) { m_manifest = path; m_tarball.clear(); }
+
+    // Only compare metadata, skipping the content digests
+    void setQuick(bool quick) { m_quick = quick; }
+
+    void run(const std::atomic<bool> *cancel = nullptr);
+
+    // Scan the rootfs and save its contents as a manifest for later checks
+    void saveManifest(const std::wstring &path, const std::atomic<bool> *cancel = nullptr);
+
+    // These may be queried from another thread while run() is active
+    Phase phase() const { return m_phase; }
+    uint64_t entriesScanned() const { return m_entriesScanned; }
+    uint64_t bytesToHash() const { return m_bytesToHash; }
+    uint64_t bytesHashed() const { return m_bytesHashed; }
+
+    const std::vector<std::string> &missing() const { return m_missing; }
+    const std::vector<Difference> &modified() const { return m_modified; }
+    const std::vector<std::string> &extra() const { return m_extra; }
+    QString report() const;
+
+private:
+    struct Entry
+    {
+        uint32_t mode;
+        uint32_t uid;
+        uint32_t gid;
+        uint64_t size;
+        bool hasDigest;
+        WslHash::Digest digest;
+
+        // Symlink target, or the first name of a hard linked file
+        std::string target;
+        bool isHardLink;
+
+        // Only used for the rootfs side
+        std::wstring ntPath;
+        uint64_t fileId;
+    };
+    typedef std::unordered_map<std::string, Entry> EntryMap;
+
+    WslFs m_rootfs;
+    std::wstring m_tarball;
+    std::wstring m_manifest;
+    bool m_quick;
+
+    std::atomic<Phase> m_phase;
+    std::atomic<uint64_t> m_entriesScanned;
+    std::atomic<uint64_t> m_bytesToHash;
+    std::atomic<uint64_t> m_bytesHashed;
+
+    std::vector<std::string> m_missing;
+    std::vector<Difference> m_modified;
+    std::vector<std::string> m_extra;
+
+    EntryMap readTarball(const std::atomic<bool> *cancel) const;
+    EntryMap readManifest() const;
+    EntryMap scanRootfs(const std::atomic<bool> *cancel);
+    void hashFile(Entry &entry);
+    void compare(const EntryMap &expected, const EntryMap &actual);
+};
+
+class WslVerifyDialog : public QDialog
+{
+public:
+    WslVerifyDialog(const QString &uuid, QWidget *parent = nullptr);
+
+    bool validate();
+    void performVerify();
+
+private:
+    std::wstring m_uuid;
+    QRadioButton *m_useTarball;
+    QRadioButton *m_useManifest;
+    QLineEdit *m_referencePath;
+    QCheckBox *m_quick;
+
+    void saveManifest();
+};
@@ -35,6 +35,10 @@ namespace WslApi
         DistributionFlags_AppendNTPath = 0x2,
         DistributionFlags_EnableDriveMounting = 0x4,
         DistributionFlags_All = 0x7,
+
+        // Only in the registry: set for WSL2 distributions, which keep
+        // their files in a virtual disk instead of a rootfs directory
+        DistributionFlags_VmMode = 0x8,
     };
 
     enum Version